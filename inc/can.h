@@ -50,6 +50,15 @@ extern void _Error_Handler(char *, int);
 
 void MX_CAN1_Init(void);
 
+// Frame IDs
+#define CAN_FAULT_ID          0x620   // A channel's faults changed, see can_send_faults()
+#define CAN_ENERGY_ID         0x621   // A channel's charge and energy, see can_send_energy()
+#define CAN_ENERGY_REQUEST_ID 0x622   // Asks for or resets them, see handle_energy_request()
+
+HAL_StatusTypeDef can_send_faults(uint8_t channel, uint8_t faults, uint8_t response, uint8_t faulted_channels);
+HAL_StatusTypeDef can_send_energy(uint8_t channel, int32_t charge_mah, int32_t energy_mwh);
+bool can_receive(uint32_t * const id, uint8_t data[8], uint8_t * const len);
+
 #ifdef __cplusplus
 }
 #endif
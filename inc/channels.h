@@ -2,6 +2,10 @@
 #define LVBMS_CHANNELS_H
 
 #include "stm32f4xx_hal.h"
+#include "i2c.h"
+#include "sensor.h"
+#include "filter.h"
+#include "timeouts.h"
 
 #include <stdbool.h>
 #include <stdint.h>
@@ -13,12 +17,26 @@
 #define DEFAULT_CMIN 42   //        mA
 #define DEFAULT_CMAX 42   //        mA
 
+// Limit faults set once 2 of the last 3 samples are out of range, and clear once all 3 are
+// back inside by the band, so a reading sitting on a limit doesn't flip the fault every sample
+#define DEFAULT_FILTER  {.band = 50, .set_n = 2, .clear_n = 3, .window = 3}  // band in mV or mA
+#define NO_FILTER       {.band = 0,  .set_n = 1, .clear_n = 1, .window = 1}
+
+#define FAULT_WINDOW_MAX  16  // Samples a filter can look back over
+
 #define PWM_ON  0xFFFFFFFFU
 #define PWM_OFF 0x00000000U
 
+#define SENSOR_MISSING  0x00  // CHANNEL_ADDR of a channel whose sensor wasn't found
+
+// Every sensor converts the same way in snapshot mode, so they all finish together
+#define SNAPSHOT_AVERAGING  INA226_AVG_4
+#define SNAPSHOT_CONV_TIME  INA226_CT_588US
+
+
 // Type definitions
 
-// Be sure to update these with their I2C Addresses -preserving the matching order- in channels.c as well
+// Be sure to update the tables indexed by these -preserving the matching order- in channels.c as well
 typedef enum {
   VCU_CHAN,
   SHUTDOWN_CHAN,
@@ -41,10 +59,23 @@ typedef enum {
   UNDER_VOLTAGE_ERROR,
   OVER_CURRENT_ERROR,
   UNDER_CURRENT_ERROR,
+  SENSOR_ERROR,         // Readings stopped coming in, see sample_quality()
   NO_ERROR,
   NUM_ERRORS
 } Error_Type;
 
+// A channel can break several limits at once, so it keeps one bit per Error_Type before NO_ERROR
+typedef uint8_t Fault_Mask;
+
+#define NUM_FAULTS      NO_ERROR
+#define NUM_LIMIT_FAULTS SENSOR_ERROR   // The ones before it are checked against limits
+#define NUM_FAULT_MASKS (1U << NUM_FAULTS)
+#define FAULT(error)    ((Fault_Mask) (1U << (error)))
+
+// Each channel's faults get a run of timeouts, in Error_Type order
+#define FAULT_TIMEOUT(name, error)  ((name) * NUM_FAULTS + (error))
+#define CHANNEL_TIMEOUTS(name)      ((Timeout_Mask) (NUM_FAULT_MASKS - 1) << FAULT_TIMEOUT(name, 0))
+
 
 typedef struct {
   bool      has_timeout;
@@ -66,34 +97,155 @@ typedef struct {
 } Channel_Cmd;
 
 
-typedef struct Channel {
-  Channel_Name name;
+// How a channel's sensor converts, every part takes the INA226's settings, see SENSOR_FN(conf)
+typedef struct {
+  uint8_t   averaging;        // INA226_AVG_*
+  uint8_t   bus_conv_time;    // INA226_CT_*
+  uint8_t   shunt_conv_time;  // INA226_CT_*
+
+  uint32_t  shunt_uohm;       // Shunt resistance, uOhm
+  uint32_t  current_lsb_ua;   // Current per current register count, uA
+
+  uint16_t  max_age_ms;       // Readings older than this are a SENSOR_ERROR
+
+  uint8_t   readings;         // READING() of each register sampled, one read per conversion each, within SENSOR_READINGS
+} Sensor_Config;
+
+typedef enum {
+  SAMPLE_NONE,        // Never read
+  SAMPLE_GOOD,
+  SAMPLE_FAILED,      // The latest read failed, the value is from the last good one
+  SAMPLE_STALE,       // Older than the channel's max age, see sample_quality()
+} Sample_Quality;
+
+// Last known good reading, filled in by the I2C queue
+// Fault checks, telemetry and the REPL all read these rather than the bus, through read_sample() where raw and seq have to match
+typedef struct {
+  int32_t   raw;        // Register counts, see sensor_decode()
+  int32_t   filtered;   // raw through the channel's smoothing, what the limits are checked against, see filter_channel()
+  uint32_t  timestamp;  // When raw was read, ms
+  uint32_t  seq;        // Good reads so far, 0 for none
+  uint8_t   quality;    // Sample_Quality of the latest read
+} Cached_Sample;
+
+// Channel limits in register counts, so readings are compared as they arrive
+typedef struct {
+  int32_t   volt_min;
+  int32_t   volt_max;
+  int32_t   curr_min;
+  int32_t   curr_max;
+  int32_t   shunt_min;  // The current limits, for channels sampling the shunt voltage
+  int32_t   shunt_max;
+} Raw_Limits;
 
-  Error_Type   err;
-  uint32_t     err_timestamp;
+typedef struct {
+  uint32_t  fresh_samples;    // Conversions read
+  uint32_t  reads_avoided;    // Reads skipped because no new conversion was ready
+  uint32_t  fresh_per_second; // Conversions read over the last whole second
+
+  uint32_t  window_start;     // Start of the current second, see fresh_per_second
+  uint32_t  window_samples;   // fresh_samples at window_start
 
-  Channel_Cmd cmd;
+  uint32_t  reinits;          // Times the sensor was found reset and re-programmed
+} Sample_Stats;
 
-  uint16_t    addr;
-  
-  TIM_HandleTypeDef   *htim;
+// Debouncing for one limit fault, see filter_faults()
+// set_n + clear_n should be more than window, or a fault can flip back and forth every sample
+typedef struct {
+  uint16_t  band;       // How far back inside the limit readings have to be to clear, mV or mA
+  uint8_t   set_n;      // Sets once this many of the last window samples are out of range
+  uint8_t   clear_n;    // Clears once this many of them are back in range
+  uint8_t   window;     // 1 to FAULT_WINDOW_MAX
+} Fault_Filter;
+
+// Everything fixed about a channel, one row per channel in channel_configs
+// Read only, so it stays in flash
+typedef struct {
+  I2C_Bus             bus;          // Channels on different buses are sampled in parallel
+  TIM_HandleTypeDef   *htim;        // PWM output
   uint32_t            tim_channel;
 
-  uint16_t    volt_min;
-  uint16_t    volt_max;
-  uint16_t    curr_min;
-  uint16_t    curr_max;
+  uint16_t    volt_min;     // mV
+  uint16_t    volt_max;     // mV
+  uint16_t    curr_min;     // mA
+  uint16_t    curr_max;     // mA
+
+  Error_Type  alert_error;  // The limit the sensor watches in hardware, NO_ERROR for none
+
+  Fault_Filter filters[NUM_LIMIT_FAULTS];
+  Sample_Filter smoothing;
+
+  Sensor_Config sensor;
+} Channel_Config;
+
+// What changes while running, the fields the main loop checks every pass come first
+typedef struct Channel {
+  uint8_t       name;         // Channel_Name
+  Fault_Mask    faults;       // FAULT() of each error present
+  uint8_t       addr;         // Sensor's 7 bit address, or SENSOR_MISSING
+  uint8_t       sub;          // Which of its device's channels, see SENSOR_DEVICE_CHANNELS
+
+  volatile bool alert_pending;  // Set by the sensor's ALERT pin interrupt
+  volatile bool limit_breached; // Sensor flagged its alert limit
+  volatile bool sampling;       // Reads queued by sample_channel() haven't all finished
+
+  Channel_Cmd   cmd;
+
+  Raw_Limits    limits;         // The config's limits in register counts, what the sensor's ALERT limit is set from
+  Raw_Limits    bands;          // Each limit's filter band in register counts
+  Raw_Limits    checked_limits; // The limits moved by the bands of confirmed faults, what readings are checked against
+  bool          limits_moved;   // Checked limits changed since evaluate_all_channels() packed them
+
+  Fault_Mask    confirmed;    // Limit faults the filters say are out of range
+  uint32_t      filtered_seq; // Bus voltage seq the fault filters last took a sample at
+  uint16_t      fault_history[NUM_LIMIT_FAULTS];  // Newest sample in bit 0, set if it was out of range
+  uint8_t       fault_counts[NUM_LIMIT_FAULTS];   // Set bits in each history's window
+  Cached_Sample samples[NUM_READINGS];
+  Filter_State  smoothing[NUM_READINGS];
+
+  Channel_Config const *config;
+
+  uint32_t      shunt_scale;      // uA per shunt voltage count, Q16
+  uint32_t      poll_timestamp;   // When the sensor's flags were last read
+  volatile uint32_t sample_timestamp; // When sample_channel()'s reads last finished
+
+  Sample_Stats  stats;
 
 } Channel;
 
 extern Channel channels[NUM_CHANNELS];
-extern uint16_t CHANNEL_ADDR[NUM_CHANNELS];
+extern Channel_Config const channel_configs[NUM_CHANNELS];
+extern uint32_t faulted_channels;
+extern uint8_t CHANNEL_ADDR[NUM_CHANNELS];
+extern uint8_t CHANNEL_SUB[NUM_CHANNELS];
 
 // Public Interface
 
-void init_channel(Channel * const channel, Channel_Name name, uint16_t addr, TIM_HandleTypeDef *htim, uint32_t tim_channel, uint16_t vmax, uint16_t vmin, uint16_t curr_max, uint16_t curr_min);
-
+void init_channel(Channel * const channel, Channel_Name name, uint8_t addr, Channel_Config const * const config);
+
+uint8_t discover_channels(void);
+bool channels_sampled(void);
+Sample_Quality sample_quality(Channel const * const channel, Reading_Type reading);
+Cached_Sample read_sample(Channel const * const channel, Reading_Type reading);
+void read_samples(Channel const * const channel, Cached_Sample samples[NUM_READINGS]);
+int32_t samples_current_ua(Channel const * const channel, Cached_Sample const samples[NUM_READINGS]);
+uint32_t samples_power_uw(Channel const * const channel, Cached_Sample const samples[NUM_READINGS]);
+int32_t channel_current_ua(Channel const * const channel);
+uint32_t channel_power_uw(Channel const * const channel);
+uint16_t sensor_conf(Channel const * const channel);
+uint16_t sensor_cal(Channel const * const channel);
+HAL_StatusTypeDef configure_channel(Channel const * const channel);
+bool check_channel(Channel * const channel);
+void set_snapshot_mode(bool on);
+bool trigger_channel(Channel const * const channel);
+bool read_channel(Channel * const channel);
+bool sample_channel(Channel * const channel);
+void filter_channel(Channel * const channel);
+void filter_samples(void);
+Fault_Mask stale_faults(Channel const * const channel);
+Fault_Mask get_faults(Channel const * const channel);
 bool update_channel(Channel * const channel_name);
+bool update_channel_faults(Channel * const channel, Fault_Mask limit_faults);
 void write_channel(Channel const * const channel_name);
 
 #endif
@@ -0,0 +1,65 @@
+#ifndef LVBMS_ENERGY_H
+#define LVBMS_ENERGY_H
+
+#include "stm32f4xx_hal.h"
+#include "channels.h"
+#include "repl.h"
+
+#include <stdint.h>
+
+// Charge and energy accounting
+//
+// Each channel's current and power are integrated over the time between its
+// samples, by the trapezoid between each sample and the one before, using the
+// timestamps the readings were taken at. The totals are 64 bit counts of nC
+// and nJ, which would take weeks to overflow even at the most power a channel
+// can read, and the pack's totals are kept as the sum of every channel's as
+// they go.
+//
+// Gaps longer than a channel's max age aren't integrated over, nothing is
+// known about them, see Energy_Totals.time_ms for how much was covered.
+
+#define ENERGY_PACK   0xFF          // Stands for every channel, in requests and CAN frames
+
+#define NC_PER_MAH    3600000000LL  // uA * ms in a mAh
+#define NJ_PER_MWH    3600000000LL  // uW * ms in a mWh
+
+typedef enum {
+  ENERGY_QUERY,   // Send the totals, see can_send_energy()
+  ENERGY_RESET,   // Start the totals over
+  NUM_ENERGY_REQUESTS
+} Energy_Request;
+
+typedef struct {
+  int64_t   charge_nc;  // uA * ms, negative for charge flowing back in
+  int64_t   energy_nj;  // uW * ms, with the current's sign
+  uint32_t  time_ms;    // Time integrated over, for the pack from its first sample to its latest
+} Energy_Totals;
+
+// What a channel has drawn, and its last sample to integrate the next one from
+typedef struct {
+  Energy_Totals totals;
+
+  int32_t   current_ua;
+  int64_t   power_uw;   // Wider than the sensor's unsigned power, to carry the current's sign
+  uint32_t  timestamp;  // When the last sample was read
+  uint32_t  seq;        // Its seq, 0 before the first
+} Energy_Account;
+
+extern Energy_Account energy_accounts[NUM_CHANNELS];
+extern Energy_Totals pack_energy;
+
+void init_energy(void);
+void reset_energy(uint8_t channel);
+void account_energy(Channel const * const channel, Energy_Account * const account);
+void update_energy(void);
+
+int32_t charge_mah(Energy_Totals const * const totals);
+int32_t energy_mwh(Energy_Totals const * const totals);
+Energy_Totals const *energy_totals(uint8_t channel);
+
+HAL_StatusTypeDef send_energy(uint8_t channel);
+void handle_energy_request(uint8_t const * const data, uint8_t len);
+REPL_Status energy_command(int argc, char argv[MAX_ARGS][MAX_ARG_LEN]);
+
+#endif
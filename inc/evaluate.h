@@ -0,0 +1,61 @@
+#ifndef LVBMS_EVALUATE_H
+#define LVBMS_EVALUATE_H
+
+#include "stm32f4xx_hal.h"
+#include "channels.h"
+
+#include <stdint.h>
+
+// Batch limit checks
+//
+// Checks every channel's latest readings against its limits at once, two
+// channels to a word. On the Cortex-M4 each SSUB16 compares both halves of a
+// word and leaves the results in the GE flags, which SEL turns into a mask.
+// Elsewhere a scalar loop over the same packed words finds the same faults.
+// Either way the faults are the ones get_faults() would find.
+//
+// Readings have to fit in 16 bits, parts with wider ones check each channel on its own.
+
+#define EVAL_WORDS      ((NUM_CHANNELS + 1) / 2)  // The even channel in the low half
+#define EVAL_BENCH_RUNS 100
+
+// Every channel's limits, packed once by pack_limits(), and readings, packed each pass by pack_samples()
+// Limits saturate to 16 bits, which no reading gets past
+typedef struct {
+  uint32_t    volt[EVAL_WORDS];
+  uint32_t    curr[EVAL_WORDS];       // Current, or the shunt voltage for channels sampling that
+  uint32_t    volt_floor[EVAL_WORDS]; // volt_min - 1, so under is the same compare as over
+  uint32_t    volt_max[EVAL_WORDS];
+  uint32_t    curr_floor[EVAL_WORDS];
+  uint32_t    curr_max[EVAL_WORDS];
+
+  Fault_Mask  checked[NUM_CHANNELS];  // Limit faults each channel has readings for
+  Fault_Mask  found[NUM_CHANNELS];    // Faults found packing, like stale readings
+} Packed_Channels;
+
+// CPU cycles to check every channel once, see bench_evaluation()
+typedef struct {
+  uint32_t  batch_cycles;     // evaluate_all_channels(), packing included
+  uint32_t  channel_cycles;   // get_faults() on each channel
+} Eval_Bench;
+
+void pack_limits(Packed_Channels * const packed, Channel const * const channels);
+void pack_samples(Packed_Channels * const packed, Channel const * const channels);
+void evaluate_packed(Packed_Channels const * const packed, Fault_Mask faults[NUM_CHANNELS]);
+void evaluate_packed_scalar(Packed_Channels const * const packed, Fault_Mask faults[NUM_CHANNELS]);
+
+void init_evaluation(void);
+void evaluate_all_channels(Fault_Mask faults[NUM_CHANNELS]);
+void bench_evaluation(Eval_Bench * const bench);
+
+// Packed 16 bit arithmetic, the tests swap in emulated instructions
+#if defined(__ARM_FEATURE_DSP) || defined(TEST)
+#define EVAL_SIMD
+#endif
+
+#ifdef TEST
+uint32_t __SSUB16(uint32_t a, uint32_t b);
+uint32_t __SEL(uint32_t a, uint32_t b);
+#endif
+
+#endif
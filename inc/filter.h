@@ -0,0 +1,60 @@
+#ifndef LVBMS_FILTER_H
+#define LVBMS_FILTER_H
+
+#include "stm32f4xx_hal.h"
+#include "sensor.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Sample filters
+//
+// Smooth each reading between the sensor and the fault checks, so a short
+// spike like a pump's inrush isn't checked as if it lasted. Either a first
+// order IIR, y += alpha * (x - y), or a boxcar averaging the last few
+// readings. Both are fixed point and take the same few operations per
+// reading whatever their settings.
+//
+// The IIR keeps FILTER_FRAC_BITS of fraction below each register count, so it
+// settles on the reading rather than somewhere within 1 / alpha counts of it.
+// Each step multiplies that by the Q15 alpha into 64 bits, one SMLAL on the M4.
+
+#define FILTER_BOXCAR_MAX 8                                   // Readings a boxcar can average
+#define FILTER_Q15(x)     ((uint16_t) ((x) * 32768.0 + 0.5))  // IIR alpha from a fraction, 0 to 1 exclusive
+
+// As much fraction as fits a full scale reading in 31 bits
+#if SENSOR_READING_MAX > INT16_MAX
+#define FILTER_FRAC_BITS  11
+#else
+#define FILTER_FRAC_BITS  15
+#endif
+
+#define NO_SMOOTHING  {.type = FILTER_NONE}
+
+typedef enum {
+  FILTER_NONE,      // Readings are checked as they're read
+  FILTER_IIR,
+  FILTER_BOXCAR,
+  NUM_FILTER_TYPES
+} Filter_Type;
+
+// How a channel smooths its readings, every reading it samples the same way
+typedef struct {
+  uint8_t   type;     // Filter_Type
+  uint8_t   length;   // FILTER_BOXCAR, readings averaged, 1 to FILTER_BOXCAR_MAX
+  uint16_t  alpha;    // FILTER_IIR, weight of each new reading, Q15
+} Sample_Filter;
+
+// One reading's filter, see filter_step()
+typedef struct {
+  int32_t   acc;      // IIR output with FILTER_FRAC_BITS of fraction, or the boxcar's sum
+  int32_t   window[FILTER_BOXCAR_MAX];  // The boxcar's readings, oldest at next
+  uint8_t   next;
+  bool      primed;   // Has taken a reading
+  uint32_t  seq;      // The reading's seq when it was last taken, see filter_channel()
+} Filter_State;
+
+void filter_reset(Filter_State * const state);
+int32_t filter_step(Sample_Filter const * const filter, Filter_State * const state, int32_t reading);
+
+#endif
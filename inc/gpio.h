@@ -46,6 +46,14 @@
 #include "stm32f4xx_hal.h"
 #include "main.h"
 
+// INA226 ALERT pins, open drain and active low
+// One per channel, in Channel_Name order, starting at ALERT_PIN_FIRST
+#define ALERT_GPIO_PORT   GPIOE
+#define ALERT_PIN_FIRST   GPIO_PIN_0
+#define ALERT_PIN_COUNT   6
+
+#define ALERT_PIN(channel)  ((uint16_t) (ALERT_PIN_FIRST << (channel)))
+
 void MX_GPIO_Init(void);
 
 #ifdef __cplusplus
@@ -45,39 +45,161 @@
 #include "main.h"
 
 extern I2C_HandleTypeDef hi2c1;
+extern I2C_HandleTypeDef hi2c2;
+extern I2C_HandleTypeDef hi2c3;
 
 /* USER CODE BEGIN Private defines */
 
-#define INA226_ADDR0 0x40
-#define INA226_REG_CONF        0x00
-#define INA226_REG_SHUNT_VOLT  0x01
-#define INA226_REG_BUS_VOLT    0x02
-#define INA226_REG_POWER       0x03
-#define INA226_REG_CURRENT     0x04
-#define INA226_REG_CAL         0x05
-#define INA226_REG_MASK        0x06
-#define INA226_REG_ALERT_LIMIT 0x07
-#define INA226_REG_MFG_ID      0xFE
-#define INA226_REG_DIE_ID      0xFF
+// Every device on the bus acts on the general call, the sensors only know reset
+#define I2C_GENERAL_CALL_ADDR  0x00
+#define I2C_GENERAL_CALL_RESET 0x06
 
-#define I2C_TIMEOUT            100
+#define I2C_TIMEOUT            2    // ms, blocking transfers only, the HAL counts in whole ticks
+
+// Run the transfers on the register level driver in i2c_ll.c rather than the HAL
+// Uncomment, or add -DI2C_LL_DRIVER to BOARD_DEFS, and compare i2c_stats' blocking and queued cycles
+//#define I2C_LL_DRIVER
+
+// Queued transactions get the time their SCL cycles should take, times the
+// margin, plus some slack for interrupt latency before the bus counts as stuck
+#define I2C_BUDGET_MARGIN      4
+#define I2C_BUDGET_SLACK_US    200
+
+#define I2C_RECOVERY_CLOCKS    9    // Enough for a device to finish any byte it was sending
+#define I2C_RECOVERY_HALF_US   5    // Half an SCL period while recovering, 100 kHz
+
+// Devices that keep failing are left alone for a while, doubling each time
+#define I2C_QUARANTINE_FAILURES 3   // Failures in a row before a device is quarantined
+#define I2C_BACKOFF_MIN_MS     10
+#define I2C_BACKOFF_MAX_MS     5000
+
+#define I2C_QUEUE_LEN          16   // Max transactions waiting on each bus
+#define I2C_MAX_REG_SIZE       4    // Widest register queue_burst() reads, bytes
+
+#define I2C_DEFAULT_SPEED      I2C_SPEED_FAST
+#define I2C_SPEED_WINDOW       200  // Transactions between error rate checks
+#define I2C_SPEED_MAX_ERRORS   10   // NACKs or arbitration losses allowed per window
+
+// Bus cost model, in SCL cycles
+#define I2C_START_CYCLES       1    // START or repeated START
+#define I2C_STOP_CYCLES        1
+#define I2C_BYTE_CYCLES        9    // 8 bits and an ACK
+
+// START, address, register, repeated START, address, 2 data bytes, STOP
+#define I2C_READ_CYCLES        (2*I2C_START_CYCLES + 5*I2C_BYTE_CYCLES + I2C_STOP_CYCLES)
+
+// START, address, 2 data bytes, STOP - when the register pointer is already set
+#define I2C_CACHED_READ_CYCLES (I2C_START_CYCLES + 3*I2C_BYTE_CYCLES + I2C_STOP_CYCLES)
+
+// START, address, register, 2 data bytes, STOP
+#define I2C_WRITE_CYCLES       (I2C_START_CYCLES + 4*I2C_BYTE_CYCLES + I2C_STOP_CYCLES)
+
+// START, address, STOP - checking for an ACK
+#define I2C_PROBE_CYCLES       (I2C_START_CYCLES + I2C_BYTE_CYCLES + I2C_STOP_CYCLES)
+
+// START, general call address, command, STOP
+#define I2C_GENERAL_CALL_CYCLES (I2C_START_CYCLES + 2*I2C_BYTE_CYCLES + I2C_STOP_CYCLES)
 
 #define VOLTAGE_LSB 125 // 10 uV
 #define CURRENT_LSB 1   // mA
 
+// Note: FMPI2C1 could be a fourth bus, but its pins aren't wired to the sensors
+typedef enum {
+  I2C_BUS_1,                // hi2c1
+  I2C_BUS_2,                // hi2c2
+  I2C_BUS_3,                // hi2c3
+  NUM_I2C_BUSES
+} I2C_Bus;
+
+typedef struct I2C_Transaction I2C_Transaction;
+
+// Called from interrupt context when a queued transaction finishes
+typedef void (*I2C_Callback)(I2C_Transaction const * const txn, HAL_StatusTypeDef status);
+
+struct I2C_Transaction {
+  I2C_Bus       bus;
+  uint8_t       channel_addr;
+  uint8_t       reg_addr;
+  bool          write;
+  uint8_t       size;       // Register width in bytes, see queue_burst()
+  uint32_t      rsp;        // Register value, read when status is HAL_OK, or to write
+
+  I2C_Callback  callback;   // May be NULL
+  void          *context;   // Passed through untouched for the callback
+};
+
+// Note: FMPI2C1 could run Fast-mode Plus, see I2C_Bus
+typedef enum {
+  I2C_SPEED_STANDARD,       // 100 kHz
+  I2C_SPEED_FAST,           // 400 kHz
+  NUM_I2C_SPEEDS
+} I2C_Speed;
+
+typedef struct {
+  uint32_t transactions;    // START to STOP, repeated starts don't count
+  uint32_t cycles;          // SCL cycles spent on the transactions
+  uint32_t reads;           // Successful register reads
+  uint32_t errors;          // Failed transactions
+  uint32_t stalls;          // Queued transactions that ran past their time budget
+  uint32_t recoveries;      // Times the bus was clocked free and the controller re-initialized
+  uint32_t quarantines;     // Times a device was quarantined
+  uint32_t skipped;         // Transactions refused because their device was quarantined
+
+  // CPU time spent in read_reg(), which waits on the bus, see I2C_LL_DRIVER
+  uint32_t blocking_reads;
+  uint32_t blocking_cycles;     // Core clock cycles, over every blocking read
+  uint32_t blocking_cycles_max; // The slowest single read
+
+  // CPU time spent running the queue, starting it and in the interrupts, including the callbacks
+  uint32_t queued;              // Queued transactions finished
+  uint32_t queued_cycles;       // Core clock cycles, over every start and interrupt
+  uint32_t queued_cycles_max;   // The slowest single start or interrupt
+} I2C_Stats;
+
+extern I2C_Stats i2c_stats;                     // Every bus
+extern I2C_Stats i2c_bus_stats[NUM_I2C_BUSES];  // Each bus on its own
+
 /* USER CODE END Private defines */
 
 extern void _Error_Handler(char *, int);
 
 void MX_I2C1_Init(void);
+void MX_I2C2_Init(void);
+void MX_I2C3_Init(void);
 
 /* USER CODE BEGIN Prototypes */
 
-HAL_StatusTypeDef read_reg(uint8_t reg_addr, uint8_t channel_addr, uint16_t *rsp);
-HAL_StatusTypeDef write_reg(uint8_t reg_addr, uint8_t channel_addr, uint16_t val);
-HAL_StatusTypeDef reset_channel(uint8_t channel_addr);
-HAL_StatusTypeDef read_current(uint8_t channel_addr, uint16_t *rsp);
-HAL_StatusTypeDef read_voltage(uint8_t channel_addr, uint16_t *rsp);
+HAL_StatusTypeDef read_reg(I2C_Bus bus, uint8_t reg_addr, uint8_t channel_addr, uint16_t *rsp);
+HAL_StatusTypeDef write_reg(I2C_Bus bus, uint8_t reg_addr, uint8_t channel_addr, uint16_t val);
+HAL_StatusTypeDef reset_channel(I2C_Bus bus, uint8_t channel_addr);
+HAL_StatusTypeDef reset_bus(I2C_Bus bus);
+uint8_t scan_bus(I2C_Bus bus, uint8_t *found, uint8_t max_found);
+void invalidate_reg_ptr(I2C_Bus bus, uint8_t channel_addr);
+void invalidate_reg_ptrs(void);
+
+HAL_StatusTypeDef i2c_set_speed(I2C_Bus bus, I2C_Speed speed);
+I2C_Speed i2c_speed(I2C_Bus bus);
+uint32_t i2c_speed_hz(I2C_Bus bus);
+uint32_t i2c_samples_per_second(void);
+void update_bus(void);
+HAL_StatusTypeDef recover_bus(I2C_Bus bus);
+bool i2c_quarantined(I2C_Bus bus, uint8_t channel_addr);
+
+HAL_StatusTypeDef queue_read(I2C_Bus bus, uint8_t reg_addr, uint8_t channel_addr, I2C_Callback callback, void *context);
+HAL_StatusTypeDef queue_burst(I2C_Bus bus, uint8_t reg_addr, uint8_t channel_addr, uint8_t size, I2C_Callback callback, void *context);
+HAL_StatusTypeDef queue_write(I2C_Bus bus, uint8_t reg_addr, uint8_t channel_addr, uint16_t val, I2C_Callback callback, void *context);
+bool i2c_bus_idle(I2C_Bus bus);
+bool i2c_queue_idle(void);
+
+// Call from the controller's event and error interrupts
+void i2c_ev_irq(I2C_Bus bus);
+void i2c_er_irq(I2C_Bus bus);
+
+// Bus recovery pins, emulated by the mock bus in tests
+void i2c_pins_gpio(I2C_Bus bus);
+void i2c_scl_write(I2C_Bus bus, GPIO_PinState state);
+void i2c_sda_write(I2C_Bus bus, GPIO_PinState state);
+GPIO_PinState i2c_sda_read(I2C_Bus bus);
 
 /* USER CODE END Prototypes */
 
@@ -0,0 +1,56 @@
+#ifndef LVBMS_I2C_LL_H
+#define LVBMS_I2C_LL_H
+
+#include "stm32f4xx_hal.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Register level I2C driver
+//
+// Master transfers straight on the controller's registers, for read_reg(),
+// write_reg() and the transaction queue when I2C_LL_DRIVER is defined. The
+// polled ones skip the HAL's tick based timeouts, the interrupt driven ones
+// its general purpose event handler. Both leave the handle's State and
+// ErrorCode the way the HAL's would, and the interrupt driven ones finish in
+// the HAL's completion callbacks, so either driver can follow the other on
+// the same controller.
+//
+// Addresses are 7 bit, unlike the HAL's.
+
+// Polls of a status flag before a transfer gives up, around I2C_TIMEOUT at 16 MHz
+#define I2C_LL_SPINS 4000
+
+// Selects reg and reads size bytes back from it, using a repeated start
+HAL_StatusTypeDef i2c_ll_mem_read(I2C_HandleTypeDef *hi2c, uint8_t addr, uint8_t reg, uint8_t *data, uint16_t size);
+
+// Reads size bytes from wherever the device's register pointer is
+HAL_StatusTypeDef i2c_ll_receive(I2C_HandleTypeDef *hi2c, uint8_t addr, uint8_t *data, uint16_t size);
+
+// Writes size bytes, for a register write the first is the register
+HAL_StatusTypeDef i2c_ll_transmit(I2C_HandleTypeDef *hi2c, uint8_t addr, uint8_t const *data, uint16_t size);
+
+// Starts selecting reg and reading size bytes back, HAL_I2C_MemRxCpltCallback() is called once they're in
+HAL_StatusTypeDef i2c_ll_mem_read_it(I2C_HandleTypeDef *hi2c, uint8_t addr, uint8_t reg, uint8_t *data, uint16_t size);
+
+// Starts reading size bytes from the register pointer, HAL_I2C_MasterRxCpltCallback() is called once they're in
+HAL_StatusTypeDef i2c_ll_receive_it(I2C_HandleTypeDef *hi2c, uint8_t addr, uint8_t *data, uint16_t size);
+
+// Starts writing size bytes to reg, HAL_I2C_MemTxCpltCallback() is called once they're out
+HAL_StatusTypeDef i2c_ll_mem_write_it(I2C_HandleTypeDef *hi2c, uint8_t addr, uint8_t reg, uint8_t *data, uint16_t size);
+
+// Steps the running transfer on, call from the controller's event and error interrupts
+// A failed transfer ends in HAL_I2C_ErrorCallback(), with the reason in ErrorCode
+void i2c_ll_ev_irq(I2C_HandleTypeDef *hi2c);
+void i2c_ll_er_irq(I2C_HandleTypeDef *hi2c);
+
+// Controller register access, the tests swap these for an emulated controller
+#ifdef TEST
+uint32_t i2c_ll_read(I2C_TypeDef *i2c, __IO uint32_t *reg);
+void i2c_ll_write(I2C_TypeDef *i2c, __IO uint32_t *reg, uint32_t val);
+#else
+#define i2c_ll_read(i2c, reg)       (*(reg))
+#define i2c_ll_write(i2c, reg, val) (*(reg) = (val))
+#endif
+
+#endif
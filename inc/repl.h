@@ -12,6 +12,7 @@ typedef enum {
 } REPL_Status;
 
 REPL_Status repl(REPL_Status (* commandHandler) (int, char[MAX_ARGS][MAX_ARG_LEN]));
+REPL_Status repl_poll(REPL_Status (* commandHandler) (int, char[MAX_ARGS][MAX_ARG_LEN]));
 bool eq(char* str1, char* str2);
 void output(char* msg);
 
@@ -0,0 +1,67 @@
+#ifndef LVBMS_SAMPLER_H
+#define LVBMS_SAMPLER_H
+
+#include "stm32f4xx_hal.h"
+#include "channels.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Constants
+
+#define SAMPLER_CHECK_PERIOD_MS 500  // How often each sensor's configuration is read back, see check_channel()
+#define SNAPSHOT_PERIOD_MS      10   // How often every sensor is triggered in snapshot mode
+
+// Type definitions
+
+// How often a channel is sampled, and how soon after release its sample must be in
+typedef struct {
+  uint16_t  period_ms;
+  uint16_t  deadline_ms;
+} Sample_Timing;
+
+// A channel's current sampling job and how its jobs have fared
+typedef struct {
+  uint32_t  release;        // When the current job became due
+  uint32_t  deadline;       // When it must be finished by
+  uint32_t  next_release;   // When the next job becomes due
+
+  bool      pending;        // Released, waiting for the bus
+  bool      in_flight;      // Reads queued, waiting for them to finish
+
+  uint32_t  next_check;     // When the sensor's configuration is next read back
+
+  uint32_t  jobs;           // Jobs finished
+  uint32_t  misses;         // Jobs finished after their deadline, or released late
+  uint32_t  worst_response; // Longest release to finish, ms
+} Sample_Job;
+
+typedef enum {
+  SNAPSHOT_OFF,         // Sampling each channel on its own period
+  SNAPSHOT_IDLE,        // Waiting for the next trigger
+  SNAPSHOT_CONVERTING,  // Triggered, waiting out the conversion
+  SNAPSHOT_READING,     // Reads queued, waiting for them to finish
+} Snapshot_State;
+
+// Every channel's readings from one trigger of all the sensors
+typedef struct {
+  uint32_t  timestamp;              // When the sensors were triggered
+  uint32_t  seq;                    // Frames completed so far
+  uint8_t   valid;                  // Bit per Channel_Name with readings from this frame
+  int32_t   voltage[NUM_CHANNELS];  // Bus voltage counts, see sensor_decode()
+  int32_t   current[NUM_CHANNELS];  // uA, see channel_current_ua()
+} Snapshot_Frame;
+
+extern Sample_Timing const sample_timing[NUM_CHANNELS];
+extern Sample_Job sample_jobs[NUM_CHANNELS];
+extern Snapshot_Frame snapshot_frame;
+
+// Public Interface
+
+void init_sampler(void);
+void run_sampler(void);
+void start_snapshots(void);
+void stop_snapshots(void);
+Snapshot_State snapshot_state(void);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef LVBMS_SCHEDULER_H
+#define LVBMS_SCHEDULER_H
+
+#include "stm32f4xx_hal.h"
+#include "repl.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Cooperative scheduler
+//
+// Tasks run to completion from the main loop, each released every period_ms
+// off HAL_GetTick(). Releases are counted from the last release rather than
+// from when the task ran, so a task started late keeps its rate. One that
+// falls a whole period or more behind skips the releases it missed instead
+// of running them back to back. With nothing due the core sleeps until the
+// next interrupt, SysTick at the latest.
+
+#define SCHEDULER_MAX_TASKS 8
+
+typedef struct {
+  char      *name;
+  void      (*run)(void);
+  uint16_t  period_ms;
+} Task;
+
+// How a task's runs have gone, times in core clock cycles, see cpu_cycles()
+typedef struct {
+  uint32_t  release;      // When the task is next due
+  uint32_t  runs;
+  uint32_t  overruns;     // Runs that took longer than the period
+  uint32_t  skipped;      // Releases dropped for running a whole period late
+  uint32_t  last_cycles;
+  uint32_t  max_cycles;
+  uint64_t  total_cycles;
+} Task_Stats;
+
+extern Task_Stats task_stats[SCHEDULER_MAX_TASKS];
+
+void init_scheduler(Task const * const tasks, uint8_t num_tasks);
+bool run_tasks(void);
+void run_scheduler(void);
+
+REPL_Status tasks_command(int argc, char argv[MAX_ARGS][MAX_ARG_LEN]);
+
+#endif
@@ -0,0 +1,372 @@
+#ifndef LVBMS_SENSOR_H
+#define LVBMS_SENSOR_H
+
+#include "i2c.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Current sensor drivers
+//
+// Every part's driver is always built, each under its own prefix. SENSOR_MODEL
+// picks the one the channels use at compile time, through SENSOR_FN(), so the
+// sampling path calls straight into it without any function pointers.
+
+#define SENSOR_INA226   226
+#define SENSOR_INA3221  3221
+#define SENSOR_INA228   228
+
+#ifndef SENSOR_MODEL
+#define SENSOR_MODEL    SENSOR_INA226
+#endif
+
+#define SENSOR_NO_REG   0xFF  // A reading the part doesn't have
+
+// INA226 - one channel, current and power worked out on the part
+#define INA226_REG_CONF        0x00
+#define INA226_REG_SHUNT_VOLT  0x01
+#define INA226_REG_BUS_VOLT    0x02
+#define INA226_REG_POWER       0x03
+#define INA226_REG_CURRENT     0x04
+#define INA226_REG_CAL         0x05
+#define INA226_REG_MASK        0x06
+#define INA226_REG_ALERT_LIMIT 0x07
+#define INA226_REG_MFG_ID      0xFE
+#define INA226_REG_DIE_ID      0xFF
+
+// Identification, see scan_bus()
+#define INA226_MFG_ID          0x5449     // "TI"
+#define INA226_DIE_ID          0x2260
+#define INA226_DIE_ID_MASK     0xFFF0     // The low bits are the silicon revision
+#define INA226_ADDR_FIRST      0x40       // A0 and A1 strap one of 16 addresses
+#define INA226_ADDR_LAST       0x4F
+
+// INA226_REG_CONF fields
+#define INA226_CONF_RST        (1 << 15)  // Reset to power on defaults
+#define INA226_CONF_AVG(n)     ((n) << 9) // Samples averaged per conversion, INA226_AVG_*
+#define INA226_CONF_VBUSCT(t)  ((t) << 6) // Bus voltage conversion time, INA226_CT_*
+#define INA226_CONF_VSHCT(t)   ((t) << 3) // Shunt voltage conversion time, INA226_CT_*
+#define INA226_MODE_CONTINUOUS 0x7        // Shunt and bus voltage, continuously
+#define INA226_MODE_TRIGGERED  0x3        // Shunt and bus voltage, once per INA226_REG_CONF write
+#define INA226_CONF_FIXED      0x4000     // Reserved bits, always read back as 100
+
+// Includes the reserved bits, so a value read back can be compared as is
+#define INA226_CONF(avg, vbusct, vshct, mode) \
+  (INA226_CONF_FIXED | INA226_CONF_AVG(avg) | INA226_CONF_VBUSCT(vbusct) | INA226_CONF_VSHCT(vshct) | (mode))
+
+typedef enum {
+  INA226_AVG_1,
+  INA226_AVG_4,
+  INA226_AVG_16,
+  INA226_AVG_64,
+  INA226_AVG_128,
+  INA226_AVG_256,
+  INA226_AVG_512,
+  INA226_AVG_1024
+} INA226_Averaging;
+
+typedef enum {
+  INA226_CT_140US,
+  INA226_CT_204US,
+  INA226_CT_332US,
+  INA226_CT_588US,
+  INA226_CT_1100US,
+  INA226_CT_2116US,
+  INA226_CT_4156US,
+  INA226_CT_8244US
+} INA226_Conversion_Time;
+
+// Register scales, current and power are set by INA226_REG_CAL
+#define INA226_BUS_VOLT_LSB_UV   1250     // Bus voltage, per count
+#define INA226_SHUNT_VOLT_LSB_NV 2500     // Shunt voltage, per count
+#define INA226_POWER_LSB_SCALE   25       // Power per count, in current LSBs times a volt
+#define INA226_CAL_SCALE         5120000000ULL  // 0.00512 in uA * uOhm units
+#define INA226_CAL_SHIFT         11       // current = shunt * cal / 2048
+
+// INA226_REG_MASK bits, only one limit can be watched at a time
+#define INA226_MASK_SOL        (1 << 15)  // Shunt voltage over limit
+#define INA226_MASK_SUL        (1 << 14)  // Shunt voltage under limit
+#define INA226_MASK_BOL        (1 << 13)  // Bus voltage over limit
+#define INA226_MASK_BUL        (1 << 12)  // Bus voltage under limit
+#define INA226_MASK_POL        (1 << 11)  // Power over limit
+#define INA226_MASK_CNVR       (1 << 10)  // Alert on conversion ready
+#define INA226_MASK_AFF        (1 << 4)   // Alert function flag
+#define INA226_MASK_CVRF       (1 << 3)   // Conversion ready flag
+#define INA226_MASK_OVF        (1 << 2)   // Math overflow flag
+#define INA226_MASK_APOL       (1 << 1)   // Alert pin active high
+#define INA226_MASK_LEN        (1 << 0)   // Latch the alert pin until MASK is read
+
+// INA3221 - three channels of shunt and bus voltage, no current or power registers
+#define INA3221_REG_CONF          0x00
+#define INA3221_REG_SHUNT_VOLT(n) (0x01 + 2*(n))  // Channel n, from 0
+#define INA3221_REG_BUS_VOLT(n)   (0x02 + 2*(n))
+#define INA3221_REG_CRITICAL(n)   (0x07 + 2*(n))  // Shunt voltage limit, channel n
+#define INA3221_REG_MASK          0x0F
+#define INA3221_REG_MFG_ID        0xFE
+#define INA3221_REG_DIE_ID        0xFF
+
+#define INA3221_MFG_ID            0x5449
+#define INA3221_DIE_ID            0x3220
+#define INA3221_ADDR_FIRST        0x40      // A0 strapped to one of four pins
+#define INA3221_ADDR_LAST         0x43
+#define INA3221_CHANNELS          3
+
+#define INA3221_CONF_RST          (1 << 15) // Reset to power on defaults
+#define INA3221_CONF_CHANNELS     0x7000    // Every channel enabled
+#define INA3221_MASK_CVRF         (1 << 0)  // Conversion ready flag
+#define INA3221_MASK_CF(n)        (1 << (9 - (n)))  // Critical alert flag, channel n
+#define INA3221_VALUE_SHIFT       3         // Readings and limits sit above 3 unused bits
+
+#define INA3221_BUS_VOLT_LSB_NV   8000000
+#define INA3221_SHUNT_VOLT_LSB_PV 40000000
+
+// INA228 - 20 bit readings in 24 bit registers
+#define INA228_REG_CONFIG         0x00
+#define INA228_REG_ADC_CONFIG     0x01
+#define INA228_REG_SHUNT_CAL      0x02
+#define INA228_REG_SHUNT_VOLT     0x04
+#define INA228_REG_BUS_VOLT       0x05
+#define INA228_REG_CURRENT        0x07
+#define INA228_REG_POWER          0x08
+#define INA228_REG_DIAG_ALRT      0x0B
+#define INA228_REG_SOVL           0x0C      // Shunt over voltage limit
+#define INA228_REG_SUVL           0x0D
+#define INA228_REG_BOVL           0x0E      // Bus over voltage limit
+#define INA228_REG_BUVL           0x0F
+#define INA228_REG_MFG_ID         0x3E
+#define INA228_REG_DIE_ID         0x3F
+
+#define INA228_MFG_ID             0x5449
+#define INA228_DIE_ID             0x2280
+#define INA228_ADDR_FIRST         0x40
+#define INA228_ADDR_LAST          0x4F
+
+#define INA228_CONFIG_RST         (1 << 15) // Reset to power on defaults, in INA228_REG_CONFIG
+#define INA228_MODE_CONTINUOUS    0xB       // Shunt and bus voltage
+#define INA228_MODE_TRIGGERED     0x3
+#define INA228_DIAG_ALATCH        (1 << 15) // Latch the alert pin until DIAG_ALRT is read
+#define INA228_DIAG_CNVR          (1 << 14) // Alert on conversion ready
+#define INA228_DIAG_LIMITS        0x0078    // Shunt and bus voltage over and under limit flags
+#define INA228_DIAG_CNVRF         (1 << 1)  // Conversion ready flag
+#define INA228_VALUE_SHIFT        4         // Readings sit above 4 unused bits
+#define INA228_LIMIT_SHIFT        4         // Limit registers count 16 reading LSBs each
+#define INA228_READING_MAX        ((1 << 19) - 1)
+#define INA228_CAL_SCALE          131072    // SHUNT_CAL = 0.0131072 in uA * uOhm units
+#define INA228_CAL_DIVISOR        10000000
+#define INA228_CAL_SHIFT          12        // current = shunt * 4096 / cal
+#define INA228_POWER_LSB_SCALE    32        // Power per count, in tenths of current LSBs times a volt
+
+#define INA228_BUS_VOLT_LSB_NV    195313    // 195.3125 uV
+#define INA228_SHUNT_VOLT_LSB_PV  312500
+
+// Type definitions
+
+// Readings a channel can sample
+typedef enum {
+  BUS_VOLT_READING,   // Bus voltage counts
+  CURRENT_READING,    // Current counts, signed
+  SHUNT_VOLT_READING, // Shunt voltage counts, signed
+  POWER_READING,      // Power counts
+  NUM_READINGS
+} Reading_Type;
+
+#define READING(reading) (1 << (reading))
+
+// The one limit the sensor watches itself, see sensor_writes()
+typedef enum {
+  SENSOR_ALERT_NONE,
+  SENSOR_ALERT_BUS_OVER,
+  SENSOR_ALERT_BUS_UNDER,
+  SENSOR_ALERT_SHUNT_OVER,
+  SENSOR_ALERT_SHUNT_UNDER,
+} Sensor_Alert;
+
+// A register write that programs a sensor
+typedef struct {
+  uint8_t   reg_addr;
+  uint16_t  val;
+} Sensor_Write;
+
+#define SENSOR_WRITES 4
+
+// The part the channels use
+
+#if SENSOR_MODEL == SENSOR_INA226
+
+#define SENSOR_FN(name)           ina226_##name
+#define SENSOR_DEVICE_CHANNELS    1
+#define SENSOR_ADDR_FIRST         INA226_ADDR_FIRST
+#define SENSOR_ADDR_LAST          INA226_ADDR_LAST
+#define SENSOR_REG_MFG_ID         INA226_REG_MFG_ID
+#define SENSOR_REG_DIE_ID         INA226_REG_DIE_ID
+#define SENSOR_DIE_ID             INA226_DIE_ID
+#define SENSOR_REG_CONF           INA226_REG_CONF
+#define SENSOR_REG_CAL            INA226_REG_CAL
+#define SENSOR_REG_RESET          INA226_REG_CONF
+#define SENSOR_RESET              INA226_CONF_RST
+#define SENSOR_REG_FLAGS          INA226_REG_MASK
+#define SENSOR_FLAG_READY         INA226_MASK_CVRF
+#define SENSOR_READING_MAX        INT16_MAX
+#define SENSOR_BUS_VOLT_LSB_NV    (INA226_BUS_VOLT_LSB_UV * 1000)
+#define SENSOR_SHUNT_VOLT_LSB_PV  (INA226_SHUNT_VOLT_LSB_NV * 1000)
+#define SENSOR_READINGS           (READING(BUS_VOLT_READING) | READING(CURRENT_READING) | READING(SHUNT_VOLT_READING) | READING(POWER_READING))
+
+#elif SENSOR_MODEL == SENSOR_INA3221
+
+#define SENSOR_FN(name)           ina3221_##name
+#define SENSOR_DEVICE_CHANNELS    INA3221_CHANNELS
+#define SENSOR_ADDR_FIRST         INA3221_ADDR_FIRST
+#define SENSOR_ADDR_LAST          INA3221_ADDR_LAST
+#define SENSOR_REG_MFG_ID         INA3221_REG_MFG_ID
+#define SENSOR_REG_DIE_ID         INA3221_REG_DIE_ID
+#define SENSOR_DIE_ID             INA3221_DIE_ID
+#define SENSOR_REG_CONF           INA3221_REG_CONF
+#define SENSOR_REG_CAL            SENSOR_NO_REG
+#define SENSOR_REG_RESET          INA3221_REG_CONF
+#define SENSOR_RESET              INA3221_CONF_RST
+#define SENSOR_REG_FLAGS          INA3221_REG_MASK
+#define SENSOR_FLAG_READY         INA3221_MASK_CVRF
+#define SENSOR_READING_MAX        (INT16_MAX >> INA3221_VALUE_SHIFT)
+#define SENSOR_BUS_VOLT_LSB_NV    INA3221_BUS_VOLT_LSB_NV
+#define SENSOR_SHUNT_VOLT_LSB_PV  INA3221_SHUNT_VOLT_LSB_PV
+#define SENSOR_READINGS           (READING(BUS_VOLT_READING) | READING(SHUNT_VOLT_READING))
+
+#elif SENSOR_MODEL == SENSOR_INA228
+
+#define SENSOR_FN(name)           ina228_##name
+#define SENSOR_DEVICE_CHANNELS    1
+#define SENSOR_ADDR_FIRST         INA228_ADDR_FIRST
+#define SENSOR_ADDR_LAST          INA228_ADDR_LAST
+#define SENSOR_REG_MFG_ID         INA228_REG_MFG_ID
+#define SENSOR_REG_DIE_ID         INA228_REG_DIE_ID
+#define SENSOR_DIE_ID             INA228_DIE_ID
+#define SENSOR_REG_CONF           INA228_REG_ADC_CONFIG
+#define SENSOR_REG_CAL            INA228_REG_SHUNT_CAL
+#define SENSOR_REG_RESET          INA228_REG_CONFIG
+#define SENSOR_RESET              INA228_CONFIG_RST
+#define SENSOR_REG_FLAGS          INA228_REG_DIAG_ALRT
+#define SENSOR_FLAG_READY         INA228_DIAG_CNVRF
+#define SENSOR_READING_MAX        INA228_READING_MAX
+#define SENSOR_BUS_VOLT_LSB_NV    INA228_BUS_VOLT_LSB_NV
+#define SENSOR_SHUNT_VOLT_LSB_PV  INA228_SHUNT_VOLT_LSB_PV
+#define SENSOR_READINGS           (READING(BUS_VOLT_READING) | READING(CURRENT_READING) | READING(SHUNT_VOLT_READING) | READING(POWER_READING))
+
+#else
+#error "Unknown SENSOR_MODEL"
+#endif
+
+#define SENSOR_MFG_ID             0x5449    // Every part is TI's
+#define SENSOR_DIE_ID_MASK        0xFFF0    // The low bits are the silicon revision
+
+// Hot path, inlined for every part
+
+// Returns the register reading is in on sub channel of the device, or SENSOR_NO_REG
+static inline uint8_t ina226_reg(Reading_Type reading, uint8_t sub) {
+
+  static uint8_t const REGS[NUM_READINGS] = {
+    INA226_REG_BUS_VOLT, INA226_REG_CURRENT, INA226_REG_SHUNT_VOLT, INA226_REG_POWER,
+  };
+
+  return REGS[reading];
+}
+
+static inline uint8_t ina3221_reg(Reading_Type reading, uint8_t sub) {
+
+  if (reading == BUS_VOLT_READING)   return INA3221_REG_BUS_VOLT(sub);
+  if (reading == SHUNT_VOLT_READING) return INA3221_REG_SHUNT_VOLT(sub);
+
+  return SENSOR_NO_REG;
+}
+
+static inline uint8_t ina228_reg(Reading_Type reading, uint8_t sub) {
+
+  static uint8_t const REGS[NUM_READINGS] = {
+    INA228_REG_BUS_VOLT, INA228_REG_CURRENT, INA228_REG_SHUNT_VOLT, INA228_REG_POWER,
+  };
+
+  return REGS[reading];
+}
+
+// Returns how many bytes reading's register is
+static inline uint8_t ina226_reg_size(Reading_Type reading) {
+  return 2;
+}
+
+static inline uint8_t ina3221_reg_size(Reading_Type reading) {
+  return 2;
+}
+
+static inline uint8_t ina228_reg_size(Reading_Type reading) {
+  return 3;
+}
+
+// Converts reading's register value to counts
+static inline int32_t ina226_decode(Reading_Type reading, uint32_t raw) {
+
+  if (reading == CURRENT_READING || reading == SHUNT_VOLT_READING) {
+    return (int16_t) raw;
+  }
+
+  return (uint16_t) raw;
+}
+
+static inline int32_t ina3221_decode(Reading_Type reading, uint32_t raw) {
+  return (int16_t) raw >> INA3221_VALUE_SHIFT;
+}
+
+static inline int32_t ina228_decode(Reading_Type reading, uint32_t raw) {
+
+  if (reading == POWER_READING) return raw;
+
+  // Sign extend the top 20 of 24 bits
+  return (int32_t) (raw << 8) >> (8 + INA228_VALUE_SHIFT);
+}
+
+// Returns true if the flags read from sub channel's device show it crossed its limit
+static inline bool ina226_alerted(uint16_t flags, uint8_t sub) {
+  return flags & INA226_MASK_AFF;
+}
+
+static inline bool ina3221_alerted(uint16_t flags, uint8_t sub) {
+  return flags & INA3221_MASK_CF(sub);
+}
+
+static inline bool ina228_alerted(uint16_t flags, uint8_t sub) {
+  return flags & INA228_DIAG_LIMITS;
+}
+
+#define sensor_reg      SENSOR_FN(reg)
+#define sensor_reg_size SENSOR_FN(reg_size)
+#define sensor_decode   SENSOR_FN(decode)
+#define sensor_alerted  SENSOR_FN(alerted)
+
+// Public Interface
+
+uint16_t ina226_conf(uint8_t avg, uint8_t vbusct, uint8_t vshct, bool triggered);
+uint16_t ina3221_conf(uint8_t avg, uint8_t vbusct, uint8_t vshct, bool triggered);
+uint16_t ina228_conf(uint8_t avg, uint8_t vbusct, uint8_t vshct, bool triggered);
+
+uint32_t ina226_conversion_time_us(uint16_t conf);
+uint32_t ina3221_conversion_time_us(uint16_t conf);
+uint32_t ina228_conversion_time_us(uint16_t conf);
+
+uint16_t ina226_calibration(uint32_t shunt_uohm, uint32_t current_lsb_ua);
+uint16_t ina3221_calibration(uint32_t shunt_uohm, uint32_t current_lsb_ua);
+uint16_t ina228_calibration(uint32_t shunt_uohm, uint32_t current_lsb_ua);
+
+uint32_t ina226_power_uw(uint32_t power, uint32_t current_lsb_ua);
+uint32_t ina3221_power_uw(uint32_t power, uint32_t current_lsb_ua);
+uint32_t ina228_power_uw(uint32_t power, uint32_t current_lsb_ua);
+
+uint8_t ina226_writes(uint16_t conf, uint16_t cal, Sensor_Alert alert, int32_t limit, uint8_t sub, Sensor_Write writes[SENSOR_WRITES]);
+uint8_t ina3221_writes(uint16_t conf, uint16_t cal, Sensor_Alert alert, int32_t limit, uint8_t sub, Sensor_Write writes[SENSOR_WRITES]);
+uint8_t ina228_writes(uint16_t conf, uint16_t cal, Sensor_Alert alert, int32_t limit, uint8_t sub, Sensor_Write writes[SENSOR_WRITES]);
+
+// The same for every part, in the build's sensor's counts
+int32_t bus_volt_counts(uint16_t mv);
+int32_t current_counts(uint16_t ma, uint32_t current_lsb_ua);
+int32_t shunt_volt_counts(int32_t current, uint32_t current_lsb_ua, uint32_t shunt_uohm);
+uint32_t shunt_scale_q16(uint32_t shunt_uohm);
+int32_t shunt_current_ua(int32_t shunt, uint32_t scale_q16);
+
+#endif
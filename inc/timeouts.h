@@ -0,0 +1,33 @@
+#ifndef LVBMS_TIMEOUTS_H
+#define LVBMS_TIMEOUTS_H
+
+#include "stm32f4xx_hal.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Timeouts
+//
+// A hashed timing wheel of up to NUM_TIMEOUTS timeouts, one slot per ms
+// around the wheel. Arming a timeout drops it in the slot its deadline lands
+// in, and each tick only that tick's slot is looked at, so nothing costs
+// anything until its deadline comes round. A deadline more than a turn off
+// stays in its slot until the wheel comes round to it on the right turn.
+//
+// Deadlines are compared by their signed difference from now, so they're
+// right across HAL_GetTick() wrapping as long as they're under 2^31 ms off.
+
+#define NUM_TIMEOUTS  32
+#define WHEEL_SLOTS   64  // Power of 2, past the longest timeout most run in one turn
+
+// One bit per timeout
+typedef uint32_t Timeout_Mask;
+
+void init_timeouts(uint32_t now);
+void arm_timeout(uint8_t timeout, uint32_t deadline);
+void cancel_timeouts(Timeout_Mask timeouts);
+bool timeout_armed(uint8_t timeout);
+void run_timeouts(uint32_t now);
+Timeout_Mask take_timeouts(Timeout_Mask timeouts);
+
+#endif
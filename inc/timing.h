@@ -0,0 +1,28 @@
+#ifndef LVBMS_TIMING_H
+#define LVBMS_TIMING_H
+
+#include "stm32f4xx_hal.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Timing
+//
+// HAL_GetTick() ticks compared by their signed difference, so they're right
+// across the tick wrapping as long as they're under 2^31 ms apart, and the
+// core's cycle counter for timing code, emulated by mock_timing in tests.
+
+// True if tick a comes before tick b
+static inline bool tick_before(uint32_t a, uint32_t b) {
+  return (int32_t) (a - b) < 0;
+}
+
+// True if tick a is at or past tick b
+static inline bool tick_reached(uint32_t a, uint32_t b) {
+  return (int32_t) (a - b) >= 0;
+}
+
+uint32_t time_us(void);
+uint32_t cpu_cycles(void);
+
+#endif
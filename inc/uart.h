@@ -18,5 +18,6 @@ void print_char(char *c);
 void print_int(int i, uint8_t base);
 
 HAL_StatusTypeDef input(char *buf, uint16_t len);
+HAL_StatusTypeDef poll_input(char *c);
 
 #endif // __UART_H
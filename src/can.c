@@ -63,6 +63,24 @@ void MX_CAN1_Init(void)
     _Error_Handler(__FILE__, __LINE__);
   }
 
+  // Only requests addressed to us make it into FIFO 0
+  // Banks 0-13 go to CAN1 and the rest to CAN2, with CAN2SB at 0 CAN1 would have no banks at all
+  CAN_FilterTypeDef filter = {
+    .FilterIdHigh = CAN_ENERGY_REQUEST_ID << 5,
+    .FilterMaskIdHigh = 0x7FF << 5,
+    .FilterFIFOAssignment = CAN_RX_FIFO0,
+    .FilterBank = 0,
+    .FilterMode = CAN_FILTERMODE_IDMASK,
+    .FilterScale = CAN_FILTERSCALE_32BIT,
+    .FilterActivation = ENABLE,
+    .SlaveStartFilterBank = 14,
+  };
+
+  if (HAL_CAN_ConfigFilter(&hcan1, &filter) != HAL_OK || HAL_CAN_Start(&hcan1) != HAL_OK)
+  {
+    _Error_Handler(__FILE__, __LINE__);
+  }
+
 }
 
 void HAL_CAN_MspInit(CAN_HandleTypeDef* canHandle)
@@ -104,3 +122,61 @@ void HAL_CAN_MspDeInit(CAN_HandleTypeDef* canHandle)
 
   }
 } 
+
+// Sends a channel's fault mask whole, with the response to it and which channels have faults, one bit each
+HAL_StatusTypeDef can_send_faults(uint8_t channel, uint8_t faults, uint8_t response, uint8_t faulted_channels)
+{
+
+  CAN_TxHeaderTypeDef header = {
+    .StdId = CAN_FAULT_ID,
+    .IDE = CAN_ID_STD,
+    .RTR = CAN_RTR_DATA,
+    .DLC = 4,
+    .TransmitGlobalTime = DISABLE,
+  };
+  uint8_t data[4] = {channel, faults, response, faulted_channels};
+  uint32_t mailbox;
+
+  return HAL_CAN_AddTxMessage(&hcan1, &header, data, &mailbox);
+
+}
+
+// Sends a channel's charge and energy so far, or the pack's for channel 0xFF
+// Big endian, the charge in 3 bytes and the energy in 4
+HAL_StatusTypeDef can_send_energy(uint8_t channel, int32_t charge_mah, int32_t energy_mwh)
+{
+
+  CAN_TxHeaderTypeDef header = {
+    .StdId = CAN_ENERGY_ID,
+    .IDE = CAN_ID_STD,
+    .RTR = CAN_RTR_DATA,
+    .DLC = 8,
+    .TransmitGlobalTime = DISABLE,
+  };
+  uint8_t data[8] = {
+    channel,
+    charge_mah >> 16, charge_mah >> 8, charge_mah,
+    energy_mwh >> 24, energy_mwh >> 16, energy_mwh >> 8, energy_mwh,
+  };
+  uint32_t mailbox;
+
+  return HAL_CAN_AddTxMessage(&hcan1, &header, data, &mailbox);
+
+}
+
+// Takes the oldest frame waiting in FIFO 0
+// Returns true if there was one
+bool can_receive(uint32_t * const id, uint8_t data[8], uint8_t * const len)
+{
+
+  CAN_RxHeaderTypeDef header;
+
+  if (HAL_CAN_GetRxFifoFillLevel(&hcan1, CAN_RX_FIFO0) == 0) return false;
+  if (HAL_CAN_GetRxMessage(&hcan1, CAN_RX_FIFO0, &header, data) != HAL_OK) return false;
+
+  *id  = header.StdId;
+  *len = header.DLC;
+
+  return true;
+
+}
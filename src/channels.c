@@ -2,22 +2,32 @@
 #include "channels.h"
 #include "tim.h"
 #include "i2c.h"
+#include "gpio.h"
+#include "can.h"
+
+#include <string.h>
 
 // Static definitions
 
 Channel channels[NUM_CHANNELS]; 
 
-// These are the I2C Addresses of each channel
-uint16_t CHANNEL_ADDR[NUM_CHANNELS] = 
+// These are the I2C Addresses of each channel, filled in at boot by discover_channels()
+uint8_t CHANNEL_ADDR[NUM_CHANNELS] = 
 {
-  0,  // VCU_CHAN,
-  0,  // SHUTDOWN_CHAN,
-  0,  // PUMPS_CHAN,
-  0,  // FANS_CHAN,
-  0,  // AERO_CHAN,
-  0,  // REGEN_CHAN,
+  SENSOR_MISSING,  // VCU_CHAN,
+  SENSOR_MISSING,  // SHUTDOWN_CHAN,
+  SENSOR_MISSING,  // PUMPS_CHAN,
+  SENSOR_MISSING,  // FANS_CHAN,
+  SENSOR_MISSING,  // AERO_CHAN,
+  SENSOR_MISSING,  // REGEN_CHAN,
 };
 
+// Which channel of its device each channel is, filled in by discover_channels() for multi-channel sensors
+uint8_t CHANNEL_SUB[NUM_CHANNELS] = {0};
+
+// One bit per Channel_Name, set while that channel has any fault
+uint32_t faulted_channels = 0;
+
 // Error definitions and responses
 
 #ifdef TEST
@@ -27,15 +37,17 @@ Channel_Error const error_definitions[NUM_ERRORS] =
   {.has_timeout=true, .timeout_period=32},  // UNDER_VOLTAGE_ERROR
   {.has_timeout=true, .timeout_period=0},   // OVER_CURRENT_ERROR
   {.has_timeout=false, .timeout_period=0},  // UNDER_CURRENT_ERROR
+  {.has_timeout=true, .timeout_period=50},  // SENSOR_ERROR
   {.has_timeout=false, .timeout_period=32}, // NO_ERROR
 };
 
-Error_Response const response_matrix[NUM_CHANNELS][NUM_ERRORS] = 
+Error_Response const response_matrix[NUM_ERRORS][NUM_CHANNELS] = 
 { // VCU_CHAN SHUTDOWN_CHAN PUMPS_CHAN FANS_CHAN  AERO_CHAN REGEN_CHAN
       WARN,     IGNORE,      SHUTOFF,   IGNORE,    WARN,     SHUTOFF,   // OVER_VOLTAGE_ERROR
       SHUTOFF,  SHUTOFF,     IGNORE,     WARN,    SHUTOFF,   IGNORE,    // UNDER_VOLTAGE_ERROR
       IGNORE,    WARN,        WARN,     SHUTOFF,  IGNORE,     WARN,     // OVER_CURRENT_ERROR
       SHUTOFF,   WARN,       IGNORE,     WARN,    SHUTOFF,   IGNORE,    // UNDER_CURRENT_ERROR
+       WARN,     WARN,        WARN,      WARN,     WARN,      WARN,     // SENSOR_ERROR
       IGNORE,   SHUTOFF,      WARN,     IGNORE,   SHUTOFF,    WARN,     // NO_ERROR
 };
 
@@ -46,15 +58,17 @@ Channel_Error const error_definitions[NUM_ERRORS] =
   {.has_timeout=false, .timeout_period=0},  // UNDER_VOLTAGE_ERROR
   {.has_timeout=false, .timeout_period=0},  // OVER_CURRENT_ERROR
   {.has_timeout=false, .timeout_period=0},  // UNDER_CURRENT_ERROR
+  {.has_timeout=false, .timeout_period=0},  // SENSOR_ERROR
   {.has_timeout=false, .timeout_period=0},  // NO_ERROR
 };
 
-Error_Response const response_matrix[NUM_CHANNELS][NUM_ERRORS] = 
+Error_Response const response_matrix[NUM_ERRORS][NUM_CHANNELS] = 
 { // VCU_CHAN SHUTDOWN_CHAN PUMPS_CHAN FANS_CHAN  AERO_CHAN REGEN_CHAN
       WARN,     WARN,         WARN,       WARN,     WARN,     WARN,   // OVER_VOLTAGE_ERROR
       WARN,     WARN,         WARN,       WARN,     WARN,     WARN,   // UNDER_VOLTAGE_ERROR
       WARN,     WARN,         WARN,       WARN,     WARN,     WARN,   // OVER_CURRENT_ERROR
       WARN,     WARN,         WARN,       WARN,     WARN,     WARN,   // UNDER_CURRENT_ERROR
+      WARN,     WARN,         WARN,       WARN,     WARN,     WARN,   // SENSOR_ERROR
      IGNORE,   IGNORE,       IGNORE,     IGNORE,   IGNORE,   IGNORE,  // NO_ERROR
 };
 
@@ -66,50 +80,706 @@ Channel_Error const error_definitions[NUM_ERRORS] =
   {.has_timeout=false, .timeout_period=0},  // UNDER_VOLTAGE_ERROR
   {.has_timeout=false, .timeout_period=0},  // OVER_CURRENT_ERROR
   {.has_timeout=false, .timeout_period=0},  // UNDER_CURRENT_ERROR
+  {.has_timeout=false, .timeout_period=0},  // SENSOR_ERROR
   {.has_timeout=false, .timeout_period=0},  // NO_ERROR
 };
 
-Error_Response const response_matrix[NUM_CHANNELS][NUM_ERRORS] = 
+Error_Response const response_matrix[NUM_ERRORS][NUM_CHANNELS] = 
 { // VCU_CHAN SHUTDOWN_CHAN PUMPS_CHAN FANS_CHAN  AERO_CHAN REGEN_CHAN
       WARN,     WARN,         WARN,       WARN,     WARN,     WARN,   // OVER_VOLTAGE_ERROR
       WARN,     WARN,         WARN,       WARN,     WARN,     WARN,   // UNDER_VOLTAGE_ERROR
       WARN,     WARN,         WARN,       WARN,     WARN,     WARN,   // OVER_CURRENT_ERROR
       WARN,     WARN,         WARN,       WARN,     WARN,     WARN,   // UNDER_CURRENT_ERROR
+      WARN,     WARN,         WARN,       WARN,     WARN,     WARN,   // SENSOR_ERROR
      IGNORE,   IGNORE,       IGNORE,     IGNORE,   IGNORE,   IGNORE,  // NO_ERROR
 };
 
 
 #endif
 
-Error_Type get_error(Channel const * const channel);
-bool check_timeout_channel(Channel const * const channel_name);
+// Channels sample their bus voltage and current, or for REGEN_CHAN the shunt voltage and power
+// Sampling the shunt voltage rather than the current keeps working with the sensor's CAL lost,
+// and the power register saves a multiply, but every register sampled costs a read
+// Parts without current or power registers sample the shunt voltage everywhere
+#if SENSOR_READINGS & READING(CURRENT_READING)
+#define SAMPLE_VI   (READING(BUS_VOLT_READING) | READING(CURRENT_READING))
+#else
+#define SAMPLE_VI   (READING(BUS_VOLT_READING) | READING(SHUNT_VOLT_READING))
+#endif
+#define SAMPLE_VSP  (SENSOR_READINGS & (READING(BUS_VOLT_READING) | READING(SHUNT_VOLT_READING) | READING(POWER_READING)))
+
+// Each channel's wiring, limits and sensor settings
+// A sensor can only watch one limit in hardware, the rest are found by polling
+// Slower conversions average away more noise, current LSBs are picked so the channel's
+// largest current fits in 15 bits, and max ages allow a few missed conversions before
+// the sensor counts as faulty
+Channel_Config const channel_configs[NUM_CHANNELS] =
+{
+  { // VCU_CHAN
+    .bus = I2C_BUS_1, .htim = &htim4, .tim_channel = TIM_CHANNEL_1,
+    .volt_min = DEFAULT_VMIN, .volt_max = DEFAULT_VMAX, .curr_min = DEFAULT_CMIN, .curr_max = DEFAULT_CMAX,
+    .alert_error = UNDER_VOLTAGE_ERROR,
+    .filters = {DEFAULT_FILTER, DEFAULT_FILTER, DEFAULT_FILTER, DEFAULT_FILTER},
+    .smoothing = NO_SMOOTHING,
+    .sensor = {.averaging=INA226_AVG_16, .bus_conv_time=INA226_CT_1100US, .shunt_conv_time=INA226_CT_1100US, .shunt_uohm=10000, .current_lsb_ua=100, .max_age_ms=200, .readings=SAMPLE_VI},
+  },
+  { // SHUTDOWN_CHAN
+    .bus = I2C_BUS_1, .htim = &htim4, .tim_channel = TIM_CHANNEL_2,
+    .volt_min = DEFAULT_VMIN, .volt_max = DEFAULT_VMAX, .curr_min = DEFAULT_CMIN, .curr_max = DEFAULT_CMAX,
+    .alert_error = UNDER_VOLTAGE_ERROR,
+    .filters = {DEFAULT_FILTER, DEFAULT_FILTER, DEFAULT_FILTER, DEFAULT_FILTER},
+    .smoothing = NO_SMOOTHING,
+    .sensor = {.averaging=INA226_AVG_4, .bus_conv_time=INA226_CT_588US, .shunt_conv_time=INA226_CT_588US, .shunt_uohm=10000, .current_lsb_ua=100, .max_age_ms=50, .readings=SAMPLE_VI},
+  },
+  { // PUMPS_CHAN
+    .bus = I2C_BUS_2, .htim = &htim4, .tim_channel = TIM_CHANNEL_3,
+    .volt_min = DEFAULT_VMIN, .volt_max = DEFAULT_VMAX, .curr_min = DEFAULT_CMIN, .curr_max = DEFAULT_CMAX,
+    .alert_error = UNDER_VOLTAGE_ERROR,
+    .filters = {DEFAULT_FILTER, DEFAULT_FILTER, DEFAULT_FILTER, DEFAULT_FILTER},
+    .smoothing = {.type = FILTER_BOXCAR, .length = 4},  // Rides out the pumps' inrush
+    .sensor = {.averaging=INA226_AVG_4, .bus_conv_time=INA226_CT_588US, .shunt_conv_time=INA226_CT_588US, .shunt_uohm=2000, .current_lsb_ua=1000, .max_age_ms=50, .readings=SAMPLE_VI},
+  },
+  { // FANS_CHAN
+    .bus = I2C_BUS_2, .htim = &htim4, .tim_channel = TIM_CHANNEL_4,
+    .volt_min = DEFAULT_VMIN, .volt_max = DEFAULT_VMAX, .curr_min = DEFAULT_CMIN, .curr_max = DEFAULT_CMAX,
+    .alert_error = UNDER_VOLTAGE_ERROR,
+    .filters = {DEFAULT_FILTER, DEFAULT_FILTER, DEFAULT_FILTER, DEFAULT_FILTER},
+    .smoothing = {.type = FILTER_IIR, .alpha = FILTER_Q15(0.25)},
+    .sensor = {.averaging=INA226_AVG_16, .bus_conv_time=INA226_CT_1100US, .shunt_conv_time=INA226_CT_1100US, .shunt_uohm=2000, .current_lsb_ua=1000, .max_age_ms=200, .readings=SAMPLE_VI},
+  },
+  { // AERO_CHAN
+    .bus = I2C_BUS_3, .htim = &htim5, .tim_channel = TIM_CHANNEL_1,
+    .volt_min = DEFAULT_VMIN, .volt_max = DEFAULT_VMAX, .curr_min = DEFAULT_CMIN, .curr_max = DEFAULT_CMAX,
+    .alert_error = UNDER_VOLTAGE_ERROR,
+    .filters = {DEFAULT_FILTER, DEFAULT_FILTER, DEFAULT_FILTER, DEFAULT_FILTER},
+    .smoothing = NO_SMOOTHING,
+    .sensor = {.averaging=INA226_AVG_64, .bus_conv_time=INA226_CT_1100US, .shunt_conv_time=INA226_CT_1100US, .shunt_uohm=2000, .current_lsb_ua=1000, .max_age_ms=500, .readings=SAMPLE_VI},
+  },
+  { // REGEN_CHAN
+    .bus = I2C_BUS_3, .htim = &htim5, .tim_channel = TIM_CHANNEL_2,
+    .volt_min = DEFAULT_VMIN, .volt_max = DEFAULT_VMAX, .curr_min = DEFAULT_CMIN, .curr_max = DEFAULT_CMAX,
+    .alert_error = UNDER_VOLTAGE_ERROR,
+    .filters = {DEFAULT_FILTER, DEFAULT_FILTER, DEFAULT_FILTER, DEFAULT_FILTER},
+    .smoothing = NO_SMOOTHING,
+    .sensor = {.averaging=INA226_AVG_16, .bus_conv_time=INA226_CT_1100US, .shunt_conv_time=INA226_CT_1100US, .shunt_uohm=2000, .current_lsb_ua=1000, .max_age_ms=200, .readings=SAMPLE_VSP},
+  },
+};
+
+// The worst response to each combination of faults, filled in from response_matrix by init_channel()
+static uint8_t fault_responses[NUM_CHANNELS][NUM_FAULT_MASKS];
+
+// The channel and reading each queued read is for, handed to store_reading() as its context
+typedef struct {
+  Channel       *channel;
+  Reading_Type  reading;
+} Reading_Context;
+
+static Reading_Context reading_contexts[NUM_CHANNELS][NUM_READINGS];
+
+_Static_assert(NUM_CHANNELS * NUM_FAULTS <= NUM_TIMEOUTS, "Every channel's faults need a timeout");
 
 bool update_cmd(Channel * const channel);
 bool update_error(Channel * const channel);
+static bool apply_faults(Channel * const channel, Fault_Mask limit_faults);
+static void move_limits(Channel * const channel);
 
 void write_cmd(Channel const * const channel, Channel_Cmd const * const);
 
 void log_error(Channel const * const channel);
 
 
-// Fills channel with initial values
-void init_channel(Channel * const channel, Channel_Name name, uint16_t addr, TIM_HandleTypeDef *htim, uint32_t tim_channel, uint16_t vmax, uint16_t vmin, uint16_t curr_max, uint16_t curr_min) {
+// Works out the response to every combination of faults on channel name, the worst of its faults' responses
+static void fill_fault_responses(Channel_Name name) {
+
+  for (uint32_t mask = 0; mask < NUM_FAULT_MASKS; mask++) {
+
+    Error_Response worst = IGNORE;
+
+    for (int i = 0; i < NUM_FAULTS; i++) {
+      if ((mask & FAULT(i)) && response_matrix[i][name] > worst) {
+        worst = response_matrix[i][name];
+      }
+    }
+
+    fault_responses[name][mask] = worst;
+  }
+}
+
+// Fills channel with initial values, its sensor at addr and everything else from config
+void init_channel(Channel * const channel, Channel_Name name, uint8_t addr, Channel_Config const * const config) {
 
   channel->name           = name;
+  channel->config         = config;
+
+  channel->faults = 0;
+  cancel_timeouts(CHANNEL_TIMEOUTS(name));
+  faulted_channels &= ~(1U << name);
 
-  channel->err            = NO_ERROR;
-  channel->err_timestamp  = HAL_GetTick();
+  fill_fault_responses(name);
 
   channel->cmd  = (Channel_Cmd) {.type=CHANNEL_ON, .pwm_val=0};
 
   channel->addr         = addr;
-  channel->htim         = htim;
-  channel->tim_channel  = tim_channel;
+  channel->sub          = CHANNEL_SUB[name];
+
+  // Convert limits once rather than every reading
+  uint32_t const current_lsb = config->sensor.current_lsb_ua;
+  uint32_t const shunt_uohm  = config->sensor.shunt_uohm;
+
+  channel->limits = (Raw_Limits) {
+    .volt_min = bus_volt_counts(config->volt_min),
+    .volt_max = bus_volt_counts(config->volt_max),
+    .curr_min = current_counts(config->curr_min, current_lsb),
+    .curr_max = current_counts(config->curr_max, current_lsb),
+  };
+
+  channel->limits.shunt_min = shunt_volt_counts(channel->limits.curr_min, current_lsb, shunt_uohm);
+  channel->limits.shunt_max = shunt_volt_counts(channel->limits.curr_max, current_lsb, shunt_uohm);
+
+  // And the filters' bands, the same way
+  Fault_Filter const * const filters = config->filters;
+
+  channel->bands = (Raw_Limits) {
+    .volt_min = bus_volt_counts(filters[UNDER_VOLTAGE_ERROR].band),
+    .volt_max = bus_volt_counts(filters[OVER_VOLTAGE_ERROR].band),
+    .curr_min = current_counts(filters[UNDER_CURRENT_ERROR].band, current_lsb),
+    .curr_max = current_counts(filters[OVER_CURRENT_ERROR].band, current_lsb),
+  };
+
+  channel->bands.shunt_min = shunt_volt_counts(channel->bands.curr_min, current_lsb, shunt_uohm);
+  channel->bands.shunt_max = shunt_volt_counts(channel->bands.curr_max, current_lsb, shunt_uohm);
+
+  channel->confirmed    = 0;
+  channel->filtered_seq = 0;
+  for (int i = 0; i < NUM_LIMIT_FAULTS; i++) {
+    channel->fault_history[i] = 0;
+    channel->fault_counts[i]  = 0;
+  }
+
+  // Nothing confirmed, readings are checked against the limits as configured
+  move_limits(channel);
+  channel->shunt_scale      = shunt_scale_q16(shunt_uohm);
+
+  // Nothing read yet, readings go stale if nothing arrives from here
+  for (int i = 0; i < NUM_READINGS; i++) {
+    channel->samples[i] = (Cached_Sample) {.timestamp = HAL_GetTick(), .quality = SAMPLE_NONE};
+    filter_reset(&channel->smoothing[i]);
+  }
+
+  // Read the sensor's flags straight away
+  channel->alert_pending  = true;
+  channel->limit_breached = false;
+  channel->poll_timestamp = HAL_GetTick();
+
+  channel->sampling         = false;
+  channel->sample_timestamp = HAL_GetTick();
+
+  channel->stats = (Sample_Stats) {.window_start = HAL_GetTick()};
+}
+
+// Sensors convert once per trigger_channel() rather than continuously, see set_snapshot_mode()
+static bool snapshot_mode = false;
+
+// Returns the SENSOR_REG_CONF value for channel's sensor
+uint16_t sensor_conf(Channel const * const channel) {
+
+  if (snapshot_mode) {
+    return SENSOR_FN(conf)(SNAPSHOT_AVERAGING, SNAPSHOT_CONV_TIME, SNAPSHOT_CONV_TIME, true);
+  }
+
+  Sensor_Config const * const config = &channel->config->sensor;
+  return SENSOR_FN(conf)(config->averaging, config->bus_conv_time, config->shunt_conv_time, false);
+}
+
+// Returns the SENSOR_REG_CAL value for channel's shunt
+uint16_t sensor_cal(Channel const * const channel) {
+  Sensor_Config const * const config = &channel->config->sensor;
+  return SENSOR_FN(calibration)(config->shunt_uohm, config->current_lsb_ua);
+}
+
+// Scans every bus and maps the sensors found into CHANNEL_ADDR
+// Each bus's sensors go to its channels in Channel_Name order, lowest address first,
+// so strap the addresses to match. Channels short of a sensor get SENSOR_MISSING
+// A multi-channel sensor takes SENSOR_DEVICE_CHANNELS channels in a row, see CHANNEL_SUB
+// Returns the number of channels with a sensor
+uint8_t discover_channels(void) {
+
+  uint8_t found[NUM_I2C_BUSES][NUM_CHANNELS];
+  uint8_t count[NUM_I2C_BUSES];
+  uint8_t next[NUM_I2C_BUSES] = {0};
+  uint8_t mapped = 0;
+
+  for (I2C_Bus bus = 0; bus < NUM_I2C_BUSES; bus++) {
+    count[bus] = scan_bus(bus, found[bus], NUM_CHANNELS);
+  }
+
+  for (Channel_Name name = 0; name < NUM_CHANNELS; name++) {
+
+    I2C_Bus const bus = channel_configs[name].bus;
+
+    if (next[bus] / SENSOR_DEVICE_CHANNELS < count[bus]) {
+      CHANNEL_ADDR[name] = found[bus][next[bus] / SENSOR_DEVICE_CHANNELS];
+      CHANNEL_SUB[name]  = next[bus] % SENSOR_DEVICE_CHANNELS;
+      next[bus]++;
+      mapped++;
+    }
+    else {
+      CHANNEL_ADDR[name] = SENSOR_MISSING;
+    }
+  }
+
+  return mapped;
+}
+
+// Returns true once every channel with a sensor has all its readings
+bool channels_sampled(void) {
+
+  for (int i = 0; i < NUM_CHANNELS; i++) {
+
+    if (channels[i].addr == SENSOR_MISSING) continue;
+
+    for (int j = 0; j < NUM_READINGS; j++) {
+      if ((channels[i].config->sensor.readings & READING(j)) && channels[i].samples[j].seq == 0) return false;
+    }
+  }
+
+  return true;
+}
+
+// Fills writes with the register values that program channel's sensor, in the order they go out
+// Returns how many there are
+static uint8_t sensor_writes(Channel const * const channel, Sensor_Write writes[SENSOR_WRITES]) {
+
+  Sensor_Alert alert = SENSOR_ALERT_NONE;
+  int32_t limit      = 0;
+
+  // Current limits are watched through the shunt voltage behind them
+  switch (channel->config->alert_error) {
+
+    case OVER_VOLTAGE_ERROR:
+      alert = SENSOR_ALERT_BUS_OVER;
+      limit = channel->limits.volt_max;
+      break;
+
+    case UNDER_VOLTAGE_ERROR:
+      alert = SENSOR_ALERT_BUS_UNDER;
+      limit = channel->limits.volt_min;
+      break;
+
+    case OVER_CURRENT_ERROR:
+      alert = SENSOR_ALERT_SHUNT_OVER;
+      limit = channel->limits.shunt_max;
+      break;
+
+    case UNDER_CURRENT_ERROR:
+      alert = SENSOR_ALERT_SHUNT_UNDER;
+      limit = channel->limits.shunt_min;
+      break;
+
+    default:  // Only watch conversions
+      break;
+  }
+
+  return SENSOR_FN(writes)(sensor_conf(channel), sensor_cal(channel), alert, limit, channel->sub, writes);
+}
+
+// Programs channel's sensor conversions and calibration, and has it watch its alert limit
+// Blocks on the bus, so only call this before the sampler starts, see check_channel()
+HAL_StatusTypeDef configure_channel(Channel const * const channel) {
+
+  if (channel->addr == SENSOR_MISSING) return HAL_ERROR;
+
+  Sensor_Write writes[SENSOR_WRITES];
+  uint8_t const count = sensor_writes(channel, writes);
+
+  for (int i = 0; i < count; i++) {
+
+    HAL_StatusTypeDef const status = write_reg(channel->config->bus, writes[i].reg_addr, channel->addr, writes[i].val);
+
+    if (status != HAL_OK) return status;
+  }
+
+  return HAL_OK;
+}
+
+// Brownout detection
+//
+// A sensor that loses power comes back converting with its power on 
+// defaults: no calibration, averaging or alert limit. check_channel() reads
+// CONF and CAL back through the queue now and again, and queues the writes
+// to re-program a sensor that doesn't match, so nothing waits on the bus.
+
+static void reprogram_channel(Channel * const channel) {
+
+  Sensor_Write writes[SENSOR_WRITES];
+  uint8_t const count = sensor_writes(channel, writes);
+
+  for (int i = 0; i < count; i++) {
+    queue_write(channel->config->bus, writes[i].reg_addr, channel->addr, writes[i].val, NULL, NULL);
+  }
+
+  channel->stats.reinits++;
+
+  // Nothing flagged conversions while it was reset
+  channel->alert_pending = true;
+}
+
+static void check_cal(I2C_Transaction const * const txn, HAL_StatusTypeDef status) {
+
+  Channel * const channel = txn->context;
+
+  if (status == HAL_OK && txn->rsp != sensor_cal(channel)) {
+    reprogram_channel(channel);
+  }
+}
+
+static void check_conf(I2C_Transaction const * const txn, HAL_StatusTypeDef status) {
+
+  Channel * const channel = txn->context;
+
+  if (status != HAL_OK) return;
+
+  if (txn->rsp != sensor_conf(channel)) {
+    reprogram_channel(channel);
+  }
+  else if (SENSOR_REG_CAL != SENSOR_NO_REG) {
+    queue_read(channel->config->bus, SENSOR_REG_CAL, channel->addr, check_cal, channel);
+  }
+}
+
+// Queues a read-back of channel's sensor configuration, re-programming the sensor if it has reset
+// Returns true if the read-back was queued
+bool check_channel(Channel * const channel) {
+
+  if (channel->addr == SENSOR_MISSING) return false;
+
+  return queue_read(channel->config->bus, SENSOR_REG_CONF, channel->addr, check_conf, channel) == HAL_OK;
+}
+
+// ALERT pin interrupt, flags the channel for sample_channel()
+void HAL_GPIO_EXTI_Callback(uint16_t pin) {
+
+  for (int i = 0; i < NUM_CHANNELS; i++) {
+    if (pin == ALERT_PIN(i)) {
+      channels[i].alert_pending = true;
+    }
+  }
+}
+
+// Returns the fault the channel's sensor flagged, or 0 if it didn't
+static Fault_Mask take_alert(Channel * const channel) {
+
+  if (!channel->limit_breached) return 0;
+
+  channel->limit_breached = false;
+
+  Error_Type const error = channel->config->alert_error;
+  return error == NO_ERROR ? 0 : FAULT(error);
+}
+
+// I2C queue callbacks, these run from interrupt context
+
+// Marks the reads queued by sample_channel() as finished
+static void end_sample(Channel * const channel) {
+  channel->sample_timestamp = HAL_GetTick();
+  channel->sampling = false;
+}
+
+// Caches a read's outcome, only a good read replaces the value
+static void cache_sample(Channel * const channel, Reading_Type reading, int32_t raw, HAL_StatusTypeDef status) {
+
+  Cached_Sample * const sample = &channel->samples[reading];
+
+  if (status != HAL_OK) {
+    sample->quality = SAMPLE_FAILED;
+    return;
+  }
+
+  sample->raw       = raw;
+  sample->timestamp = HAL_GetTick();
+  sample->seq++;
+  sample->quality   = SAMPLE_GOOD;
+}
+
+// Returns the quality of channel's cached reading, as of now
+Sample_Quality sample_quality(Channel const * const channel, Reading_Type reading) {
+
+  Cached_Sample const * const sample = &channel->samples[reading];
+
+  // Signed, so the age is right across HAL_GetTick() wrapping
+  int32_t const age = HAL_GetTick() - sample->timestamp;
+
+  if (age > channel->config->sensor.max_age_ms) {
+    return SAMPLE_STALE;
+  }
+
+  return sample->quality;
+}
+
+// Copies channel's cached reading with the I2C completions held off, so its raw, timestamp and seq all come from the same read
+Cached_Sample read_sample(Channel const * const channel, Reading_Type reading) {
+
+  uint32_t const primask = __get_PRIMASK();
+  __disable_irq();
+
+  Cached_Sample const sample = channel->samples[reading];
+
+  __set_PRIMASK(primask);
+  return sample;
+}
+
+// Copies every one of channel's cached readings at once, so they all come from the same sample, see read_sample()
+void read_samples(Channel const * const channel, Cached_Sample samples[NUM_READINGS]) {
+
+  uint32_t const primask = __get_PRIMASK();
+  __disable_irq();
+
+  memcpy(samples, channel->samples, sizeof(channel->samples));
+
+  __set_PRIMASK(primask);
+}
+
+// Returns the current in samples in uA, from the shunt voltage if channel samples that
+int32_t samples_current_ua(Channel const * const channel, Cached_Sample const samples[NUM_READINGS]) {
+
+  if (channel->config->sensor.readings & READING(SHUNT_VOLT_READING)) {
+    return shunt_current_ua(samples[SHUNT_VOLT_READING].raw, channel->shunt_scale);
+  }
+
+  return samples[CURRENT_READING].raw * (int32_t) channel->config->sensor.current_lsb_ua;
+}
+
+// Returns the power in samples in uW, from the power register if channel samples that, saturating at UINT32_MAX
+uint32_t samples_power_uw(Channel const * const channel, Cached_Sample const samples[NUM_READINGS]) {
+
+  if (channel->config->sensor.readings & READING(POWER_READING)) {
+    return SENSOR_FN(power_uw)(samples[POWER_READING].raw, channel->config->sensor.current_lsb_ua);
+  }
+
+  // Otherwise multiply it out like the sensor would, uV * uA / 10^6
+  int32_t const current_ua = samples_current_ua(channel, samples);
+  uint64_t const bus_uv = (uint64_t) samples[BUS_VOLT_READING].raw * SENSOR_BUS_VOLT_LSB_NV / 1000;
+  uint64_t const uw = bus_uv * (current_ua < 0 ? -(int64_t) current_ua : current_ua) / 1000000;
+
+  return uw > UINT32_MAX ? UINT32_MAX : uw;
+}
+
+// Returns channel's latest current in uA, see samples_current_ua()
+int32_t channel_current_ua(Channel const * const channel) {
+  return samples_current_ua(channel, channel->samples);
+}
+
+// Returns channel's latest power in uW, see samples_power_uw()
+uint32_t channel_power_uw(Channel const * const channel) {
+  return samples_power_uw(channel, channel->samples);
+}
+
+// Returns how many registers are read for readings
+static uint8_t reading_count(uint8_t readings) {
 
-  channel->volt_max     = vmax;
-  channel->volt_min     = vmin;
-  channel->curr_max     = curr_max;
-  channel->curr_min     = curr_min;
+  uint8_t count = 0;
+
+  for (Reading_Type reading = 0; reading < NUM_READINGS; reading++) {
+    if (readings & READING(reading)) count++;
+  }
+
+  return count;
+}
+
+// Returns the last of channel's readings to be read each conversion, they're read in Reading_Type order
+static Reading_Type last_reading(Channel const * const channel) {
+
+  Reading_Type last = 0;
+
+  for (Reading_Type reading = 0; reading < NUM_READINGS; reading++) {
+    if (channel->config->sensor.readings & READING(reading)) {
+      last = reading;
+    }
+  }
+
+  return last;
+}
+
+// Caches a reading, counting the conversion once its last one is in
+static void store_reading(I2C_Transaction const * const txn, HAL_StatusTypeDef status) {
+
+  Reading_Context const * const context = txn->context;
+  Channel * const channel = context->channel;
+  Reading_Type const reading = context->reading;
+
+  cache_sample(channel, reading, sensor_decode(reading, txn->rsp), status);
+
+  if (reading == last_reading(channel) && status == HAL_OK) {
+    channel->stats.fresh_samples++;
+  }
+}
+
+// Caches the last reading queued by sample_channel(), which finishes the sample
+static void finish_reading(I2C_Transaction const * const txn, HAL_StatusTypeDef status) {
+  store_reading(txn, status);
+  end_sample(((Reading_Context const *) txn->context)->channel);
+}
+
+// Queues reads of channel's latest conversion, finishing its sample with the last if finish is set
+static void queue_readings(Channel * const channel, bool finish) {
+
+  uint8_t const readings = channel->config->sensor.readings;
+  Reading_Type const last = last_reading(channel);
+
+  for (Reading_Type reading = 0; reading < NUM_READINGS; reading++) {
+
+    if (!(readings & READING(reading))) continue;
+
+    Reading_Context * const context = &reading_contexts[channel->name][reading];
+    *context = (Reading_Context) {.channel = channel, .reading = reading};
+
+    I2C_Callback const callback = finish && reading == last ? finish_reading : store_reading;
+    HAL_StatusTypeDef const status = queue_burst(channel->config->bus, sensor_reg(reading, channel->sub), channel->addr,
+                                                 sensor_reg_size(reading), callback, context);
+
+    // The last read finishes the sample, unless it never makes it onto the bus
+    if (status != HAL_OK && callback == finish_reading) {
+      end_sample(channel);
+    }
+  }
+}
+
+static void check_flags(I2C_Transaction const * const txn, HAL_StatusTypeDef status) {
+
+  Channel * const channel = txn->context;
+
+  if (status != HAL_OK) {
+    end_sample(channel);
+    return;
+  }
+
+  if (sensor_alerted(txn->rsp, channel->sub)) {
+    channel->limit_breached = true;
+  }
+
+  // Only read the conversion if there is a new one
+  if (!(txn->rsp & SENSOR_FLAG_READY)) {
+    channel->stats.reads_avoided += reading_count(channel->config->sensor.readings);
+    end_sample(channel);
+    return;
+  }
+
+  // Every channel of a multi-channel sensor converted together, and reading its flags
+  // cleared them all, so read the other channels' conversions in the same burst
+  for (int i = 0; SENSOR_DEVICE_CHANNELS > 1 && i < NUM_CHANNELS; i++) {
+
+    Channel * const sibling = &channels[i];
+
+    if (sibling == channel || sibling->config->bus != channel->config->bus || sibling->addr != channel->addr) continue;
+
+    if (sensor_alerted(txn->rsp, sibling->sub)) {
+      sibling->limit_breached = true;
+    }
+
+    sibling->alert_pending  = false;
+    sibling->poll_timestamp = HAL_GetTick();
+    queue_readings(sibling, false);
+  }
+
+  queue_readings(channel, true);
+}
+
+// Measures the channel's fresh samples per second
+static void update_sample_rate(Channel * const channel) {
+
+  Sample_Stats * const stats = &channel->stats;
+  uint32_t const elapsed = HAL_GetTick() - stats->window_start;
+
+  if (elapsed >= 1000) {
+    stats->fresh_per_second = (uint64_t) (stats->fresh_samples - stats->window_samples) * 1000 / elapsed;
+    stats->window_start = HAL_GetTick();
+    stats->window_samples = stats->fresh_samples;
+  }
+}
+
+// Switches every sensor between converting continuously and once per trigger_channel()
+// Only changes what sensor_conf() returns, trigger each channel to write it out
+void set_snapshot_mode(bool on) {
+  snapshot_mode = on;
+}
+
+// Queues a write of channel's CONF, which starts a single conversion in snapshot mode
+// A multi-channel sensor is only triggered through its first channel
+// Returns true if the write was queued
+bool trigger_channel(Channel const * const channel) {
+
+  if (channel->addr == SENSOR_MISSING || channel->sub != 0) return false;
+
+  return queue_write(channel->config->bus, SENSOR_REG_CONF, channel->addr, sensor_conf(channel), NULL, NULL) == HAL_OK;
+}
+
+// Queues a read of channel's flags, then of its voltage and current if there's a new conversion
+// Doesn't wait on the ALERT pin, see sample_channel()
+// Returns true if reads were queued, channel->sampling is cleared once they finish
+bool read_channel(Channel * const channel) {
+
+  if (channel->addr == SENSOR_MISSING) return false;
+
+  channel->sampling = true;
+
+  if (queue_read(channel->config->bus, SENSOR_REG_FLAGS, channel->addr, check_flags, channel) != HAL_OK) {
+    channel->sampling = false;
+    return false;
+  }
+
+  channel->alert_pending  = false;
+  channel->poll_timestamp = HAL_GetTick();
+
+  return true;
+}
+
+// Queues reads of channel's voltage and current once its sensor has a new conversion
+// Returns immediately, readings are stored in the channel as they arrive
+// Returns true if reads were queued, channel->sampling is cleared once they finish
+bool sample_channel(Channel * const channel) {
+
+  if (channel->addr == SENSOR_MISSING) return false;
+
+  update_sample_rate(channel);
+
+  // The ALERT pin flags new conversions, but poll the flags every couple of 
+  // conversions in case an edge was missed and the pin is stuck latched
+  uint32_t const poll_period = 2 * SENSOR_FN(conversion_time_us)(sensor_conf(channel)) / 1000 + 1;
+  bool const overdue = HAL_GetTick() - channel->poll_timestamp > poll_period;
+
+  if (!channel->alert_pending && !overdue) {
+
+    // Reading now would only get the last conversion again
+    channel->stats.reads_avoided += reading_count(channel->config->sensor.readings);
+
+    return false;
+  }
+
+  return read_channel(channel);
+}
+
+
+// Runs each of channel's new readings through its smoothing, the raw readings stay as they were read
+void filter_channel(Channel * const channel) {
+
+  for (Reading_Type reading = 0; reading < NUM_READINGS; reading++) {
+
+    Cached_Sample const sample = read_sample(channel, reading);
+    Filter_State * const state = &channel->smoothing[reading];
+
+    if (sample.seq == state->seq) continue;
+
+    state->seq = sample.seq;
+    channel->samples[reading].filtered = filter_step(&channel->config->smoothing, state, sample.raw);
+  }
+}
+
+// Filters every channel's new readings in one pass, ahead of checking their limits
+void filter_samples(void) {
+
+  for (int i = 0; i < NUM_CHANNELS; i++) {
+    filter_channel(&channels[i]);
+  }
 }
 
 
@@ -125,103 +795,200 @@ bool update_cmd(Channel * const channel) {
 
 }
 
-// Logs channel's error to CAN
+// Reports channel's faults to CAN, the whole mask in one frame
 void log_error(Channel const * const channel) {
 
-  // TODO: Implement this
-  
-  _Error_Handler(__FILE__, __LINE__);
+  can_send_faults(channel->name, channel->faults, fault_responses[channel->name][channel->faults], faulted_channels);
 
 }
 
-// Checks for and returns error on passed channel
-Error_Type get_error(Channel const * const channel) {
+// Returns FAULT(SENSOR_ERROR) if any of the readings channel samples went stale, else 0
+Fault_Mask stale_faults(Channel const * const channel) {
 
-  // Check for voltage errors
-  uint16_t voltage;
-  read_voltage(channel->addr, &voltage);
-  
-  if (voltage < channel->volt_min) {
-    return UNDER_VOLTAGE_ERROR;
+  for (int i = 0; i < NUM_READINGS; i++) {
+    if ((channel->config->sensor.readings & READING(i)) && sample_quality(channel, i) == SAMPLE_STALE) {
+      return FAULT(SENSOR_ERROR);
+    }
   }
-  if (voltage > channel->volt_max) {
-    return OVER_VOLTAGE_ERROR;
+
+  return 0;
+}
+
+// Checks every limit on passed channel's latest readings in one pass
+// Returns the FAULT() of each one broken, 0 if none are
+Fault_Mask get_faults(Channel const * const channel) {
+
+  Cached_Sample const * const voltage = &channel->samples[BUS_VOLT_READING];
+  Cached_Sample const * const current = &channel->samples[CURRENT_READING];
+  Cached_Sample const * const shunt   = &channel->samples[SHUNT_VOLT_READING];
+
+  // Readings that stopped coming in can't be trusted either way
+  Fault_Mask faults = stale_faults(channel);
+
+  // Check for voltage errors, on the last good reading once filtered
+  if (voltage->seq > 0) {
+  
+    if (voltage->filtered < channel->checked_limits.volt_min) {
+      faults |= FAULT(UNDER_VOLTAGE_ERROR);
+    }
+    if (voltage->filtered > channel->checked_limits.volt_max) {
+      faults |= FAULT(OVER_VOLTAGE_ERROR);
+    }
   }
 
   // Check for current errors
-  uint16_t current;
-  read_current(channel->addr, &current);
+  if (current->seq > 0) {
 
-  if (current < channel->curr_min) {
-    return UNDER_CURRENT_ERROR;
+    if (current->filtered < channel->checked_limits.curr_min) {
+      faults |= FAULT(UNDER_CURRENT_ERROR);
+    }
+    if (current->filtered > channel->checked_limits.curr_max) {
+      faults |= FAULT(OVER_CURRENT_ERROR);
+    }
   }
-  if (current > channel->curr_max) {
-    return OVER_CURRENT_ERROR;  
+
+  // Or through the shunt voltage, for channels that sample that instead
+  else if (shunt->seq > 0) {
+
+    if (shunt->filtered < channel->checked_limits.shunt_min) {
+      faults |= FAULT(UNDER_CURRENT_ERROR);
+    }
+    if (shunt->filtered > channel->checked_limits.shunt_max) {
+      faults |= FAULT(OVER_CURRENT_ERROR);
+    }
   }
 
-  // No more errors
-  return NO_ERROR;
+  return faults;
 
 }
 
-// Tries to update errors on this channel, 
-// Returns true if there are updates, else false
+// Updates channel's faults from its latest readings, faults no longer seen clear once they time out
+// Returns true if its faults changed, else false
 bool update_error(Channel * const channel) {
+  return apply_faults(channel, get_faults(channel));
+}
 
-  // Check for errors on channel
-  Error_Type current_error = get_error(channel);
+// Works out the limits readings are checked against: the configured ones, moved inward by the
+// band of each confirmed fault, so readings have to clear a confirmed fault's limit by that much
+static void move_limits(Channel * const channel) {
 
-  // If there are errors, update channel
-  if (current_error != NO_ERROR) {
+  Raw_Limits const * const bands = &channel->bands;
+  Raw_Limits * const checked = &channel->checked_limits;
+  Fault_Mask const confirmed = channel->confirmed;
 
-    channel->err = current_error;
-    channel->err_timestamp = HAL_GetTick();
+  *checked = channel->limits;
 
-    return true;
+  if (confirmed & FAULT(UNDER_VOLTAGE_ERROR)) {
+    checked->volt_min += bands->volt_min;
+  }
 
-  }  
+  if (confirmed & FAULT(OVER_VOLTAGE_ERROR)) {
+    checked->volt_max -= bands->volt_max;
+  }
 
-  // If there aren't current errors, try timing out old ones
-  if (check_timeout_channel(channel)) {
+  if (confirmed & FAULT(UNDER_CURRENT_ERROR)) {
+    checked->curr_min  += bands->curr_min;
+    checked->shunt_min += bands->shunt_min;
+  }
 
-    channel->err = NO_ERROR;
-    channel->err_timestamp = HAL_GetTick();
+  if (confirmed & FAULT(OVER_CURRENT_ERROR)) {
+    checked->curr_max  -= bands->curr_max;
+    checked->shunt_max -= bands->shunt_max;
+  }
 
-    return true;
+  channel->limits_moved = true;
+}
 
-  }
+// Takes one sample's limit faults into each fault's last window samples, updating which are confirmed
+// Keeps a running count of each window, so it's the same few operations however long the window is
+static void filter_faults(Channel * const channel, Fault_Mask limit_faults) {
 
-  // There are no error updates
-  return false;
+  for (int i = 0; i < NUM_LIMIT_FAULTS; i++) {
+
+    Fault_Filter const * const filter = &channel->config->filters[i];
+    uint32_t const window = filter->window ? filter->window : 1;
+
+    uint32_t const out     = (limit_faults >> i) & 1;
+    uint32_t const leaving = (channel->fault_history[i] >> (window - 1)) & 1;
+
+    channel->fault_history[i] = (channel->fault_history[i] << 1) | out;
+    channel->fault_counts[i] += out - leaving;
 
+    uint32_t const count = channel->fault_counts[i];
+
+    if (!(channel->confirmed & FAULT(i)) && count >= filter->set_n && count > 0) {
+      channel->confirmed |= FAULT(i);
+      move_limits(channel);
+    }
+    else if ((channel->confirmed & FAULT(i)) && window - count >= filter->clear_n) {
+      channel->confirmed &= ~FAULT(i);
+      move_limits(channel);
+    }
+  }
 }
 
-// Returns true if a channel's error has timed out, else false
-bool check_timeout_channel(Channel const * const channel) {
+// Updates channel's faults with the ones found on its readings, see update_error()
+static bool apply_faults(Channel * const channel, Fault_Mask limit_faults) {
+
+  // Limit faults only count once their filters agree, and only once per sample
+  if (channel->smoothing[BUS_VOLT_READING].seq != channel->filtered_seq) {
+    channel->filtered_seq = channel->smoothing[BUS_VOLT_READING].seq;
+    filter_faults(channel, limit_faults);
+  }
+
+  // Stale readings already waited out the channel's max age, the sensor's own limit check did its own averaging
+  Fault_Mask const found = channel->confirmed | (limit_faults & FAULT(SENSOR_ERROR)) | take_alert(channel);
+
+  uint32_t const now = HAL_GetTick();
 
-  // Get error's definition
-  const Channel_Error error_def = error_definitions[channel->err];
+  // Only a no-op after the first channel this tick
+  run_timeouts(now);
 
-  // Check if it is timed out
-  if (error_def.has_timeout && HAL_GetTick() > channel->err_timestamp + error_def.timeout_period) {
-      return true;
+  // Each time a fault's seen its timeout starts over, it clears once it's gone unseen for the whole period
+  for (int i = 0; i < NUM_FAULTS; i++) {
+    if ((found & FAULT(i)) && error_definitions[i].has_timeout) {
+      arm_timeout(FAULT_TIMEOUT(channel->name, i), now + error_definitions[i].timeout_period + 1);
+    }
   }
 
-  // Then the error isn't timed out
-  else {
+  Timeout_Mask const timed_out = take_timeouts(CHANNEL_TIMEOUTS(channel->name)) >> FAULT_TIMEOUT(channel->name, 0);
+  Fault_Mask const faults = (channel->faults | found) & ~timed_out;
+
+  // There are no error updates
+  if (faults == channel->faults) {
     return false;
   }
+
+  channel->faults = faults;
+
+  if (faults) {
+    faulted_channels |= 1U << channel->name;
+  }
+  else {
+    faulted_channels &= ~(1U << channel->name);
+  }
+
+  return true;
+
 }
 
 // Updates channel
 // Returns true if there are updates, else false
 bool update_channel(Channel * const channel) {
+  return update_channel_faults(channel, get_faults(channel));
+}
+
+// Updates channel with the faults already found on its readings, see evaluate_all_channels()
+// Returns true if there are updates, else false
+bool update_channel_faults(Channel * const channel, Fault_Mask limit_faults) {
   
+  Fault_Mask const before = channel->faults;
+
   // Get errors if present
-  if (update_error(channel)) {
+  if (apply_faults(channel, limit_faults)) {
 
-    // Log errors that aren't ignored
-    if (response_matrix[channel->name][channel->err] > IGNORE) {
+    // Log changes to errors that aren't ignored, including them clearing
+    if (fault_responses[channel->name][before | channel->faults] > IGNORE) {
       log_error(channel);
     }
     
@@ -240,15 +1007,15 @@ bool update_channel(Channel * const channel) {
 void write_cmd(Channel const * const channel, Channel_Cmd const * const cmd) {
   
   if (cmd->type == CHANNEL_ON) {
-    pwm_write(channel->htim, channel->tim_channel, UINT32_MAX);  
+    pwm_write(channel->config->htim, channel->config->tim_channel, UINT32_MAX);  
   }
   
   else if (cmd->type == CHANNEL_OFF) {
-    pwm_write(channel->htim, channel->tim_channel, 0U);
+    pwm_write(channel->config->htim, channel->config->tim_channel, 0U);
   }
   
   else if (cmd->type == PWM_VALUE) {
-    pwm_write(channel->htim, channel->tim_channel, cmd->pwm_val);
+    pwm_write(channel->config->htim, channel->config->tim_channel, cmd->pwm_val);
   }
   
   else if (cmd->type == NO_COMMAND) {
@@ -271,47 +1038,16 @@ void write_cmd(Channel const * const channel, Channel_Cmd const * const cmd) {
 
 // Write command and error responses described in passed channel
 void write_channel(Channel const * const channel) {
-  
-  // If there is an error, respond to it
-  if (channel->err != NO_ERROR) {
-    
-    switch(response_matrix[channel->name][channel->err]) {
-      
-      case SHUTOFF : 
-      {            
-
-        // Turn off the channel
-        Channel_Cmd cmd = {.type=CHANNEL_OFF, .pwm_val=0}; // Note pwm_val is irrelevant for CHANNEL_OFF
-        write_cmd(channel, &cmd);
-        
-        // Now return - we won't write the channel's command
-        return;
-      }
-      break;
-
-      case WARN :   // Error was logged already
-      break;        // Do nothing here
-
-      case IGNORE : // Do nothing
-      break; 
-
-      default:      // We shouldn't fall through
-        
-        // Throw error if testing    
-        #ifdef TEST
-        _Error_Handler(__FILE__, __LINE__);
-        #endif
-
-        // Otherwise, do nothing
-
-      break;
-    }
 
-    // For errors that don't return, 
-    // will now write the channel's command
+  // The worst response to all of the channel's errors at once
+  if (fault_responses[channel->name][channel->faults] == SHUTOFF) {
 
+    // Turn off the channel, we won't write the channel's command
+    Channel_Cmd cmd = {.type=CHANNEL_OFF, .pwm_val=0}; // Note pwm_val is irrelevant for CHANNEL_OFF
+    write_cmd(channel, &cmd);
+    return;
   }
 
-  // Write the channel's command
+  // Warnings were logged already, write the channel's command
   write_cmd(channel, &channel->cmd);
 }
@@ -0,0 +1,212 @@
+#include "energy.h"
+#include "can.h"
+#include "uart.h"
+#include "timing.h"
+
+#include <string.h>
+
+Energy_Account energy_accounts[NUM_CHANNELS];
+
+// Every channel's charge and energy added up, over the time from the first sample integrated to the latest
+Energy_Totals pack_energy;
+
+static bool pack_started;   // pack_end is set
+static uint32_t pack_end;   // When the latest interval integrated on any channel ended
+
+// The reading samples_current_ua() works its current out from
+static Reading_Type current_reading(Channel const * const channel) {
+  return (channel->config->sensor.readings & READING(SHUNT_VOLT_READING)) ? SHUNT_VOLT_READING : CURRENT_READING;
+}
+
+// Adds the trapezoid from account's last sample to this one, current_ua and power_uw over the elapsed ms up to end
+static void integrate(Energy_Account * const account, int32_t current_ua, int64_t power_uw, uint32_t elapsed, uint32_t end) {
+
+  int64_t const charge = ((int64_t) account->current_ua + current_ua) * elapsed / 2;
+  int64_t const energy = (account->power_uw + power_uw) * elapsed / 2;
+
+  account->totals.charge_nc += charge;
+  account->totals.energy_nj += energy;
+  account->totals.time_ms   += elapsed;
+
+  pack_energy.charge_nc += charge;
+  pack_energy.energy_nj += energy;
+
+  // Channels cover the same time side by side, the pack only counts it once
+  if (!pack_started) {
+    pack_started = true;
+    pack_end = end - elapsed;
+  }
+
+  if (tick_before(pack_end, end)) {
+    pack_energy.time_ms += end - pack_end;
+    pack_end = end;
+  }
+}
+
+// Starts every total over
+void init_energy(void) {
+  memset(energy_accounts, 0, sizeof(energy_accounts));
+  memset(&pack_energy, 0, sizeof(pack_energy));
+  pack_started = false;
+}
+
+// Starts channel's totals over, taking its charge and energy out of the pack's, or every total for ENERGY_PACK
+// The next sample is integrated from the last one as usual
+void reset_energy(uint8_t channel) {
+
+  if (channel == ENERGY_PACK) {
+
+    for (int i = 0; i < NUM_CHANNELS; i++) {
+      energy_accounts[i].totals = (Energy_Totals) {0};
+    }
+
+    pack_energy = (Energy_Totals) {0};
+    pack_started = false;
+    return;
+  }
+
+  if (channel >= NUM_CHANNELS) return;
+
+  Energy_Totals * const totals = &energy_accounts[channel].totals;
+
+  pack_energy.charge_nc -= totals->charge_nc;
+  pack_energy.energy_nj -= totals->energy_nj;
+
+  *totals = (Energy_Totals) {0};
+}
+
+// Integrates channel's latest sample into account, if it has a new one
+void account_energy(Channel const * const channel, Energy_Account * const account) {
+
+  // All from the same sample, the I2C completions keep replacing them
+  Cached_Sample samples[NUM_READINGS];
+  read_samples(channel, samples);
+
+  Cached_Sample const * const sample = &samples[current_reading(channel)];
+
+  if (sample->seq == account->seq) return;
+
+  int32_t const current_ua = samples_current_ua(channel, samples);
+  int64_t const power = samples_power_uw(channel, samples);
+  int64_t const power_uw = current_ua < 0 ? -power : power;
+
+  // Unsigned, so the time between is right across HAL_GetTick() wrapping
+  uint32_t const elapsed = sample->timestamp - account->timestamp;
+
+  if (account->seq != 0 && elapsed <= channel->config->sensor.max_age_ms) {
+    integrate(account, current_ua, power_uw, elapsed, sample->timestamp);
+  }
+
+  account->current_ua = current_ua;
+  account->power_uw   = power_uw;
+  account->timestamp  = sample->timestamp;
+  account->seq        = sample->seq;
+}
+
+// Integrates every channel's new samples in one pass
+void update_energy(void) {
+
+  for (int i = 0; i < NUM_CHANNELS; i++) {
+    account_energy(&channels[i], &energy_accounts[i]);
+  }
+}
+
+// Returns totals' charge in whole mAh, rounded toward zero
+int32_t charge_mah(Energy_Totals const * const totals) {
+  return totals->charge_nc / NC_PER_MAH;
+}
+
+// Returns totals' energy in whole mWh, rounded toward zero
+int32_t energy_mwh(Energy_Totals const * const totals) {
+  return totals->energy_nj / NJ_PER_MWH;
+}
+
+// Returns channel's totals, or the pack's for ENERGY_PACK, NULL for neither
+Energy_Totals const *energy_totals(uint8_t channel) {
+
+  if (channel == ENERGY_PACK) return &pack_energy;
+  if (channel >= NUM_CHANNELS) return NULL;
+
+  return &energy_accounts[channel].totals;
+}
+
+// Sends channel's totals to CAN, or every channel's then the pack's for ENERGY_PACK
+HAL_StatusTypeDef send_energy(uint8_t channel) {
+
+  if (channel == ENERGY_PACK) {
+
+    HAL_StatusTypeDef status = HAL_OK;
+
+    for (int i = 0; i < NUM_CHANNELS; i++) {
+      if (send_energy(i) != HAL_OK) status = HAL_ERROR;
+    }
+
+    Energy_Totals const * const totals = energy_totals(ENERGY_PACK);
+
+    if (can_send_energy(ENERGY_PACK, charge_mah(totals), energy_mwh(totals)) != HAL_OK) status = HAL_ERROR;
+
+    return status;
+  }
+
+  Energy_Totals const * const totals = energy_totals(channel);
+
+  if (totals == NULL) return HAL_ERROR;
+
+  return can_send_energy(channel, charge_mah(totals), energy_mwh(totals));
+}
+
+// Answers a CAN_ENERGY_REQUEST_ID frame, {channel or ENERGY_PACK, Energy_Request}
+void handle_energy_request(uint8_t const * const data, uint8_t len) {
+
+  if (len < 2) return;
+
+  switch (data[1]) {
+
+    case ENERGY_QUERY:
+      send_energy(data[0]);
+      break;
+
+    case ENERGY_RESET:
+      reset_energy(data[0]);
+      break;
+
+    default:
+      break;
+  }
+}
+
+// Prints one line of totals
+static void print_totals(char *name, Energy_Totals const * const totals) {
+
+  print("\n\r");
+  print(name);
+  print(": ");
+  print_int(charge_mah(totals), 10);
+  print(" mAh, ");
+  print_int(energy_mwh(totals), 10);
+  print(" mWh over ");
+  print_int(totals->time_ms / 1000, 10);
+  print(" s");
+}
+
+// REPL command, "energy" prints every channel's totals and the pack's, "energy reset" starts them all over
+REPL_Status energy_command(int argc, char argv[MAX_ARGS][MAX_ARG_LEN]) {
+
+  if (argc >= 1 && eq(argv[1], "reset")) {
+    reset_energy(ENERGY_PACK);
+    output("Energy totals reset");
+    return REPL_CONTINUE;
+  }
+
+  for (int i = 0; i < NUM_CHANNELS; i++) {
+
+    char name[] = "Channel 0";
+    name[sizeof(name) - 2] += i;
+
+    print_totals(name, energy_totals(i));
+  }
+
+  print_totals("Pack", energy_totals(ENERGY_PACK));
+
+  return REPL_CONTINUE;
+}
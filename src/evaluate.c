@@ -0,0 +1,191 @@
+#include "evaluate.h"
+#include "timing.h"
+
+#include <string.h>
+
+#define LANE_BITS 0x00010001U   // Bit 0 of each half
+
+// Every channel, packed by init_evaluation()
+static Packed_Channels packed_channels;
+
+// Saturates val to a signed halfword
+static uint16_t half(int32_t val) {
+
+  if (val > INT16_MAX) return INT16_MAX;
+  if (val < INT16_MIN) return (uint16_t) INT16_MIN;
+
+  return val;
+}
+
+// Sets channel i's half of its word
+static void put(uint32_t * const words, int i, int32_t val) {
+
+  uint32_t const shift = (i & 1) * 16;
+
+  words[i / 2] = (words[i / 2] & ~(0xFFFFU << shift)) | ((uint32_t) half(val) << shift);
+}
+
+// Returns channel i's half of its word
+static int32_t get(uint32_t const * const words, int i) {
+  return (int16_t) (words[i / 2] >> ((i & 1) * 16));
+}
+
+// Channels sample either their current or their shunt voltage, see SAMPLE_VI
+static Reading_Type current_reading(Channel const * const channel) {
+  return (channel->config->sensor.readings & READING(CURRENT_READING)) ? CURRENT_READING : SHUNT_VOLT_READING;
+}
+
+// Packs channel i's limits, the ones for whichever reading it checks its current with
+static void pack_channel_limits(Packed_Channels * const packed, Channel const * const channel, int i) {
+
+  Raw_Limits const * const limits = &channel->checked_limits;
+  bool const shunt = current_reading(channel) == SHUNT_VOLT_READING;
+
+  put(packed->volt_floor, i, limits->volt_min - 1);
+  put(packed->volt_max,   i, limits->volt_max);
+  put(packed->curr_floor, i, (shunt ? limits->shunt_min : limits->curr_min) - 1);
+  put(packed->curr_max,   i, shunt ? limits->shunt_max : limits->curr_max);
+}
+
+// Packs each channel's limits
+void pack_limits(Packed_Channels * const packed, Channel const * const channels) {
+
+  memset(packed, 0, sizeof(*packed));
+
+  for (int i = 0; i < NUM_CHANNELS; i++) {
+    pack_channel_limits(packed, &channels[i], i);
+  }
+}
+
+// Packs each channel's latest filtered readings, only the ones that have arrived get checked
+void pack_samples(Packed_Channels * const packed, Channel const * const channels) {
+
+  for (int i = 0; i < NUM_CHANNELS; i++) {
+
+    Channel const * const channel = &channels[i];
+    Cached_Sample const * const voltage = &channel->samples[BUS_VOLT_READING];
+    Cached_Sample const * const current = &channel->samples[current_reading(channel)];
+
+    put(packed->volt, i, voltage->filtered);
+    put(packed->curr, i, current->filtered);
+
+    packed->checked[i] = (voltage->seq > 0 ? FAULT(UNDER_VOLTAGE_ERROR) | FAULT(OVER_VOLTAGE_ERROR) : 0)
+                       | (current->seq > 0 ? FAULT(UNDER_CURRENT_ERROR) | FAULT(OVER_CURRENT_ERROR) : 0);
+    packed->found[i]   = stale_faults(channel);
+  }
+}
+
+// Checks two channels per word, writing each channel's faults
+void evaluate_packed(Packed_Channels const * const packed, Fault_Mask faults[NUM_CHANNELS]) {
+
+#ifdef EVAL_SIMD
+
+  for (int w = 0; w < EVAL_WORDS; w++) {
+
+    // Each SEL after an SSUB16 is all ones in the halves where the limit minus the reading is >= 0
+    (void) __SSUB16(packed->volt_floor[w], packed->volt[w]);
+    uint32_t const under_volt = __SEL(UINT32_MAX, 0);
+
+    (void) __SSUB16(packed->volt_max[w], packed->volt[w]);
+    uint32_t const over_volt = ~__SEL(UINT32_MAX, 0);
+
+    (void) __SSUB16(packed->curr_floor[w], packed->curr[w]);
+    uint32_t const under_curr = __SEL(UINT32_MAX, 0);
+
+    (void) __SSUB16(packed->curr_max[w], packed->curr[w]);
+    uint32_t const over_curr = ~__SEL(UINT32_MAX, 0);
+
+    // Fault bits for both channels, one in each half
+    uint32_t const bits = ((under_volt & LANE_BITS) << UNDER_VOLTAGE_ERROR)
+                        | ((over_volt  & LANE_BITS) << OVER_VOLTAGE_ERROR)
+                        | ((under_curr & LANE_BITS) << UNDER_CURRENT_ERROR)
+                        | ((over_curr  & LANE_BITS) << OVER_CURRENT_ERROR);
+
+    int const i = 2 * w;
+
+    faults[i] = (bits & packed->checked[i]) | packed->found[i];
+
+    if (i + 1 < NUM_CHANNELS) {
+      faults[i + 1] = ((bits >> 16) & packed->checked[i + 1]) | packed->found[i + 1];
+    }
+  }
+
+#else
+  evaluate_packed_scalar(packed, faults);
+#endif
+}
+
+// Checks one channel at a time, finding exactly what evaluate_packed() does
+void evaluate_packed_scalar(Packed_Channels const * const packed, Fault_Mask faults[NUM_CHANNELS]) {
+
+  for (int i = 0; i < NUM_CHANNELS; i++) {
+
+    int32_t const volt = get(packed->volt, i);
+    int32_t const curr = get(packed->curr, i);
+
+    Fault_Mask bits = 0;
+
+    if (get(packed->volt_floor, i) - volt >= 0) bits |= FAULT(UNDER_VOLTAGE_ERROR);
+    if (get(packed->volt_max, i)   - volt <  0) bits |= FAULT(OVER_VOLTAGE_ERROR);
+    if (get(packed->curr_floor, i) - curr >= 0) bits |= FAULT(UNDER_CURRENT_ERROR);
+    if (get(packed->curr_max, i)   - curr <  0) bits |= FAULT(OVER_CURRENT_ERROR);
+
+    faults[i] = (bits & packed->checked[i]) | packed->found[i];
+  }
+}
+
+// Packs every channel's limits, once init_channel() has worked them out
+void init_evaluation(void) {
+
+  pack_limits(&packed_channels, channels);
+
+  for (int i = 0; i < NUM_CHANNELS; i++) {
+    channels[i].limits_moved = false;
+  }
+}
+
+// Checks every channel's latest readings, writing each channel's faults
+void evaluate_all_channels(Fault_Mask faults[NUM_CHANNELS]) {
+
+#if SENSOR_READING_MAX > INT16_MAX
+  // Readings don't fit in half a word
+  for (int i = 0; i < NUM_CHANNELS; i++) {
+    faults[i] = get_faults(&channels[i]);
+  }
+#else
+  // Filters move the limits when faults set and clear
+  for (int i = 0; i < NUM_CHANNELS; i++) {
+    if (channels[i].limits_moved) {
+      channels[i].limits_moved = false;
+      pack_channel_limits(&packed_channels, &channels[i], i);
+    }
+  }
+
+  pack_samples(&packed_channels, channels);
+  evaluate_packed(&packed_channels, faults);
+#endif
+}
+
+// Times evaluate_all_channels() against get_faults() on each channel, over EVAL_BENCH_RUNS runs
+void bench_evaluation(Eval_Bench * const bench) {
+
+  Fault_Mask faults[NUM_CHANNELS];
+
+  uint32_t start = cpu_cycles();
+
+  for (int run = 0; run < EVAL_BENCH_RUNS; run++) {
+    evaluate_all_channels(faults);
+  }
+
+  bench->batch_cycles = (cpu_cycles() - start) / EVAL_BENCH_RUNS;
+
+  start = cpu_cycles();
+
+  for (int run = 0; run < EVAL_BENCH_RUNS; run++) {
+    for (int i = 0; i < NUM_CHANNELS; i++) {
+      faults[i] = get_faults(&channels[i]);
+    }
+  }
+
+  bench->channel_cycles = (cpu_cycles() - start) / EVAL_BENCH_RUNS;
+}
@@ -0,0 +1,77 @@
+#include "filter.h"
+
+// Divides rounding to the nearest, halves away from zero
+static int32_t div_round(int32_t num, int32_t den) {
+  return (num + (num < 0 ? -den / 2 : den / 2)) / den;
+}
+
+// Forgets every reading taken, the next one starts the filter over
+void filter_reset(Filter_State * const state) {
+  *state = (Filter_State) {0};
+}
+
+// Readings filter's boxcar averages, in range
+static uint8_t boxcar_length(Sample_Filter const * const filter) {
+
+  if (filter->length < 1) return 1;
+  if (filter->length > FILTER_BOXCAR_MAX) return FILTER_BOXCAR_MAX;
+
+  return filter->length;
+}
+
+// Starts the filter at reading, as if it had been there all along
+static void prime(Sample_Filter const * const filter, Filter_State * const state, int32_t reading) {
+
+  if (filter->type == FILTER_IIR) {
+    state->acc = reading * (1 << FILTER_FRAC_BITS);
+  }
+  else if (filter->type == FILTER_BOXCAR) {
+
+    uint8_t const length = boxcar_length(filter);
+
+    for (int i = 0; i < length; i++) {
+      state->window[i] = reading;
+    }
+
+    state->acc = reading * length;
+  }
+
+  state->next   = 0;
+  state->primed = true;
+}
+
+// Takes a reading into the filter
+// Returns the filtered reading, in the same register counts
+int32_t filter_step(Sample_Filter const * const filter, Filter_State * const state, int32_t reading) {
+
+  if (!state->primed) {
+    prime(filter, state, reading);
+  }
+
+  switch (filter->type) {
+
+    case FILTER_IIR: {
+
+      // alpha * (x - y), both sides Q15 and the difference up to 32 bits
+      int64_t const step = (int64_t) filter->alpha * (reading * (1LL << FILTER_FRAC_BITS) - state->acc);
+      state->acc += step >> 15;
+
+      return div_round(state->acc, 1 << FILTER_FRAC_BITS);
+    }
+
+    case FILTER_BOXCAR: {
+
+      uint8_t const length = boxcar_length(filter);
+
+      // The sum drops the oldest reading as the newest takes its place
+      state->acc += reading - state->window[state->next];
+      state->window[state->next] = reading;
+      state->next = (state->next + 1) % length;
+
+      return div_round(state->acc, length);
+    }
+
+    default:
+      return reading;
+  }
+}
@@ -10,5 +10,23 @@ void MX_GPIO_Init(void)
   __HAL_RCC_GPIOG_CLK_ENABLE();
   __HAL_RCC_GPIOB_CLK_ENABLE();
   __HAL_RCC_GPIOD_CLK_ENABLE();
+  __HAL_RCC_GPIOE_CLK_ENABLE();
+
+  // Sensor ALERT pins interrupt on their falling edge
+  GPIO_InitTypeDef GPIO_InitStruct;
+  GPIO_InitStruct.Pin = 0;
+  for (int i = 0; i < ALERT_PIN_COUNT; i++) {
+    GPIO_InitStruct.Pin |= ALERT_PIN(i);
+  }
+  GPIO_InitStruct.Mode = GPIO_MODE_IT_FALLING;
+  GPIO_InitStruct.Pull = GPIO_PULLUP;
+  HAL_GPIO_Init(ALERT_GPIO_PORT, &GPIO_InitStruct);
+
+  // PE0-PE4 have their own EXTI lines, PE5 shares EXTI9_5
+  IRQn_Type const alert_irqs[] = { EXTI0_IRQn, EXTI1_IRQn, EXTI2_IRQn, EXTI3_IRQn, EXTI4_IRQn, EXTI9_5_IRQn };
+  for (size_t i = 0; i < sizeof(alert_irqs) / sizeof(alert_irqs[0]); i++) {
+    HAL_NVIC_SetPriority(alert_irqs[i], 2, 0);
+    HAL_NVIC_EnableIRQ(alert_irqs[i]);
+  }
 
 }
@@ -38,51 +38,929 @@
 
 /* Includes ------------------------------------------------------------------*/
 #include "i2c.h"
+#include "i2c_ll.h"
+#include "sensor.h"
 #include "uart.h"
 #include "gpio.h"
+#include "timing.h"
 
-HAL_StatusTypeDef read_reg(uint8_t reg_addr, uint8_t channel_addr, uint16_t *rsp) {
+I2C_HandleTypeDef hi2c1;
+I2C_HandleTypeDef hi2c2;
+I2C_HandleTypeDef hi2c3;
 
-  // Select the internal register
-  HAL_StatusTypeDef status = HAL_I2C_Master_Transmit(&hi2c1, channel_addr << 1, (uint8_t*) &reg_addr, sizeof(reg_addr), I2C_TIMEOUT); 
+I2C_Stats i2c_stats = {0};
+I2C_Stats i2c_bus_stats[NUM_I2C_BUSES] = {0};
 
-  if (status != HAL_OK) return status;
+static uint32_t const SPEED_HZ[NUM_I2C_SPEEDS] = 
+{
+  100000,   // I2C_SPEED_STANDARD
+  400000,   // I2C_SPEED_FAST
+};
+
+// Sample rate measurement, see update_bus()
+
+static uint32_t rate_window_start = 0;
+static uint32_t rate_window_reads = 0;
+static uint32_t samples_per_second = 0;
+
+// Register pointer cache
+//
+// The sensors keep their register pointer between transactions, so a device 
+// that already points at the register we want can just be read. The cache
+// is direct mapped on the low address bits, which is all sensor addresses
+// differ by.
+
+#define PTR_CACHE_LEN 16
+
+typedef struct {
+  bool    valid;
+  uint8_t channel_addr;
+  uint8_t reg_addr;
+} Ptr_Cache_Entry;
+
+// Device quarantine
+//
+// A device that keeps failing gets no transactions until its backoff runs
+// out, so a dead sensor can't eat into every other channel's bus time. The 
+// first transaction after that is a probe, failing it doubles the backoff.
+// Mapped like the pointer cache.
+
+typedef struct {
+  uint8_t   channel_addr;
+  uint8_t   failures;       // In a row
+  uint32_t  backoff;        // ms, 0 when not quarantined
+  uint32_t  release_time;   // When the device can be tried again
+} Device_Health;
+
+// Buses
+//
+// Each bus has its own devices, speed and transaction queue, so the buses 
+// work through their reads at the same time. Devices on different buses 
+// may share an address.
+
+typedef struct {
+  I2C_HandleTypeDef *hi2c;
+  I2C_Bus           id;
+
+  // Speed and its error window, see update_bus()
+  I2C_Speed         speed;
+  uint32_t          speed_window_transactions;
+  uint32_t          speed_window_errors;
+
+  Ptr_Cache_Entry   ptr_cache[PTR_CACHE_LEN];
+  Device_Health     health[PTR_CACHE_LEN];
+
+  // Transaction queue, see queue_read()
+  I2C_Transaction   queue[I2C_QUEUE_LEN];
+  volatile uint8_t  queue_head;     // Index of the running transaction
+  volatile uint8_t  queue_count;    // Including the running transaction
+  volatile bool     queue_running;
+  volatile bool     recovering;     // Stalled transaction claimed by check_stall()
+
+  uint8_t           txn_buf[I2C_MAX_REG_SIZE];  // Must outlive the HAL's interrupt transfer
+  uint32_t          txn_start_us;   // When the running transaction started
+  uint32_t          txn_budget_us;  // How long it has before the bus counts as stuck
+} I2C_Bus_State;
+
+static I2C_Bus_State buses[NUM_I2C_BUSES] =
+{
+  {.hi2c = &hi2c1, .id = I2C_BUS_1, .speed = I2C_DEFAULT_SPEED},
+  {.hi2c = &hi2c2, .id = I2C_BUS_2, .speed = I2C_DEFAULT_SPEED},
+  {.hi2c = &hi2c3, .id = I2C_BUS_3, .speed = I2C_DEFAULT_SPEED},
+};
+
+// Returns the bus driven by hi2c, or NULL if it isn't one of ours
+static I2C_Bus_State *bus_of(I2C_HandleTypeDef const * const hi2c) {
+
+  for (int i = 0; i < NUM_I2C_BUSES; i++) {
+    if (buses[i].hi2c == hi2c) return &buses[i];
+  }
+
+  return NULL;
+}
+
+// Adds a transaction to the bus statistics
+static void count_transaction(I2C_Bus_State * const bus, uint32_t cycles) {
+  i2c_stats.transactions++;
+  i2c_stats.cycles += cycles;
+  i2c_bus_stats[bus->id].transactions++;
+  i2c_bus_stats[bus->id].cycles += cycles;
+  bus->speed_window_transactions++;
+}
+
+static void device_result(I2C_Bus_State * const bus, uint8_t channel_addr, HAL_StatusTypeDef status);
+
+// Adds a transaction's outcome to the bus statistics
+static void count_result(I2C_Bus_State * const bus, HAL_StatusTypeDef status, uint8_t channel_addr, bool is_read) {
+
+  device_result(bus, channel_addr, status);
+
+  if (status == HAL_OK) {
+    if (is_read) {
+      i2c_stats.reads++;
+      i2c_bus_stats[bus->id].reads++;
+    }
+    return;
+  }
+
+  i2c_stats.errors++;
+  i2c_bus_stats[bus->id].errors++;
+
+  // NACKs and lost arbitration are what a bus that's too fast for its wiring looks like
+  if (HAL_I2C_GetError(bus->hi2c) & (HAL_I2C_ERROR_AF | HAL_I2C_ERROR_ARLO)) {
+    bus->speed_window_errors++;
+  }
+}
+
+// Adds the CPU time a blocking read took, start is from cpu_cycles()
+static void count_blocking(I2C_Bus_State * const bus, uint32_t start) {
+
+  uint32_t const cycles = cpu_cycles() - start;
+  I2C_Stats * const stats[2] = {&i2c_stats, &i2c_bus_stats[bus->id]};
+
+  for (int i = 0; i < 2; i++) {
+    stats[i]->blocking_reads++;
+    stats[i]->blocking_cycles += cycles;
+    if (cycles > stats[i]->blocking_cycles_max) stats[i]->blocking_cycles_max = cycles;
+  }
+}
+
+// Adds the CPU time one step of the queue took, start is from cpu_cycles()
+static void count_queued_cycles(I2C_Bus_State * const bus, uint32_t start) {
+
+  uint32_t const cycles = cpu_cycles() - start;
+  I2C_Stats * const stats[2] = {&i2c_stats, &i2c_bus_stats[bus->id]};
+
+  for (int i = 0; i < 2; i++) {
+    stats[i]->queued_cycles += cycles;
+    if (cycles > stats[i]->queued_cycles_max) stats[i]->queued_cycles_max = cycles;
+  }
+}
+
+static void count_skipped(I2C_Bus_State * const bus) {
+  i2c_stats.skipped++;
+  i2c_bus_stats[bus->id].skipped++;
+}
+
+// Returns true if channel_addr is known to point at reg_addr
+static bool ptr_cached(I2C_Bus_State const * const bus, uint8_t reg_addr, uint8_t channel_addr) {
+  Ptr_Cache_Entry const * const entry = &bus->ptr_cache[channel_addr % PTR_CACHE_LEN];
+  return entry->valid && entry->channel_addr == channel_addr && entry->reg_addr == reg_addr;
+}
+
+static void ptr_cache_store(I2C_Bus_State * const bus, uint8_t reg_addr, uint8_t channel_addr) {
+  bus->ptr_cache[channel_addr % PTR_CACHE_LEN] = (Ptr_Cache_Entry) {
+    .valid        = true,
+    .channel_addr = channel_addr,
+    .reg_addr     = reg_addr,
+  };
+}
+
+static void invalidate_bus_ptrs(I2C_Bus_State * const bus) {
+  for (int i = 0; i < PTR_CACHE_LEN; i++) {
+    bus->ptr_cache[i].valid = false;
+  }
+}
+
+// Forgets where channel_addr's register pointer is
+void invalidate_reg_ptr(I2C_Bus bus_id, uint8_t channel_addr) {
+
+  if (bus_id >= NUM_I2C_BUSES) return;
+
+  Ptr_Cache_Entry * const entry = &buses[bus_id].ptr_cache[channel_addr % PTR_CACHE_LEN];
+  if (entry->channel_addr == channel_addr) entry->valid = false;
+}
+
+// Forgets every device's register pointer, on every bus
+void invalidate_reg_ptrs(void) {
+  for (int i = 0; i < NUM_I2C_BUSES; i++) {
+    invalidate_bus_ptrs(&buses[i]);
+  }
+}
+
+static bool quarantined(I2C_Bus_State const * const bus, uint8_t channel_addr) {
+  Device_Health const * const health = &bus->health[channel_addr % PTR_CACHE_LEN];
+  return health->channel_addr == channel_addr && health->backoff > 0 
+      && (int32_t) (HAL_GetTick() - health->release_time) < 0;
+}
+
+// Returns true if channel_addr is being left alone
+bool i2c_quarantined(I2C_Bus bus_id, uint8_t channel_addr) {
+  return bus_id < NUM_I2C_BUSES && quarantined(&buses[bus_id], channel_addr);
+}
+
+static void device_result(I2C_Bus_State * const bus, uint8_t channel_addr, HAL_StatusTypeDef status) {
+
+  Device_Health * const health = &bus->health[channel_addr % PTR_CACHE_LEN];
+
+  if (health->channel_addr != channel_addr) {
+    *health = (Device_Health) {.channel_addr = channel_addr};
+  }
+
+  if (status == HAL_OK) {
+    health->failures = 0;
+    health->backoff = 0;
+    return;
+  }
+
+  if (health->failures < UINT8_MAX) health->failures++;
+  if (health->failures < I2C_QUARANTINE_FAILURES) return;
+
+  if (health->backoff == 0) {
+    health->backoff = I2C_BACKOFF_MIN_MS;
+  }
+  else if (health->backoff < I2C_BACKOFF_MAX_MS / 2) {
+    health->backoff *= 2;
+  }
+  else {
+    health->backoff = I2C_BACKOFF_MAX_MS;
+  }
+
+  health->release_time = HAL_GetTick() + health->backoff;
+  i2c_stats.quarantines++;
+  i2c_bus_stats[bus->id].quarantines++;
+}
+
+// Blocking transfers, on the HAL or with I2C_LL_DRIVER the register level driver
+
+static HAL_StatusTypeDef blocking_mem_read(I2C_HandleTypeDef *hi2c, uint8_t addr, uint8_t reg, uint8_t *data, uint16_t size) {
+#ifdef I2C_LL_DRIVER
+  return i2c_ll_mem_read(hi2c, addr, reg, data, size);
+#else
+  return HAL_I2C_Mem_Read(hi2c, addr << 1, reg, I2C_MEMADD_SIZE_8BIT, data, size, I2C_TIMEOUT);
+#endif
+}
+
+static HAL_StatusTypeDef blocking_receive(I2C_HandleTypeDef *hi2c, uint8_t addr, uint8_t *data, uint16_t size) {
+#ifdef I2C_LL_DRIVER
+  return i2c_ll_receive(hi2c, addr, data, size);
+#else
+  return HAL_I2C_Master_Receive(hi2c, addr << 1, data, size, I2C_TIMEOUT);
+#endif
+}
+
+static HAL_StatusTypeDef blocking_transmit(I2C_HandleTypeDef *hi2c, uint8_t addr, uint8_t *data, uint16_t size) {
+#ifdef I2C_LL_DRIVER
+  return i2c_ll_transmit(hi2c, addr, data, size);
+#else
+  return HAL_I2C_Master_Transmit(hi2c, addr << 1, data, size, I2C_TIMEOUT);
+#endif
+}
+
+HAL_StatusTypeDef read_reg(I2C_Bus bus_id, uint8_t reg_addr, uint8_t channel_addr, uint16_t *rsp) {
+
+  uint8_t buf[2];
+  HAL_StatusTypeDef status;
+
+  if (bus_id >= NUM_I2C_BUSES) return HAL_ERROR;
+
+  I2C_Bus_State * const bus = &buses[bus_id];
+
+  if (quarantined(bus, channel_addr)) {
+    count_skipped(bus);
+    return HAL_BUSY;
+  }
+
+  // The interrupt queue owns the controller until it drains
+  if (!i2c_bus_idle(bus_id)) return HAL_BUSY;
+
+  uint32_t const start = cpu_cycles();
 
-  // Read it
-  status = HAL_I2C_Master_Receive(&hi2c1, channel_addr << 1, (uint8_t*) rsp, sizeof(*rsp), I2C_TIMEOUT);
+  // Device already points at the register, just read it
+  if (ptr_cached(bus, reg_addr, channel_addr)) {
+    status = blocking_receive(bus->hi2c, channel_addr, buf, sizeof(buf));
+    count_transaction(bus, I2C_CACHED_READ_CYCLES);
+  }
+
+  // Otherwise select the internal register and read it back in one transaction, using a repeated start
+  else {
+    status = blocking_mem_read(bus->hi2c, channel_addr, reg_addr, buf, sizeof(buf));
+    count_transaction(bus, I2C_READ_CYCLES);
+  }
+
+  count_blocking(bus, start);
+  count_result(bus, status, channel_addr, true);
+
+  // Can't trust where the pointer was left after an error
+  // Nothing else was using the bus, so HAL_BUSY means it stayed busy past the timeout
+  if (status != HAL_OK) {
+    invalidate_bus_ptrs(bus);
+    if (status == HAL_BUSY || status == HAL_TIMEOUT) recover_bus(bus_id);
+    return status;
+  }
+
+  ptr_cache_store(bus, reg_addr, channel_addr);
 
   // Convert big endian to little endian
-  *rsp = ((*rsp) << 8) | ((*rsp) >> 8);
+  *rsp = (buf[0] << 8) | buf[1];
 
   return status;
 }
 
-HAL_StatusTypeDef write_reg(uint8_t reg_addr, uint8_t channel_addr, uint16_t val) {
+HAL_StatusTypeDef write_reg(I2C_Bus bus_id, uint8_t reg_addr, uint8_t channel_addr, uint16_t val) {
+
+  if (bus_id >= NUM_I2C_BUSES) return HAL_ERROR;
+
+  I2C_Bus_State * const bus = &buses[bus_id];
   
-  uint8_t msg[3] = {reg_addr, val};
-  return HAL_I2C_Master_Transmit(&hi2c1, channel_addr << 1, msg, sizeof(msg), I2C_TIMEOUT);
+  if (quarantined(bus, channel_addr)) {
+    count_skipped(bus);
+    return HAL_BUSY;
+  }
+
+  if (!i2c_bus_idle(bus_id)) return HAL_BUSY;
+
+  // Registers are big endian
+  uint8_t msg[3] = {reg_addr, val >> 8, val};
+  count_transaction(bus, I2C_WRITE_CYCLES);
+  invalidate_reg_ptr(bus_id, channel_addr);
+
+  HAL_StatusTypeDef status = blocking_transmit(bus->hi2c, channel_addr, msg, sizeof(msg));
+  count_result(bus, status, channel_addr, false);
+  
+  if (status != HAL_OK) {
+    invalidate_bus_ptrs(bus);
+    if (status == HAL_BUSY || status == HAL_TIMEOUT) recover_bus(bus_id);
+  }
+
+  return status;
 }
 
-HAL_StatusTypeDef reset_channel(uint8_t channel_addr) {
-  return write_reg(INA226_REG_CONF, channel_addr, 1 << 7);  // Set reset value to 1
+HAL_StatusTypeDef reset_channel(I2C_Bus bus_id, uint8_t channel_addr) {
+  invalidate_reg_ptr(bus_id, channel_addr);
+  return write_reg(bus_id, SENSOR_REG_RESET, channel_addr, SENSOR_RESET);
 }
 
-HAL_StatusTypeDef read_current(uint8_t channel_addr, uint16_t* rsp) {
-  return read_reg(INA226_REG_CURRENT, channel_addr, rsp);
+// Resets every sensor on bus_id in one transaction, using the general call
+HAL_StatusTypeDef reset_bus(I2C_Bus bus_id) {
+
+  if (bus_id >= NUM_I2C_BUSES) return HAL_ERROR;
+
+  if (!i2c_bus_idle(bus_id)) return HAL_BUSY;
+
+  I2C_Bus_State * const bus = &buses[bus_id];
+  uint8_t cmd = I2C_GENERAL_CALL_RESET;
+
+  // Every register pointer goes back to its power on default
+  invalidate_bus_ptrs(bus);
+  count_transaction(bus, I2C_GENERAL_CALL_CYCLES);
+
+  HAL_StatusTypeDef status = blocking_transmit(bus->hi2c, I2C_GENERAL_CALL_ADDR, &cmd, sizeof(cmd));
+
+  // Not any one device's failure, so it doesn't count towards quarantine
+  if (status != HAL_OK) {
+    i2c_stats.errors++;
+    i2c_bus_stats[bus_id].errors++;
+    if (status == HAL_BUSY || status == HAL_TIMEOUT) recover_bus(bus_id);
+  }
+
+  return status;
 }
 
-HAL_StatusTypeDef read_voltage(uint8_t channel_addr, uint16_t* rsp) {
-  return read_reg(INA226_REG_BUS_VOLT, channel_addr, rsp);
+// Probes every address the build's sensor can strap on bus_id, lowest first, see SENSOR_MODEL
+// Addresses that identify as that sensor are stored in found, up to max_found of them
+// Returns the number stored, none while the bus's queue is busy
+uint8_t scan_bus(I2C_Bus bus_id, uint8_t *found, uint8_t max_found) {
+
+  if (bus_id >= NUM_I2C_BUSES || !i2c_bus_idle(bus_id)) return 0;
+
+  I2C_Bus_State * const bus = &buses[bus_id];
+  uint8_t count = 0;
+
+  for (uint8_t addr = SENSOR_ADDR_FIRST; addr <= SENSOR_ADDR_LAST && count < max_found; addr++) {
+
+    // Empty addresses just NACK, which isn't a device failing
+    count_transaction(bus, I2C_PROBE_CYCLES);
+    HAL_StatusTypeDef const status = HAL_I2C_IsDeviceReady(bus->hi2c, addr << 1, 1, I2C_TIMEOUT);
+
+    if (status != HAL_OK) {
+      if (status == HAL_BUSY || status == HAL_TIMEOUT) recover_bus(bus_id);
+      continue;
+    }
+
+    // Something answered, make sure it's a sensor we know how to drive
+    uint16_t mfg_id, die_id;
+
+    if (read_reg(bus_id, SENSOR_REG_MFG_ID, addr, &mfg_id) != HAL_OK) continue;
+    if (read_reg(bus_id, SENSOR_REG_DIE_ID, addr, &die_id) != HAL_OK) continue;
+
+    if (mfg_id == SENSOR_MFG_ID && (die_id & SENSOR_DIE_ID_MASK) == SENSOR_DIE_ID) {
+      found[count++] = addr;
+    }
+  }
+
+  return count;
 }
 
-I2C_HandleTypeDef hi2c1;
+// Interrupt driven transaction queues
+//
+// Reads and writes are queued by the main loop and run back to back from 
+// the I2C interrupts: each one's completion interrupt starts the next 
+// transaction queued on its bus. The main loop never waits. A transaction whose 
+// interrupt never comes is caught by update_bus() once it runs past its 
+// time budget.
+
+static void start_transaction(I2C_Bus_State * const bus);
+static void finish_transaction(I2C_Bus_State * const bus, HAL_StatusTypeDef status);
+static void pop_transaction(I2C_Bus_State * const bus, HAL_StatusTypeDef status);
+
+// Adds a transaction to bus_id's queue, starting it if the bus was idle
+static HAL_StatusTypeDef queue_transaction(I2C_Bus bus_id, I2C_Transaction const txn) {
+
+  if (bus_id >= NUM_I2C_BUSES) return HAL_ERROR;
+
+  I2C_Bus_State * const bus = &buses[bus_id];
+
+  if (quarantined(bus, txn.channel_addr)) {
+    count_skipped(bus);
+    return HAL_BUSY;
+  }
+
+  // Transactions finish from interrupts, so hold them off while we touch the queue
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+
+  if (bus->queue_count >= I2C_QUEUE_LEN) {
+    __set_PRIMASK(primask);
+    return HAL_BUSY;
+  }
+
+  bus->queue[(bus->queue_head + bus->queue_count) % I2C_QUEUE_LEN] = txn;
+  bus->queue_count++;
+
+  // Kick the bus if it was sitting idle
+  if (!bus->queue_running && !bus->recovering) {
+    uint32_t const start = cpu_cycles();
+    bus->queue_running = true;
+    start_transaction(bus);
+    count_queued_cycles(bus, start);
+  }
+
+  __set_PRIMASK(primask);
+  return HAL_OK;
+}
+
+// Queues a read of the 16 bit register reg_addr on channel_addr, callback is called with the result
+// Returns HAL_BUSY if the bus's queue is full or the device is quarantined
+HAL_StatusTypeDef queue_read(I2C_Bus bus_id, uint8_t reg_addr, uint8_t channel_addr, I2C_Callback callback, void *context) {
+  return queue_burst(bus_id, reg_addr, channel_addr, 2, callback, context);
+}
+
+// Queues a read of size bytes from reg_addr on channel_addr in one transfer, for wider registers
+// Returns HAL_ERROR if size is more than I2C_MAX_REG_SIZE, otherwise like queue_read()
+HAL_StatusTypeDef queue_burst(I2C_Bus bus_id, uint8_t reg_addr, uint8_t channel_addr, uint8_t size, I2C_Callback callback, void *context) {
+
+  if (size == 0 || size > I2C_MAX_REG_SIZE) return HAL_ERROR;
+
+  return queue_transaction(bus_id, (I2C_Transaction) {
+    .bus          = bus_id,
+    .channel_addr = channel_addr,
+    .reg_addr     = reg_addr,
+    .write        = false,
+    .size         = size,
+    .rsp          = 0,
+    .callback     = callback,
+    .context      = context,
+  });
+}
+
+// Queues a write of val to reg_addr on channel_addr, callback is called once it's done and may be NULL
+// Returns HAL_BUSY if the bus's queue is full or the device is quarantined
+HAL_StatusTypeDef queue_write(I2C_Bus bus_id, uint8_t reg_addr, uint8_t channel_addr, uint16_t val, I2C_Callback callback, void *context) {
+  return queue_transaction(bus_id, (I2C_Transaction) {
+    .bus          = bus_id,
+    .channel_addr = channel_addr,
+    .reg_addr     = reg_addr,
+    .write        = true,
+    .size         = 2,
+    .rsp          = val,
+    .callback     = callback,
+    .context      = context,
+  });
+}
+
+// Returns true once every transaction queued on bus_id has finished
+bool i2c_bus_idle(I2C_Bus bus_id) {
+  return bus_id >= NUM_I2C_BUSES || buses[bus_id].queue_count == 0;
+}
+
+// Returns true once every queued transaction, on every bus, has finished
+bool i2c_queue_idle(void) {
+
+  for (int i = 0; i < NUM_I2C_BUSES; i++) {
+    if (buses[i].queue_count != 0) return false;
+  }
+
+  return true;
+}
+
+// Returns how long a transaction of cycles SCL cycles may take on bus, in us
+static uint32_t time_budget_us(I2C_Bus_State const * const bus, uint32_t cycles) {
+  return cycles * I2C_BUDGET_MARGIN * 1000000 / SPEED_HZ[bus->speed] + I2C_BUDGET_SLACK_US;
+}
+
+// Queued transfers, on the HAL or with I2C_LL_DRIVER the register level driver
+// Either way they finish in the HAL's completion callbacks below
+
+static HAL_StatusTypeDef queued_mem_read(I2C_HandleTypeDef *hi2c, uint8_t addr, uint8_t reg, uint8_t *data, uint16_t size) {
+#ifdef I2C_LL_DRIVER
+  return i2c_ll_mem_read_it(hi2c, addr, reg, data, size);
+#else
+  return HAL_I2C_Mem_Read_IT(hi2c, addr << 1, reg, I2C_MEMADD_SIZE_8BIT, data, size);
+#endif
+}
+
+static HAL_StatusTypeDef queued_receive(I2C_HandleTypeDef *hi2c, uint8_t addr, uint8_t *data, uint16_t size) {
+#ifdef I2C_LL_DRIVER
+  return i2c_ll_receive_it(hi2c, addr, data, size);
+#else
+  return HAL_I2C_Master_Receive_IT(hi2c, addr << 1, data, size);
+#endif
+}
+
+static HAL_StatusTypeDef queued_mem_write(I2C_HandleTypeDef *hi2c, uint8_t addr, uint8_t reg, uint8_t *data, uint16_t size) {
+#ifdef I2C_LL_DRIVER
+  return i2c_ll_mem_write_it(hi2c, addr, reg, data, size);
+#else
+  return HAL_I2C_Mem_Write_IT(hi2c, addr << 1, reg, I2C_MEMADD_SIZE_8BIT, data, size);
+#endif
+}
+
+static void start_transaction(I2C_Bus_State * const bus) {
+
+  I2C_Transaction *txn = &bus->queue[bus->queue_head];
+  HAL_StatusTypeDef status;
+  uint32_t cycles;
+
+  // Device was quarantined since this was queued, don't spend bus time on it
+  if (quarantined(bus, txn->channel_addr)) {
+    count_skipped(bus);
+    pop_transaction(bus, HAL_BUSY);
+    return;
+  }
+
+  bus->txn_start_us = time_us();
+
+  // Registers are big endian
+  if (txn->write) {
+    bus->txn_buf[0] = txn->rsp >> 8;
+    bus->txn_buf[1] = txn->rsp;
+
+    cycles = I2C_WRITE_CYCLES;
+    bus->txn_budget_us = time_budget_us(bus, cycles);
+    status = queued_mem_write(bus->hi2c, txn->channel_addr, txn->reg_addr, bus->txn_buf, 2);
+  }
+
+  // Device already points at the register, just read it
+  else if (ptr_cached(bus, txn->reg_addr, txn->channel_addr)) {
+    cycles = I2C_CACHED_READ_CYCLES + (txn->size - 2) * I2C_BYTE_CYCLES;
+    bus->txn_budget_us = time_budget_us(bus, cycles);
+    status = queued_receive(bus->hi2c, txn->channel_addr, bus->txn_buf, txn->size);
+  }
+  
+  // Otherwise select the internal register and read it back in one go, using a repeated start
+  else {
+    cycles = I2C_READ_CYCLES + (txn->size - 2) * I2C_BYTE_CYCLES;
+    bus->txn_budget_us = time_budget_us(bus, cycles);
+    status = queued_mem_read(bus->hi2c, txn->channel_addr, txn->reg_addr, bus->txn_buf, txn->size);
+  }
+
+  count_transaction(bus, cycles);
+
+  if (status != HAL_OK) finish_transaction(bus, status);
+}
+
+static void finish_transaction(I2C_Bus_State * const bus, HAL_StatusTypeDef status) {
+
+  I2C_Transaction const * const txn = &bus->queue[bus->queue_head];
+  count_result(bus, status, txn->channel_addr, !txn->write);
+  i2c_stats.queued++;
+  i2c_bus_stats[bus->id].queued++;
+  
+  if (status != HAL_OK) {
+    invalidate_bus_ptrs(bus);  // Can't trust where the pointer was left after an error
+  }
+  else if (txn->write) {
+    invalidate_reg_ptr(bus->id, txn->channel_addr);  // Like write_reg()
+  }
+  else {
+    ptr_cache_store(bus, txn->reg_addr, txn->channel_addr);
+  }
+
+  pop_transaction(bus, status);
+}
+
+static void pop_transaction(I2C_Bus_State * const bus, HAL_StatusTypeDef status) {
+
+  // check_stall() finishes transactions from the main loop, keep queueing out while the queue moves
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+
+  // Pop the transaction before calling back, so the callback is free to queue more
+  I2C_Transaction txn = bus->queue[bus->queue_head];
+
+  bus->queue_head = (bus->queue_head + 1) % I2C_QUEUE_LEN;
+  bus->queue_count--;
+
+  __set_PRIMASK(primask);
+
+  if (txn.callback != NULL) {
+    txn.callback(&txn, status);
+  }
+
+  __disable_irq();
+
+  // Move straight on to the next transaction
+  if (bus->queue_count > 0) {
+    start_transaction(bus);
+  }
+  else {
+    bus->queue_running = false;
+  }
+
+  __set_PRIMASK(primask);
+}
+
+static void read_complete(I2C_HandleTypeDef *hi2c) {
+
+  I2C_Bus_State * const bus = bus_of(hi2c);
+
+  if (bus == NULL || !bus->queue_running) return;
+
+  I2C_Transaction * const txn = &bus->queue[bus->queue_head];
+
+  // Convert big endian to little endian
+  txn->rsp = 0;
+  for (int i = 0; i < txn->size; i++) {
+    txn->rsp = (txn->rsp << 8) | bus->txn_buf[i];
+  }
+  
+  finish_transaction(bus, HAL_OK);
+}
+
+void HAL_I2C_MemRxCpltCallback(I2C_HandleTypeDef *hi2c) {
+  read_complete(hi2c);
+}
+
+void HAL_I2C_MemTxCpltCallback(I2C_HandleTypeDef *hi2c) {
+
+  I2C_Bus_State * const bus = bus_of(hi2c);
+
+  if (bus == NULL || !bus->queue_running) return;
+
+  finish_transaction(bus, HAL_OK);
+}
+
+void HAL_I2C_MasterRxCpltCallback(I2C_HandleTypeDef *hi2c) {
+  read_complete(hi2c);
+}
+
+void HAL_I2C_ErrorCallback(I2C_HandleTypeDef *hi2c) {
+
+  I2C_Bus_State * const bus = bus_of(hi2c);
+
+  if (bus == NULL || !bus->queue_running) return;
+
+  finish_transaction(bus, HAL_ERROR);
+}
+
+// Bus recovery
+//
+// A device reset or glitched part way through a byte it was sending keeps
+// holding SDA low, waiting for the rest of its clocks. Clocking SCL by hand 
+// until it lets go, then sending a STOP, frees the bus for the controller.
+
+static void delay_us(uint32_t us) {
+  uint32_t const start = time_us();
+  while (time_us() - start < us);
+}
+
+// Clocks any stuck device off bus_id and re-initializes its controller
+// Returns HAL_ERROR if SDA is still held low afterwards
+HAL_StatusTypeDef recover_bus(I2C_Bus bus_id) {
+
+  if (bus_id >= NUM_I2C_BUSES) return HAL_ERROR;
+
+  I2C_Bus_State * const bus = &buses[bus_id];
+
+  i2c_stats.recoveries++;
+  i2c_bus_stats[bus_id].recoveries++;
+  invalidate_bus_ptrs(bus);
+
+  HAL_I2C_DeInit(bus->hi2c);
+  i2c_pins_gpio(bus_id);
+
+  for (int i = 0; i < I2C_RECOVERY_CLOCKS && i2c_sda_read(bus_id) == GPIO_PIN_RESET; i++) {
+    i2c_scl_write(bus_id, GPIO_PIN_RESET);
+    delay_us(I2C_RECOVERY_HALF_US);
+    i2c_scl_write(bus_id, GPIO_PIN_SET);
+    delay_us(I2C_RECOVERY_HALF_US);
+  }
+
+  bool const released = i2c_sda_read(bus_id) == GPIO_PIN_SET;
+
+  // STOP, SDA rising while SCL is high
+  i2c_scl_write(bus_id, GPIO_PIN_RESET);
+  delay_us(I2C_RECOVERY_HALF_US);
+  i2c_sda_write(bus_id, GPIO_PIN_RESET);
+  delay_us(I2C_RECOVERY_HALF_US);
+  i2c_scl_write(bus_id, GPIO_PIN_SET);
+  delay_us(I2C_RECOVERY_HALF_US);
+  i2c_sda_write(bus_id, GPIO_PIN_SET);
+  delay_us(I2C_RECOVERY_HALF_US);
+
+  // Hands the pins back to the controller, see HAL_I2C_MspInit()
+  HAL_StatusTypeDef const status = HAL_I2C_Init(bus->hi2c);
+
+  if (status != HAL_OK) return status;
+
+  return released ? HAL_OK : HAL_ERROR;
+}
+
+// Recovers the bus if its running transaction has gone past its time budget
+static void check_stall(I2C_Bus_State * const bus) {
+
+  // Claim the transaction with the interrupts held off, it could still finish under us
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+
+  bool const stalled = bus->queue_running && time_us() - bus->txn_start_us > bus->txn_budget_us;
+
+  // Its completion is ignored from here on, and nothing else starts on the bus
+  if (stalled) {
+    bus->queue_running = false;
+    bus->recovering = true;
+  }
+
+  __set_PRIMASK(primask);
+
+  if (!stalled) return;
+
+  // Clocking the bus free takes a while, the other buses carry on meanwhile
+  i2c_stats.stalls++;
+  i2c_bus_stats[bus->id].stalls++;
+  recover_bus(bus->id);
+
+  bus->queue_running = true;
+  bus->recovering = false;
+  finish_transaction(bus, HAL_TIMEOUT);
+}
+
+// Bus speed
+//
+// Each bus starts at I2C_DEFAULT_SPEED and steps down a speed whenever too 
+// many transactions in a window are NACKed or lose arbitration.
+
+// Sets bus_id's clock, only call this while its queue is idle
+HAL_StatusTypeDef i2c_set_speed(I2C_Bus bus_id, I2C_Speed speed) {
+
+  if (bus_id >= NUM_I2C_BUSES || speed >= NUM_I2C_SPEEDS) return HAL_ERROR;
+  if (!i2c_bus_idle(bus_id)) return HAL_BUSY;
+
+  I2C_Bus_State * const bus = &buses[bus_id];
+
+  bus->speed = speed;
+  bus->hi2c->Init.ClockSpeed = SPEED_HZ[speed];
+
+  // The controller is stopped and reprogrammed with the new clock
+  return HAL_I2C_Init(bus->hi2c);
+}
+
+I2C_Speed i2c_speed(I2C_Bus bus_id) {
+  return buses[bus_id].speed;
+}
+
+uint32_t i2c_speed_hz(I2C_Bus bus_id) {
+  return SPEED_HZ[buses[bus_id].speed];
+}
+
+// Successful register reads over the last whole second, on every bus
+uint32_t i2c_samples_per_second(void) {
+  return samples_per_second;
+}
+
+// Housekeeping for the buses, call this regularly from the main loop
+// Recovers stuck buses, measures the sample rate and steps a bus's speed 
+// down if it is making errors
+void update_bus(void) {
+
+  for (int i = 0; i < NUM_I2C_BUSES; i++) {
+    check_stall(&buses[i]);
+  }
+
+  // Measure the sample rate once a second
+  uint32_t elapsed = HAL_GetTick() - rate_window_start;
+
+  if (elapsed >= 1000) {
+    samples_per_second = (uint64_t) (i2c_stats.reads - rate_window_reads) * 1000 / elapsed;
+    rate_window_start = HAL_GetTick();
+    rate_window_reads = i2c_stats.reads;
+  }
+
+  // Check each bus's error rate once its window is full
+  for (int i = 0; i < NUM_I2C_BUSES; i++) {
+
+    I2C_Bus_State * const bus = &buses[i];
+
+    if (bus->speed_window_transactions < I2C_SPEED_WINDOW || !i2c_bus_idle(bus->id)) continue;
+
+    if (bus->speed_window_errors > I2C_SPEED_MAX_ERRORS && bus->speed > I2C_SPEED_STANDARD) {
+      i2c_set_speed(bus->id, bus->speed - 1);
+    }
+
+    bus->speed_window_transactions = 0;
+    bus->speed_window_errors = 0;
+  }
+}
+
+#ifndef TEST
+
+// The controller interrupts, timed for i2c_stats
+
+void i2c_ev_irq(I2C_Bus bus_id) {
+
+  uint32_t const start = cpu_cycles();
+
+#ifdef I2C_LL_DRIVER
+  i2c_ll_ev_irq(buses[bus_id].hi2c);
+#else
+  HAL_I2C_EV_IRQHandler(buses[bus_id].hi2c);
+#endif
+
+  count_queued_cycles(&buses[bus_id], start);
+}
+
+void i2c_er_irq(I2C_Bus bus_id) {
+
+  uint32_t const start = cpu_cycles();
+
+#ifdef I2C_LL_DRIVER
+  i2c_ll_er_irq(buses[bus_id].hi2c);
+#else
+  HAL_I2C_ER_IRQHandler(buses[bus_id].hi2c);
+#endif
+
+  count_queued_cycles(&buses[bus_id], start);
+}
+
+// Bus recovery pins, see recover_bus()
+
+typedef struct {
+  GPIO_TypeDef  *scl_port;
+  uint16_t      scl_pin;
+  GPIO_TypeDef  *sda_port;
+  uint16_t      sda_pin;
+} I2C_Pins;
+
+// Must match HAL_I2C_MspInit()
+static I2C_Pins const BUS_PINS[NUM_I2C_BUSES] =
+{
+  {GPIOB, GPIO_PIN_6, GPIOB, GPIO_PIN_7},   // I2C_BUS_1
+  {GPIOF, GPIO_PIN_1, GPIOF, GPIO_PIN_0},   // I2C_BUS_2
+  {GPIOA, GPIO_PIN_8, GPIOC, GPIO_PIN_9},   // I2C_BUS_3
+};
+
+// Takes SCL and SDA from the controller to clock the bus by hand
+void i2c_pins_gpio(I2C_Bus bus_id) {
+
+  I2C_Pins const * const pins = &BUS_PINS[bus_id];
+  GPIO_InitTypeDef GPIO_InitStruct;
+
+  HAL_GPIO_WritePin(pins->scl_port, pins->scl_pin, GPIO_PIN_SET);
+  HAL_GPIO_WritePin(pins->sda_port, pins->sda_pin, GPIO_PIN_SET);
+
+  GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_OD;
+  GPIO_InitStruct.Pull = GPIO_PULLUP;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_VERY_HIGH;
+
+  GPIO_InitStruct.Pin = pins->scl_pin;
+  HAL_GPIO_Init(pins->scl_port, &GPIO_InitStruct);
+
+  GPIO_InitStruct.Pin = pins->sda_pin;
+  HAL_GPIO_Init(pins->sda_port, &GPIO_InitStruct);
+}
+
+void i2c_scl_write(I2C_Bus bus_id, GPIO_PinState state) {
+  HAL_GPIO_WritePin(BUS_PINS[bus_id].scl_port, BUS_PINS[bus_id].scl_pin, state);
+}
+
+void i2c_sda_write(I2C_Bus bus_id, GPIO_PinState state) {
+  HAL_GPIO_WritePin(BUS_PINS[bus_id].sda_port, BUS_PINS[bus_id].sda_pin, state);
+}
+
+// Open drain, so this reads whether anything is holding the line low
+GPIO_PinState i2c_sda_read(I2C_Bus bus_id) {
+  return HAL_GPIO_ReadPin(BUS_PINS[bus_id].sda_port, BUS_PINS[bus_id].sda_pin);
+}
+
+#endif
 
 /* I2C1 init function */
 void MX_I2C1_Init(void)
 {
 
   hi2c1.Instance = I2C1;
-  hi2c1.Init.ClockSpeed = 100000;
+  hi2c1.Init.ClockSpeed = SPEED_HZ[buses[I2C_BUS_1].speed];
   hi2c1.Init.DutyCycle = I2C_DUTYCYCLE_2;
   hi2c1.Init.OwnAddress1 = 0;
   hi2c1.Init.AddressingMode = I2C_ADDRESSINGMODE_7BIT;
@@ -97,6 +975,46 @@ void MX_I2C1_Init(void)
 
 }
 
+/* I2C2 init function */
+void MX_I2C2_Init(void)
+{
+
+  hi2c2.Instance = I2C2;
+  hi2c2.Init.ClockSpeed = SPEED_HZ[buses[I2C_BUS_2].speed];
+  hi2c2.Init.DutyCycle = I2C_DUTYCYCLE_2;
+  hi2c2.Init.OwnAddress1 = 0;
+  hi2c2.Init.AddressingMode = I2C_ADDRESSINGMODE_7BIT;
+  hi2c2.Init.DualAddressMode = I2C_DUALADDRESS_DISABLE;
+  hi2c2.Init.OwnAddress2 = 0;
+  hi2c2.Init.GeneralCallMode = I2C_GENERALCALL_DISABLE;
+  hi2c2.Init.NoStretchMode = I2C_NOSTRETCH_DISABLE;
+  if (HAL_I2C_Init(&hi2c2) != HAL_OK)
+  {
+    _Error_Handler(__FILE__, __LINE__);
+  }
+
+}
+
+/* I2C3 init function */
+void MX_I2C3_Init(void)
+{
+
+  hi2c3.Instance = I2C3;
+  hi2c3.Init.ClockSpeed = SPEED_HZ[buses[I2C_BUS_3].speed];
+  hi2c3.Init.DutyCycle = I2C_DUTYCYCLE_2;
+  hi2c3.Init.OwnAddress1 = 0;
+  hi2c3.Init.AddressingMode = I2C_ADDRESSINGMODE_7BIT;
+  hi2c3.Init.DualAddressMode = I2C_DUALADDRESS_DISABLE;
+  hi2c3.Init.OwnAddress2 = 0;
+  hi2c3.Init.GeneralCallMode = I2C_GENERALCALL_DISABLE;
+  hi2c3.Init.NoStretchMode = I2C_NOSTRETCH_DISABLE;
+  if (HAL_I2C_Init(&hi2c3) != HAL_OK)
+  {
+    _Error_Handler(__FILE__, __LINE__);
+  }
+
+}
+
 void HAL_I2C_MspInit(I2C_HandleTypeDef* i2cHandle)
 {
 
@@ -118,6 +1036,68 @@ void HAL_I2C_MspInit(I2C_HandleTypeDef* i2cHandle)
     // I2C1 clock enable
     __HAL_RCC_I2C1_CLK_ENABLE();
 
+    // I2C1 interrupts drive the transaction queue
+    HAL_NVIC_SetPriority(I2C1_EV_IRQn, 1, 0);
+    HAL_NVIC_EnableIRQ(I2C1_EV_IRQn);
+    HAL_NVIC_SetPriority(I2C1_ER_IRQn, 1, 0);
+    HAL_NVIC_EnableIRQ(I2C1_ER_IRQn);
+
+  }
+  else if(i2cHandle->Instance==I2C2)
+  {
+
+    __HAL_RCC_GPIOF_CLK_ENABLE();
+
+    /** I2C2 GPIO Configuration    
+    PF0     ------> I2C2_SDA
+    PF1     ------> I2C2_SCL 
+    */
+    GPIO_InitStruct.Pin = GPIO_PIN_0|GPIO_PIN_1;
+    GPIO_InitStruct.Mode = GPIO_MODE_AF_OD;
+    GPIO_InitStruct.Pull = GPIO_PULLUP;
+    GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_VERY_HIGH;
+    GPIO_InitStruct.Alternate = GPIO_AF4_I2C2;
+    HAL_GPIO_Init(GPIOF, &GPIO_InitStruct);
+
+    // I2C2 clock enable
+    __HAL_RCC_I2C2_CLK_ENABLE();
+
+    // I2C2 interrupts drive its transaction queue
+    HAL_NVIC_SetPriority(I2C2_EV_IRQn, 1, 0);
+    HAL_NVIC_EnableIRQ(I2C2_EV_IRQn);
+    HAL_NVIC_SetPriority(I2C2_ER_IRQn, 1, 0);
+    HAL_NVIC_EnableIRQ(I2C2_ER_IRQn);
+
+  }
+  else if(i2cHandle->Instance==I2C3)
+  {
+
+    __HAL_RCC_GPIOA_CLK_ENABLE();
+    __HAL_RCC_GPIOC_CLK_ENABLE();
+
+    /** I2C3 GPIO Configuration    
+    PA8     ------> I2C3_SCL
+    PC9     ------> I2C3_SDA 
+    */
+    GPIO_InitStruct.Pin = GPIO_PIN_8;
+    GPIO_InitStruct.Mode = GPIO_MODE_AF_OD;
+    GPIO_InitStruct.Pull = GPIO_PULLUP;
+    GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_VERY_HIGH;
+    GPIO_InitStruct.Alternate = GPIO_AF4_I2C3;
+    HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
+
+    GPIO_InitStruct.Pin = GPIO_PIN_9;
+    HAL_GPIO_Init(GPIOC, &GPIO_InitStruct);
+
+    // I2C3 clock enable
+    __HAL_RCC_I2C3_CLK_ENABLE();
+
+    // I2C3 interrupts drive its transaction queue
+    HAL_NVIC_SetPriority(I2C3_EV_IRQn, 1, 0);
+    HAL_NVIC_EnableIRQ(I2C3_EV_IRQn);
+    HAL_NVIC_SetPriority(I2C3_ER_IRQn, 1, 0);
+    HAL_NVIC_EnableIRQ(I2C3_ER_IRQn);
+
   }
 }
 
@@ -136,5 +1116,41 @@ void HAL_I2C_MspDeInit(I2C_HandleTypeDef* i2cHandle)
     */
     HAL_GPIO_DeInit(GPIOB, GPIO_PIN_6|GPIO_PIN_7);
 
+    HAL_NVIC_DisableIRQ(I2C1_EV_IRQn);
+    HAL_NVIC_DisableIRQ(I2C1_ER_IRQn);
+
+  }
+  else if(i2cHandle->Instance==I2C2)
+  {
+
+    // Peripheral clock disable
+    __HAL_RCC_I2C2_CLK_DISABLE();
+  
+    /** I2C2 GPIO Configuration    
+    PF0     ------> I2C2_SDA
+    PF1     ------> I2C2_SCL 
+    */
+    HAL_GPIO_DeInit(GPIOF, GPIO_PIN_0|GPIO_PIN_1);
+
+    HAL_NVIC_DisableIRQ(I2C2_EV_IRQn);
+    HAL_NVIC_DisableIRQ(I2C2_ER_IRQn);
+
+  }
+  else if(i2cHandle->Instance==I2C3)
+  {
+
+    // Peripheral clock disable
+    __HAL_RCC_I2C3_CLK_DISABLE();
+  
+    /** I2C3 GPIO Configuration    
+    PA8     ------> I2C3_SCL
+    PC9     ------> I2C3_SDA 
+    */
+    HAL_GPIO_DeInit(GPIOA, GPIO_PIN_8);
+    HAL_GPIO_DeInit(GPIOC, GPIO_PIN_9);
+
+    HAL_NVIC_DisableIRQ(I2C3_EV_IRQn);
+    HAL_NVIC_DisableIRQ(I2C3_ER_IRQn);
+
   }
 } 
@@ -0,0 +1,447 @@
+#include "i2c_ll.h"
+
+// Register level I2C driver
+//
+// Follows the master sequences in the reference manual, including the ones
+// for the last two bytes of a read, where the ACK and STOP have to be set up
+// while those bytes are still coming in.
+
+static void cr1_set(I2C_TypeDef * const i2c, uint32_t bits) {
+  i2c_ll_write(i2c, &i2c->CR1, i2c_ll_read(i2c, &i2c->CR1) | bits);
+}
+
+static void cr1_clear(I2C_TypeDef * const i2c, uint32_t bits) {
+  i2c_ll_write(i2c, &i2c->CR1, i2c_ll_read(i2c, &i2c->CR1) & ~bits);
+}
+
+// Reading SR1 then SR2 clears ADDR, which lets the transfer carry on
+static void clear_addr(I2C_TypeDef * const i2c) {
+  (void) i2c_ll_read(i2c, &i2c->SR1);
+  (void) i2c_ll_read(i2c, &i2c->SR2);
+}
+
+// Waits for any of flags in SR1, giving up on a bus error or after I2C_LL_SPINS polls
+static HAL_StatusTypeDef wait_flag(I2C_HandleTypeDef * const hi2c, uint32_t flags) {
+
+  I2C_TypeDef * const i2c = hi2c->Instance;
+
+  for (uint32_t spins = 0; spins < I2C_LL_SPINS; spins++) {
+
+    uint32_t const sr1 = i2c_ll_read(i2c, &i2c->SR1);
+
+    if (sr1 & flags) return HAL_OK;
+
+    // NACK, still our bus so let it go
+    if (sr1 & I2C_SR1_AF) {
+      cr1_set(i2c, I2C_CR1_STOP);
+      i2c_ll_write(i2c, &i2c->SR1, ~I2C_SR1_AF);
+      hi2c->ErrorCode |= HAL_I2C_ERROR_AF;
+      return HAL_ERROR;
+    }
+
+    // Losing arbitration already dropped the controller off the bus
+    if (sr1 & (I2C_SR1_ARLO | I2C_SR1_BERR)) {
+      i2c_ll_write(i2c, &i2c->SR1, ~(I2C_SR1_ARLO | I2C_SR1_BERR));
+      hi2c->ErrorCode |= (sr1 & I2C_SR1_ARLO) ? HAL_I2C_ERROR_ARLO : HAL_I2C_ERROR_BERR;
+      return HAL_ERROR;
+    }
+  }
+
+  hi2c->ErrorCode |= HAL_I2C_ERROR_TIMEOUT;
+  return HAL_TIMEOUT;
+}
+
+// Claims the controller, refusing like the HAL does while a transfer is running or the bus is held
+static HAL_StatusTypeDef begin(I2C_HandleTypeDef * const hi2c) {
+
+  I2C_TypeDef * const i2c = hi2c->Instance;
+
+  if (hi2c->State != HAL_I2C_STATE_READY) return HAL_BUSY;
+
+  uint32_t spins = 0;
+  while (i2c_ll_read(i2c, &i2c->SR2) & I2C_SR2_BUSY) {
+    if (++spins >= I2C_LL_SPINS) return HAL_BUSY;
+  }
+
+  hi2c->State = HAL_I2C_STATE_BUSY;
+  hi2c->ErrorCode = HAL_I2C_ERROR_NONE;
+
+  if (!(i2c_ll_read(i2c, &i2c->CR1) & I2C_CR1_PE)) {
+    cr1_set(i2c, I2C_CR1_PE);
+  }
+
+  cr1_clear(i2c, I2C_CR1_POS);
+  return HAL_OK;
+}
+
+// Hands the controller back, passing status through
+static HAL_StatusTypeDef end(I2C_HandleTypeDef * const hi2c, HAL_StatusTypeDef status) {
+  hi2c->State = HAL_I2C_STATE_READY;
+  return status;
+}
+
+// Sends a START, or a repeated START, then the address byte, and waits for its ACK
+static HAL_StatusTypeDef send_address(I2C_HandleTypeDef * const hi2c, uint8_t addr_byte) {
+
+  I2C_TypeDef * const i2c = hi2c->Instance;
+
+  cr1_set(i2c, I2C_CR1_START);
+
+  HAL_StatusTypeDef const status = wait_flag(hi2c, I2C_SR1_SB);
+  if (status != HAL_OK) return status;
+
+  i2c_ll_write(i2c, &i2c->DR, addr_byte);
+  return wait_flag(hi2c, I2C_SR1_ADDR);
+}
+
+// Writes size bytes to addr, leaving the bus held once the last has gone out
+static HAL_StatusTypeDef send(I2C_HandleTypeDef * const hi2c, uint8_t addr, uint8_t const *data, uint16_t size) {
+
+  I2C_TypeDef * const i2c = hi2c->Instance;
+
+  HAL_StatusTypeDef status = send_address(hi2c, addr << 1);
+  if (status != HAL_OK) return status;
+
+  clear_addr(i2c);
+
+  for (uint16_t i = 0; i < size; i++) {
+    status = wait_flag(hi2c, I2C_SR1_TXE);
+    if (status != HAL_OK) return status;
+    i2c_ll_write(i2c, &i2c->DR, data[i]);
+  }
+
+  return wait_flag(hi2c, I2C_SR1_BTF);
+}
+
+// Reads size bytes from addr, ending with a STOP
+static HAL_StatusTypeDef receive(I2C_HandleTypeDef * const hi2c, uint8_t addr, uint8_t *data, uint16_t size) {
+
+  I2C_TypeDef * const i2c = hi2c->Instance;
+
+  if (size == 0) return HAL_ERROR;
+
+  cr1_set(i2c, I2C_CR1_ACK);
+
+  HAL_StatusTypeDef status = send_address(hi2c, (addr << 1) | 1);
+  if (status != HAL_OK) return status;
+
+  // NACK the only byte, the STOP goes out after it
+  if (size == 1) {
+    cr1_clear(i2c, I2C_CR1_ACK);
+    clear_addr(i2c);
+    cr1_set(i2c, I2C_CR1_STOP);
+
+    status = wait_flag(hi2c, I2C_SR1_RXNE);
+    if (status != HAL_OK) return status;
+
+    data[0] = i2c_ll_read(i2c, &i2c->DR);
+    return HAL_OK;
+  }
+
+  // POS moves the NACK onto the second byte, both arrive before the STOP
+  if (size == 2) {
+    cr1_clear(i2c, I2C_CR1_ACK);
+    cr1_set(i2c, I2C_CR1_POS);
+    clear_addr(i2c);
+
+    status = wait_flag(hi2c, I2C_SR1_BTF);
+    if (status != HAL_OK) return status;
+
+    cr1_set(i2c, I2C_CR1_STOP);
+    data[0] = i2c_ll_read(i2c, &i2c->DR);
+    data[1] = i2c_ll_read(i2c, &i2c->DR);
+    cr1_clear(i2c, I2C_CR1_POS);
+    return HAL_OK;
+  }
+
+  clear_addr(i2c);
+
+  uint16_t i = 0;
+  while (size - i > 3) {
+    status = wait_flag(hi2c, I2C_SR1_RXNE);
+    if (status != HAL_OK) return status;
+    data[i++] = i2c_ll_read(i2c, &i2c->DR);
+  }
+
+  // Last three, with the NACK on the final byte
+  status = wait_flag(hi2c, I2C_SR1_BTF);
+  if (status != HAL_OK) return status;
+
+  cr1_clear(i2c, I2C_CR1_ACK);
+  data[i++] = i2c_ll_read(i2c, &i2c->DR);
+
+  status = wait_flag(hi2c, I2C_SR1_BTF);
+  if (status != HAL_OK) return status;
+
+  cr1_set(i2c, I2C_CR1_STOP);
+  data[i++] = i2c_ll_read(i2c, &i2c->DR);
+  data[i++] = i2c_ll_read(i2c, &i2c->DR);
+
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef i2c_ll_mem_read(I2C_HandleTypeDef *hi2c, uint8_t addr, uint8_t reg, uint8_t *data, uint16_t size) {
+
+  HAL_StatusTypeDef status = begin(hi2c);
+  if (status != HAL_OK) return status;
+
+  status = send(hi2c, addr, &reg, 1);
+  if (status != HAL_OK) return end(hi2c, status);
+
+  return end(hi2c, receive(hi2c, addr, data, size));
+}
+
+HAL_StatusTypeDef i2c_ll_receive(I2C_HandleTypeDef *hi2c, uint8_t addr, uint8_t *data, uint16_t size) {
+
+  HAL_StatusTypeDef const status = begin(hi2c);
+  if (status != HAL_OK) return status;
+
+  return end(hi2c, receive(hi2c, addr, data, size));
+}
+
+HAL_StatusTypeDef i2c_ll_transmit(I2C_HandleTypeDef *hi2c, uint8_t addr, uint8_t const *data, uint16_t size) {
+
+  HAL_StatusTypeDef status = begin(hi2c);
+  if (status != HAL_OK) return status;
+
+  status = send(hi2c, addr, data, size);
+  if (status == HAL_OK) {
+    cr1_set(hi2c->Instance, I2C_CR1_STOP);
+  }
+
+  return end(hi2c, status);
+}
+
+// Interrupt driven transfers
+//
+// The same sequences, stepped through from the event interrupt one flag at a
+// time. The transfer's progress lives in the handle, in the fields the HAL
+// uses for its own, with EventCount as the phase.
+
+#define CR2_IT (I2C_CR2_ITEVTEN | I2C_CR2_ITERREN | I2C_CR2_ITBUFEN)
+
+#define EVENT_REGISTER 0    // A memory transfer's register still to go out
+#define EVENT_WRITE    1    // Register out, then any bytes written
+#define EVENT_READ     2    // Addressed for reading
+
+static void cr2_set(I2C_TypeDef * const i2c, uint32_t bits) {
+  i2c_ll_write(i2c, &i2c->CR2, i2c_ll_read(i2c, &i2c->CR2) | bits);
+}
+
+static void cr2_clear(I2C_TypeDef * const i2c, uint32_t bits) {
+  i2c_ll_write(i2c, &i2c->CR2, i2c_ll_read(i2c, &i2c->CR2) & ~bits);
+}
+
+static bool running(I2C_HandleTypeDef const * const hi2c) {
+  return hi2c->State == HAL_I2C_STATE_BUSY_TX || hi2c->State == HAL_I2C_STATE_BUSY_RX;
+}
+
+static HAL_StatusTypeDef begin_it(I2C_HandleTypeDef * const hi2c, HAL_I2C_StateTypeDef state, HAL_I2C_ModeTypeDef mode,
+                                  uint8_t addr, uint8_t reg, uint8_t *data, uint16_t size) {
+
+  I2C_TypeDef * const i2c = hi2c->Instance;
+
+  if (size == 0) return HAL_ERROR;
+
+  HAL_StatusTypeDef const status = begin(hi2c);
+  if (status != HAL_OK) return status;
+
+  hi2c->State = state;
+  hi2c->Mode = mode;
+  hi2c->Devaddress = addr << 1;
+  hi2c->Memaddress = reg;
+  hi2c->EventCount = mode == HAL_I2C_MODE_MEM ? EVENT_REGISTER : EVENT_READ;
+  hi2c->pBuffPtr = data;
+  hi2c->XferSize = size;
+  hi2c->XferCount = size;
+
+  if (state == HAL_I2C_STATE_BUSY_RX) cr1_set(i2c, I2C_CR1_ACK);
+
+  cr2_set(i2c, CR2_IT);
+  cr1_set(i2c, I2C_CR1_START);
+  return HAL_OK;
+}
+
+// Hands the controller back and calls the HAL's completion callback for the transfer
+static void complete(I2C_HandleTypeDef * const hi2c) {
+
+  cr2_clear(hi2c->Instance, CR2_IT);
+
+  HAL_I2C_StateTypeDef const state = hi2c->State;
+  HAL_I2C_ModeTypeDef const mode = hi2c->Mode;
+
+  hi2c->State = HAL_I2C_STATE_READY;
+  hi2c->Mode = HAL_I2C_MODE_NONE;
+
+  if (mode != HAL_I2C_MODE_MEM) {
+    HAL_I2C_MasterRxCpltCallback(hi2c);
+  }
+  else if (state == HAL_I2C_STATE_BUSY_RX) {
+    HAL_I2C_MemRxCpltCallback(hi2c);
+  }
+  else {
+    HAL_I2C_MemTxCpltCallback(hi2c);
+  }
+}
+
+static void take_byte(I2C_HandleTypeDef * const hi2c) {
+  *hi2c->pBuffPtr++ = i2c_ll_read(hi2c->Instance, &hi2c->Instance->DR);
+  hi2c->XferCount--;
+}
+
+// The address was ACKed for a read, set up the NACK and STOP like receive() does
+static void rx_address(I2C_HandleTypeDef * const hi2c) {
+
+  I2C_TypeDef * const i2c = hi2c->Instance;
+
+  if (hi2c->XferCount == 1) {
+    cr1_clear(i2c, I2C_CR1_ACK);
+    clear_addr(i2c);
+    cr1_set(i2c, I2C_CR1_STOP);
+  }
+  else if (hi2c->XferCount == 2) {
+    cr1_clear(i2c, I2C_CR1_ACK);
+    cr1_set(i2c, I2C_CR1_POS);
+    clear_addr(i2c);
+    cr2_clear(i2c, I2C_CR2_ITBUFEN);
+  }
+  else {
+    clear_addr(i2c);
+    if (hi2c->XferCount == 3) cr2_clear(i2c, I2C_CR2_ITBUFEN);
+  }
+}
+
+static void rx_event(I2C_HandleTypeDef * const hi2c, uint32_t sr1) {
+
+  I2C_TypeDef * const i2c = hi2c->Instance;
+  uint16_t const left = hi2c->XferCount;
+
+  // The last three wait for BTF, with the buffer interrupt off
+  if (left == 3) {
+    if (!(sr1 & I2C_SR1_BTF)) return;
+    cr1_clear(i2c, I2C_CR1_ACK);
+    take_byte(hi2c);
+  }
+  else if (left == 2) {
+    if (!(sr1 & I2C_SR1_BTF)) return;
+    cr1_set(i2c, I2C_CR1_STOP);
+    take_byte(hi2c);
+    take_byte(hi2c);
+    cr1_clear(i2c, I2C_CR1_POS);
+    complete(hi2c);
+  }
+  else if (sr1 & I2C_SR1_RXNE) {
+    take_byte(hi2c);
+    if (left == 1) complete(hi2c);
+    else if (left == 4) cr2_clear(i2c, I2C_CR2_ITBUFEN);
+  }
+}
+
+static void tx_event(I2C_HandleTypeDef * const hi2c, uint32_t sr1) {
+
+  I2C_TypeDef * const i2c = hi2c->Instance;
+  bool const writing = hi2c->State == HAL_I2C_STATE_BUSY_TX;
+  uint16_t const left = (hi2c->EventCount == EVENT_REGISTER) + (writing ? hi2c->XferCount : 0);
+
+  if (left > 0) {
+
+    if (!(sr1 & I2C_SR1_TXE)) return;
+
+    if (hi2c->EventCount == EVENT_REGISTER) {
+      i2c_ll_write(i2c, &i2c->DR, hi2c->Memaddress);
+      hi2c->EventCount = EVENT_WRITE;
+    }
+    else {
+      i2c_ll_write(i2c, &i2c->DR, *hi2c->pBuffPtr++);
+      hi2c->XferCount--;
+    }
+
+    // Only BTF left to wait for
+    if (left == 1) cr2_clear(i2c, I2C_CR2_ITBUFEN);
+    return;
+  }
+
+  if (!(sr1 & I2C_SR1_BTF)) return;
+
+  // Register selected, turn the bus around for the read
+  if (!writing) {
+    hi2c->EventCount = EVENT_READ;
+    cr2_set(i2c, I2C_CR2_ITBUFEN);
+    cr1_set(i2c, I2C_CR1_START);
+    return;
+  }
+
+  cr1_set(i2c, I2C_CR1_STOP);
+  complete(hi2c);
+}
+
+HAL_StatusTypeDef i2c_ll_mem_read_it(I2C_HandleTypeDef *hi2c, uint8_t addr, uint8_t reg, uint8_t *data, uint16_t size) {
+  return begin_it(hi2c, HAL_I2C_STATE_BUSY_RX, HAL_I2C_MODE_MEM, addr, reg, data, size);
+}
+
+HAL_StatusTypeDef i2c_ll_receive_it(I2C_HandleTypeDef *hi2c, uint8_t addr, uint8_t *data, uint16_t size) {
+  return begin_it(hi2c, HAL_I2C_STATE_BUSY_RX, HAL_I2C_MODE_MASTER, addr, 0, data, size);
+}
+
+HAL_StatusTypeDef i2c_ll_mem_write_it(I2C_HandleTypeDef *hi2c, uint8_t addr, uint8_t reg, uint8_t *data, uint16_t size) {
+  return begin_it(hi2c, HAL_I2C_STATE_BUSY_TX, HAL_I2C_MODE_MEM, addr, reg, data, size);
+}
+
+void i2c_ll_ev_irq(I2C_HandleTypeDef *hi2c) {
+
+  I2C_TypeDef * const i2c = hi2c->Instance;
+  uint32_t const sr1 = i2c_ll_read(i2c, &i2c->SR1);
+
+  // Left over from a transfer recover_bus() cut short
+  if (!running(hi2c)) {
+    cr2_clear(i2c, CR2_IT);
+    return;
+  }
+
+  bool const receiving = hi2c->EventCount == EVENT_READ;
+
+  if (sr1 & I2C_SR1_SB) {
+    i2c_ll_write(i2c, &i2c->DR, hi2c->Devaddress | receiving);
+  }
+  else if (sr1 & I2C_SR1_ADDR) {
+    if (receiving) rx_address(hi2c);
+    else clear_addr(i2c);
+  }
+  else if (receiving) {
+    rx_event(hi2c, sr1);
+  }
+  else {
+    tx_event(hi2c, sr1);
+  }
+}
+
+void i2c_ll_er_irq(I2C_HandleTypeDef *hi2c) {
+
+  I2C_TypeDef * const i2c = hi2c->Instance;
+  uint32_t const sr1 = i2c_ll_read(i2c, &i2c->SR1);
+  uint32_t error = HAL_I2C_ERROR_NONE;
+
+  // NACK, still our bus so let it go, like wait_flag()
+  if (sr1 & I2C_SR1_AF) {
+    cr1_set(i2c, I2C_CR1_STOP);
+    error |= HAL_I2C_ERROR_AF;
+  }
+
+  if (sr1 & I2C_SR1_ARLO) error |= HAL_I2C_ERROR_ARLO;
+  if (sr1 & I2C_SR1_BERR) error |= HAL_I2C_ERROR_BERR;
+  if (sr1 & I2C_SR1_OVR)  error |= HAL_I2C_ERROR_OVR;
+
+  i2c_ll_write(i2c, &i2c->SR1, ~(I2C_SR1_AF | I2C_SR1_ARLO | I2C_SR1_BERR | I2C_SR1_OVR));
+
+  if (error == HAL_I2C_ERROR_NONE) return;
+
+  cr2_clear(i2c, CR2_IT);
+  cr1_clear(i2c, I2C_CR1_POS);
+
+  if (!running(hi2c)) return;
+
+  hi2c->ErrorCode |= error;
+  hi2c->State = HAL_I2C_STATE_READY;
+  hi2c->Mode = HAL_I2C_MODE_NONE;
+  HAL_I2C_ErrorCallback(hi2c);
+}
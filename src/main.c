@@ -10,13 +10,42 @@
 
 #include "uart.h"
 #include "channels.h"
+#include "sampler.h"
+#include "evaluate.h"
+#include "energy.h"
+#include "scheduler.h"
+#include "repl.h"
 
 // Use testing and development errors and responses
 // Comment out to use competition errors and responses
 #define DEVELOPMENT_ERRORS 
 
+// Sample every channel at the same moment, rather than each on its own period
+// Uncomment to trade the fastest channels' rate for time-coherent readings
+//#define SNAPSHOT_SAMPLING
+
+// Check every channel's limits in one batch, two channels per instruction, see evaluate.h
+// Uncomment to trade checking each channel on its own for the packed kernel
+//#define BATCH_EVALUATION
+
 void SystemClock_Config(void);
 
+static void sense_task(void);
+static void comms_task(void);
+static void housekeeping_task(void);
+
+// Fault sensing every ms, CAN and the REPL at 100 Hz, everything slower at 10 Hz
+static Task const tasks[] = {
+  {.name = "sense",        .run = sense_task,        .period_ms = 1},
+  {.name = "comms",        .run = comms_task,        .period_ms = 10},
+  {.name = "housekeeping", .run = housekeeping_task, .period_ms = 100},
+};
+
+static uint8_t sensors;             // Found by discover_channels()
+static bool first_sample = false;   // Every sensor found has sampled, see report_first_sample()
+static uint32_t first_sample_ms;    // When it did, from boot
+static bool first_sample_reported = false;
+
 int main(void) {
   
   // HAL Initialization and setup
@@ -29,42 +58,181 @@ int main(void) {
   MX_GPIO_Init();
   //MX_CAN1_Init();       // Initializing CAN on lonely bus causes exception
   MX_I2C1_Init();
+  MX_I2C2_Init();
+  MX_I2C3_Init();
   MX_TIM4_Init();
   MX_TIM5_Init();
 
-  // Initialize channels
+  // Find the sensors, then reset each bus's at once so they all start from power on defaults
+  sensors = discover_channels();
+
+  for (I2C_Bus bus = 0; bus < NUM_I2C_BUSES; bus++) {
+    reset_bus(bus);
+  }
+
+  init_timeouts(HAL_GetTick());
+
+  // Initialize channels, everything but the sensors found comes from channel_configs
   for (int i = 0; i < NUM_CHANNELS; i++) {
 
-    // Note: that the first four channels are on htim4
-    if (i < 4) {
-      init_channel(&channels[i], i, CHANNEL_ADDR[i], &htim4, i+1, DEFAULT_VMAX, DEFAULT_VMIN, DEFAULT_CMAX, DEFAULT_CMIN);
-    }
+    init_channel(&channels[i], i, CHANNEL_ADDR[i], &channel_configs[i]);
+
+    // Have the sensor watch its limit too
+    configure_channel(&channels[i]);
+  }
+
+  init_sampler();
+  init_energy();
+
+#ifdef BATCH_EVALUATION
+  init_evaluation();
+#endif
 
-    // The rest are on htim5
-    else {
-      init_channel(&channels[i], i, CHANNEL_ADDR[i], &htim5, i-3, DEFAULT_VMAX, DEFAULT_VMIN, DEFAULT_CMAX, DEFAULT_CMIN);
+#ifdef SNAPSHOT_SAMPLING
+  start_snapshots();
+#endif
+
+  init_scheduler(tasks, sizeof(tasks) / sizeof(tasks[0]));
+  run_scheduler();
+
+}
+
+// Reads the sensors and acts on their readings, every ms
+static void sense_task(void) {
+
+  update_bus();
+
+  // Queue reads of any new conversions, earliest deadline first
+  // The buses work through them from interrupts while we check channels below
+  run_sampler();
+
+  // Smooth whatever readings came in since, the limits are checked against these
+  filter_samples();
+
+  // Note when every sensor first has a reading, housekeeping reports it
+  if (!first_sample && channels_sampled()) {
+    first_sample = true;
+    first_sample_ms = HAL_GetTick();
+  }
+
+  // Add them to each channel's charge and energy
+  update_energy();
+
+#ifdef BATCH_EVALUATION
+  Fault_Mask faults[NUM_CHANNELS];
+  evaluate_all_channels(faults);
+#endif
+
+  // for each named channel
+  for (int i = 0; i < NUM_CHANNELS; i++) {
+
+    // Check for channel updates
+#ifdef BATCH_EVALUATION
+    bool channel_dirty = update_channel_faults(&channels[i], faults[i]);
+#else
+    bool channel_dirty = update_channel(&channels[i]);
+#endif
+
+    // Write results
+    if (channel_dirty) {
+      write_channel(&channels[i]);
     }
+
   }
+}
 
-  // Main loop
-  
-  while (1)
-  {
+// Prints each channel's latest readings from the cache, what the fault checks are working from
+static void print_samples(void) {
 
-    // for each named channel
-    for (int i = 0; i < NUM_CHANNELS; i++) {
+  static char * const qualities[] = {"none", "good", "failed", "stale"};
 
-      // Check for channel updates
-      bool channel_dirty = update_channel(&channels[i]);
+  for (int i = 0; i < NUM_CHANNELS; i++) {
 
-      // Write results
-      if (channel_dirty) {
-        write_channel(&channels[i]);
-      }
+    Channel const * const channel = &channels[i];
+    Cached_Sample const * const voltage = &channel->samples[BUS_VOLT_READING];
+
+    print("\n\rChannel ");
+    print_int(i, 10);
+    print(": ");
+    print(qualities[sample_quality(channel, BUS_VOLT_READING)]);
+    print(", ");
+    print_int((int64_t) voltage->filtered * 1000 / bus_volt_counts(1000), 10);
+    print(" mV, ");
+    print_int(channel_current_ua(channel) / 1000, 10);
+    print(" mA, ");
+    print_int(HAL_GetTick() - voltage->timestamp, 10);
+    print(" ms old");
+  }
+}
+
+// Commands the REPL hands over, see repl()
+static REPL_Status command_handler(int argc, char argv[MAX_ARGS][MAX_ARG_LEN]) {
+
+  if (eq(argv[0], "sample")) {
+    print_samples();
+    return REPL_CONTINUE;
+  }
+
+  if (eq(argv[0], "energy")) {
+    return energy_command(argc, argv);
+  }
 
-    }    
+  if (eq(argv[0], "tasks")) {
+    return tasks_command(argc, argv);
   }
 
+  output("Unknown command, try sample, energy or tasks");
+  return REPL_CONTINUE;
+}
+
+// Answers CAN requests and the REPL, at 100 Hz
+static void comms_task(void) {
+
+  uint32_t can_id;
+  uint8_t can_data[8];
+  uint8_t can_len;
+
+  while (can_receive(&can_id, can_data, &can_len)) {
+    if (can_id == CAN_ENERGY_REQUEST_ID) {
+      handle_energy_request(can_data, can_len);
+    }
+  }
+
+  repl_poll(command_handler);
+}
+
+// Prints how long it took from boot for every sensor found to have a valid sample
+static void report_first_sample(uint8_t sensors, uint32_t ms) {
+
+  print("\n\rFound ");
+  print_int(sensors, 10);
+  print(" of ");
+  print_int(NUM_CHANNELS, 10);
+  print(" sensors, first samples in after ");
+  print_int(ms, 10);
+  print(" ms\n\r");
+
+#ifdef BATCH_EVALUATION
+  // On real readings, so the benchmark takes the same branches the loop does
+  Eval_Bench bench;
+  bench_evaluation(&bench);
+
+  print("Checking every channel takes ");
+  print_int(bench.batch_cycles, 10);
+  print(" cycles batched, ");
+  print_int(bench.channel_cycles, 10);
+  print(" one at a time\n\r");
+#endif
+}
+
+// Slow bookkeeping, at 10 Hz
+static void housekeeping_task(void) {
+
+  // Report startup latency once every sensor has sampled
+  if (first_sample && !first_sample_reported) {
+    first_sample_reported = true;
+    report_first_sample(sensors, first_sample_ms);
+  }
 }
 
 /**
@@ -61,6 +61,115 @@ bool eq(char* str1, char* str2) {
 
 
 
+/**
+ * @brief Command line state, kept between calls so repl_poll() can pick up where it left off
+ */
+static char argv[MAX_ARGS][MAX_ARG_LEN];
+static uint8_t argc = 0;
+static uint8_t char_count = 0;
+static bool first_input = true;
+
+
+/**
+ * @brief Handles one character of input, running the command on enter
+ *
+ * @param c               the character
+ * @param commandHandler  see repl()
+ *
+ * @return    the command's REPL_Status, or REPL_CONTINUE if no command ran
+ */
+static REPL_Status take_char(char c, REPL_Status (* commandHandler) (int, char[MAX_ARGS][MAX_ARG_LEN])) {
+
+  // Print the prompt first time
+  if (first_input) {
+    clear_state(argv, &argc, &char_count);
+    first_input = false;
+    return REPL_CONTINUE;
+  }
+
+  // process command on enter -- this is carriage return for some reason
+  if (c == '\r') {
+
+    char* cmd = argv[0];
+
+    // swallow empty enters
+    if (eq(cmd, "")) {
+      clear_state(argv, &argc, &char_count);
+      return REPL_CONTINUE;
+    }
+
+    // Built-in commands
+    if (eq(cmd, "echo")) {
+
+      // Example for later
+      output("Unimplemented");
+      clear_state(argv, &argc, &char_count);
+      return REPL_CONTINUE;
+    }
+
+    // User commands
+    REPL_Status const status = commandHandler(argc, argv);
+    clear_state(argv, &argc, &char_count);
+
+    // User outputs a REPL_Status
+    // We could handle errors and such here...
+
+    // E.g. Catch unknown commands
+    // output("Unknown Command");
+    // clear_state(argv, &argc, &char_count);
+
+    return status;
+  }
+
+  // abort on backtick
+  if (c == '`') {
+    print_char(&c);
+    output("ABORT"); 
+    clear_state(argv, &argc, &char_count);
+    return REPL_CONTINUE;
+  }
+
+  // handle spaces
+  else if (isspace(c)) {
+
+    // Swallow leading spaces
+    if (char_count == 0) {
+      print_char(&c);
+      return REPL_CONTINUE;
+    }
+
+    // Catch arguement count overflow, the next arguement would be past the end of argv
+    if (argc + 1 >= MAX_ARGS) {
+      output("TOO MANY ARGUEMENTS");
+      clear_state(argv, &argc, &char_count); 
+      return REPL_CONTINUE;
+    }
+
+    // Otherwise tokenize arguements
+    argc++;
+    char_count = 0;
+    return REPL_CONTINUE;
+  }
+ 
+  // Catch arguement length overflow, leaving room for the terminator
+  if (char_count + 1 >= MAX_ARG_LEN) {
+    output("ARGUEMENT TOO LONG");
+    clear_state(argv, &argc, &char_count);
+    return REPL_CONTINUE;
+  }
+
+  // print the character
+  print_char(&c);
+
+  // Store the character
+  argv[argc][char_count] = c;
+  argv[argc][char_count + 1] = '\0';
+  char_count++; 
+
+  return REPL_CONTINUE;
+}
+
+
 /**
  * @brief Call this to begin repl loop. 
  *
@@ -75,113 +184,17 @@ REPL_Status repl(REPL_Status (* commandHandler) (int, char[MAX_ARGS][MAX_ARG_LEN
   // REPL State
   REPL_Status status = REPL_CONTINUE;
   
-  char argv[MAX_ARGS][MAX_ARG_LEN];
-  argv[0][0] = '\0';
-  uint8_t argc = 0;
-  uint8_t char_count = 0;
-  
-  bool first_input = true;
-  
+  first_input = true;
   clear_state(argv, &argc, &char_count);
 
   // Serial State
-  HAL_StatusTypeDef serial_status;
   char c;
 
   do {
 
     // Get serial input
-    serial_status = input(&c, sizeof(c));
-
-    // If there's input
-    if (serial_status == HAL_OK) {
-
-      // Print the prompt first time
-      if (first_input) {
-        clear_state(argv, &argc, &char_count);
-        first_input = false;
-        continue;
-      }
-
-      // process command on enter -- this is carriage return for some reason
-      if (c == '\r') {
-
-        char* cmd = argv[0];
-
-        // swallow empty enters
-        if (eq(cmd, "")) {
-          clear_state(argv, &argc, &char_count);
-          continue;
-        }
-
-        // Built-in commands
-        if (eq(cmd, "echo")) {
-
-          // Example for later
-          output("Unimplemented");
-          clear_state(argv, &argc, &char_count);
-          continue;
-        }
-
-        // User commands
-        status = commandHandler(argc, argv);
-        clear_state(argv, &argc, &char_count);
-
-        // User outputs a REPL_Status
-        // We could handle errors and such here...
-
-        // E.g. Catch unknown commands
-        // output("Unknown Command");
-        // clear_state(argv, &argc, &char_count);
-        
-        continue;
-      }
-
-      // abort on backtick
-      if (c == '`') {
-        print_char(&c);
-        output("ABORT"); 
-        clear_state(argv, &argc, &char_count);
-        continue;
-      }
-
-      // handle spaces
-      else if (isspace(c)) {
-
-        // Swallow leading spaces
-        if (char_count == 0) {
-          print_char(&c);
-          continue;
-        }
-
-        // Catch arguement count overflow
-        if (argc >= MAX_ARGS) {
-          output("TOO MANY ARGUEMENTS");
-          clear_state(argv, &argc, &char_count); 
-          continue;
-        }
-
-        // Otherwise tokenize arguements
-        argc++;
-        char_count = 0;
-        continue;
-      }
-     
-      // Catch arguement length overflow
-      if (char_count >= MAX_ARG_LEN) {
-        output("ARGUEMENT TOO LONG");
-        clear_state(argv, &argc, &char_count);
-        continue;
-      }
-
-      // print the character
-      print_char(&c);
-
-      // Store the character
-      argv[argc][char_count] = c;
-      argv[argc][char_count + 1] = '\0';
-      char_count++; 
-
+    if (input(&c, sizeof(c)) == HAL_OK) {
+      status = take_char(c, commandHandler);
     }
 
   } while (status == REPL_CONTINUE);
@@ -189,3 +202,24 @@ REPL_Status repl(REPL_Status (* commandHandler) (int, char[MAX_ARGS][MAX_ARG_LEN
   return status;
 
 }
+
+
+/**
+ * @brief Runs the repl on whatever input has come in, without waiting for more. Call this
+ *        regularly from a loop that can't block, the command line carries over between calls.
+ *
+ * @param commandHandler  see repl()
+ *
+ * @return    REPL_EXIT if a command exited, else REPL_CONTINUE
+ */
+REPL_Status repl_poll(REPL_Status (* commandHandler) (int, char[MAX_ARGS][MAX_ARG_LEN])) {
+
+  REPL_Status status = REPL_CONTINUE;
+  char c;
+
+  while (status == REPL_CONTINUE && poll_input(&c) == HAL_OK) {
+    status = take_char(c, commandHandler);
+  }
+
+  return status;
+}
@@ -0,0 +1,312 @@
+#include "sampler.h"
+#include "timing.h"
+
+// Sensor polling
+//
+// Every channel releases a sampling job once a period, due within its deadline.
+// Each bus runs one job at a time, always the waiting job with the earliest
+// deadline, so a slow channel never holds up one that protects the car.
+// Whatever bus time is left over goes to checking the sensors haven't reset.
+//
+// In snapshot mode every sensor is triggered in one sweep of the buses instead,
+// and all are read once the conversion is done, so a frame's readings come from
+// the same moment on every channel.
+
+// Periods follow each sensor's conversion time, see channel_configs in channels.c
+// Be sure to keep these in the same order as Channel_Name
+Sample_Timing const sample_timing[NUM_CHANNELS] =
+{
+  {.period_ms=35,  .deadline_ms=20},  // VCU_CHAN
+  {.period_ms=5,   .deadline_ms=2},   // SHUTDOWN_CHAN
+  {.period_ms=5,   .deadline_ms=3},   // PUMPS_CHAN
+  {.period_ms=35,  .deadline_ms=35},  // FANS_CHAN
+  {.period_ms=140, .deadline_ms=140}, // AERO_CHAN
+  {.period_ms=35,  .deadline_ms=10},  // REGEN_CHAN
+};
+
+Sample_Job sample_jobs[NUM_CHANNELS];
+
+// The latest complete snapshot
+Snapshot_Frame snapshot_frame;
+
+static struct {
+  Snapshot_State  state;
+  uint32_t        trigger;       // When the frame in progress was triggered
+  uint32_t        next_trigger;
+  uint32_t        conversion_ms; // How long after the trigger the sensors are done
+} snapshot = {.state = SNAPSHOT_OFF};
+
+static void finish_job(Sample_Job * const job, uint32_t finished) {
+
+  uint32_t const response = finished - job->release;
+
+  if (tick_before(job->deadline, finished)) {
+    job->misses++;
+  }
+
+  if (response > job->worst_response) {
+    job->worst_response = response;
+  }
+
+  job->jobs++;
+  job->pending   = false;
+  job->in_flight = false;
+}
+
+// Releases the channel's next job once its period comes round
+static void release_job(Sample_Job * const job, Sample_Timing const * const timing, uint32_t now) {
+
+  if (job->pending || job->in_flight || tick_before(now, job->next_release)) return;
+
+  // The last job overran a whole period, its missed release is dropped
+  // and the period restarts from now rather than catching up in a burst
+  if (!tick_before(now, job->next_release + timing->period_ms)) {
+    job->misses++;
+    job->next_release = now;
+  }
+
+  job->release  = job->next_release;
+  job->deadline = job->release + timing->deadline_ms;
+  job->pending  = true;
+
+  job->next_release += timing->period_ms;
+}
+
+// Returns the waiting channel on bus with the earliest deadline, or NUM_CHANNELS if none are waiting
+static Channel_Name earliest_job(I2C_Bus bus) {
+
+  Channel_Name earliest = NUM_CHANNELS;
+
+  for (Channel_Name name = 0; name < NUM_CHANNELS; name++) {
+
+    if (channel_configs[name].bus != bus || !sample_jobs[name].pending) continue;
+
+    if (earliest == NUM_CHANNELS || tick_before(sample_jobs[name].deadline, sample_jobs[earliest].deadline)) {
+      earliest = name;
+    }
+  }
+
+  return earliest;
+}
+
+// Starts channel's job, returns true if it's now waiting on the bus
+static bool start_job(Channel_Name name) {
+
+  Sample_Job * const job = &sample_jobs[name];
+
+  job->pending = false;
+
+  if (sample_channel(&channels[name])) {
+    job->in_flight = true;
+    return true;
+  }
+
+  // Nothing new to read, the job is done already
+  finish_job(job, HAL_GetTick());
+  return false;
+}
+
+// Reads back the configuration of the channel on bus that's been longest without, once it's due
+// Only call this while the bus is idle, the check and any re-programming run ahead of the next job
+static void start_check(I2C_Bus bus, uint32_t now) {
+
+  Channel_Name due = NUM_CHANNELS;
+
+  for (Channel_Name name = 0; name < NUM_CHANNELS; name++) {
+
+    if (channel_configs[name].bus != bus || tick_before(now, sample_jobs[name].next_check)) continue;
+
+    if (due == NUM_CHANNELS || tick_before(sample_jobs[name].next_check, sample_jobs[due].next_check)) {
+      due = name;
+    }
+  }
+
+  if (due == NUM_CHANNELS) return;
+
+  sample_jobs[due].next_check = now + SAMPLER_CHECK_PERIOD_MS;
+  check_channel(&channels[due]);
+}
+
+// Copies every channel's readings from the frame just read into snapshot_frame
+static void finish_frame(void) {
+
+  snapshot_frame.timestamp = snapshot.trigger;
+  snapshot_frame.valid     = 0;
+
+  for (Channel_Name name = 0; name < NUM_CHANNELS; name++) {
+
+    Channel const * const channel = &channels[name];
+    bool fresh = channel->addr != SENSOR_MISSING;
+
+    // Every reading the channel samples must have come in since the trigger
+    for (Reading_Type reading = 0; reading < NUM_READINGS; reading++) {
+
+      Cached_Sample const * const sample = &channel->samples[reading];
+
+      if ((channel->config->sensor.readings & READING(reading))
+          && (sample->quality != SAMPLE_GOOD || tick_before(sample->timestamp, snapshot.trigger))) {
+        fresh = false;
+      }
+    }
+
+    if (fresh) {
+      snapshot_frame.voltage[name] = channel->samples[BUS_VOLT_READING].raw;
+      snapshot_frame.current[name] = channel_current_ua(channel);
+      snapshot_frame.valid |= 1 << name;
+    }
+  }
+
+  snapshot_frame.seq++;
+}
+
+// Triggers every sensor, waits out the conversion, then reads them all
+static void run_snapshot(uint32_t now, bool const busy[NUM_I2C_BUSES]) {
+
+  switch (snapshot.state) {
+
+    case SNAPSHOT_IDLE:
+
+      // Checks still get the slack between frames
+      if (tick_before(now, snapshot.next_trigger)) {
+        for (I2C_Bus bus = 0; bus < NUM_I2C_BUSES; bus++) {
+          if (!busy[bus] && i2c_bus_idle(bus)) {
+            start_check(bus, now);
+          }
+        }
+        return;
+      }
+
+      // Only trigger on idle buses, so the sweep goes out back to back
+      for (I2C_Bus bus = 0; bus < NUM_I2C_BUSES; bus++) {
+        if (busy[bus] || !i2c_bus_idle(bus)) return;
+      }
+
+      for (Channel_Name name = 0; name < NUM_CHANNELS; name++) {
+        trigger_channel(&channels[name]);
+      }
+
+      snapshot.trigger       = now;
+      snapshot.next_trigger += SNAPSHOT_PERIOD_MS;
+      snapshot.state         = SNAPSHOT_CONVERTING;
+
+      // Behind by a whole period, restart it from now rather than catching up
+      if (!tick_before(now, snapshot.next_trigger)) {
+        snapshot.next_trigger = now + SNAPSHOT_PERIOD_MS;
+      }
+      break;
+
+    case SNAPSHOT_CONVERTING:
+
+      if (tick_before(now, snapshot.trigger + snapshot.conversion_ms)) return;
+
+      for (Channel_Name name = 0; name < NUM_CHANNELS; name++) {
+        read_channel(&channels[name]);
+      }
+
+      snapshot.state = SNAPSHOT_READING;
+      break;
+
+    case SNAPSHOT_READING:
+
+      for (Channel_Name name = 0; name < NUM_CHANNELS; name++) {
+        if (channels[name].sampling) return;
+      }
+
+      finish_frame();
+      snapshot.state = SNAPSHOT_IDLE;
+      break;
+
+    case SNAPSHOT_OFF:
+      break;
+  }
+}
+
+// Releases every channel's first job now, call once the channels are initialized
+void init_sampler(void) {
+
+  for (Channel_Name name = 0; name < NUM_CHANNELS; name++) {
+    sample_jobs[name] = (Sample_Job) {
+      .next_release = HAL_GetTick(),
+      .next_check   = HAL_GetTick() + SAMPLER_CHECK_PERIOD_MS,
+    };
+  }
+}
+
+// Finishes, releases and starts sampling jobs, call every time round the main loop
+// Returns immediately, the bus works through the jobs from interrupts
+void run_sampler(void) {
+
+  uint32_t const now = HAL_GetTick();
+  bool busy[NUM_I2C_BUSES] = {false};
+
+  for (Channel_Name name = 0; name < NUM_CHANNELS; name++) {
+
+    Sample_Job * const job = &sample_jobs[name];
+    Channel const * const channel = &channels[name];
+
+    if (job->in_flight && !channel->sampling) {
+      finish_job(job, channel->sample_timestamp);
+    }
+
+    if (snapshot.state == SNAPSHOT_OFF) {
+      release_job(job, &sample_timing[name], now);
+    }
+
+    if (job->in_flight) {
+      busy[channel->config->bus] = true;
+    }
+  }
+
+  if (snapshot.state != SNAPSHOT_OFF) {
+    run_snapshot(now, busy);
+    return;
+  }
+
+  // One job per bus at a time, so a later deadline never queues ahead of an earlier one
+  for (I2C_Bus bus = 0; bus < NUM_I2C_BUSES; bus++) {
+
+    while (!busy[bus]) {
+
+      Channel_Name const name = earliest_job(bus);
+      if (name == NUM_CHANNELS) break;
+
+      busy[bus] = start_job(name);
+    }
+
+    // Low priority, only when no job is waiting on the bus
+    if (!busy[bus] && i2c_bus_idle(bus)) {
+      start_check(bus, now);
+    }
+  }
+}
+
+// Switches the sensors to triggered conversions and the sampler to whole frames
+// The first frame is triggered as soon as the buses are idle
+void start_snapshots(void) {
+
+  set_snapshot_mode(true);
+
+  // Every sensor converts the same way, so the longest is any of them
+  // Conversion times are typical, leave a tenth more for a slow sensor clock
+  snapshot.conversion_ms = SENSOR_FN(conversion_time_us)(sensor_conf(&channels[0])) * 11 / 10000 + 1;
+  snapshot.next_trigger  = HAL_GetTick();
+  snapshot.state         = SNAPSHOT_IDLE;
+}
+
+// Switches the sensors back to converting continuously, and each channel to its own period
+// A frame in progress is dropped, its reads still finish into the channels
+void stop_snapshots(void) {
+
+  set_snapshot_mode(false);
+
+  for (Channel_Name name = 0; name < NUM_CHANNELS; name++) {
+    trigger_channel(&channels[name]);
+    sample_jobs[name].next_release = HAL_GetTick();
+  }
+
+  snapshot.state = SNAPSHOT_OFF;
+}
+
+Snapshot_State snapshot_state(void) {
+  return snapshot.state;
+}
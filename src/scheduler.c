@@ -0,0 +1,135 @@
+#include "scheduler.h"
+#include "timing.h"
+#include "uart.h"
+
+#include <string.h>
+
+Task_Stats task_stats[SCHEDULER_MAX_TASKS];
+
+static Task const *task_table;
+static uint8_t num_table_tasks;
+
+// Starts running tasks, every one of them due straight away
+void init_scheduler(Task const * const tasks, uint8_t num_tasks) {
+
+  if (num_tasks > SCHEDULER_MAX_TASKS) num_tasks = SCHEDULER_MAX_TASKS;
+
+  task_table      = tasks;
+  num_table_tasks = num_tasks;
+
+  memset(task_stats, 0, sizeof(task_stats));
+
+  for (int i = 0; i < num_tasks; i++) {
+    task_stats[i].release = HAL_GetTick();
+  }
+}
+
+// Runs task if it's due, returns true if it ran
+static bool run_task(Task const * const task, Task_Stats * const stats) {
+
+  uint32_t const now = HAL_GetTick();
+
+  if (!tick_reached(now, stats->release)) return false;
+
+  // Whole periods late, drop those releases and keep to the ones after
+  uint32_t const missed = (now - stats->release) / task->period_ms;
+
+  stats->skipped += missed;
+  stats->release += (missed + 1) * task->period_ms;
+
+  uint32_t const start = cpu_cycles();
+  task->run();
+  uint32_t const cycles = cpu_cycles() - start;
+
+  stats->runs++;
+  stats->last_cycles   = cycles;
+  stats->total_cycles += cycles;
+
+  if (cycles > stats->max_cycles) stats->max_cycles = cycles;
+  if (cycles > SystemCoreClock / 1000 * task->period_ms) stats->overruns++;
+
+  return true;
+}
+
+// Runs every task that's due once, in table order
+// Returns true if any ran
+bool run_tasks(void) {
+
+  bool ran = false;
+
+  for (int i = 0; i < num_table_tasks; i++) {
+    if (run_task(&task_table[i], &task_stats[i])) ran = true;
+  }
+
+  return ran;
+}
+
+#ifndef TEST
+
+// True if any task is due
+static bool tasks_due(void) {
+
+  uint32_t const now = HAL_GetTick();
+
+  for (int i = 0; i < num_table_tasks; i++) {
+    if (tick_reached(now, task_stats[i].release)) return true;
+  }
+
+  return false;
+}
+
+// Runs tasks forever, sleeping whenever none are due
+void run_scheduler(void) {
+
+  while (1) {
+
+    if (run_tasks()) continue;
+
+    // With interrupts masked, a tick landing between the check and the WFI still wakes it
+    __disable_irq();
+
+    if (!tasks_due()) {
+      __WFI();
+    }
+
+    __enable_irq();
+  }
+}
+
+#endif
+
+// REPL command, "tasks" prints how each task's runs have gone, "tasks reset" starts the counts over
+REPL_Status tasks_command(int argc, char argv[MAX_ARGS][MAX_ARG_LEN]) {
+
+  if (argc >= 1 && eq(argv[1], "reset")) {
+
+    for (int i = 0; i < num_table_tasks; i++) {
+      uint32_t const release = task_stats[i].release;
+      task_stats[i] = (Task_Stats) {.release = release};
+    }
+
+    output("Task stats reset");
+    return REPL_CONTINUE;
+  }
+
+  for (int i = 0; i < num_table_tasks; i++) {
+
+    Task_Stats const * const stats = &task_stats[i];
+
+    print("\n\r");
+    print(task_table[i].name);
+    print(": ");
+    print_int(stats->runs, 10);
+    print(" runs, ");
+    print_int(stats->runs ? stats->total_cycles / stats->runs : 0, 10);
+    print(" cycles average, ");
+    print_int(stats->max_cycles, 10);
+    print(" max, ");
+    print_int(stats->overruns, 10);
+    print(" overruns, ");
+    print_int(stats->skipped, 10);
+    print(" skipped");
+  }
+
+  return REPL_CONTINUE;
+}
@@ -0,0 +1,214 @@
+#include "sensor.h"
+
+// Current sensor drivers
+//
+// Each part's register layout, timing and scaling. Nothing here touches the
+// bus, the channels queue the reads and writes these work out.
+
+static uint16_t const AVG_COUNT[8] = { 1, 4, 16, 64, 128, 256, 512, 1024 };
+
+// INA226 and INA3221 conversion times, INA226_CT_*
+static uint16_t const CT_US[8] = { 140, 204, 332, 588, 1100, 2116, 4156, 8244 };
+
+// INA228 conversion times, and the nearest to each INA226_CT_*
+static uint16_t const INA228_CT_US[8]      = { 50, 84, 150, 280, 540, 1052, 2074, 4120 };
+static uint8_t const INA228_CT_NEAREST[8] = { 2, 2, 3, 4, 5, 6, 7, 7 };
+
+// INA228_REG_ADC_CONFIG fields
+#define INA228_ADC_MODE(m)    ((m) << 12)
+#define INA228_ADC_VBUSCT(t)  ((t) << 9)
+#define INA228_ADC_VSHCT(t)   ((t) << 6)
+#define INA228_ADC_AVG(n)     (n)
+
+// INA226
+
+// Returns the INA226_REG_CONF value, avg is INA226_AVG_* and the times INA226_CT_*
+uint16_t ina226_conf(uint8_t avg, uint8_t vbusct, uint8_t vshct, bool triggered) {
+  return INA226_CONF(avg, vbusct, vshct, triggered ? INA226_MODE_TRIGGERED : INA226_MODE_CONTINUOUS);
+}
+
+// Returns the time between conversions for a INA226_REG_CONF value, in us
+uint32_t ina226_conversion_time_us(uint16_t conf) {
+
+  uint8_t const avg   = (conf >> 9) & 0x7;
+  uint8_t const vbus  = (conf >> 6) & 0x7;
+  uint8_t const vsh   = (conf >> 3) & 0x7;
+
+  return AVG_COUNT[avg] * (uint32_t) (CT_US[vbus] + CT_US[vsh]);
+}
+
+// Returns the INA226_REG_CAL value for a shunt and the current each count should be
+uint16_t ina226_calibration(uint32_t shunt_uohm, uint32_t current_lsb_ua) {
+
+  uint64_t const cal = INA226_CAL_SCALE / ((uint64_t) shunt_uohm * current_lsb_ua);
+
+  // Only 15 bits, a larger current LSB is needed past that
+  return cal > 0x7fff ? 0x7fff : cal;
+}
+
+// Converts INA226_REG_POWER counts to uW, the sensor did the multiply
+uint32_t ina226_power_uw(uint32_t power, uint32_t current_lsb_ua) {
+  return power * INA226_POWER_LSB_SCALE * current_lsb_ua;
+}
+
+// Fills writes with the register values that program an INA226, returns how many
+// CONF goes first, so the sensor is converting while the rest is written
+// The ALERT pin flags each finished conversion as well as the limit
+uint8_t ina226_writes(uint16_t conf, uint16_t cal, Sensor_Alert alert, int32_t limit, uint8_t sub, Sensor_Write writes[SENSOR_WRITES]) {
+
+  static uint16_t const FUNCTION[] = {
+    [SENSOR_ALERT_NONE]         = 0,
+    [SENSOR_ALERT_BUS_OVER]     = INA226_MASK_BOL,
+    [SENSOR_ALERT_BUS_UNDER]    = INA226_MASK_BUL,
+    [SENSOR_ALERT_SHUNT_OVER]   = INA226_MASK_SOL,
+    [SENSOR_ALERT_SHUNT_UNDER]  = INA226_MASK_SUL,
+  };
+
+  writes[0] = (Sensor_Write) {.reg_addr = INA226_REG_CONF,        .val = conf};
+  writes[1] = (Sensor_Write) {.reg_addr = INA226_REG_CAL,         .val = cal};
+  writes[2] = (Sensor_Write) {.reg_addr = INA226_REG_ALERT_LIMIT, .val = alert == SENSOR_ALERT_NONE ? 0 : limit};
+  writes[3] = (Sensor_Write) {.reg_addr = INA226_REG_MASK,        .val = FUNCTION[alert] | INA226_MASK_CNVR | INA226_MASK_LEN};
+
+  return 4;
+}
+
+// INA3221
+
+// Returns the INA3221_REG_CONF value with every channel enabled, times are INA226_CT_* as the INA3221 shares them
+uint16_t ina3221_conf(uint8_t avg, uint8_t vbusct, uint8_t vshct, bool triggered) {
+  return ina226_conf(avg, vbusct, vshct, triggered) | INA3221_CONF_CHANNELS;
+}
+
+// Returns the time between conversions of a channel, which waits on the other two
+uint32_t ina3221_conversion_time_us(uint16_t conf) {
+  return INA3221_CHANNELS * ina226_conversion_time_us(conf);
+}
+
+// The INA3221 has no current or power registers, so nothing to calibrate
+uint16_t ina3221_calibration(uint32_t shunt_uohm, uint32_t current_lsb_ua) {
+  return 0;
+}
+
+uint32_t ina3221_power_uw(uint32_t power, uint32_t current_lsb_ua) {
+  return 0;
+}
+
+// Fills writes with the register values that program sub channel of an INA3221, returns how many
+// It can only watch shunt voltage over a limit, on its CRITICAL pin, and has no conversion ready alert
+uint8_t ina3221_writes(uint16_t conf, uint16_t cal, Sensor_Alert alert, int32_t limit, uint8_t sub, Sensor_Write writes[SENSOR_WRITES]) {
+
+  writes[0] = (Sensor_Write) {.reg_addr = INA3221_REG_CONF, .val = conf};
+
+  if (alert != SENSOR_ALERT_SHUNT_OVER) return 1;
+
+  writes[1] = (Sensor_Write) {.reg_addr = INA3221_REG_CRITICAL(sub), .val = limit << INA3221_VALUE_SHIFT};
+
+  return 2;
+}
+
+// INA228
+
+// Returns the INA228_REG_ADC_CONFIG value, taking INA226_AVG_* and INA226_CT_* so configs carry over
+// The INA228's averaging counts match, each conversion time goes to the nearest it has
+uint16_t ina228_conf(uint8_t avg, uint8_t vbusct, uint8_t vshct, bool triggered) {
+  return INA228_ADC_MODE(triggered ? INA228_MODE_TRIGGERED : INA228_MODE_CONTINUOUS)
+       | INA228_ADC_VBUSCT(INA228_CT_NEAREST[vbusct])
+       | INA228_ADC_VSHCT(INA228_CT_NEAREST[vshct])
+       | INA228_ADC_AVG(avg);
+}
+
+// Returns the time between conversions for a INA228_REG_ADC_CONFIG value, in us
+uint32_t ina228_conversion_time_us(uint16_t conf) {
+
+  uint8_t const avg   = conf & 0x7;
+  uint8_t const vbus  = (conf >> 9) & 0x7;
+  uint8_t const vsh   = (conf >> 6) & 0x7;
+
+  return AVG_COUNT[avg] * (uint32_t) (INA228_CT_US[vbus] + INA228_CT_US[vsh]);
+}
+
+// Returns the INA228_REG_SHUNT_CAL value for a shunt and the current each count should be
+uint16_t ina228_calibration(uint32_t shunt_uohm, uint32_t current_lsb_ua) {
+
+  uint64_t const cal = (uint64_t) shunt_uohm * current_lsb_ua * INA228_CAL_SCALE / INA228_CAL_DIVISOR;
+
+  // Only 15 bits, a smaller current LSB is needed past that
+  return cal > 0x7fff ? 0x7fff : cal;
+}
+
+// Converts INA228_REG_POWER counts to uW, saturating past 4 kW
+uint32_t ina228_power_uw(uint32_t power, uint32_t current_lsb_ua) {
+
+  uint64_t const uw = (uint64_t) power * INA228_POWER_LSB_SCALE * current_lsb_ua / 10;
+
+  return uw > UINT32_MAX ? UINT32_MAX : uw;
+}
+
+// Fills writes with the register values that program an INA228, returns how many
+// Limits are 16 bits, a sixteenth of the 20 bit readings' resolution
+uint8_t ina228_writes(uint16_t conf, uint16_t cal, Sensor_Alert alert, int32_t limit, uint8_t sub, Sensor_Write writes[SENSOR_WRITES]) {
+
+  static uint8_t const LIMIT_REG[] = {
+    [SENSOR_ALERT_NONE]         = SENSOR_NO_REG,
+    [SENSOR_ALERT_BUS_OVER]     = INA228_REG_BOVL,
+    [SENSOR_ALERT_BUS_UNDER]    = INA228_REG_BUVL,
+    [SENSOR_ALERT_SHUNT_OVER]   = INA228_REG_SOVL,
+    [SENSOR_ALERT_SHUNT_UNDER]  = INA228_REG_SUVL,
+  };
+
+  uint8_t count = 0;
+
+  writes[count++] = (Sensor_Write) {.reg_addr = INA228_REG_ADC_CONFIG, .val = conf};
+  writes[count++] = (Sensor_Write) {.reg_addr = INA228_REG_SHUNT_CAL,  .val = cal};
+
+  if (alert != SENSOR_ALERT_NONE) {
+    writes[count++] = (Sensor_Write) {.reg_addr = LIMIT_REG[alert], .val = limit >> INA228_LIMIT_SHIFT};
+  }
+
+  writes[count++] = (Sensor_Write) {.reg_addr = INA228_REG_DIAG_ALRT, .val = INA228_DIAG_CNVR | INA228_DIAG_ALATCH};
+
+  return count;
+}
+
+// Every part
+
+// Converts a voltage to bus voltage counts
+int32_t bus_volt_counts(uint16_t mv) {
+  return (uint64_t) mv * 1000000 / SENSOR_BUS_VOLT_LSB_NV;
+}
+
+// Converts a current to current counts, saturating at the register's range
+int32_t current_counts(uint16_t ma, uint32_t current_lsb_ua) {
+
+  uint32_t const counts = (uint32_t) ma * 1000 / current_lsb_ua;
+
+  return counts > SENSOR_READING_MAX ? SENSOR_READING_MAX : counts;
+}
+
+// Converts current counts to the shunt voltage counts behind them, saturating at the register's range
+// Worked out from the shunt rather than the calibration, so it holds for parts without one
+int32_t shunt_volt_counts(int32_t current, uint32_t current_lsb_ua, uint32_t shunt_uohm) {
+
+  // uA * uOhm is pV
+  int64_t const counts = (int64_t) current * current_lsb_ua * shunt_uohm / SENSOR_SHUNT_VOLT_LSB_PV;
+
+  if (counts > SENSOR_READING_MAX)  return SENSOR_READING_MAX;
+  if (counts < -SENSOR_READING_MAX) return -SENSOR_READING_MAX;
+
+  return counts;
+}
+
+// Returns the current per shunt voltage count through shunt_uohm, in uA as Q16
+// Work it out once per shunt, so each reading only takes a multiply, see shunt_current_ua()
+uint32_t shunt_scale_q16(uint32_t shunt_uohm) {
+
+  uint64_t const scale = ((uint64_t) SENSOR_SHUNT_VOLT_LSB_PV << 16) / shunt_uohm;
+
+  return scale > UINT32_MAX ? UINT32_MAX : scale;
+}
+
+// Converts shunt voltage counts to uA, with scale_q16 from shunt_scale_q16()
+// Resolution is only set by the shunt, unlike the current register's LSB
+int32_t shunt_current_ua(int32_t shunt, uint32_t scale_q16) {
+  return ((int64_t) shunt * scale_q16) >> 16;
+}
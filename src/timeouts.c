@@ -0,0 +1,108 @@
+#include "timeouts.h"
+#include "timing.h"
+
+#include <string.h>
+
+#define SLOT(tick)  ((tick) & (WHEEL_SLOTS - 1))
+
+_Static_assert((WHEEL_SLOTS & (WHEEL_SLOTS - 1)) == 0, "WHEEL_SLOTS has to be a power of 2");
+
+static Timeout_Mask slots[WHEEL_SLOTS];   // The timeouts whose deadlines land in each slot
+static Timeout_Mask armed;
+static Timeout_Mask expired;              // Timed out, but not yet taken
+static uint32_t deadlines[NUM_TIMEOUTS];
+static uint32_t wheel_tick;               // Every slot up to this one has been run
+
+// Empties the wheel, starting it at now
+void init_timeouts(uint32_t now) {
+
+  memset(slots, 0, sizeof(slots));
+  armed   = 0;
+  expired = 0;
+
+  wheel_tick = now;
+}
+
+// Takes each of timeouts out of its slot
+static void disarm(Timeout_Mask timeouts) {
+
+  timeouts &= armed;
+
+  for (uint8_t i = 0; i < NUM_TIMEOUTS; i++) {
+    if (timeouts & (1U << i)) {
+      slots[SLOT(deadlines[i])] &= ~(1U << i);
+    }
+  }
+
+  armed &= ~timeouts;
+}
+
+// Times timeout out at deadline, in place of any deadline it had
+void arm_timeout(uint8_t timeout, uint32_t deadline) {
+
+  Timeout_Mask const bit = 1U << timeout;
+
+  disarm(bit);
+  expired &= ~bit;
+
+  // Its slot has already come round
+  if (tick_reached(wheel_tick, deadline)) {
+    expired |= bit;
+    return;
+  }
+
+  deadlines[timeout] = deadline;
+  slots[SLOT(deadline)] |= bit;
+  armed |= bit;
+}
+
+// Drops each of timeouts, including ones that timed out but weren't taken
+void cancel_timeouts(Timeout_Mask timeouts) {
+  disarm(timeouts);
+  expired &= ~timeouts;
+}
+
+// True if timeout is waiting for its deadline
+bool timeout_armed(uint8_t timeout) {
+  return armed & (1U << timeout);
+}
+
+// Expires the timeouts in slot that are due by now, leaving the ones a turn or more off
+static void run_slot(uint32_t slot, uint32_t now) {
+
+  Timeout_Mask const waiting = slots[slot];
+
+  for (uint8_t i = 0; i < NUM_TIMEOUTS; i++) {
+    if ((waiting & (1U << i)) && tick_reached(now, deadlines[i])) {
+      slots[slot] &= ~(1U << i);
+      armed       &= ~(1U << i);
+      expired     |= 1U << i;
+    }
+  }
+}
+
+// Turns the wheel up to now, running each slot it passes
+void run_timeouts(uint32_t now) {
+
+  uint32_t const elapsed = now - wheel_tick;
+
+  // A turn or more, every slot comes round once
+  uint32_t const steps = elapsed < WHEEL_SLOTS ? elapsed : WHEEL_SLOTS;
+
+  for (uint32_t i = 1; i <= steps; i++) {
+    if (slots[SLOT(wheel_tick + i)]) {
+      run_slot(SLOT(wheel_tick + i), now);
+    }
+  }
+
+  wheel_tick = now;
+}
+
+// Returns each of timeouts that timed out since it was last taken, and forgets them
+Timeout_Mask take_timeouts(Timeout_Mask timeouts) {
+
+  Timeout_Mask const timed_out = expired & timeouts;
+  expired &= ~timeouts;
+
+  return timed_out;
+}
@@ -0,0 +1,46 @@
+#include "timing.h"
+
+#ifndef TEST
+
+// Microseconds, from the core's cycle counter
+// The counter wraps every 2^32 / SystemCoreClock seconds, about 268 s at the
+// 16 MHz HSI, call this more often than that
+uint32_t time_us(void) {
+
+  static uint32_t last_cycles = 0;
+  static uint32_t remainder   = 0;
+  static uint32_t time_us     = 0;
+
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+
+  if (!(DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk)) {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    last_cycles = 0;
+  }
+
+  uint32_t const cycles_per_us = SystemCoreClock / 1000000;
+  uint32_t const now = DWT->CYCCNT;
+  uint32_t const cycles = now - last_cycles + remainder;
+
+  last_cycles = now;
+  time_us += cycles / cycles_per_us;
+  remainder = cycles % cycles_per_us;
+
+  __set_PRIMASK(primask);
+  return time_us;
+}
+
+// Core clock cycles, for timing code
+uint32_t cpu_cycles(void) {
+
+  if (!(DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk)) {
+    time_us();  // Starts the counter
+  }
+
+  return DWT->CYCCNT;
+}
+
+#endif
@@ -31,6 +31,11 @@ HAL_StatusTypeDef input(char *buf, uint16_t len) {
   return HAL_UART_Receive(&uart, (uint8_t*) buf, len, UART_DELAY);
 }
 
+// Takes a character if one has come in, without waiting for one
+HAL_StatusTypeDef poll_input(char *c) {
+  return HAL_UART_Receive(&uart, (uint8_t*) c, 1, 0);
+}
+
 void print_int(int i, uint8_t base) {
   char buf[(sizeof(uint32_t)*8+1)];
   itoa(i, buf, base);
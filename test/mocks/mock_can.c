@@ -0,0 +1,16 @@
+#include "mock_can.h"
+
+#include <string.h>
+
+CAN_TxHeaderTypeDef can_header;
+uint8_t can_data[8];
+uint32_t can_frames = 0;
+
+HAL_StatusTypeDef HAL_CAN_AddTxMessage(CAN_HandleTypeDef *hcan, CAN_TxHeaderTypeDef *header, uint8_t data[], uint32_t *mailbox) {
+
+  can_header = *header;
+  memcpy(can_data, data, header->DLC);
+  can_frames++;
+
+  return HAL_OK;
+}
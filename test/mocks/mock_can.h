@@ -0,0 +1,13 @@
+#ifndef MOCK_CAN_H
+#define MOCK_CAN_H
+
+#include "common_mock.h"
+#include "stm32f4xx_hal.h"
+
+// Emulated CAN transmit, keeping the last frame sent
+
+extern CAN_TxHeaderTypeDef can_header;
+extern uint8_t can_data[8];
+extern uint32_t can_frames;   // Frames sent, the test clears it
+
+#endif
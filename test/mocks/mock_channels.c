@@ -0,0 +1,11 @@
+#include "channels.h"
+#include "mock_channels.h"
+
+void init_mock_channels(uint32_t ticks) {
+
+  SYSTEM_TICKS = ticks;
+
+  for (Channel_Name name = 0; name < NUM_CHANNELS; name++) {
+    init_channel(&channels[name], name, 0x40 + name, &channel_configs[name]);
+  }
+}
@@ -0,0 +1,10 @@
+#ifndef MOCK_CHANNELS_H
+#define MOCK_CHANNELS_H
+
+#include "common_mock.h"
+
+// Sets up every channel from its configuration at ticks, each sensor at 0x40 plus its name
+// Nothing's been read, tests set up whatever else they need after
+void init_mock_channels(uint32_t ticks);
+
+#endif
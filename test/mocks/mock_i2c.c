@@ -1,5 +1,7 @@
 #include "unity.h"
 #include "i2c.h"
+#include "mock_i2c.h"
+#include "mock_sensor.h"
 
 // Pointers to start and end of the transmission / reception queues
 // Set these to a valid queues for i2c to read from / write to
@@ -14,16 +16,106 @@ uint8_t * rx_queue_end    = NULL;
 uint16_t transmit_address;
 uint16_t receive_address;
 
+// Returned by every mocked transfer, set it to inject bus errors
+
+HAL_StatusTypeDef mock_i2c_status = HAL_OK;
+
+// Error code the failed transfers leave in the handle
+
+uint32_t mock_i2c_error = HAL_I2C_ERROR_AF;
+
+// Counts controller (re)initializations
+
+uint32_t mock_i2c_inits = 0;
+
+// Counts every transfer on the mocked bus
+
+uint32_t mock_i2c_transfers = 0;
+
+// Set to emulate a device holding SDA low, it lets go after this many SCL clocks
+
+uint32_t mock_i2c_stuck = 0;
+
+// Counts SCL clocks given by hand, see i2c_scl_write()
+
+uint32_t mock_i2c_clocks = 0;
+
+// Devices that ACK their address, indexed by 7 bit address
+
+bool mock_i2c_present[MOCK_ADDRESSES];
+
+static GPIO_PinState scl_state = GPIO_PIN_SET;
+
+// Interrupt mode transfer waiting on mock_i2c_complete()
+
+typedef enum {
+  MOCK_IDLE,
+  MOCK_TRANSMIT,
+  MOCK_RECEIVE,
+  MOCK_MEM_READ,
+  MOCK_MEM_WRITE
+} Mock_Transfer_Type;
+
+typedef struct {
+  Mock_Transfer_Type  type;
+  I2C_HandleTypeDef   *hi2c;
+  uint16_t            address;
+  uint16_t            mem_address;
+  uint8_t             *data;
+  uint16_t            size;
+} Mock_Transfer;
+
+// One transfer can be pending on each controller, like on the real buses
+#define MOCK_CONTROLLERS 4
+
+static Mock_Transfer pending[MOCK_CONTROLLERS];
+static int next_completion = 0;
+
+// Returns hi2c's pending transfer slot, NULL if all are taken by other controllers
+static Mock_Transfer *pending_slot(I2C_HandleTypeDef *hi2c) {
+
+  for (int i = 0; i < MOCK_CONTROLLERS; i++) {
+    if (pending[i].type != MOCK_IDLE && pending[i].hi2c == hi2c) return &pending[i];
+  }
+
+  for (int i = 0; i < MOCK_CONTROLLERS; i++) {
+    if (pending[i].type == MOCK_IDLE) return &pending[i];
+  }
+
+  return NULL;
+}
+
+static HAL_StatusTypeDef hold_transfer(Mock_Transfer const transfer) {
+
+  Mock_Transfer * const slot = pending_slot(transfer.hi2c);
+
+  if (slot == NULL || slot->type != MOCK_IDLE) return HAL_BUSY;
+
+  *slot = transfer;
+  return HAL_OK;
+}
+
 // Mocks the functionality of i2c transmit by writing each value to tx_queue
 // Always sets transmit_address to DevAddress before writing
 HAL_StatusTypeDef HAL_I2C_Master_Transmit(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint8_t *pData, uint16_t Size, uint32_t Timeout) {
 
   //printf(" A  %#x   ", DevAddress);
+
+  // The controller waits out the busy bus before giving up
+  if (mock_i2c_stuck) {
+    hi2c->ErrorCode = HAL_I2C_ERROR_TIMEOUT;
+    return HAL_BUSY;
+  }
   
   transmit_address = DevAddress;
+  mock_i2c_transfers++;
+  hi2c->ErrorCode = (mock_i2c_status == HAL_OK) ? HAL_I2C_ERROR_NONE : mock_i2c_error;
     
   //printf(" B  %#x   ", transmit_address);
 
+  // Emulated sensors answer for themselves
+  if (mock_sensor_transmit(DevAddress >> 1, pData, Size)) return mock_i2c_status;
+
   TEST_ASSERT_NOT_NULL_MESSAGE(tx_queue_start, "I2C Mock Failed: tx_queue's start wasn't initialized");
   TEST_ASSERT_NOT_NULL_MESSAGE(tx_queue_end, "I2C Mock Failed: tx_queue'end wasn't initialized");
   TEST_ASSERT_TRUE_MESSAGE(tx_queue_start < tx_queue_end, "I2C Mock Failed: tx_queue's start is after its end");
@@ -36,15 +128,24 @@ HAL_StatusTypeDef HAL_I2C_Master_Transmit(I2C_HandleTypeDef *hi2c, uint16_t DevA
 
   //printf(" C  %#x   ", transmit_address);
 
-  return HAL_OK;
+  return mock_i2c_status;
 
 }
 
 // Mocks the functionality of i2c read by reading each value from rx_queue
 // Always sets receive_address to DevAddress before reading
 HAL_StatusTypeDef HAL_I2C_Master_Receive(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint8_t *rsp, uint16_t Size, uint32_t Timeout) {
+
+  if (mock_i2c_stuck) {
+    hi2c->ErrorCode = HAL_I2C_ERROR_TIMEOUT;
+    return HAL_BUSY;
+  }
   
   receive_address = DevAddress;
+  mock_i2c_transfers++;
+  hi2c->ErrorCode = (mock_i2c_status == HAL_OK) ? HAL_I2C_ERROR_NONE : mock_i2c_error;
+
+  if (mock_sensor_receive(DevAddress >> 1, rsp, Size)) return mock_i2c_status;
 
   TEST_ASSERT_NOT_NULL_MESSAGE(rx_queue_start, "I2C Mock Failed: rx_queue's start wasn't initialized");
   TEST_ASSERT_NOT_NULL_MESSAGE(rx_queue_end, "I2C Mock Failed: rx_queue's end wasn't initialized");
@@ -57,6 +158,217 @@ HAL_StatusTypeDef HAL_I2C_Master_Receive(I2C_HandleTypeDef *hi2c, uint16_t DevAd
     rx_queue_start++;
   }
 
+  return mock_i2c_status;
+
+}
+
+// Mocks a combined register read by writing the register to tx_queue then reading from rx_queue
+// Counts as a single transfer, like the repeated start on a real bus
+HAL_StatusTypeDef HAL_I2C_Mem_Read(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint16_t MemAddress, uint16_t MemAddSize, uint8_t *rsp, uint16_t Size, uint32_t Timeout) {
+
+  uint8_t reg = MemAddress;
+
+  if (mock_i2c_stuck) {
+    hi2c->ErrorCode = HAL_I2C_ERROR_TIMEOUT;
+    return HAL_BUSY;
+  }
+  
+  HAL_I2C_Master_Transmit(hi2c, DevAddress, &reg, sizeof(reg), Timeout);
+  HAL_I2C_Master_Receive(hi2c, DevAddress, rsp, Size, Timeout);
+  mock_i2c_transfers--;
+
+  return mock_i2c_status;
+}
+
+// Mocks a register write by writing the register then each value to tx_queue, in one transfer
+HAL_StatusTypeDef HAL_I2C_Mem_Write(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint16_t MemAddress, uint16_t MemAddSize, uint8_t *pData, uint16_t Size, uint32_t Timeout) {
+
+  uint8_t msg[8];
+
+  TEST_ASSERT_TRUE_MESSAGE(Size < sizeof(msg), "I2C Mock Failed: register write too long");
+
+  msg[0] = MemAddress;
+  for (int i = 0; i < Size; i++) {
+    msg[i + 1] = pData[i];
+  }
+
+  return HAL_I2C_Master_Transmit(hi2c, DevAddress, msg, Size + 1, Timeout);
+}
+
+// Mocks probing for a device, only addresses marked in mock_i2c_present ACK
+HAL_StatusTypeDef HAL_I2C_IsDeviceReady(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint32_t Trials, uint32_t Timeout) {
+
+  if (mock_i2c_stuck) {
+    hi2c->ErrorCode = HAL_I2C_ERROR_TIMEOUT;
+    return HAL_BUSY;
+  }
+
+  transmit_address = DevAddress;
+  mock_i2c_transfers++;
+
+  if (!mock_i2c_present[(DevAddress >> 1) % MOCK_ADDRESSES] && !mock_sensor_attached(DevAddress >> 1)) {
+    hi2c->ErrorCode = HAL_I2C_ERROR_AF;
+    return HAL_ERROR;
+  }
+
+  hi2c->ErrorCode = HAL_I2C_ERROR_NONE;
   return HAL_OK;
+}
+
+// Mocks controller initialization, just counts it
+HAL_StatusTypeDef HAL_I2C_Init(I2C_HandleTypeDef *hi2c) {
+  mock_i2c_inits++;
+  return HAL_OK;
+}
+
+// Mocks controller de-initialization, dropping any pending transfer
+HAL_StatusTypeDef HAL_I2C_DeInit(I2C_HandleTypeDef *hi2c) {
+
+  for (int i = 0; i < MOCK_CONTROLLERS; i++) {
+    if (pending[i].hi2c == hi2c) pending[i].type = MOCK_IDLE;
+  }
+
+  return HAL_OK;
+}
+
+// Mocks interrupt mode transmit, the transfer happens on mock_i2c_complete()
+HAL_StatusTypeDef HAL_I2C_Master_Transmit_IT(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint8_t *pData, uint16_t Size) {
+  return hold_transfer((Mock_Transfer) {
+    .type    = MOCK_TRANSMIT,
+    .hi2c    = hi2c,
+    .address = DevAddress,
+    .data    = pData,
+    .size    = Size,
+  });
+}
+
+// Mocks interrupt mode receive, the transfer happens on mock_i2c_complete()
+HAL_StatusTypeDef HAL_I2C_Master_Receive_IT(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint8_t *pData, uint16_t Size) {
+  return hold_transfer((Mock_Transfer) {
+    .type    = MOCK_RECEIVE,
+    .hi2c    = hi2c,
+    .address = DevAddress,
+    .data    = pData,
+    .size    = Size,
+  });
+}
+
+// Mocks interrupt mode combined register read, the transfer happens on mock_i2c_complete()
+HAL_StatusTypeDef HAL_I2C_Mem_Read_IT(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint16_t MemAddress, uint16_t MemAddSize, uint8_t *pData, uint16_t Size) {
+  return hold_transfer((Mock_Transfer) {
+    .type        = MOCK_MEM_READ,
+    .hi2c        = hi2c,
+    .address     = DevAddress,
+    .mem_address = MemAddress,
+    .data        = pData,
+    .size        = Size,
+  });
+}
+
+// Mocks interrupt mode register write, the transfer happens on mock_i2c_complete()
+HAL_StatusTypeDef HAL_I2C_Mem_Write_IT(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint16_t MemAddress, uint16_t MemAddSize, uint8_t *pData, uint16_t Size) {
+  return hold_transfer((Mock_Transfer) {
+    .type        = MOCK_MEM_WRITE,
+    .hi2c        = hi2c,
+    .address     = DevAddress,
+    .mem_address = MemAddress,
+    .data        = pData,
+    .size        = Size,
+  });
+}
+
+// Emulates the completion interrupt of a pending transfer
+// Controllers take turns, as if their buses were running side by side
+// Returns false if nothing was pending
+bool mock_i2c_complete(void) {
+
+  // A stuck bus never finishes the transfer
+  if (mock_i2c_stuck) return false;
+
+  Mock_Transfer *slot = NULL;
+
+  for (int i = 0; i < MOCK_CONTROLLERS && slot == NULL; i++) {
+    int const index = (next_completion + i) % MOCK_CONTROLLERS;
+    if (pending[index].type != MOCK_IDLE) {
+      slot = &pending[index];
+      next_completion = index + 1;
+    }
+  }
+
+  if (slot == NULL) return false;
+
+  // Clear pending first, the callback is likely to start another transfer
+  Mock_Transfer const transfer = *slot;
+  slot->type = MOCK_IDLE;
+
+  HAL_StatusTypeDef status;
+
+  if (transfer.type == MOCK_TRANSMIT) {
+    status = HAL_I2C_Master_Transmit(transfer.hi2c, transfer.address, transfer.data, transfer.size, 0);
+  }
+  else if (transfer.type == MOCK_RECEIVE) {
+    status = HAL_I2C_Master_Receive(transfer.hi2c, transfer.address, transfer.data, transfer.size, 0);
+  }
+  else if (transfer.type == MOCK_MEM_WRITE) {
+    status = HAL_I2C_Mem_Write(transfer.hi2c, transfer.address, transfer.mem_address, 1, transfer.data, transfer.size, 0);
+  }
+  else {
+    status = HAL_I2C_Mem_Read(transfer.hi2c, transfer.address, transfer.mem_address, 1, transfer.data, transfer.size, 0);
+  }
+
+  // Failed transfers complete through the error interrupt
+  if (status != HAL_OK) {
+    HAL_I2C_ErrorCallback(transfer.hi2c);
+  }
+  else if (transfer.type == MOCK_TRANSMIT) {
+    HAL_I2C_MasterTxCpltCallback(transfer.hi2c);
+  }
+  else if (transfer.type == MOCK_RECEIVE) {
+    HAL_I2C_MasterRxCpltCallback(transfer.hi2c);
+  }
+  else if (transfer.type == MOCK_MEM_WRITE) {
+    HAL_I2C_MemTxCpltCallback(transfer.hi2c);
+  }
+  else {
+    HAL_I2C_MemRxCpltCallback(transfer.hi2c);
+  }
+
+  return true;
+}
+
+// Completes transfers until the bus goes quiet
+// Returns the number of transfers completed
+uint32_t mock_i2c_run(void) {
+
+  uint32_t completed = 0;
+
+  while (mock_i2c_complete()) {
+    completed++;
+  }
+
+  return completed;
+}
+
+// Emulated bus recovery pins and clock, replacing the ones in i2c.c
+
+void i2c_pins_gpio(I2C_Bus bus) {
+  scl_state = GPIO_PIN_SET;
+}
+
+// The stuck device lets go of SDA a clock at a time
+void i2c_scl_write(I2C_Bus bus, GPIO_PinState state) {
+
+  if (state == GPIO_PIN_SET && scl_state == GPIO_PIN_RESET) {
+    mock_i2c_clocks++;
+    if (mock_i2c_stuck > 0) mock_i2c_stuck--;
+  }
+
+  scl_state = state;
+}
+
+void i2c_sda_write(I2C_Bus bus, GPIO_PinState state) {}
+
+GPIO_PinState i2c_sda_read(I2C_Bus bus) {
+  return mock_i2c_stuck ? GPIO_PIN_RESET : GPIO_PIN_SET;
+}
 
-} 
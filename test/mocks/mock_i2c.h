@@ -17,12 +17,76 @@ extern uint8_t * rx_queue_end;
 extern uint16_t transmit_address;
 extern uint16_t receive_address;
 
-// Mocks the functionality of i2c transmit by writing each value to tx_queue
+// Returned by every mocked transfer, set it to inject bus errors
+
+extern HAL_StatusTypeDef mock_i2c_status;
+
+// Error code the failed transfers leave in the handle
+
+extern uint32_t mock_i2c_error;
+
+// Counts controller (re)initializations
+
+extern uint32_t mock_i2c_inits;
+
+// Counts every transfer on the mocked bus
+
+extern uint32_t mock_i2c_transfers;
+
+// Set to emulate a device holding SDA low, it lets go after this many SCL clocks
+// While stuck, interrupt transfers never complete and blocking ones return HAL_BUSY
+
+extern uint32_t mock_i2c_stuck;
+
+// Counts SCL clocks given by hand, see i2c_scl_write()
+
+extern uint32_t mock_i2c_clocks;
+
+// Set an address to have a device ACK it, see HAL_I2C_IsDeviceReady()
+
+#define MOCK_ADDRESSES 128
+
+extern bool mock_i2c_present[MOCK_ADDRESSES];
+
+// Mocks the functionality of i2c transmit by writing each value to tx_queue, or to an emulated sensor
 // Always sets transmit_address to DevAddress before writing
-HAL_StatusTypeDef HAL_I3C_Master_Transmit(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint8_t *pData, uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_I2C_Master_Transmit(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint8_t *pData, uint16_t Size, uint32_t Timeout);
 
-// Mocks the functionality of i2c read by reading each value from rx_queue
+// Mocks the functionality of i2c read by reading each value from rx_queue, or from an emulated sensor
 // Always sets receive_address to DevAddress before reading
 HAL_StatusTypeDef HAL_I2C_Master_Receive(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint8_t *rsp, uint16_t Size, uint32_t Timeout);
 
+// Mocks a combined register read by writing the register to tx_queue then reading from rx_queue
+// Counts as a single transfer, like the repeated start on a real bus
+HAL_StatusTypeDef HAL_I2C_Mem_Read(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint16_t MemAddress, uint16_t MemAddSize, uint8_t *rsp, uint16_t Size, uint32_t Timeout);
+
+// Mocks a register write by writing the register then each value to tx_queue, in one transfer
+HAL_StatusTypeDef HAL_I2C_Mem_Write(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint16_t MemAddress, uint16_t MemAddSize, uint8_t *pData, uint16_t Size, uint32_t Timeout);
+
+// Mocks probing for a device, only addresses marked in mock_i2c_present or with an emulated sensor ACK
+HAL_StatusTypeDef HAL_I2C_IsDeviceReady(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint32_t Trials, uint32_t Timeout);
+
+// Mocks controller initialization, just counts it
+HAL_StatusTypeDef HAL_I2C_Init(I2C_HandleTypeDef *hi2c);
+
+// Mocks controller de-initialization, dropping any pending transfer
+HAL_StatusTypeDef HAL_I2C_DeInit(I2C_HandleTypeDef *hi2c);
+
+// Interrupt mode transfers are held until completed by the test, 
+// which then calls the HAL's completion callbacks like the interrupt would
+
+HAL_StatusTypeDef HAL_I2C_Master_Transmit_IT(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_I2C_Master_Receive_IT(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_I2C_Mem_Write_IT(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint16_t MemAddress, uint16_t MemAddSize, uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_I2C_Mem_Read_IT(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint16_t MemAddress, uint16_t MemAddSize, uint8_t *pData, uint16_t Size);
+
+// Emulates the completion interrupt of a pending transfer
+// Controllers take turns, as if their buses were running side by side
+// Returns false if nothing was pending
+bool mock_i2c_complete(void);
+
+// Completes transfers until the bus goes quiet
+// Returns the number of transfers completed
+uint32_t mock_i2c_run(void);
+
 #endif
@@ -0,0 +1,254 @@
+#include "unity.h"
+#include "i2c_ll.h"
+#include "mock_i2c.h"
+#include "mock_sensor.h"
+#include "mock_i2c_ll.h"
+
+#define MOCK_I2C_LL_BYTES 8   // Per transfer, each way
+
+#define SR2_MSL (1U << 0)     // Master mode
+
+#define MOCK_I2C_LL_MAX_IRQS 100  // Per run, more is a transfer that never ends
+
+#define SR1_EVENTS (I2C_SR1_SB | I2C_SR1_ADDR | I2C_SR1_BTF)
+#define SR1_BUFFER (I2C_SR1_TXE | I2C_SR1_RXNE)
+#define SR1_ERRORS (I2C_SR1_AF | I2C_SR1_ARLO | I2C_SR1_BERR | I2C_SR1_OVR)
+
+bool mock_i2c_ll_hang = false;
+uint32_t mock_i2c_ll_accesses = 0;
+uint32_t mock_i2c_ll_stops = 0;
+
+typedef enum {
+  PHASE_IDLE,
+  PHASE_START,      // SB set, waiting for the address
+  PHASE_ADDRESS,    // ADDR set, waiting for it to be cleared
+  PHASE_WRITE,
+  PHASE_READ,
+} Phase;
+
+static Phase phase = PHASE_IDLE;
+static bool sr1_read = false;       // Half of clearing SB or ADDR
+
+static uint8_t addr;
+static bool reading;
+static bool stopping;
+
+static uint8_t tx[MOCK_I2C_LL_BYTES];
+static uint8_t tx_len;
+
+static uint8_t rx[MOCK_I2C_LL_BYTES];
+static uint8_t rx_next;             // Next byte the device sends
+static uint8_t shift;               // Received byte waiting behind DR
+static bool shift_full;
+
+void mock_i2c_ll_reset(I2C_TypeDef *i2c) {
+
+  i2c->CR1 = 0;
+  i2c->CR2 = 0;
+  i2c->SR1 = 0;
+  i2c->SR2 = 0;
+  i2c->DR  = 0;
+
+  phase = PHASE_IDLE;
+  sr1_read = false;
+  stopping = false;
+  tx_len = 0;
+  shift_full = false;
+}
+
+// Hands the bytes written so far to the device, as one transaction
+static void flush_tx(void) {
+
+  if (phase == PHASE_WRITE && tx_len > 0) {
+    mock_sensor_transmit(addr, tx, tx_len);
+  }
+
+  tx_len = 0;
+}
+
+// Moves the next byte from the device into the shift register, then DR when it's free
+static void receive_byte(I2C_TypeDef *i2c) {
+
+  if (stopping || rx_next >= MOCK_I2C_LL_BYTES) return;
+
+  if (!(i2c->SR1 & I2C_SR1_RXNE)) {
+    i2c->DR = rx[rx_next++];
+    i2c->SR1 |= I2C_SR1_RXNE;
+  }
+  else if (!shift_full) {
+    shift = rx[rx_next++];
+    shift_full = true;
+    i2c->SR1 |= I2C_SR1_BTF;
+  }
+}
+
+static void start(I2C_TypeDef *i2c) {
+
+  flush_tx();
+
+  i2c->SR2 |= SR2_MSL | I2C_SR2_BUSY;
+  i2c->SR1 &= ~(I2C_SR1_TXE | I2C_SR1_BTF | I2C_SR1_RXNE);
+  phase = PHASE_START;
+  sr1_read = false;
+  stopping = false;
+  shift_full = false;
+
+  if (!mock_i2c_ll_hang) i2c->SR1 |= I2C_SR1_SB;
+}
+
+static void stop(I2C_TypeDef *i2c) {
+
+  flush_tx();
+
+  i2c->SR2 &= ~(SR2_MSL | I2C_SR2_BUSY);
+  i2c->SR1 &= ~(I2C_SR1_TXE | I2C_SR1_BTF);
+  phase = PHASE_IDLE;
+  stopping = true;
+  mock_i2c_ll_stops++;
+}
+
+// The address byte goes out, an emulated sensor ACKs it
+static void address(I2C_TypeDef *i2c, uint8_t val) {
+
+  TEST_ASSERT_TRUE_MESSAGE(sr1_read, "I2C LL Mock Failed: wrote the address without reading SR1 after SB");
+
+  i2c->SR1 &= ~I2C_SR1_SB;
+  addr = val >> 1;
+  reading = val & 1;
+
+  if (mock_i2c_ll_hang) return;
+
+  if (!mock_sensor_attached(addr)) {
+    i2c->SR1 |= I2C_SR1_AF;
+    phase = PHASE_IDLE;
+    return;
+  }
+
+  if (reading) {
+    mock_sensor_receive(addr, rx, MOCK_I2C_LL_BYTES);
+    rx_next = 0;
+    shift_full = false;
+  }
+
+  i2c->SR1 |= I2C_SR1_ADDR;
+  phase = PHASE_ADDRESS;
+  sr1_read = false;
+}
+
+// Reading SR2 right after SR1 clears ADDR, the data phase starts
+static void clear_addr(I2C_TypeDef *i2c) {
+
+  i2c->SR1 &= ~I2C_SR1_ADDR;
+
+  if (reading) {
+    phase = PHASE_READ;
+    receive_byte(i2c);
+    receive_byte(i2c);
+  }
+  else {
+    phase = PHASE_WRITE;
+    tx_len = 0;
+    i2c->SR1 |= I2C_SR1_TXE;
+  }
+}
+
+uint32_t i2c_ll_read(I2C_TypeDef *i2c, __IO uint32_t *reg) {
+
+  mock_i2c_ll_accesses++;
+
+  if (reg == &i2c->SR1) {
+    sr1_read = true;
+    return i2c->SR1;
+  }
+
+  if (reg == &i2c->SR2) {
+
+    // The emulated bus stuck low, see mock_i2c_stuck
+    if (mock_i2c_stuck) return i2c->SR2 | I2C_SR2_BUSY;
+
+    if (sr1_read && (i2c->SR1 & I2C_SR1_ADDR)) clear_addr(i2c);
+    sr1_read = false;
+    return i2c->SR2;
+  }
+
+  if (reg == &i2c->DR) {
+
+    TEST_ASSERT_TRUE_MESSAGE(i2c->SR1 & I2C_SR1_RXNE, "I2C LL Mock Failed: read DR with nothing received");
+
+    uint32_t const val = i2c->DR;
+    i2c->SR1 &= ~(I2C_SR1_RXNE | I2C_SR1_BTF);
+
+    if (shift_full) {
+      i2c->DR = shift;
+      i2c->SR1 |= I2C_SR1_RXNE;
+      shift_full = false;
+    }
+
+    if (phase == PHASE_READ) receive_byte(i2c);
+    return val;
+  }
+
+  return *reg;
+}
+
+void i2c_ll_write(I2C_TypeDef *i2c, __IO uint32_t *reg, uint32_t val) {
+
+  mock_i2c_ll_accesses++;
+
+  if (reg == &i2c->CR1) {
+
+    i2c->CR1 = val & ~(I2C_CR1_START | I2C_CR1_STOP);
+
+    if (val & I2C_CR1_START) start(i2c);
+    if (val & I2C_CR1_STOP)  stop(i2c);
+    return;
+  }
+
+  // Flags clear by writing 0
+  if (reg == &i2c->SR1) {
+    i2c->SR1 &= val;
+    return;
+  }
+
+  if (reg == &i2c->DR) {
+
+    if (phase == PHASE_START) {
+      address(i2c, val);
+      return;
+    }
+
+    TEST_ASSERT_TRUE_MESSAGE(phase == PHASE_WRITE, "I2C LL Mock Failed: wrote DR outside a write");
+    TEST_ASSERT_TRUE_MESSAGE(i2c->SR1 & I2C_SR1_TXE, "I2C LL Mock Failed: wrote DR before TXE");
+    TEST_ASSERT_TRUE_MESSAGE(tx_len < MOCK_I2C_LL_BYTES, "I2C LL Mock Failed: wrote too many bytes");
+
+    // The byte shifts out at once, ACKed
+    tx[tx_len++] = val;
+    i2c->SR1 |= I2C_SR1_TXE | I2C_SR1_BTF;
+    return;
+  }
+
+  *reg = val;
+}
+
+uint32_t mock_i2c_ll_run(I2C_HandleTypeDef *hi2c) {
+
+  I2C_TypeDef * const i2c = hi2c->Instance;
+
+  for (uint32_t irqs = 0; irqs < MOCK_I2C_LL_MAX_IRQS; irqs++) {
+
+    uint32_t const cr2 = i2c->CR2;
+
+    if ((cr2 & I2C_CR2_ITERREN) && (i2c->SR1 & SR1_ERRORS)) {
+      i2c_ll_er_irq(hi2c);
+    }
+    else if ((cr2 & I2C_CR2_ITEVTEN) && ((i2c->SR1 & SR1_EVENTS) || ((cr2 & I2C_CR2_ITBUFEN) && (i2c->SR1 & SR1_BUFFER)))) {
+      i2c_ll_ev_irq(hi2c);
+    }
+    else {
+      return irqs;
+    }
+  }
+
+  TEST_FAIL_MESSAGE("I2C LL Mock Failed: interrupts never stopped");
+  return MOCK_I2C_LL_MAX_IRQS;
+}
@@ -0,0 +1,37 @@
+#ifndef MOCK_I2C_LL_H
+#define MOCK_I2C_LL_H
+
+#include "common_mock.h"
+#include "stm32f4xx_hal.h"
+
+// Emulated I2C controller registers, replacing the register access in i2c_ll.h
+//
+// Models the master side of the controller's CR1, SR1, SR2 and DR the way
+// the reference manual describes them, with the emulated sensors in
+// mock_sensor.h on the other end of the bus. Bytes written go to the sensor
+// at the STOP or repeated START, a read fetches the register's bytes when
+// the address is ACKed. Only one transfer can be in flight, on any controller.
+//
+// Getting the sequence wrong, like reading DR with nothing received, fails the test.
+// Nothing raises the interrupts on its own, see mock_i2c_ll_run().
+
+// Set to have the controller never raise another status flag, so transfers time out
+extern bool mock_i2c_ll_hang;
+
+// Counts controller register reads and writes, the host stand in for a transfer's cost
+extern uint32_t mock_i2c_ll_accesses;
+
+// Counts STOPs sent
+extern uint32_t mock_i2c_ll_stops;
+
+// Takes the controller's interrupts until none is pending, the error interrupt first
+// Returns how many were taken
+uint32_t mock_i2c_ll_run(I2C_HandleTypeDef *hi2c);
+
+// Puts i2c back to its reset state, with nothing in flight
+void mock_i2c_ll_reset(I2C_TypeDef *i2c);
+
+uint32_t i2c_ll_read(I2C_TypeDef *i2c, __IO uint32_t *reg);
+void i2c_ll_write(I2C_TypeDef *i2c, __IO uint32_t *reg, uint32_t val);
+
+#endif
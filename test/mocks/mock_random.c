@@ -0,0 +1,12 @@
+#include "mock_random.h"
+
+static uint32_t state = 1;
+
+void seed_random(uint32_t seed) {
+  state = seed;
+}
+
+uint32_t next_random(void) {
+  state = state * 1664525 + 1013904223;
+  return state;
+}
@@ -0,0 +1,13 @@
+#ifndef MOCK_RANDOM_H
+#define MOCK_RANDOM_H
+
+#include "common_mock.h"
+
+// Small LCG, so every run of a test sees the same numbers
+
+// Starts the sequence over from seed
+void seed_random(uint32_t seed);
+
+uint32_t next_random(void);
+
+#endif
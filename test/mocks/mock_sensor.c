@@ -0,0 +1,234 @@
+#include "unity.h"
+#include "sensor.h"
+#include "mock_sensor.h"
+
+#define MOCK_SENSOR_ADDRESSES 128
+#define MOCK_SENSOR_REGS      256
+
+typedef struct {
+  int       model;    // 0 for none
+  uint8_t   ptr;      // Register pointer
+  uint32_t  regs[MOCK_SENSOR_REGS];
+  uint32_t  writes;
+} Mock_Sensor;
+
+static Mock_Sensor sensors[MOCK_SENSOR_ADDRESSES];
+
+// Returns how many bytes reg is on model
+static uint8_t reg_size(int model, uint8_t reg) {
+
+  if (model != SENSOR_INA228) return 2;
+
+  switch (reg) {
+    case INA228_REG_SHUNT_VOLT:
+    case INA228_REG_BUS_VOLT:
+    case INA228_REG_CURRENT:
+    case INA228_REG_POWER:
+      return 3;
+    default:
+      return 2;
+  }
+}
+
+// Loads model's power on register values
+static void power_on(Mock_Sensor * const sensor) {
+
+  for (int i = 0; i < MOCK_SENSOR_REGS; i++) {
+    sensor->regs[i] = 0;
+  }
+
+  sensor->ptr = 0;
+
+  switch (sensor->model) {
+
+    case SENSOR_INA226:
+      sensor->regs[INA226_REG_CONF]   = 0x4127;
+      sensor->regs[INA226_REG_MFG_ID] = INA226_MFG_ID;
+      sensor->regs[INA226_REG_DIE_ID] = INA226_DIE_ID;
+      break;
+
+    case SENSOR_INA3221:
+      sensor->regs[INA3221_REG_CONF]   = 0x7127;
+      sensor->regs[INA3221_REG_MFG_ID] = INA3221_MFG_ID;
+      sensor->regs[INA3221_REG_DIE_ID] = INA3221_DIE_ID;
+      for (int sub = 0; sub < INA3221_CHANNELS; sub++) {
+        sensor->regs[INA3221_REG_CRITICAL(sub)] = 0x7FF8;
+      }
+      break;
+
+    case SENSOR_INA228:
+      sensor->regs[INA228_REG_ADC_CONFIG] = 0xFB68;
+      sensor->regs[INA228_REG_SHUNT_CAL]  = 0x1000;
+      sensor->regs[INA228_REG_DIAG_ALRT]  = 0x0001;
+      sensor->regs[INA228_REG_SOVL]       = 0x7FFF;
+      sensor->regs[INA228_REG_SUVL]       = 0x8000;
+      sensor->regs[INA228_REG_BOVL]       = 0x7FFF;
+      sensor->regs[INA228_REG_MFG_ID]     = INA228_MFG_ID;
+      sensor->regs[INA228_REG_DIE_ID]     = INA228_DIE_ID | 0x1;
+      break;
+  }
+}
+
+void mock_sensor_attach(uint8_t addr, int model) {
+  sensors[addr % MOCK_SENSOR_ADDRESSES].model  = model;
+  sensors[addr % MOCK_SENSOR_ADDRESSES].writes = 0;
+  power_on(&sensors[addr % MOCK_SENSOR_ADDRESSES]);
+}
+
+void mock_sensor_reset(void) {
+  for (int i = 0; i < MOCK_SENSOR_ADDRESSES; i++) {
+    sensors[i].model = 0;
+  }
+}
+
+bool mock_sensor_attached(uint8_t addr) {
+  return sensors[addr % MOCK_SENSOR_ADDRESSES].model != 0;
+}
+
+uint32_t mock_sensor_reg(uint8_t addr, uint8_t reg) {
+  return sensors[addr % MOCK_SENSOR_ADDRESSES].regs[reg];
+}
+
+uint32_t mock_sensor_writes(uint8_t addr) {
+  return sensors[addr % MOCK_SENSOR_ADDRESSES].writes;
+}
+
+static int32_t magnitude(int32_t x) {
+  return x < 0 ? -x : x;
+}
+
+static void convert_ina226(Mock_Sensor * const sensor, int32_t shunt, int32_t bus) {
+
+  uint32_t * const regs = sensor->regs;
+  int32_t const current = shunt * (int32_t) regs[INA226_REG_CAL] / 2048;
+  int16_t const limit   = regs[INA226_REG_ALERT_LIMIT];
+  uint16_t const mask   = regs[INA226_REG_MASK];
+
+  regs[INA226_REG_SHUNT_VOLT] = (uint16_t) shunt;
+  regs[INA226_REG_BUS_VOLT]   = (uint16_t) bus;
+  regs[INA226_REG_CURRENT]    = (uint16_t) current;
+  regs[INA226_REG_POWER]      = (uint16_t) (magnitude(current) * bus / 20000);
+
+  bool const breached = ((mask & INA226_MASK_SOL) && shunt > limit)
+                     || ((mask & INA226_MASK_SUL) && shunt < limit)
+                     || ((mask & INA226_MASK_BOL) && bus > (uint16_t) limit)
+                     || ((mask & INA226_MASK_BUL) && bus < (uint16_t) limit);
+
+  regs[INA226_REG_MASK] |= INA226_MASK_CVRF | (breached ? INA226_MASK_AFF : 0);
+}
+
+static void convert_ina3221(Mock_Sensor * const sensor, uint8_t sub, int32_t shunt, int32_t bus) {
+
+  uint32_t * const regs = sensor->regs;
+
+  regs[INA3221_REG_SHUNT_VOLT(sub)] = (uint16_t) (shunt << INA3221_VALUE_SHIFT);
+  regs[INA3221_REG_BUS_VOLT(sub)]   = (uint16_t) (bus << INA3221_VALUE_SHIFT);
+
+  if (shunt > (int16_t) regs[INA3221_REG_CRITICAL(sub)] >> INA3221_VALUE_SHIFT) {
+    regs[INA3221_REG_MASK] |= INA3221_MASK_CF(sub);
+  }
+  else {
+    regs[INA3221_REG_MASK] &= ~INA3221_MASK_CF(sub);
+  }
+
+  regs[INA3221_REG_MASK] |= INA3221_MASK_CVRF;
+}
+
+static void convert_ina228(Mock_Sensor * const sensor, int32_t shunt, int32_t bus) {
+
+  uint32_t * const regs = sensor->regs;
+  uint16_t const cal = regs[INA228_REG_SHUNT_CAL];
+  int32_t const current = cal == 0 ? 0 : (int64_t) shunt * (1 << INA228_CAL_SHIFT) / cal;
+
+  regs[INA228_REG_SHUNT_VOLT] = (uint32_t) (shunt << INA228_VALUE_SHIFT) & 0xFFFFFF;
+  regs[INA228_REG_BUS_VOLT]   = (uint32_t) (bus << INA228_VALUE_SHIFT) & 0xFFFFFF;
+  regs[INA228_REG_CURRENT]    = (uint32_t) (current << INA228_VALUE_SHIFT) & 0xFFFFFF;
+  regs[INA228_REG_POWER]      = ((uint64_t) magnitude(current) * bus / 16384) & 0xFFFFFF;
+
+  // Limits are compared against the top 16 bits of each reading
+  uint16_t flags = 0;
+  if (shunt >> INA228_LIMIT_SHIFT > (int16_t) regs[INA228_REG_SOVL]) flags |= 1 << 6;
+  if (shunt >> INA228_LIMIT_SHIFT < (int16_t) regs[INA228_REG_SUVL]) flags |= 1 << 5;
+  if (bus >> INA228_LIMIT_SHIFT > (int32_t) regs[INA228_REG_BOVL])   flags |= 1 << 4;
+  if (bus >> INA228_LIMIT_SHIFT < (int32_t) regs[INA228_REG_BUVL])   flags |= 1 << 3;
+
+  regs[INA228_REG_DIAG_ALRT] |= INA228_DIAG_CNVRF | flags;
+}
+
+void mock_sensor_convert(uint8_t addr, uint8_t sub, int32_t shunt, int32_t bus) {
+
+  Mock_Sensor * const sensor = &sensors[addr % MOCK_SENSOR_ADDRESSES];
+
+  TEST_ASSERT_TRUE_MESSAGE(sensor->model != 0, "Sensor Mock Failed: nothing attached to convert");
+
+  switch (sensor->model) {
+    case SENSOR_INA226:  convert_ina226(sensor, shunt, bus);        break;
+    case SENSOR_INA3221: convert_ina3221(sensor, sub, shunt, bus);  break;
+    case SENSOR_INA228:  convert_ina228(sensor, shunt, bus);        break;
+  }
+}
+
+// A register write, or a bare register pointer write
+bool mock_sensor_transmit(uint8_t addr, uint8_t const *data, uint16_t size) {
+
+  Mock_Sensor * const sensor = &sensors[addr % MOCK_SENSOR_ADDRESSES];
+
+  if (sensor->model == 0) return false;
+  if (size == 0) return true;
+
+  sensor->ptr = data[0];
+
+  if (size < 3) return true;
+
+  uint16_t const val = (data[1] << 8) | data[2];
+  sensor->writes++;
+
+  // Bit 15 of the first register resets every part
+  if (sensor->ptr == 0x00 && (val & (1 << 15))) {
+    power_on(sensor);
+    return true;
+  }
+
+  sensor->regs[sensor->ptr] = val;
+
+  // Writing the conversion settings restarts the conversion
+  if (sensor->model == SENSOR_INA226 && sensor->ptr == INA226_REG_CONF) {
+    sensor->regs[INA226_REG_MASK] &= ~INA226_MASK_CVRF;
+  }
+  else if (sensor->model == SENSOR_INA3221 && sensor->ptr == INA3221_REG_CONF) {
+    sensor->regs[INA3221_REG_MASK] &= ~INA3221_MASK_CVRF;
+  }
+  else if (sensor->model == SENSOR_INA228 && sensor->ptr == INA228_REG_ADC_CONFIG) {
+    sensor->regs[INA228_REG_DIAG_ALRT] &= ~INA228_DIAG_CNVRF;
+  }
+
+  return true;
+}
+
+// Reads the register at the pointer, reading the flags clears them
+bool mock_sensor_receive(uint8_t addr, uint8_t *data, uint16_t size) {
+
+  Mock_Sensor * const sensor = &sensors[addr % MOCK_SENSOR_ADDRESSES];
+
+  if (sensor->model == 0) return false;
+
+  uint8_t const width = reg_size(sensor->model, sensor->ptr);
+  uint32_t const val = sensor->regs[sensor->ptr];
+
+  // Bytes past the register's width read as zero
+  for (int i = 0; i < size; i++) {
+    data[i] = i < width ? val >> (8 * (width - 1 - i)) : 0;
+  }
+
+  if (sensor->model == SENSOR_INA226 && sensor->ptr == INA226_REG_MASK) {
+    sensor->regs[INA226_REG_MASK] &= ~(INA226_MASK_CVRF | INA226_MASK_AFF);
+  }
+  else if (sensor->model == SENSOR_INA3221 && sensor->ptr == INA3221_REG_MASK) {
+    sensor->regs[INA3221_REG_MASK] &= ~INA3221_MASK_CVRF;
+  }
+  else if (sensor->model == SENSOR_INA228 && sensor->ptr == INA228_REG_DIAG_ALRT) {
+    sensor->regs[INA228_REG_DIAG_ALRT] &= ~(INA228_DIAG_CNVRF | INA228_DIAG_LIMITS);
+  }
+
+  return true;
+}
@@ -0,0 +1,39 @@
+#ifndef MOCK_SENSOR_H
+#define MOCK_SENSOR_H
+
+#include "common_mock.h"
+
+// Emulated INA226, INA3221 and INA228 register files
+//
+// An attached address answers the mocked bus from its registers rather than
+// the tx / rx queues: writes set the register pointer and values, reads return
+// the register's width in bytes, big endian. Conversions only happen when the
+// test calls mock_sensor_convert(), which works out every register the real
+// part would from the shunt and bus voltages.
+
+// Emulates model, one of SENSOR_INA226, SENSOR_INA3221 or SENSOR_INA228, at the 7 bit addr
+// The registers start at the part's power on values
+void mock_sensor_attach(uint8_t addr, int model);
+
+// Detaches every emulated sensor, the bus goes back to the tx / rx queues
+void mock_sensor_reset(void);
+
+// Returns true if an emulated sensor is attached at addr
+bool mock_sensor_attached(uint8_t addr);
+
+// Emulates a finished conversion on sub channel of the sensor at addr, in its own counts
+// Fills in the shunt and bus voltage, current and power registers and sets the ready and alert flags
+void mock_sensor_convert(uint8_t addr, uint8_t sub, int32_t shunt, int32_t bus);
+
+// Returns the value of reg on the sensor at addr
+uint32_t mock_sensor_reg(uint8_t addr, uint8_t reg);
+
+// Counts register writes to the sensor at addr
+uint32_t mock_sensor_writes(uint8_t addr);
+
+// Called by the mocked bus, return false when nothing is attached at addr
+
+bool mock_sensor_transmit(uint8_t addr, uint8_t const *data, uint16_t size);
+bool mock_sensor_receive(uint8_t addr, uint8_t *data, uint16_t size);
+
+#endif
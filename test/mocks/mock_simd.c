@@ -0,0 +1,27 @@
+#include "mock_simd.h"
+
+uint32_t mock_simd_ge = 0;
+
+// Subtracts each half, GE set for the halves whose difference is >= 0
+uint32_t __SSUB16(uint32_t a, uint32_t b) {
+
+  int32_t const lo = (int16_t) a - (int16_t) b;
+  int32_t const hi = (int16_t) (a >> 16) - (int16_t) (b >> 16);
+
+  mock_simd_ge = (lo >= 0 ? 0x3 : 0) | (hi >= 0 ? 0xC : 0);
+
+  return ((uint32_t) hi << 16) | ((uint32_t) lo & 0xFFFF);
+}
+
+// Each byte from a where its GE flag is set, else from b
+uint32_t __SEL(uint32_t a, uint32_t b) {
+
+  uint32_t result = 0;
+
+  for (int i = 0; i < 4; i++) {
+    uint32_t const byte = 0xFFU << (8 * i);
+    result |= (mock_simd_ge & (1 << i)) ? (a & byte) : (b & byte);
+  }
+
+  return result;
+}
@@ -0,0 +1,17 @@
+#ifndef MOCK_SIMD_H
+#define MOCK_SIMD_H
+
+#include "common_mock.h"
+
+// Emulated Cortex-M4 packed 16 bit instructions, replacing the CMSIS intrinsics in evaluate.h
+//
+// Keeps the APSR GE flags between instructions the way the core does, one per
+// byte, so SEL picks its bytes from whatever the last SSUB16 left behind.
+
+// The GE flags, bit n for byte n
+extern uint32_t mock_simd_ge;
+
+uint32_t __SSUB16(uint32_t a, uint32_t b);
+uint32_t __SEL(uint32_t a, uint32_t b);
+
+#endif
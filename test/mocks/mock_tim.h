@@ -0,0 +1,8 @@
+#ifndef MOCK_TIM_H
+#define MOCK_TIM_H
+
+#include "common_mock.h"
+
+// Emulated PWM timers, every call succeeds so MX_TIM4_Init() and the channels' outputs work
+
+#endif
@@ -0,0 +1,13 @@
+#include "timing.h"
+#include "mock_timing.h"
+
+uint32_t mock_time_us = 0;
+uint32_t mock_cpu_cycles = 0;
+
+uint32_t time_us(void) {
+  return mock_time_us++;
+}
+
+uint32_t cpu_cycles(void) {
+  return mock_cpu_cycles++;
+}
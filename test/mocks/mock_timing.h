@@ -0,0 +1,14 @@
+#ifndef MOCK_TIMING_H
+#define MOCK_TIMING_H
+
+#include "common_mock.h"
+
+// Emulated microsecond clock, ticks once every time it's read
+
+extern uint32_t mock_time_us;
+
+// Emulated core clock cycle counter, ticks once every time it's read
+
+extern uint32_t mock_cpu_cycles;
+
+#endif
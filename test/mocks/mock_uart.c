@@ -0,0 +1,32 @@
+#include "uart.h"
+#include "mock_uart.h"
+
+#include <stdio.h>
+#include <string.h>
+
+char printed[512];
+char const *typed = NULL;
+
+void print(char *s) {
+  strncat(printed, s, sizeof(printed) - strlen(printed) - 1);
+}
+
+void print_char(char *c) {}
+
+void print_int(int i, uint8_t base) {
+  char buf[16];
+  sprintf(buf, "%d", i);
+  print(buf);
+}
+
+HAL_StatusTypeDef input(char *buf, uint16_t len) {
+  return HAL_TIMEOUT;
+}
+
+HAL_StatusTypeDef poll_input(char *c) {
+
+  if (typed == NULL || *typed == '\0') return HAL_TIMEOUT;
+
+  *c = *typed++;
+  return HAL_OK;
+}
@@ -0,0 +1,14 @@
+#ifndef MOCK_UART_H
+#define MOCK_UART_H
+
+#include "common_mock.h"
+
+// Emulated serial console
+//
+// Everything printed is appended to printed, which the test clears. Input is
+// handed out of typed a character at a time, as if it came in between polls.
+
+extern char printed[512];
+extern char const *typed;     // NULL or used up, nothing's been typed
+
+#endif
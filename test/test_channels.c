@@ -2,16 +2,19 @@
 #include "channels.h"
 #include "tim.h"
 #include "i2c.h"
+#include "gpio.h"
+#include "can.h"
 
+#include "mocks/mock_can.h"
 #include "mocks/mock_i2c.h"
+#include "mocks/mock_sensor.h"
+#include "mocks/mock_tim.h"
 
 #include <stdio.h>
+#include <string.h>
 
 // Expose some private functions and variables for testing 
 
-Error_Type get_error(Channel const * const channel);
-bool check_timeout_channel(Channel const * const channel_name);
-
 bool update_cmd(Channel * const channel);
 bool update_error(Channel * const channel);
 
@@ -21,8 +24,48 @@ void log_error(Channel const * const channel);
 
 // Private variables (made extern for testing purposes)
 extern Channel_Error const error_definitions[NUM_ERRORS];
-extern Error_Response const response_matrix[NUM_CHANNELS][NUM_ERRORS];
+extern Error_Response const response_matrix[NUM_ERRORS][NUM_CHANNELS];
+
+#define TEST_CONFIGS 16
+
+// Initializes channel from name's configuration, with the test's own timer and limits
+// Each channel keeps its own copy of the configuration while the tests run
+static void init_test_channel(Channel * const channel, Channel_Name name, uint8_t addr, TIM_HandleTypeDef *htim, uint32_t tim_channel, uint16_t vmax, uint16_t vmin, uint16_t curr_max, uint16_t curr_min) {
+
+  static Channel const *owners[TEST_CONFIGS];
+  static Channel_Config configs[TEST_CONFIGS];
+
+  int i = 0;
+  while (owners[i] != channel && owners[i] != NULL) {
+    i++;
+    TEST_ASSERT_TRUE_MESSAGE(i < TEST_CONFIGS, "Out of test channel configurations");
+  }
+
+  owners[i]  = channel;
+  configs[i] = channel_configs[name];
+
+  configs[i].htim        = htim;
+  configs[i].tim_channel = tim_channel;
+  configs[i].volt_max    = vmax;
+  configs[i].volt_min    = vmin;
+  configs[i].curr_max    = curr_max;
+  configs[i].curr_min    = curr_min;
 
+  // Faults follow every reading as read, test_fault_filters() covers the filters
+  for (int j = 0; j < NUM_LIMIT_FAULTS; j++) {
+    configs[i].filters[j] = (Fault_Filter) NO_FILTER;
+  }
+
+  configs[i].smoothing = (Sample_Filter) NO_SMOOTHING;
+
+  init_channel(channel, name, addr, &configs[i]);
+}
+
+
+// True if a fault channel saw is waiting out its timeout
+static bool fault_timing_out(Channel const * const channel, Error_Type error) {
+  return timeout_armed(FAULT_TIMEOUT(channel->name, error));
+}
 
 void test_should_always_pass(void) {}
 
@@ -39,20 +82,20 @@ void test_single_channel_initialization(void) {
 
   Channel channel;
 
-  init_channel(&channel, SHUTDOWN_CHAN, 7889, &phony_timer, 34, 113, 33, 344, 44);
+  init_test_channel(&channel, SHUTDOWN_CHAN, 0x4F, &phony_timer, 34, 113, 33, 344, 44);
   
   
-  TEST_ASSERT_EQUAL_INT_MESSAGE(NO_ERROR, channel.err, "Initialized with error");
-  TEST_ASSERT_EQUAL_INT32_MESSAGE(1001, channel.err_timestamp, "Initialzed with wrong timestamp");
+  TEST_ASSERT_EQUAL_HEX8_MESSAGE(0, channel.faults, "Initialized with error");
+  TEST_ASSERT_FALSE_MESSAGE(fault_timing_out(&channel, SENSOR_ERROR), "Initialized with a fault timing out");
   TEST_ASSERT_EQUAL_INT_MESSAGE(CHANNEL_ON, channel.cmd.type, "Initialized without CHANNEL_ON commmand");
   TEST_ASSERT_EQUAL_INT32_MESSAGE(0, channel.cmd.pwm_val, "Initialized with nonzero pwm value");
-  TEST_ASSERT_EQUAL_INT16_MESSAGE(channel.addr, 7889, "Initialized with wrong I2C address");
-  TEST_ASSERT_EQUAL_PTR_MESSAGE(&phony_timer, channel.htim, "Initialized with wrong timer pointer");
-  TEST_ASSERT_EQUAL_INT32_MESSAGE(34, channel.tim_channel, "Initialized with wrong timer channel");
-  TEST_ASSERT_EQUAL_INT32_MESSAGE(113, channel.volt_max, "Initialized with wrong voltage max");
-  TEST_ASSERT_EQUAL_INT32_MESSAGE(33, channel.volt_min, "Initialized with wrong voltage min");
-  TEST_ASSERT_EQUAL_INT32_MESSAGE(344, channel.curr_max, "Initialized with wrong current max");
-  TEST_ASSERT_EQUAL_INT32_MESSAGE(44, channel.curr_min, "Initialized with wrong current min");
+  TEST_ASSERT_EQUAL_INT16_MESSAGE(channel.addr, 0x4F, "Initialized with wrong I2C address");
+  TEST_ASSERT_EQUAL_PTR_MESSAGE(&phony_timer, channel.config->htim, "Initialized with wrong timer pointer");
+  TEST_ASSERT_EQUAL_INT32_MESSAGE(34, channel.config->tim_channel, "Initialized with wrong timer channel");
+  TEST_ASSERT_EQUAL_INT32_MESSAGE(113, channel.config->volt_max, "Initialized with wrong voltage max");
+  TEST_ASSERT_EQUAL_INT32_MESSAGE(33, channel.config->volt_min, "Initialized with wrong voltage min");
+  TEST_ASSERT_EQUAL_INT32_MESSAGE(344, channel.config->curr_max, "Initialized with wrong current max");
+  TEST_ASSERT_EQUAL_INT32_MESSAGE(44, channel.config->curr_min, "Initialized with wrong current min");
 }
 
 void test_channel_initialization_like_irl(void) {
@@ -63,25 +106,38 @@ void test_channel_initialization_like_irl(void) {
   Channel phony_channels[NUM_CHANNELS];
   
   for (int i = 0; i < NUM_CHANNELS; i++) {
-    init_channel(&phony_channels[i], VCU_CHAN, CHANNEL_ADDR[i], &htim4, i+1, DEFAULT_VMAX, DEFAULT_VMIN, DEFAULT_CMAX, DEFAULT_CMIN);
+    init_channel(&phony_channels[i], i, CHANNEL_ADDR[i], &channel_configs[i]);
     SYSTEM_TICKS++;
   }
 
+  // The first four channels drive htim4, the rest htim5
+  uint32_t const tim_channels[NUM_CHANNELS] = {TIM_CHANNEL_1, TIM_CHANNEL_2, TIM_CHANNEL_3, TIM_CHANNEL_4, TIM_CHANNEL_1, TIM_CHANNEL_2};
+
   for (int i = 0; i < NUM_CHANNELS; i++) {
     Channel channel = phony_channels[i];
-    TEST_ASSERT_EQUAL_INT(NO_ERROR, channel.err);
-    TEST_ASSERT_EQUAL_INT32(SYSTEM_TICKS - NUM_CHANNELS + i, channel.err_timestamp);
+    TEST_ASSERT_EQUAL_HEX8(0, channel.faults);
+    TEST_ASSERT_FALSE(fault_timing_out(&channel, OVER_VOLTAGE_ERROR));
     TEST_ASSERT_EQUAL_INT(CHANNEL_ON, channel.cmd.type);
     TEST_ASSERT_EQUAL_INT32(0, channel.cmd.pwm_val);
     TEST_ASSERT_EQUAL_INT16(CHANNEL_ADDR[i], channel.addr);
-    TEST_ASSERT_EQUAL_PTR(&htim4, channel.htim);
-    TEST_ASSERT_EQUAL_INT32(DEFAULT_VMAX, channel.volt_max);
-    TEST_ASSERT_EQUAL_INT32(DEFAULT_VMIN, channel.volt_min);
-    TEST_ASSERT_EQUAL_INT32(DEFAULT_CMAX, channel.curr_min);
-    TEST_ASSERT_EQUAL_INT32(DEFAULT_CMIN, channel.curr_min);
+    TEST_ASSERT_EQUAL_PTR(&channel_configs[i], channel.config);
+    TEST_ASSERT_EQUAL_PTR(i < 4 ? &htim4 : &htim5, channel.config->htim);
+    TEST_ASSERT_EQUAL_UINT32(tim_channels[i], channel.config->tim_channel);
+    TEST_ASSERT_EQUAL_INT32(DEFAULT_VMAX, channel.config->volt_max);
+    TEST_ASSERT_EQUAL_INT32(DEFAULT_VMIN, channel.config->volt_min);
+    TEST_ASSERT_EQUAL_INT32(DEFAULT_CMAX, channel.config->curr_max);
+    TEST_ASSERT_EQUAL_INT32(DEFAULT_CMIN, channel.config->curr_min);
   }
 }
 
+// Loads readings as if they had just come back from the I2C queue
+void load_sample(Channel * const channel, uint16_t voltage, int16_t current) {
+  uint32_t const seq = channel->samples[BUS_VOLT_READING].seq + 1;
+  channel->samples[BUS_VOLT_READING] = (Cached_Sample) {.raw = voltage, .timestamp = SYSTEM_TICKS, .seq = seq, .quality = SAMPLE_GOOD};
+  channel->samples[CURRENT_READING]  = (Cached_Sample) {.raw = current, .timestamp = SYSTEM_TICKS, .seq = seq, .quality = SAMPLE_GOOD};
+  filter_channel(channel);
+}
+
 void test_errors(void) {
 
   Channel c;
@@ -89,233 +145,792 @@ void test_errors(void) {
   
   SYSTEM_TICKS = 2390;
 
-  uint8_t tx_buf[2];
-  tx_queue_start = &tx_buf[0];
-  tx_queue_end = &tx_buf[2];
-
-  uint8_t rx_buf[4] = { 0x00, 0x96, 0x0f, 0x11 };
-  rx_queue_start = &rx_buf[0];
-  rx_queue_end = &rx_buf[4];  
-
-  init_channel(&c, REGEN_CHAN, 339, &phony_timer, 133, 0x0095, 0x0000, 0xffff, 0x0000); 
+  // Limits are in mV and mA, readings in counts of 1.25 mV and each channel's current LSB
+  init_test_channel(&c, REGEN_CHAN, 0x53, &phony_timer, 133, 11000, 0, 0xffff, 0); 
+  load_sample(&c, 9600, 3857);
   
   // Test has over voltage
 
-  TEST_ASSERT_TRUE_MESSAGE(get_error(&c) == OVER_VOLTAGE_ERROR, "get_error() didn't return OVER_VOLTAGE_ERROR");
+  TEST_ASSERT_TRUE_MESSAGE(get_faults(&c) == FAULT(OVER_VOLTAGE_ERROR), "get_faults() didn't return OVER_VOLTAGE_ERROR");
   
-  tx_queue_start = &tx_buf[0];
-  rx_queue_start = &rx_buf[0];
   SYSTEM_TICKS = 293;
 
   TEST_ASSERT_TRUE_MESSAGE(update_error(&c), "update_error() didn't return true for OVER_VOLTAGE_ERROR");
-  TEST_ASSERT_TRUE_MESSAGE(c.err == OVER_VOLTAGE_ERROR, "channel wasn't set to OVER_VOLTAGE_ERROR");
-  TEST_ASSERT_EQUAL_INT32_MESSAGE(SYSTEM_TICKS, c.err_timestamp, "channel was given wrong timestamp");
+  TEST_ASSERT_EQUAL_HEX8_MESSAGE(FAULT(OVER_VOLTAGE_ERROR), c.faults, "channel wasn't set to OVER_VOLTAGE_ERROR");
+  TEST_ASSERT_EQUAL_MESSAGE(error_definitions[OVER_VOLTAGE_ERROR].has_timeout, fault_timing_out(&c, OVER_VOLTAGE_ERROR), "Fault\'s timeout wasn\'t started");
 
   // Test has under voltage error
 
-  tx_queue_start = &tx_buf[0];
-  rx_queue_start = &rx_buf[0];
-  init_channel(&c, VCU_CHAN, 339, &phony_timer, 133, 0x0099, 0x0098, 0x0f13, 0x0003); 
+  init_test_channel(&c, VCU_CHAN, 0x53, &phony_timer, 133, 14000, 13000, 5000, 3); 
+  load_sample(&c, 9600, 3857);
 
-  TEST_ASSERT_TRUE_MESSAGE(get_error(&c) == UNDER_VOLTAGE_ERROR, "get_error() didn't return UNDER_VOLTAGE_ERROR");
+  TEST_ASSERT_TRUE_MESSAGE(get_faults(&c) == FAULT(UNDER_VOLTAGE_ERROR), "get_faults() didn't return UNDER_VOLTAGE_ERROR");
    
-  tx_queue_start = &tx_buf[0];
-  rx_queue_start = &rx_buf[0];
   SYSTEM_TICKS = 290;
   
   TEST_ASSERT_TRUE_MESSAGE(update_error(&c), "update_error() didn't return true for UNDER_VOLTAGE_ERROR");
-  TEST_ASSERT_TRUE_MESSAGE(c.err == UNDER_VOLTAGE_ERROR, "channel wasn't set to UNDER_VOLTAGE_ERROR");
-  TEST_ASSERT_EQUAL_INT32_MESSAGE(SYSTEM_TICKS, c.err_timestamp, "channel was given wrong timestamp");
+  TEST_ASSERT_EQUAL_HEX8_MESSAGE(FAULT(UNDER_VOLTAGE_ERROR), c.faults, "channel wasn't set to UNDER_VOLTAGE_ERROR");
+  TEST_ASSERT_EQUAL_MESSAGE(error_definitions[UNDER_VOLTAGE_ERROR].has_timeout, fault_timing_out(&c, UNDER_VOLTAGE_ERROR), "Fault\'s timeout wasn\'t started");
 
   // Test has over current error
 
-  tx_queue_start = &tx_buf[0];
-  rx_queue_start = &rx_buf[0];
-  init_channel(&c, REGEN_CHAN, 339, &phony_timer, 133, 0x0099, 0x0094, 0x0013, 0x0003); 
+  init_test_channel(&c, REGEN_CHAN, 0x53, &phony_timer, 133, 14000, 11000, 3000, 3); 
+  load_sample(&c, 9600, 3857);
 
-  TEST_ASSERT_TRUE_MESSAGE(get_error(&c) == OVER_CURRENT_ERROR, "get_error() didn't return OVER_CURRENT_ERROR");
+  TEST_ASSERT_TRUE_MESSAGE(get_faults(&c) == FAULT(OVER_CURRENT_ERROR), "get_faults() didn't return OVER_CURRENT_ERROR");
   
-  tx_queue_start = &tx_buf[0];
-  rx_queue_start = &rx_buf[0];
   SYSTEM_TICKS = 198;
   
   TEST_ASSERT_TRUE_MESSAGE(update_error(&c), "update_error() didn't return true for OVER_CURRENT_ERROR");
-  TEST_ASSERT_TRUE_MESSAGE(c.err == OVER_CURRENT_ERROR, "channel wasn't set to OVER_CURRENT_ERROR");
-  TEST_ASSERT_EQUAL_INT32_MESSAGE(SYSTEM_TICKS, c.err_timestamp, "channel was given wrong timestamp");
+  TEST_ASSERT_EQUAL_HEX8_MESSAGE(FAULT(OVER_CURRENT_ERROR), c.faults, "channel wasn't set to OVER_CURRENT_ERROR");
+  TEST_ASSERT_EQUAL_MESSAGE(error_definitions[OVER_CURRENT_ERROR].has_timeout, fault_timing_out(&c, OVER_CURRENT_ERROR), "Fault\'s timeout wasn\'t started");
 
   // Test has under current error
 
-  tx_queue_start = &tx_buf[0];
-  rx_queue_start = &rx_buf[0];
-  init_channel(&c, VCU_CHAN, 339, &phony_timer, 133, 0x0099, 0x0094, 0xfff3, 0xff43); 
+  init_test_channel(&c, VCU_CHAN, 0x53, &phony_timer, 133, 14000, 11000, 0xfff3, 500); 
+  load_sample(&c, 9600, 3857);
 
-  TEST_ASSERT_TRUE_MESSAGE(get_error(&c) == UNDER_CURRENT_ERROR, "get_error() didn't return UNDER_CURRENT_ERROR");
+  TEST_ASSERT_TRUE_MESSAGE(get_faults(&c) == FAULT(UNDER_CURRENT_ERROR), "get_faults() didn't return UNDER_CURRENT_ERROR");
   
-  tx_queue_start = &tx_buf[0];
-  rx_queue_start = &rx_buf[0];
   SYSTEM_TICKS = 119;
   
   TEST_ASSERT_TRUE_MESSAGE(update_error(&c), "update_error() didn't return true for UNDER_CURRENT_ERROR");
-  TEST_ASSERT_TRUE_MESSAGE(c.err == UNDER_CURRENT_ERROR, "channel wasn't set to UNDER_CURRENT_ERROR");
-  TEST_ASSERT_EQUAL_INT32_MESSAGE(SYSTEM_TICKS, c.err_timestamp, "channel was given wrong timestamp");
+  TEST_ASSERT_EQUAL_HEX8_MESSAGE(FAULT(UNDER_CURRENT_ERROR), c.faults, "channel wasn't set to UNDER_CURRENT_ERROR");
+  TEST_ASSERT_EQUAL_MESSAGE(error_definitions[UNDER_CURRENT_ERROR].has_timeout, fault_timing_out(&c, UNDER_CURRENT_ERROR), "Fault\'s timeout wasn\'t started");
  
-  // How should we handle multiple errors? 
+  // Test has under voltage and over current errors at once
+
+  init_test_channel(&c, VCU_CHAN, 0x53, &phony_timer, 133, 14000, 13000, 300, 3); 
+  load_sample(&c, 9600, 3857);
+
+  TEST_ASSERT_EQUAL_HEX8_MESSAGE(FAULT(UNDER_VOLTAGE_ERROR) | FAULT(OVER_CURRENT_ERROR), get_faults(&c), "get_faults() didn't return both errors");
+
+  SYSTEM_TICKS = 152;
+
+  TEST_ASSERT_TRUE_MESSAGE(update_error(&c), "update_error() didn't return true for both errors");
+  TEST_ASSERT_EQUAL_HEX8_MESSAGE(FAULT(UNDER_VOLTAGE_ERROR) | FAULT(OVER_CURRENT_ERROR), c.faults, "channel wasn't set to both errors");
+  TEST_ASSERT_EQUAL_MESSAGE(error_definitions[UNDER_VOLTAGE_ERROR].has_timeout, fault_timing_out(&c, UNDER_VOLTAGE_ERROR), "Fault\'s timeout wasn\'t started");
+  TEST_ASSERT_EQUAL_MESSAGE(error_definitions[OVER_CURRENT_ERROR].has_timeout, fault_timing_out(&c, OVER_CURRENT_ERROR), "Fault\'s timeout wasn\'t started");
+  TEST_ASSERT_TRUE_MESSAGE(faulted_channels & (1U << VCU_CHAN), "Channel wasn't flagged as faulted");
+
+  TEST_ASSERT_FALSE_MESSAGE(update_error(&c), "update_error() returned true, but the errors didn't change");
 
   // Test doesn't have error
 
-  tx_queue_start = &tx_buf[0];
-  rx_queue_start = &rx_buf[0];
-  init_channel(&c, REGEN_CHAN, 339, &phony_timer, 133, 0x0097, 0x0003, 0x0f13, 0x0003); 
+  init_test_channel(&c, REGEN_CHAN, 0x53, &phony_timer, 133, 14000, 11000, 5000, 3); 
+  load_sample(&c, 9600, 3857);
 
-  TEST_ASSERT_TRUE_MESSAGE(get_error(&c) == NO_ERROR, "get_error() didn't return NO_ERROR");
+  TEST_ASSERT_TRUE_MESSAGE(get_faults(&c) == 0, "get_faults() didn't return NO_ERROR");
   
-  tx_queue_start = &tx_buf[0];
-  rx_queue_start = &rx_buf[0];
   SYSTEM_TICKS = 193;
-  c.err_timestamp = 399;
 
   TEST_ASSERT_FALSE_MESSAGE(update_error(&c), "update_error() didn't return false for NO_ERROR");
-  TEST_ASSERT_TRUE_MESSAGE(c.err == NO_ERROR, "channel wasn't set to NO_ERROR");
-  TEST_ASSERT_EQUAL_INT32_MESSAGE(399, c.err_timestamp, "channel's timestamp was changed");
+  TEST_ASSERT_EQUAL_HEX8_MESSAGE(0, c.faults, "channel wasn't cleared of errors");
+  TEST_ASSERT_FALSE_MESSAGE(fault_timing_out(&c, OVER_VOLTAGE_ERROR), "Started a timeout without a fault");
 
 }
 
-// Updating and logging really depends on can
+void test_limits_in_counts(void) {
 
-void test_timeout_channel(void) {
+  Channel c;
+  TIM_HandleTypeDef phony_timer;
+
+  // 100 uA current LSB
+  init_test_channel(&c, VCU_CHAN, 0x40, &phony_timer, 1, 12500, 11000, 3000, 20);
+
+  TEST_ASSERT_EQUAL_UINT16_MESSAGE(10000, c.limits.volt_max, "Wrong voltage max counts");
+  TEST_ASSERT_EQUAL_UINT16_MESSAGE(8800, c.limits.volt_min, "Wrong voltage min counts");
+  TEST_ASSERT_EQUAL_INT16_MESSAGE(30000, c.limits.curr_max, "Wrong current max counts");
+  TEST_ASSERT_EQUAL_INT16_MESSAGE(200, c.limits.curr_min, "Wrong current min counts");
+
+  // Past the register's range
+  init_test_channel(&c, VCU_CHAN, 0x40, &phony_timer, 1, 12500, 11000, 4000, 20);
+  TEST_ASSERT_EQUAL_INT16_MESSAGE(INT16_MAX, c.limits.curr_max, "Current max didn't saturate");
+
+  // Readings right on the limits are fine
+  load_sample(&c, 10000, 200);
+  TEST_ASSERT_TRUE_MESSAGE(get_faults(&c) == 0, "Reading on limit was an error");
+
+  load_sample(&c, 10001, 200);
+  TEST_ASSERT_TRUE_MESSAGE(get_faults(&c) == FAULT(OVER_VOLTAGE_ERROR), "Missed over voltage by a count");
+
+  // Current is signed, so charging current is under any positive minimum
+  load_sample(&c, 10000, -5);
+  TEST_ASSERT_TRUE_MESSAGE(get_faults(&c) == FAULT(UNDER_CURRENT_ERROR), "Negative current wasn't under minimum");
+}
+
+void test_no_error_before_sampling(void) {
 
   Channel c;
   TIM_HandleTypeDef phony_timer;
-  init_channel(&c, AERO_CHAN, 78, &phony_timer, 12,38, 32, 88, 9);
 
-  for (int i = 0; i < NUM_ERRORS; i++) {
+  // Every reading would be out of range, but none have arrived yet
+  init_test_channel(&c, PUMPS_CHAN, 0x41, &phony_timer, 1, 0x0000, 0x0000, 0x0000, 0x0000);
 
-    c.err = i;
-    c.err_timestamp = 14;
-    Channel_Error def = error_definitions[i]; 
+  TEST_ASSERT_TRUE_MESSAGE(get_faults(&c) == 0, "get_faults() checked readings that never arrived");
+}
 
-    if (def.has_timeout) {
+void test_sample_channel(void) {
 
-      // Try not timing out error
-      
-      for (int j = 0; j <= def.timeout_period + c.err_timestamp; j++) {
-        SYSTEM_TICKS = j;
+  Channel c;
+  TIM_HandleTypeDef phony_timer;
 
-        TEST_ASSERT_FALSE_MESSAGE(check_timeout_channel(&c), "Error timed-out early");
+  // Flags with a conversion ready, then the conversion
+  uint8_t rx_buf[6] = { 0x00, 0x08, 0x01, 0x23, 0x04, 0x56 };
+  rx_queue_start = &rx_buf[0];
+  rx_queue_end = &rx_buf[6];
 
-      }
+  uint8_t tx_buf[3];
+  tx_queue_start = &tx_buf[0];
+  tx_queue_end = &tx_buf[3];
+  invalidate_reg_ptrs();
+
+  SYSTEM_TICKS = 1000;
+  init_test_channel(&c, FANS_CHAN, 0x44, &phony_timer, 1, 0x0200, 0x0100, 0x0500, 0x0400);
+
+  sample_channel(&c);
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, c.samples[BUS_VOLT_READING].seq, "sample_channel() waited on the bus");
+
+  SYSTEM_TICKS = 1002;
+  mock_i2c_run();
+
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, c.samples[BUS_VOLT_READING].seq, "Voltage wasn't cached");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, c.samples[CURRENT_READING].seq, "Current wasn't cached");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(1002, c.samples[CURRENT_READING].timestamp, "Cached wrong timestamp");
+  TEST_ASSERT_EQUAL_INT_MESSAGE(SAMPLE_GOOD, sample_quality(&c, CURRENT_READING), "Fresh reading wasn't good");
+  TEST_ASSERT_EQUAL_UINT8_MESSAGE(INA226_REG_MASK, tx_buf[0], "Didn't check for a new conversion");
+  TEST_ASSERT_EQUAL_UINT8_MESSAGE(INA226_REG_BUS_VOLT, tx_buf[1], "Didn't read voltage register");
+  TEST_ASSERT_EQUAL_UINT8_MESSAGE(INA226_REG_CURRENT, tx_buf[2], "Didn't read current register");
+  TEST_ASSERT_EQUAL_HEX16_MESSAGE(0x0123, c.samples[BUS_VOLT_READING].raw, "Stored wrong voltage");
+  TEST_ASSERT_EQUAL_HEX16_MESSAGE(0x0456, c.samples[CURRENT_READING].raw, "Stored wrong current");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, c.stats.fresh_samples, "Didn't count fresh sample");
+  filter_channel(&c);
+  TEST_ASSERT_TRUE_MESSAGE(get_faults(&c) == 0, "get_faults() found error in sampled readings");
+
+  // Nothing new to read until the sensor says so
+  sample_channel(&c);
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, mock_i2c_run(), "Read without a new conversion");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(2, c.stats.reads_avoided, "Didn't count avoided reads");
+
+  // Sensor flags a conversion that isn't ready yet
+  uint8_t flags[2] = { 0x00, 0x00 };
+  rx_queue_start = &flags[0];
+  rx_queue_end = &flags[2];
+  tx_queue_start = &tx_buf[0];
+  tx_queue_end = &tx_buf[1];
 
-      for (int j = def.timeout_period + c.err_timestamp + 1; j <= UINT16_MAX; j++) {
+  HAL_GPIO_EXTI_Callback(ALERT_PIN(FANS_CHAN));
+  c.alert_pending = channels[FANS_CHAN].alert_pending;
+  channels[FANS_CHAN].alert_pending = false;
 
-        // Reset error
-        c.err = i;
+  sample_channel(&c);
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, mock_i2c_run(), "Read more than the flags");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(4, c.stats.reads_avoided, "Didn't count avoided reads");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, c.stats.fresh_samples, "Counted a stale sample");
+}
 
-        // Try timing out error
-        SYSTEM_TICKS = j;
-        
-        TEST_ASSERT_TRUE_MESSAGE(check_timeout_channel(&c), "Error didn't timeout");
-      }
-    }
+void test_sample_channel_overdue(void) {
 
-  }
+  Channel c;
+  TIM_HandleTypeDef phony_timer;
+
+  uint8_t rx_buf[6] = { 0x00, 0x08, 0x01, 0x23, 0x04, 0x56 };
+  uint8_t tx_buf[3];
+  invalidate_reg_ptrs();
+
+  SYSTEM_TICKS = 1000;
+  init_test_channel(&c, FANS_CHAN, 0x44, &phony_timer, 1, 0x0200, 0x0100, 0x0500, 0x0400);
+  c.alert_pending = false;
+
+  uint32_t poll_period = 2 * SENSOR_FN(conversion_time_us)(sensor_conf(&c)) / 1000 + 1;
+
+  // The pin never fired, poll anyway once a couple of conversions are missed
+  SYSTEM_TICKS += poll_period;
+  sample_channel(&c);
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, mock_i2c_run(), "Polled before missing a conversion");
+
+  rx_queue_start = &rx_buf[0];
+  rx_queue_end = &rx_buf[6];
+  tx_queue_start = &tx_buf[0];
+  tx_queue_end = &tx_buf[3];
+
+  SYSTEM_TICKS++;
+  sample_channel(&c);
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(3, mock_i2c_run(), "Didn't poll overdue sensor");
+  TEST_ASSERT_EQUAL_UINT8_MESSAGE(INA226_REG_MASK, tx_buf[0], "Didn't poll flags");
+  TEST_ASSERT_EQUAL_HEX16_MESSAGE(0x0123, c.samples[BUS_VOLT_READING].raw, "Stored wrong voltage");
+
+  // Rate is taken over whole seconds
+  uint8_t flags[2] = { 0x00, 0x00 };
+  rx_queue_start = &flags[0];
+  rx_queue_end = &flags[2];
+  tx_queue_start = &tx_buf[0];
+  tx_queue_end = &tx_buf[1];
 
+  SYSTEM_TICKS = 2000;
+  sample_channel(&c);
+  mock_i2c_run();
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, c.stats.fresh_per_second, "Measured wrong sample rate");
 }
 
-void test_update_errors(void) {
+void test_sample_cache(void) {
 
   Channel c;
   TIM_HandleTypeDef phony_timer;
 
-  uint8_t rx_buf[4] = {0xbf, 0xff, 0x55, 0x44};
+  // Flags with a conversion ready then the conversion, one that fails, then another
+  uint8_t rx_buf[18] = {
+    0x00, 0x08, 0x01, 0x23, 0x04, 0x56,
+    0x00, 0x08, 0xff, 0xff, 0xff, 0xff,
+    0x00, 0x08, 0x01, 0x24, 0x04, 0x57,
+  };
   rx_queue_start = &rx_buf[0];
-  rx_queue_end = &rx_buf[4];
+  rx_queue_end = &rx_buf[18];
 
-  uint8_t tx_buf[2];
+  uint8_t tx_buf[16];
   tx_queue_start = &tx_buf[0];
-  tx_queue_end = &tx_buf[2];
+  tx_queue_end = &tx_buf[16];
+  invalidate_reg_ptrs();
+
+  SYSTEM_TICKS = 1000;
+  init_test_channel(&c, FANS_CHAN, 0x44, &phony_timer, 1, 0x0200, 0x0100, 0x0500, 0x0400);
+
+  TEST_ASSERT_EQUAL_INT_MESSAGE(SAMPLE_NONE, sample_quality(&c, BUS_VOLT_READING), "Reading before any arrived");
+
+  sample_channel(&c);
+  mock_i2c_run();
+
+  // The flags come back, the readings don't
+  c.alert_pending = true;
+  sample_channel(&c);
+  mock_i2c_complete();
+  mock_i2c_status = HAL_ERROR;
+  mock_i2c_run();
+  mock_i2c_status = HAL_OK;
+
+  TEST_ASSERT_EQUAL_INT_MESSAGE(SAMPLE_FAILED, sample_quality(&c, BUS_VOLT_READING), "Failed read wasn't flagged");
+  TEST_ASSERT_EQUAL_HEX16_MESSAGE(0x0123, c.samples[BUS_VOLT_READING].raw, "Failed read replaced the last good value");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, c.samples[BUS_VOLT_READING].seq, "Counted a failed read");
+  filter_channel(&c);
+  TEST_ASSERT_TRUE_MESSAGE(get_faults(&c) == 0, "Last good reading wasn't used");
+
+  // Nothing good arrives for longer than the channel allows
+  SYSTEM_TICKS += channel_configs[FANS_CHAN].sensor.max_age_ms + 1;
+
+  TEST_ASSERT_EQUAL_INT_MESSAGE(SAMPLE_STALE, sample_quality(&c, CURRENT_READING), "Old reading wasn't stale");
+  TEST_ASSERT_TRUE_MESSAGE(get_faults(&c) == FAULT(SENSOR_ERROR), "Stale reading wasn't a sensor error");
+
+  // Until the sensor answers again
+  c.alert_pending = true;
+  sample_channel(&c);
+  mock_i2c_run();
+
+  TEST_ASSERT_EQUAL_INT_MESSAGE(SAMPLE_GOOD, sample_quality(&c, CURRENT_READING), "New reading wasn't good");
+  TEST_ASSERT_EQUAL_HEX16_MESSAGE(0x0457, c.samples[CURRENT_READING].raw, "Cached wrong current");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(2, c.samples[CURRENT_READING].seq, "Didn't count the new reading");
+  TEST_ASSERT_TRUE_MESSAGE(get_faults(&c) == 0, "Sensor error outlived the stale reading");
+}
 
-  SYSTEM_TICKS = 1990;
+void test_sample_registers(void) {
 
-  init_channel(&c, VCU_CHAN, 3, &phony_timer, 1, 0x00af, 0x0044, 0x0055, 0x0033); 
-  SYSTEM_TICKS = 18;
+  Channel c;
+  TIM_HandleTypeDef phony_timer;
 
-  TEST_ASSERT_TRUE_MESSAGE(update_error(&c), "update_error() didn't return true, no error update was found"); 
-  TEST_ASSERT_TRUE_MESSAGE(c.err == OVER_VOLTAGE_ERROR, "update_error() set channel to wrong error");
+  // REGEN_CHAN samples the shunt voltage and power rather than the current
+  TEST_ASSERT_FALSE(channel_configs[REGEN_CHAN].sensor.readings & READING(CURRENT_READING));
+
+  // Flags with a conversion ready, then 12 V, 3 mV across 2 mOhm and 18 W
+  uint8_t rx_buf[8] = { 0x00, 0x08, 0x25, 0x80, 0x04, 0xb0, 0x02, 0xd0 };
+  rx_queue_start = &rx_buf[0];
+  rx_queue_end = &rx_buf[8];
+
+  uint8_t tx_buf[4];
+  tx_queue_start = &tx_buf[0];
+  tx_queue_end = &tx_buf[4];
+  invalidate_reg_ptrs();
+
+  SYSTEM_TICKS = 1000;
+  init_test_channel(&c, REGEN_CHAN, 0x45, &phony_timer, 1, 14000, 11000, 2000, 0);
+
+  sample_channel(&c);
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(4, mock_i2c_run(), "Read the wrong number of registers");
+  TEST_ASSERT_FALSE_MESSAGE(c.sampling, "Sample didn't finish");
+
+  TEST_ASSERT_EQUAL_UINT8(INA226_REG_BUS_VOLT, tx_buf[1]);
+  TEST_ASSERT_EQUAL_UINT8(INA226_REG_SHUNT_VOLT, tx_buf[2]);
+  TEST_ASSERT_EQUAL_UINT8(INA226_REG_POWER, tx_buf[3]);
+
+  TEST_ASSERT_EQUAL_INT32_MESSAGE(1500000, channel_current_ua(&c), "Wrong current from shunt voltage");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(18000000, channel_power_uw(&c), "Wrong power from power register");
+  TEST_ASSERT_EQUAL_UINT32(1, c.stats.fresh_samples);
+  filter_channel(&c);
+  TEST_ASSERT_TRUE_MESSAGE(get_faults(&c) == 0, "Current register it doesn't sample went stale");
+
+  // Current limits are checked through the shunt voltage
+  init_test_channel(&c, REGEN_CHAN, 0x45, &phony_timer, 1, 14000, 11000, 1000, 0);
+  c.samples[SHUNT_VOLT_READING] = (Cached_Sample) {.raw = 1200, .timestamp = SYSTEM_TICKS, .seq = 1, .quality = SAMPLE_GOOD};
+  filter_channel(&c);
+  TEST_ASSERT_TRUE_MESSAGE(get_faults(&c) == FAULT(OVER_CURRENT_ERROR), "Missed over current in shunt voltage");
+
+  // Channels sampling the current register multiply out the power
+  init_test_channel(&c, VCU_CHAN, 0x40, &phony_timer, 1, 14000, 11000, 2000, 0);
+  load_sample(&c, 9600, 15000);
+  TEST_ASSERT_EQUAL_INT32(1500000, channel_current_ua(&c));
+  TEST_ASSERT_EQUAL_UINT32(18000000, channel_power_uw(&c));
+}
+
+// Fills rx_buf with the identification of count INA226s
+static void load_ina226_ids(uint8_t *rx_buf, int count) {
 
-  TEST_ASSERT_EQUAL_INT32_MESSAGE(SYSTEM_TICKS, c.err_timestamp, "update_error() set channel's err_timestamp incorrectly");
+  for (int i = 0; i < count; i++) {
+    rx_buf[4*i + 0] = INA226_MFG_ID >> 8;
+    rx_buf[4*i + 1] = INA226_MFG_ID & 0xff;
+    rx_buf[4*i + 2] = INA226_DIE_ID >> 8;
+    rx_buf[4*i + 3] = INA226_DIE_ID & 0xff;
+  }
+}
 
+void test_discover_channels(void) {
+
+  uint8_t rx_buf[24];
+  uint8_t tx_buf[12];
+  TIM_HandleTypeDef phony_timer;
 
+  // Two sensors on every bus
+  load_ina226_ids(rx_buf, 6);
   rx_queue_start = &rx_buf[0];
+  rx_queue_end = &rx_buf[24];
   tx_queue_start = &tx_buf[0];
+  tx_queue_end = &tx_buf[12];
+  invalidate_reg_ptrs();
 
-  init_channel(&c, VCU_CHAN, 3, &phony_timer, 1, 0xffaf, 0x0044, 0xff66, 0x0033); 
-  SYSTEM_TICKS = 1899;
+  mock_i2c_present[0x40] = true;
+  mock_i2c_present[0x41] = true;
 
-  TEST_ASSERT_FALSE_MESSAGE(update_error(&c), "update_error() returned true, but there was no error update");
-  TEST_ASSERT_TRUE_MESSAGE(c.err == NO_ERROR, "update_error() gave channel error when none was present");
-  TEST_ASSERT_EQUAL_INT32_MESSAGE(18, c.err_timestamp, "update_error() set channel's err_timestamp, but there was no error");
+  TEST_ASSERT_EQUAL_UINT8_MESSAGE(NUM_CHANNELS, discover_channels(), "Didn't map every sensor");
+  TEST_ASSERT_EQUAL_HEX16(0x40, CHANNEL_ADDR[VCU_CHAN]);
+  TEST_ASSERT_EQUAL_HEX16(0x41, CHANNEL_ADDR[SHUTDOWN_CHAN]);
+  TEST_ASSERT_EQUAL_HEX16(0x40, CHANNEL_ADDR[PUMPS_CHAN]);
+  TEST_ASSERT_EQUAL_HEX16(0x41, CHANNEL_ADDR[FANS_CHAN]);
+  TEST_ASSERT_EQUAL_HEX16(0x40, CHANNEL_ADDR[AERO_CHAN]);
+  TEST_ASSERT_EQUAL_HEX16(0x41, CHANNEL_ADDR[REGEN_CHAN]);
+
+  // One sensor short on every bus
+  mock_i2c_present[0x40] = false;
+
+  load_ina226_ids(rx_buf, 3);
+  rx_queue_start = &rx_buf[0];
+  tx_queue_start = &tx_buf[0];
+
+  TEST_ASSERT_EQUAL_UINT8(3, discover_channels());
+  TEST_ASSERT_EQUAL_HEX16(0x41, CHANNEL_ADDR[VCU_CHAN]);
+  TEST_ASSERT_EQUAL_HEX16(SENSOR_MISSING, CHANNEL_ADDR[SHUTDOWN_CHAN]);
+  TEST_ASSERT_EQUAL_HEX16(SENSOR_MISSING, CHANNEL_ADDR[REGEN_CHAN]);
+
+  // Channels without a sensor are left alone, and aren't waited on at startup
+  for (int i = 0; i < NUM_CHANNELS; i++) {
+    init_test_channel(&channels[i], i, CHANNEL_ADDR[i], &phony_timer, 1, 0x0200, 0x0100, 0x0500, 0x0400);
+    if (CHANNEL_ADDR[i] != SENSOR_MISSING) load_sample(&channels[i], 0x0150, 0x0450);
+  }
+
+  mock_i2c_transfers = 0;
+  TEST_ASSERT_EQUAL_INT(HAL_ERROR, configure_channel(&channels[SHUTDOWN_CHAN]));
+  TEST_ASSERT_FALSE(sample_channel(&channels[SHUTDOWN_CHAN]));
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, mock_i2c_transfers, "Talked to a missing sensor");
+  TEST_ASSERT_TRUE_MESSAGE(channels_sampled(), "Waited on a missing sensor");
 
+  channels[VCU_CHAN].samples[CURRENT_READING].seq = 0;
+  TEST_ASSERT_FALSE_MESSAGE(channels_sampled(), "Didn't wait for both readings");
 
+  memset(mock_i2c_present, 0, sizeof(mock_i2c_present));
 }
 
-void test_update_errors_timeout(void) {
+void test_configure_channel(void) {
+
+  Channel c;
+  TIM_HandleTypeDef phony_timer;
+
+  uint8_t tx_buf[12];
+  tx_queue_start = &tx_buf[0];
+  tx_queue_end = &tx_buf[12];
+
+  init_test_channel(&c, SHUTDOWN_CHAN, 0x45, &phony_timer, 1, 14000, 11000, 0x0500, 0x0400);
+
+  TEST_ASSERT_EQUAL_INT_MESSAGE(HAL_OK, configure_channel(&c), "configure_channel() failed");
+
+  // Conversions, calibration, limit, then arm it along with conversion ready
+  uint16_t conf  = sensor_conf(&c);
+  uint16_t cal   = sensor_cal(&c);
+  uint16_t limit = channel_configs[SHUTDOWN_CHAN].alert_error == OVER_VOLTAGE_ERROR ? 11200 : 8800;
+  uint16_t mask  = channel_configs[SHUTDOWN_CHAN].alert_error == OVER_VOLTAGE_ERROR ? INA226_MASK_BOL : INA226_MASK_BUL;
+  mask |= INA226_MASK_CNVR | INA226_MASK_LEN;
+
+  TEST_ASSERT_EQUAL_HEX16_MESSAGE(INA226_CONF(INA226_AVG_4, INA226_CT_588US, INA226_CT_588US, INA226_MODE_CONTINUOUS), conf, "Wrong sensor configuration");
+  TEST_ASSERT_EQUAL_UINT16_MESSAGE(5120, cal, "Wrong calibration for 10 mOhm shunt and 100 uA LSB");
+
+  uint16_t const writes[4][2] = {
+    { INA226_REG_CONF, conf },
+    { INA226_REG_CAL, cal },
+    { INA226_REG_ALERT_LIMIT, limit },
+    { INA226_REG_MASK, mask },
+  };
+
+  for (int i = 0; i < 4; i++) {
+    TEST_ASSERT_EQUAL_UINT8_MESSAGE(writes[i][0], tx_buf[3*i], "Wrote registers out of order");
+    TEST_ASSERT_EQUAL_HEX8_MESSAGE(writes[i][1] >> 8, tx_buf[3*i + 1], "Wrote wrong value");
+    TEST_ASSERT_EQUAL_HEX8_MESSAGE(writes[i][1] & 0xff, tx_buf[3*i + 2], "Wrote wrong value");
+  }
+}
+
+void test_check_channel(void) {
 
   Channel c;
   TIM_HandleTypeDef phony_timer;
 
-  uint8_t rx_buf[4] = {0x00, 0x46, 0x00, 0x44};
+  uint8_t rx_buf[4];
+  uint8_t tx_buf[16];
+
+  init_test_channel(&c, FANS_CHAN, 0x44, &phony_timer, 1, 14000, 11000, 0x0500, 0x0400);
+  c.alert_pending = false;
+
+  uint16_t const conf = sensor_conf(&c);
+  uint16_t const cal  = sensor_cal(&c);
+
+  // Sensor still has its configuration
+  rx_buf[0] = conf >> 8;
+  rx_buf[1] = conf;
+  rx_buf[2] = cal >> 8;
+  rx_buf[3] = cal;
   rx_queue_start = &rx_buf[0];
   rx_queue_end = &rx_buf[4];
+  tx_queue_start = &tx_buf[0];
+  tx_queue_end = &tx_buf[16];
+  invalidate_reg_ptrs();
+
+  TEST_ASSERT_TRUE(check_channel(&c));
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(2, mock_i2c_run(), "Read back more than CONF and CAL");
+  TEST_ASSERT_EQUAL_UINT8(INA226_REG_CONF, tx_buf[0]);
+  TEST_ASSERT_EQUAL_UINT8(INA226_REG_CAL, tx_buf[1]);
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, c.stats.reinits, "Re-programmed a healthy sensor");
+
+  // Sensor browned out, it's back on its power on defaults
+  rx_buf[0] = 0x41;
+  rx_buf[1] = 0x27;
+  rx_queue_start = &rx_buf[0];
+  tx_queue_start = &tx_buf[0];
 
-  uint8_t tx_buf[2];
+  TEST_ASSERT_TRUE(check_channel(&c));
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(1 + 4, mock_i2c_run(), "Didn't re-program the reset sensor");
+  TEST_ASSERT_EQUAL_UINT8_MESSAGE(INA226_REG_CONF, tx_buf[1], "Didn't re-program conversions first");
+  TEST_ASSERT_EQUAL_HEX8(conf >> 8, tx_buf[2]);
+  TEST_ASSERT_EQUAL_HEX8(conf & 0xff, tx_buf[3]);
+  TEST_ASSERT_EQUAL_UINT8(INA226_REG_CAL, tx_buf[4]);
+  TEST_ASSERT_EQUAL_UINT8(INA226_REG_MASK, tx_buf[10]);
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, c.stats.reinits, "Didn't count the re-init");
+  TEST_ASSERT_TRUE_MESSAGE(c.alert_pending, "Didn't look for conversions missed while reset");
+
+  // Only the calibration was lost
+  rx_buf[0] = conf >> 8;
+  rx_buf[1] = conf;
+  rx_buf[2] = 0;
+  rx_buf[3] = 0;
+  rx_queue_start = &rx_buf[0];
   tx_queue_start = &tx_buf[0];
-  tx_queue_end = &tx_buf[2];
 
-  SYSTEM_TICKS = 1990;
+  check_channel(&c);
+  TEST_ASSERT_EQUAL_UINT32(2 + 4, mock_i2c_run());
+  TEST_ASSERT_EQUAL_UINT32(2, c.stats.reinits);
+}
 
-  init_channel(&c, REGEN_CHAN, 2, &phony_timer, 1, 0x0123, 0x0023, 0xffff, 0x0000);
+void test_alert_event(void) {
 
-  c.err = OVER_VOLTAGE_ERROR;
-  c.err_timestamp = 199;
-  SYSTEM_TICKS = 199 + error_definitions[c.err].timeout_period + 1;
-  
-  TEST_ASSERT_TRUE_MESSAGE(update_error(&c), "update_error() didn't return true, no error update was found");
-  TEST_ASSERT_TRUE_MESSAGE(c.err == NO_ERROR, "update_error() didn't set channel to NO_ERROR");
-  TEST_ASSERT_EQUAL_INT32_MESSAGE(SYSTEM_TICKS, c.err_timestamp, "update_error() didn't set channel's err_timestamp correctly");
+  Channel * const c = &channels[PUMPS_CHAN];
+  TIM_HandleTypeDef phony_timer;
+
+  SYSTEM_TICKS = 500;
+
+  // Readings are in range, only the sensor knows better
+  init_test_channel(c, PUMPS_CHAN, 0x42, &phony_timer, 1, 0x0200, 0x0100, 0x0500, 0x0400);
+  load_sample(c, 0x0150, 0x0450);
+  c->alert_pending = false;
+
+  TEST_ASSERT_FALSE_MESSAGE(update_error(c), "update_error() found error without alert");
+
+  // Another channel's alert isn't ours
+  HAL_GPIO_EXTI_Callback(ALERT_PIN(FANS_CHAN));
+  channels[FANS_CHAN].alert_pending = false;
+  TEST_ASSERT_FALSE_MESSAGE(c->alert_pending, "Took another channel's alert");
 
+  // Flags say the limit was crossed, no new conversion
+  uint8_t rx_buf[2] = { 0x00, INA226_MASK_AFF };
   rx_queue_start = &rx_buf[0];
+  rx_queue_end = &rx_buf[2];
+
+  uint8_t tx_buf[1];
   tx_queue_start = &tx_buf[0];
+  tx_queue_end = &tx_buf[1];
+  invalidate_reg_ptrs();
+
+  SYSTEM_TICKS = 510;
+  HAL_GPIO_EXTI_Callback(ALERT_PIN(PUMPS_CHAN));
+
+  // The flags are read on the next sample, which also releases the pin
+  sample_channel(c);
+  TEST_ASSERT_FALSE_MESSAGE(c->alert_pending, "Alert wasn't taken");
+  mock_i2c_run();
+  TEST_ASSERT_EQUAL_UINT8_MESSAGE(INA226_REG_MASK, tx_buf[0], "Didn't read mask to release alert");
+
+  TEST_ASSERT_TRUE_MESSAGE(update_error(c), "update_error() didn't return true for alert");
+  TEST_ASSERT_EQUAL_HEX8_MESSAGE(FAULT(channel_configs[PUMPS_CHAN].alert_error), c->faults, "Alert set wrong error");
+  TEST_ASSERT_EQUAL_MESSAGE(error_definitions[channel_configs[PUMPS_CHAN].alert_error].has_timeout,
+                            fault_timing_out(c, channel_configs[PUMPS_CHAN].alert_error), "Alert didn't start its fault's timeout");
+  TEST_ASSERT_FALSE_MESSAGE(c->limit_breached, "Breach was taken twice");
+}
 
-  TEST_ASSERT_FALSE_MESSAGE(update_error(&c), "update_error() returned true for channel without errors or timeout");
-  TEST_ASSERT_TRUE_MESSAGE(c.err == NO_ERROR, "update_error() set error incorrectly");
-  TEST_ASSERT_EQUAL_INT32_MESSAGE(SYSTEM_TICKS, c.err_timestamp, "update_error() set channel's err_timestamp incorrectly");
+// Updating and logging really depends on can
+
+void test_timeout_channel(void) {
+
+  Channel c;
+  TIM_HandleTypeDef phony_timer;
+
+  // Each limit fault on its own, the clean sample is 12 V and 3857 mA
+  struct {uint16_t voltage; int16_t current;} const faulty[NUM_LIMIT_FAULTS] = {
+    [OVER_VOLTAGE_ERROR]  = {12000, 3857},
+    [UNDER_VOLTAGE_ERROR] = {8000, 3857},
+    [OVER_CURRENT_ERROR]  = {9600, 6000},
+    [UNDER_CURRENT_ERROR] = {9600, 1},
+  };
+
+  for (int i = 0; i < NUM_LIMIT_FAULTS; i++) {
+
+    SYSTEM_TICKS = 14;
+
+    init_test_channel(&c, REGEN_CHAN, 0x53, &phony_timer, 133, 14000, 11000, 5000, 3);
+    load_sample(&c, faulty[i].voltage, faulty[i].current);
+    update_error(&c);
+
+    TEST_ASSERT_EQUAL_HEX8_MESSAGE(FAULT(i), c.faults, "Fault wasn't set");
+
+    Channel_Error const def = error_definitions[i];
+    // Without a timeout it's held past two turns of the wheel
+    uint32_t const held_until = def.has_timeout ? 14 + def.timeout_period : 14 + 2 * WHEEL_SLOTS;
 
+    // Try not timing out error
+    for (SYSTEM_TICKS = 15; SYSTEM_TICKS <= held_until; SYSTEM_TICKS++) {
+      load_sample(&c, 9600, 3857);
+      update_error(&c);
+
+      TEST_ASSERT_EQUAL_HEX8_MESSAGE(FAULT(i), c.faults, "Error timed-out early");
+    }
+
+    // Try timing out error
+    if (def.has_timeout) {
+      load_sample(&c, 9600, 3857);
+
+      TEST_ASSERT_TRUE_MESSAGE(update_error(&c), "Error didn't timeout");
+      TEST_ASSERT_EQUAL_HEX8_MESSAGE(0, c.faults, "Error didn't timeout");
+    }
+  }
+
+  // Faults time out on their own, the others stay, and seeing one again starts its timeout over
+  SYSTEM_TICKS = 14;
+
+  init_test_channel(&c, REGEN_CHAN, 0x53, &phony_timer, 133, 14000, 11000, 5000, 3);
+  load_sample(&c, 12000, 1);
+  update_error(&c);
+
+  SYSTEM_TICKS = 20;
+  load_sample(&c, 12000, 3857);
+  update_error(&c);
+
+  for (SYSTEM_TICKS = 21; SYSTEM_TICKS <= 20 + error_definitions[OVER_VOLTAGE_ERROR].timeout_period; SYSTEM_TICKS++) {
+    load_sample(&c, 9600, 3857);
+    update_error(&c);
+  }
+
+  TEST_ASSERT_EQUAL_HEX8_MESSAGE(FAULT(OVER_VOLTAGE_ERROR) | FAULT(UNDER_CURRENT_ERROR), c.faults, "Timed out from when the fault was first seen");
+
+  load_sample(&c, 9600, 3857);
+  update_error(&c);
+
+  TEST_ASSERT_EQUAL_HEX8_MESSAGE(FAULT(UNDER_CURRENT_ERROR), c.faults, "Timed out the wrong faults");
+
+  // Starting the channel over drops its timeouts
+  SYSTEM_TICKS = 100;
+
+  init_test_channel(&c, REGEN_CHAN, 0x53, &phony_timer, 133, 14000, 11000, 5000, 3);
+
+  for (int i = 0; i < NUM_FAULTS; i++) {
+    TEST_ASSERT_FALSE_MESSAGE(timeout_armed(FAULT_TIMEOUT(REGEN_CHAN, i)), "Timeout survived init_channel()");
+  }
 }
 
-// Mock a couple of hal functions so that MX_TIM4_Init() works
+void test_update_errors(void) {
 
-HAL_StatusTypeDef HAL_TIM_PWM_Init(TIM_HandleTypeDef * htim) {
+  Channel c;
+  TIM_HandleTypeDef phony_timer;
 
-  return HAL_OK;
+  SYSTEM_TICKS = 1990;
+
+  init_test_channel(&c, VCU_CHAN, 3, &phony_timer, 1, 0x00af, 0x0044, 0x0055, 0x0033); 
+  load_sample(&c, 0xbfff, 0x5544);
+  SYSTEM_TICKS = 18;
+
+  TEST_ASSERT_TRUE_MESSAGE(update_error(&c), "update_error() didn't return true, no error update was found"); 
+  TEST_ASSERT_EQUAL_HEX8_MESSAGE(FAULT(OVER_VOLTAGE_ERROR) | FAULT(OVER_CURRENT_ERROR), c.faults, "update_error() set channel to wrong errors");
+
+  TEST_ASSERT_EQUAL_MESSAGE(error_definitions[OVER_VOLTAGE_ERROR].has_timeout, fault_timing_out(&c, OVER_VOLTAGE_ERROR), "update_error() didn't start the fault's timeout");
+
+
+  init_test_channel(&c, VCU_CHAN, 3, &phony_timer, 1, 0xffaf, 0x0044, 0xff66, 0x0033); 
+  SYSTEM_TICKS = 1899;
+  load_sample(&c, 0xbfff, 0x5544);
+
+  TEST_ASSERT_FALSE_MESSAGE(update_error(&c), "update_error() returned true, but there was no error update");
+  TEST_ASSERT_EQUAL_HEX8_MESSAGE(0, c.faults, "update_error() gave channel error when none was present");
+  TEST_ASSERT_FALSE_MESSAGE(fault_timing_out(&c, OVER_VOLTAGE_ERROR), "update_error() started a timeout, but there was no error");
+
+
+}
+
+void test_update_errors_timeout(void) {
+
+  Channel c;
+  TIM_HandleTypeDef phony_timer;
+
+  SYSTEM_TICKS = 1990;
+
+  init_test_channel(&c, REGEN_CHAN, 2, &phony_timer, 1, 0x0123, 0x0023, 0xffff, 0x0000);
+
+  SYSTEM_TICKS = 199;
+  load_sample(&c, 0x0100, 0x0044);
+  update_error(&c);
+
+  TEST_ASSERT_EQUAL_HEX8_MESSAGE(FAULT(OVER_VOLTAGE_ERROR), c.faults, "update_error() didn't set the channel's error");
+
+  SYSTEM_TICKS = 199 + error_definitions[OVER_VOLTAGE_ERROR].timeout_period;
+  load_sample(&c, 0x0046, 0x0044);
+
+  TEST_ASSERT_FALSE_MESSAGE(update_error(&c), "update_error() timed out the channel's error early");
+
+  SYSTEM_TICKS++;
+  load_sample(&c, 0x0046, 0x0044);
+
+  TEST_ASSERT_TRUE_MESSAGE(update_error(&c), "update_error() didn't return true, no error update was found");
+  TEST_ASSERT_EQUAL_HEX8_MESSAGE(0, c.faults, "update_error() didn't clear the channel's errors");
+
+  TEST_ASSERT_FALSE_MESSAGE(update_error(&c), "update_error() returned true for channel without errors or timeout");
+  TEST_ASSERT_EQUAL_HEX8_MESSAGE(0, c.faults, "update_error() set error incorrectly");
 
 }
 
-HAL_StatusTypeDef HAL_TIMEx_MasterConfigSynchronization(TIM_HandleTypeDef * htim, TIM_MasterConfigTypeDef * sMasterConfig) {
+void test_fault_filters(void) {
+
+  Channel c;
+  TIM_HandleTypeDef phony_timer;
+
+  SYSTEM_TICKS = 3000;
+
+  // Under 12 V sets once 2 of the last 3 samples are under, and clears once 3 are 100 mV above
+  init_test_channel(&c, FANS_CHAN, 0x43, &phony_timer, 1, 14000, 12000, 5000, 0);
+  Channel_Config * const config = (Channel_Config *) c.config;
+  config->filters[UNDER_VOLTAGE_ERROR] = (Fault_Filter) {.band = 100, .set_n = 2, .clear_n = 3, .window = 3};
+  init_channel(&c, FANS_CHAN, 0x43, config);
+
+  int32_t const limit = bus_volt_counts(12000);
+  int32_t const band  = bus_volt_counts(100);
+
+  // A single dip doesn't set it
+  load_sample(&c, limit - 1, 100);
+  TEST_ASSERT_FALSE_MESSAGE(update_error(&c), "One sample set the fault");
+  load_sample(&c, limit, 100);
+  TEST_ASSERT_FALSE(update_error(&c));
+  load_sample(&c, limit, 100);
+  TEST_ASSERT_FALSE(update_error(&c));
+
+  // Two in three do
+  load_sample(&c, limit - 1, 100);
+  TEST_ASSERT_FALSE(update_error(&c));
+  load_sample(&c, limit + 1, 100);
+  TEST_ASSERT_FALSE(update_error(&c));
+  load_sample(&c, limit - 1, 100);
+  TEST_ASSERT_TRUE_MESSAGE(update_error(&c), "Two of three samples didn't set the fault");
+  TEST_ASSERT_EQUAL_HEX8(FAULT(UNDER_VOLTAGE_ERROR), c.faults);
+  TEST_ASSERT_EQUAL_INT32_MESSAGE(limit + band, c.checked_limits.volt_min, "Limit didn't move by the band");
+  TEST_ASSERT_EQUAL_INT32_MESSAGE(limit, c.limits.volt_min, "Moved the configured limit the sensor's ALERT is set from");
+  TEST_ASSERT_TRUE(c.limits_moved);
+
+  // Readings back over the limit but inside the band, or checked again without a new sample, hold it
+  for (int i = 0; i < 10; i++) {
+    SYSTEM_TICKS++;
+    load_sample(&c, limit + band - 1, 100);
+    TEST_ASSERT_FALSE_MESSAGE(update_error(&c), "Noise inside the band changed the fault");
+    TEST_ASSERT_FALSE(update_error(&c));
+  }
+
+  // Clear of the band for the whole window
+  load_sample(&c, limit + band, 100);
+  update_error(&c);
+  load_sample(&c, limit + band, 100);
+  update_error(&c);
+  TEST_ASSERT_TRUE_MESSAGE(c.confirmed & FAULT(UNDER_VOLTAGE_ERROR), "Cleared before the window was back in range");
+
+  load_sample(&c, limit + band, 100);
+  update_error(&c);
+  TEST_ASSERT_EQUAL_HEX8_MESSAGE(0, c.confirmed, "Window back in range didn't clear the filter");
+  TEST_ASSERT_EQUAL_INT32_MESSAGE(limit, c.checked_limits.volt_min, "Limit didn't move back");
+
+  // Then the fault waits out its timeout as before
+  TEST_ASSERT_EQUAL_HEX8(FAULT(UNDER_VOLTAGE_ERROR), c.faults);
+  SYSTEM_TICKS += error_definitions[UNDER_VOLTAGE_ERROR].timeout_period + 1;
+  TEST_ASSERT_TRUE(update_error(&c));
+  TEST_ASSERT_EQUAL_HEX8(0, c.faults);
+
+  // Windows up to the longest take the same few steps per sample
+  config->filters[OVER_CURRENT_ERROR] = (Fault_Filter) {.band = 0, .set_n = 12, .clear_n = 5, .window = FAULT_WINDOW_MAX};
+  init_channel(&c, FANS_CHAN, 0x43, config);
+
+  for (int i = 0; i < 3 * FAULT_WINDOW_MAX; i++) {
+    load_sample(&c, limit, (i % 4) ? 5001 : 100);
+    update_error(&c);
+    TEST_ASSERT_TRUE_MESSAGE(c.fault_counts[OVER_CURRENT_ERROR] <= FAULT_WINDOW_MAX, "Window count ran past the window");
+  }
+
+  TEST_ASSERT_EQUAL_UINT8_MESSAGE(12, c.fault_counts[OVER_CURRENT_ERROR], "Wrong count over a full window");
+  TEST_ASSERT_EQUAL_HEX8(FAULT(OVER_CURRENT_ERROR), c.faults);
+}
 
-  return HAL_OK;
+// Limits are checked against the smoothed readings, the raw ones stay as read
+void test_smoothing(void) {
 
-} 
+  Channel c;
+  TIM_HandleTypeDef phony_timer;
 
-HAL_StatusTypeDef HAL_TIM_PWM_ConfigChannel(TIM_HandleTypeDef * htim, TIM_OC_InitTypeDef * sConfig, uint32_t channel) {
+  SYSTEM_TICKS = 4000;
 
-  return HAL_OK;
+  init_test_channel(&c, PUMPS_CHAN, 0x42, &phony_timer, 1, 14000, 11000, 5000, 0);
+  Channel_Config * const config = (Channel_Config *) c.config;
+  config->smoothing = (Sample_Filter) {.type = FILTER_BOXCAR, .length = 4};
+  init_channel(&c, PUMPS_CHAN, 0x42, config);
 
-}  
+  load_sample(&c, 9600, 2000);
 
-HAL_StatusTypeDef HAL_TIM_PWM_Start(TIM_HandleTypeDef * htim, uint32_t channel) {
+  // One reading of inrush is a quarter of the average
+  load_sample(&c, 9600, 12000);
+  TEST_ASSERT_EQUAL_INT32_MESSAGE(12000, c.samples[CURRENT_READING].raw, "Smoothing changed the raw reading");
+  TEST_ASSERT_EQUAL_INT32(4500, c.samples[CURRENT_READING].filtered);
+  TEST_ASSERT_EQUAL_HEX8_MESSAGE(0, get_faults(&c), "Single spike tripped over current");
 
-  return HAL_OK;
+  // Taking the same reading again changes nothing
+  filter_channel(&c);
+  filter_channel(&c);
+  TEST_ASSERT_EQUAL_INT32_MESSAGE(4500, c.samples[CURRENT_READING].filtered, "Filtered a reading twice");
 
+  // Two are too many
+  load_sample(&c, 9600, 12000);
+  TEST_ASSERT_EQUAL_INT32(7000, c.samples[CURRENT_READING].filtered);
+  TEST_ASSERT_EQUAL_HEX8_MESSAGE(FAULT(OVER_CURRENT_ERROR), get_faults(&c), "Sustained over current missed");
 }
 
 void test_write_cmd(void) {
@@ -323,7 +938,7 @@ void test_write_cmd(void) {
   Channel c;
 
   MX_TIM4_Init();
-  init_channel(&c, AERO_CHAN, 2, &htim4, 0, 134, 4, 11, 4);
+  init_test_channel(&c, AERO_CHAN, 2, &htim4, 0, 134, 4, 11, 4);
  
   Channel_Cmd cmd = { CHANNEL_ON, 0};
 
@@ -361,6 +976,86 @@ void test_write_cmd(void) {
 
 }
 
+void test_sample_emulated_sensor(void) {
+
+  Channel c;
+  TIM_HandleTypeDef phony_timer;
+
+  mock_sensor_attach(0x46, SENSOR_MODEL);
+  invalidate_reg_ptrs();
+
+  SYSTEM_TICKS = 1000;
+  init_test_channel(&c, REGEN_CHAN, 0x46, &phony_timer, 1, 14000, 11000, 2000, 0);
+  TEST_ASSERT_EQUAL_INT(HAL_OK, configure_channel(&c));
+  TEST_ASSERT_EQUAL_HEX16_MESSAGE(sensor_conf(&c), mock_sensor_reg(0x46, SENSOR_REG_CONF), "Sensor wasn't programmed");
+
+  // 1.5 A through the 2 mOhm shunt at 12 V
+  mock_sensor_convert(0x46, 0, shunt_volt_counts(1500, 1000, 2000), bus_volt_counts(12000));
+
+  TEST_ASSERT_TRUE(sample_channel(&c));
+  mock_i2c_run();
+
+  TEST_ASSERT_FALSE_MESSAGE(c.sampling, "Sample didn't finish");
+  TEST_ASSERT_EQUAL_UINT32(1, c.stats.fresh_samples);
+  TEST_ASSERT_EQUAL_INT32(bus_volt_counts(12000), c.samples[BUS_VOLT_READING].raw);
+  TEST_ASSERT_UINT32_WITHIN(2000, 1500000, channel_current_ua(&c));
+  TEST_ASSERT_UINT32_WITHIN(100000, 18000000, channel_power_uw(&c));
+  filter_channel(&c);
+  TEST_ASSERT_TRUE(get_faults(&c) == 0);
+
+  // Reading the flags cleared the conversion
+  TEST_ASSERT_FALSE(mock_sensor_reg(0x46, SENSOR_REG_FLAGS) & SENSOR_FLAG_READY);
+
+  mock_sensor_reset();
+}
+
+void test_fault_responses(void) {
+
+  Channel c;
+
+  MX_TIM4_Init();
+  SYSTEM_TICKS = 1000;
+  init_test_channel(&c, FANS_CHAN, 0x43, &htim4, TIM_CHANNEL_1, 14000, 13000, 300, 3);
+  faulted_channels = 0;
+
+  // Every combination of faults gets the worst of their responses
+  for (uint32_t mask = 0; mask < NUM_FAULT_MASKS; mask++) {
+
+    bool shutoff = false;
+    for (int i = 0; i < NUM_FAULTS; i++) {
+      shutoff |= (mask & FAULT(i)) && response_matrix[i][FANS_CHAN] == SHUTOFF;
+    }
+
+    c.faults = mask;
+    htim4.Instance->CCR1 = 1234;
+    write_channel(&c);
+
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(shutoff ? 0 : UINT32_MAX, htim4.Instance->CCR1, "write_channel() responded to faults wrong");
+  }
+
+  // Under voltage and over current together go out in one frame
+  c.faults = 0;
+  can_frames = 0;
+  load_sample(&c, 9600, 3857);
+
+  TEST_ASSERT_TRUE(update_channel(&c));
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, can_frames, "Faults weren't logged in one frame");
+  TEST_ASSERT_EQUAL_HEX32(CAN_FAULT_ID, can_header.StdId);
+  TEST_ASSERT_EQUAL_UINT8(FANS_CHAN, can_data[0]);
+  TEST_ASSERT_EQUAL_HEX8_MESSAGE(FAULT(UNDER_VOLTAGE_ERROR) | FAULT(OVER_CURRENT_ERROR), can_data[1], "Frame didn't carry the whole mask");
+  TEST_ASSERT_EQUAL_UINT8(SHUTOFF, can_data[2]);
+  TEST_ASSERT_EQUAL_HEX8(1U << FANS_CHAN, can_data[3]);
+
+  // Both clear once they time out, which is logged too
+  SYSTEM_TICKS += error_definitions[UNDER_VOLTAGE_ERROR].timeout_period + 1;
+  load_sample(&c, 10800, 100);
+
+  TEST_ASSERT_TRUE(update_channel(&c));
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(2, can_frames, "Clearing faults wasn't logged");
+  TEST_ASSERT_EQUAL_HEX8(0, can_data[1]);
+  TEST_ASSERT_EQUAL_HEX32_MESSAGE(0, faulted_channels, "Channel was still flagged as faulted");
+}
+
 int main(void) {
   UNITY_BEGIN();
   RUN_TEST(test_should_always_pass);
@@ -368,10 +1063,24 @@ int main(void) {
   RUN_TEST(test_single_channel_initialization);
   RUN_TEST(test_channel_initialization_like_irl);
   RUN_TEST(test_errors);
+  RUN_TEST(test_limits_in_counts);
+  RUN_TEST(test_no_error_before_sampling);
+  RUN_TEST(test_sample_channel);
+  RUN_TEST(test_sample_channel_overdue);
+  RUN_TEST(test_sample_cache);
+  RUN_TEST(test_sample_registers);
+  RUN_TEST(test_discover_channels);
+  RUN_TEST(test_configure_channel);
+  RUN_TEST(test_check_channel);
+  RUN_TEST(test_alert_event);
   RUN_TEST(test_timeout_channel);
   RUN_TEST(test_update_errors); 
   RUN_TEST(test_update_errors_timeout);
+  RUN_TEST(test_fault_filters);
+  RUN_TEST(test_smoothing);
   RUN_TEST(test_write_cmd);
+  RUN_TEST(test_fault_responses);
+  RUN_TEST(test_sample_emulated_sensor);
   return UNITY_END();
 }
 
@@ -0,0 +1,270 @@
+#include "unity.h"
+#include "energy.h"
+#include "channels.h"
+#include "tim.h"
+#include "can.h"
+
+#include "mocks/mock_can.h"
+#include "mocks/mock_channels.h"
+#include "mocks/mock_tim.h"
+#include "mocks/mock_uart.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// 1 A and 12 V, in VCU_CHAN's current LSB and bus voltage counts
+#define ONE_AMP     10000
+#define TWELVE_VOLT 9600
+
+// Sets up every channel and starts every account over, nothing read yet
+static void start_energy(uint32_t ticks) {
+
+  init_mock_channels(ticks);
+  init_energy();
+  can_frames = 0;
+}
+
+// Loads a new sample into channel at the current tick, current in counts of whichever reading it samples
+static void load_sample(Channel * const channel, int32_t voltage, int32_t current) {
+
+  Reading_Type const reading = (channel->config->sensor.readings & READING(SHUNT_VOLT_READING)) ? SHUNT_VOLT_READING : CURRENT_READING;
+  uint32_t const seq = channel->samples[reading].seq + 1;
+
+  channel->samples[BUS_VOLT_READING] = (Cached_Sample) {.raw = voltage, .timestamp = SYSTEM_TICKS, .seq = seq, .quality = SAMPLE_GOOD};
+  channel->samples[reading]          = (Cached_Sample) {.raw = current, .timestamp = SYSTEM_TICKS, .seq = seq, .quality = SAMPLE_GOOD};
+}
+
+void test_should_always_pass(void) {}
+
+// An hour at 1 A and 12 V, sampled every 10 ms, is 1 Ah and 12 Wh exactly
+void test_constant_draw(void) {
+
+  start_energy(1000);
+
+  for (int i = 0; i <= 360000; i++) {
+    load_sample(&channels[VCU_CHAN], TWELVE_VOLT, ONE_AMP);
+    update_energy();
+    SYSTEM_TICKS += 10;
+  }
+
+  Energy_Totals const * const totals = energy_totals(VCU_CHAN);
+
+  TEST_ASSERT_TRUE_MESSAGE(totals->charge_nc == 3600LL * 1000000000, "Wrong charge");
+  TEST_ASSERT_TRUE_MESSAGE(totals->energy_nj == 12LL * 3600 * 1000000000, "Wrong energy");
+  TEST_ASSERT_EQUAL_INT32(1000, charge_mah(totals));
+  TEST_ASSERT_EQUAL_INT32(12000, energy_mwh(totals));
+  TEST_ASSERT_EQUAL_UINT32(3600000, totals->time_ms);
+
+  // Nothing new, nothing added
+  update_energy();
+  TEST_ASSERT_EQUAL_UINT32(3600000, totals->time_ms);
+
+  // The only channel drawing anything is the whole pack
+  TEST_ASSERT_TRUE_MESSAGE(memcmp(totals, energy_totals(ENERGY_PACK), sizeof(*totals)) == 0, "Pack isn't the sum of its channels");
+}
+
+// Each interval counts the average of the samples either side, using when they were read
+void test_trapezoids_and_gaps(void) {
+
+  start_energy(2000);
+  Channel * const vcu = &channels[VCU_CHAN];
+
+  load_sample(vcu, TWELVE_VOLT, 0);
+  update_energy();
+
+  SYSTEM_TICKS += 100;
+  load_sample(vcu, TWELVE_VOLT, 2 * ONE_AMP);
+
+  // Integrated by when the sample was read, not when it's accounted
+  SYSTEM_TICKS += 30;
+  update_energy();
+
+  TEST_ASSERT_TRUE_MESSAGE(energy_totals(VCU_CHAN)->charge_nc == 100000000, "Ramp from 0 to 2 A over 100 ms isn't 0.1 C");
+  TEST_ASSERT_EQUAL_UINT32(100, energy_totals(VCU_CHAN)->time_ms);
+
+  // Nothing is known about time past the channel's max age
+  SYSTEM_TICKS += channel_configs[VCU_CHAN].sensor.max_age_ms + 1;
+  load_sample(vcu, TWELVE_VOLT, 2 * ONE_AMP);
+  update_energy();
+
+  TEST_ASSERT_TRUE_MESSAGE(energy_totals(VCU_CHAN)->charge_nc == 100000000, "Integrated over a gap");
+  TEST_ASSERT_EQUAL_UINT32(100, energy_totals(VCU_CHAN)->time_ms);
+
+  // Then carries on from the sample after it
+  SYSTEM_TICKS += 10;
+  load_sample(vcu, TWELVE_VOLT, 2 * ONE_AMP);
+  update_energy();
+
+  TEST_ASSERT_TRUE(energy_totals(VCU_CHAN)->charge_nc == 120000000);
+  TEST_ASSERT_EQUAL_UINT32(110, energy_totals(VCU_CHAN)->time_ms);
+}
+
+void test_tick_wrap(void) {
+
+  start_energy(UINT32_MAX - 45);
+
+  for (int i = 0; i < 10; i++) {
+    load_sample(&channels[VCU_CHAN], TWELVE_VOLT, ONE_AMP);
+    update_energy();
+    SYSTEM_TICKS += 10;
+  }
+
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(90, energy_totals(VCU_CHAN)->time_ms, "Lost time across the tick wrapping");
+  TEST_ASSERT_TRUE(energy_totals(VCU_CHAN)->charge_nc == 90LL * 1000000);
+}
+
+// The pack adds up every channel as it goes, and resets come back out of it
+void test_pack_and_resets(void) {
+
+  start_energy(3000);
+
+  // REGEN_CHAN sends 1.5 A back through its 2 mOhm shunt, 18 W in its power register
+  int32_t const regen = shunt_volt_counts(-1500, 1000, 2000);
+
+  for (int i = 0; i <= 100; i++) {
+    load_sample(&channels[VCU_CHAN], TWELVE_VOLT, ONE_AMP);
+    load_sample(&channels[REGEN_CHAN], TWELVE_VOLT, regen);
+    channels[REGEN_CHAN].samples[POWER_READING] = (Cached_Sample) {.raw = 720, .timestamp = SYSTEM_TICKS, .seq = i + 1, .quality = SAMPLE_GOOD};
+    update_energy();
+    SYSTEM_TICKS += 10;
+  }
+
+  Energy_Totals const vcu = *energy_totals(VCU_CHAN);
+  Energy_Totals const regen_totals = *energy_totals(REGEN_CHAN);
+  Energy_Totals const * const pack = energy_totals(ENERGY_PACK);
+
+  TEST_ASSERT_TRUE_MESSAGE(regen_totals.charge_nc == -1500LL * 1000 * 1000, "Charge flowing back in wasn't negative");
+  TEST_ASSERT_TRUE(regen_totals.energy_nj == -18LL * 1000000 * 1000);
+  TEST_ASSERT_TRUE(pack->charge_nc == vcu.charge_nc + regen_totals.charge_nc);
+  TEST_ASSERT_TRUE(pack->energy_nj == vcu.energy_nj + regen_totals.energy_nj);
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(1000, pack->time_ms, "Counted the channels' time side by side twice");
+
+  reset_energy(REGEN_CHAN);
+  TEST_ASSERT_TRUE_MESSAGE(memcmp(&vcu, pack, sizeof(vcu)) == 0, "Channel reset didn't come out of the pack");
+  TEST_ASSERT_TRUE(energy_totals(REGEN_CHAN)->charge_nc == 0);
+
+  reset_energy(ENERGY_PACK);
+  TEST_ASSERT_TRUE(energy_totals(VCU_CHAN)->charge_nc == 0);
+  TEST_ASSERT_TRUE(pack->charge_nc == 0 && pack->energy_nj == 0 && pack->time_ms == 0);
+
+  // Carries on from the last sample after a reset
+  load_sample(&channels[VCU_CHAN], TWELVE_VOLT, ONE_AMP);
+  update_energy();
+  TEST_ASSERT_EQUAL_UINT32(10, pack->time_ms);
+
+  TEST_ASSERT_NULL(energy_totals(NUM_CHANNELS));
+}
+
+// Over 2.1 kW, past what an int32_t of uW holds
+void test_high_power(void) {
+
+  start_energy(6000);
+
+  // 200 A at 12 V, in 10 mA counts
+  Channel_Config config = channel_configs[VCU_CHAN];
+  config.sensor.current_lsb_ua = 10000;
+  init_channel(&channels[VCU_CHAN], VCU_CHAN, 0x40, &config);
+
+  for (int i = 0; i <= 100; i++) {
+    load_sample(&channels[VCU_CHAN], TWELVE_VOLT, 20000);
+    update_energy();
+    SYSTEM_TICKS += 10;
+  }
+
+  TEST_ASSERT_TRUE_MESSAGE(energy_totals(VCU_CHAN)->energy_nj == 2400LL * 1000000 * 1000, "Power overflowed");
+
+  // Flowing back in it keeps its sign
+  load_sample(&channels[VCU_CHAN], TWELVE_VOLT, -20000);
+  update_energy();
+
+  TEST_ASSERT_TRUE(energy_totals(VCU_CHAN)->energy_nj == 2400LL * 1000000 * 1000);
+  TEST_ASSERT_TRUE(energy_accounts[VCU_CHAN].power_uw == -2400LL * 1000000);
+
+  init_channel(&channels[VCU_CHAN], VCU_CHAN, 0x40, &channel_configs[VCU_CHAN]);
+}
+
+void test_can_requests(void) {
+
+  start_energy(4000);
+
+  for (int i = 0; i <= 360; i++) {
+    load_sample(&channels[VCU_CHAN], TWELVE_VOLT, 2 * ONE_AMP);
+    update_energy();
+    SYSTEM_TICKS += 10;
+  }
+
+  // 2 A and 24 W for 3.6 s is 2 mAh and 24 mWh
+  uint8_t const query[] = {VCU_CHAN, ENERGY_QUERY};
+  handle_energy_request(query, sizeof(query));
+
+  uint8_t const expected[8] = {VCU_CHAN, 0, 0, 2, 0, 0, 0, 24};
+
+  TEST_ASSERT_EQUAL_UINT32(1, can_frames);
+  TEST_ASSERT_EQUAL_HEX32(CAN_ENERGY_ID, can_header.StdId);
+  TEST_ASSERT_EQUAL_UINT32(8, can_header.DLC);
+  for (int i = 0; i < 8; i++) {
+    TEST_ASSERT_EQUAL_HEX8_MESSAGE(expected[i], can_data[i], "Wrong energy frame");
+  }
+
+  // Every channel then the pack
+  uint8_t const query_all[] = {ENERGY_PACK, ENERGY_QUERY};
+  handle_energy_request(query_all, sizeof(query_all));
+
+  TEST_ASSERT_EQUAL_UINT32(2 + NUM_CHANNELS, can_frames);
+  TEST_ASSERT_EQUAL_HEX8(ENERGY_PACK, can_data[0]);
+  TEST_ASSERT_EQUAL_HEX8(24, can_data[7]);
+
+  // Short frames are ignored, resets send nothing
+  handle_energy_request(query, 1);
+  uint8_t const reset[] = {ENERGY_PACK, ENERGY_RESET};
+  handle_energy_request(reset, sizeof(reset));
+
+  TEST_ASSERT_EQUAL_UINT32(2 + NUM_CHANNELS, can_frames);
+  TEST_ASSERT_TRUE(energy_totals(ENERGY_PACK)->charge_nc == 0);
+}
+
+void test_repl_command(void) {
+
+  start_energy(5000);
+
+  for (int i = 0; i <= 360; i++) {
+    load_sample(&channels[VCU_CHAN], TWELVE_VOLT, ONE_AMP);
+    update_energy();
+    SYSTEM_TICKS += 10;
+  }
+
+  char argv[MAX_ARGS][MAX_ARG_LEN] = {"energy"};
+
+  printed[0] = '\0';
+  TEST_ASSERT_EQUAL_INT(REPL_CONTINUE, energy_command(0, argv));
+  TEST_ASSERT_NOT_NULL_MESSAGE(strstr(printed, "Pack: 1 mAh, 12 mWh over 3 s"), "Didn't print the pack's totals");
+
+  strcpy(argv[1], "reset");
+  TEST_ASSERT_EQUAL_INT(REPL_CONTINUE, energy_command(1, argv));
+  TEST_ASSERT_TRUE(energy_totals(ENERGY_PACK)->charge_nc == 0);
+}
+
+int main(void) {
+  UNITY_BEGIN();
+
+  RUN_TEST(test_should_always_pass);
+  RUN_TEST(test_constant_draw);
+  RUN_TEST(test_trapezoids_and_gaps);
+  RUN_TEST(test_tick_wrap);
+  RUN_TEST(test_pack_and_resets);
+  RUN_TEST(test_high_power);
+  RUN_TEST(test_can_requests);
+  RUN_TEST(test_repl_command);
+
+  return UNITY_END();
+}
+
+
+void _Error_Handler(char *file, int line)
+{
+
+  char error_message[10000];
+  sprintf(&error_message[0], "Error was thrown at line %d in %s", line, file);
+  TEST_FAIL_MESSAGE(error_message);
+
+}
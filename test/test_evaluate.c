@@ -0,0 +1,174 @@
+#include "unity.h"
+#include "evaluate.h"
+#include "channels.h"
+#include "i2c.h"
+#include "tim.h"
+#include "can.h"
+
+#include "mocks/mock_channels.h"
+#include "mocks/mock_random.h"
+#include "mocks/mock_simd.h"
+#include "mocks/mock_tim.h"
+
+#include <stdio.h>
+
+// Readings either side of and right on each limit, plus the ends of the range
+static int32_t const edges[] = {INT16_MIN, -1201, -1200, -1199, -1, 0, 1, 99, 100, 101, 8799, 8800, 8801, 10000, 10001, INT16_MAX};
+#define NUM_EDGES (sizeof(edges) / sizeof(edges[0]))
+
+// Sets up every channel with limits the tests pick
+static void init_limits(uint32_t ticks) {
+
+  init_mock_channels(ticks);
+
+  for (Channel_Name name = 0; name < NUM_CHANNELS; name++) {
+    channels[name].checked_limits = (Raw_Limits) {
+      .volt_min = 8800, .volt_max = 10000,
+      .curr_min = 100, .curr_max = 10000,
+      .shunt_min = -1200, .shunt_max = 1200,
+    };
+  }
+
+  init_evaluation();
+}
+
+// Loads a reading, if channel samples it
+static void load_reading(Channel * const channel, Reading_Type reading, int32_t raw) {
+  if (!(channel->config->sensor.readings & READING(reading))) return;
+  channel->samples[reading] = (Cached_Sample) {.raw = raw, .filtered = raw, .timestamp = SYSTEM_TICKS, .seq = 1, .quality = SAMPLE_GOOD};
+}
+
+// Checks evaluate_all_channels() finds what get_faults() does on every channel
+static void check_all_channels(char const * const message) {
+
+  Fault_Mask faults[NUM_CHANNELS];
+  evaluate_all_channels(faults);
+
+  for (int i = 0; i < NUM_CHANNELS; i++) {
+    TEST_ASSERT_EQUAL_HEX8_MESSAGE(get_faults(&channels[i]), faults[i], message);
+  }
+}
+
+void test_should_always_pass(void) {}
+
+// The packed and scalar kernels agree on every word, bit for bit
+void test_packed_matches_scalar(void) {
+
+  Packed_Channels packed;
+
+  // Every run checks the same words
+  seed_random(12345);
+
+  for (int run = 0; run < 20000; run++) {
+
+    uint32_t *const words[] = {packed.volt, packed.curr, packed.volt_floor, packed.volt_max, packed.curr_floor, packed.curr_max};
+
+    for (int k = 0; k < 6; k++) {
+      for (int w = 0; w < EVAL_WORDS; w++) {
+        words[k][w] = next_random();
+      }
+    }
+
+    // Plenty of limits right on their readings
+    for (int k = 2; k < 6; k++) {
+      for (int w = 0; w < EVAL_WORDS; w++) {
+        if (next_random() & 1) {
+          words[k][w] = words[k < 4 ? 0 : 1][w];
+        }
+      }
+    }
+
+    for (int i = 0; i < NUM_CHANNELS; i++) {
+      packed.checked[i] = next_random() & (NUM_FAULT_MASKS - 1);
+      packed.found[i]   = next_random() & FAULT(SENSOR_ERROR);
+    }
+
+    Fault_Mask simd[NUM_CHANNELS];
+    Fault_Mask scalar[NUM_CHANNELS];
+
+    evaluate_packed(&packed, simd);
+    evaluate_packed_scalar(&packed, scalar);
+
+    for (int i = 0; i < NUM_CHANNELS; i++) {
+      TEST_ASSERT_EQUAL_HEX8_MESSAGE(scalar[i], simd[i], "Packed and scalar kernels disagree");
+    }
+  }
+}
+
+void test_matches_get_faults(void) {
+
+  init_limits(1000);
+
+  // Nothing read yet, nothing to find
+  check_all_channels("Checked readings that never arrived");
+
+  // Each channel's voltage and current sweep past their limits, out of step with each other
+  for (int v = 0; v < NUM_EDGES; v++) {
+    for (int c = 0; c < NUM_EDGES; c++) {
+
+      for (int i = 0; i < NUM_CHANNELS; i++) {
+        load_reading(&channels[i], BUS_VOLT_READING, edges[(v + i) % NUM_EDGES]);
+        load_reading(&channels[i], CURRENT_READING, edges[(c + 2 * i) % NUM_EDGES]);
+        load_reading(&channels[i], SHUNT_VOLT_READING, edges[(c + 3 * i) % NUM_EDGES]);
+      }
+
+      check_all_channels("Batch found different faults than get_faults()");
+    }
+  }
+
+  // REGEN_CHAN checks its current through the shunt voltage
+  load_reading(&channels[REGEN_CHAN], BUS_VOLT_READING, 9600);
+  load_reading(&channels[REGEN_CHAN], SHUNT_VOLT_READING, 1201);
+
+  Fault_Mask faults[NUM_CHANNELS];
+  evaluate_all_channels(faults);
+  TEST_ASSERT_EQUAL_HEX8_MESSAGE(FAULT(OVER_CURRENT_ERROR), faults[REGEN_CHAN], "Missed over current in shunt voltage");
+
+  // Readings go stale on their own schedules
+  SYSTEM_TICKS += channel_configs[SHUTDOWN_CHAN].sensor.max_age_ms + 1;
+  check_all_channels("Stale readings weren't sensor errors");
+}
+
+// Limits past the register's range still hold against the largest reading
+void test_limits_saturate(void) {
+
+  init_limits(2000);
+
+  channels[VCU_CHAN].checked_limits.volt_min = 40000;
+  channels[VCU_CHAN].checked_limits.volt_max = 50000;
+  channels[SHUTDOWN_CHAN].checked_limits.volt_max = 60000;
+  init_evaluation();
+
+  for (int i = 0; i < NUM_CHANNELS; i++) {
+    load_reading(&channels[i], BUS_VOLT_READING, INT16_MAX);
+    load_reading(&channels[i], CURRENT_READING, 200);
+  }
+
+  Fault_Mask faults[NUM_CHANNELS];
+  evaluate_all_channels(faults);
+
+  TEST_ASSERT_EQUAL_HEX8_MESSAGE(FAULT(UNDER_VOLTAGE_ERROR), faults[VCU_CHAN], "Full scale wasn't under a minimum past it");
+  TEST_ASSERT_EQUAL_HEX8_MESSAGE(0, faults[SHUTDOWN_CHAN], "Full scale was over a maximum past it");
+  check_all_channels("Saturated limits found different faults");
+}
+
+int main(void) {
+  UNITY_BEGIN();
+
+  RUN_TEST(test_should_always_pass);
+  RUN_TEST(test_packed_matches_scalar);
+  RUN_TEST(test_matches_get_faults);
+  RUN_TEST(test_limits_saturate);
+
+  return UNITY_END();
+}
+
+
+void _Error_Handler(char *file, int line)
+{
+
+  char error_message[10000];
+  sprintf(&error_message[0], "Error was thrown at line %d in %s", line, file);
+  TEST_FAIL_MESSAGE(error_message);
+
+}
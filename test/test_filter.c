@@ -0,0 +1,159 @@
+#include "unity.h"
+#include "filter.h"
+
+#include "mocks/mock_random.h"
+
+#include <math.h>
+#include <stdio.h>
+
+#define STEPS 2000
+
+// A noisy supply that steps, spikes and swings the full range now and then
+static int32_t supply_reading(int step) {
+
+  if (step % 500 > 480) {
+    return (step & 1) ? SENSOR_READING_MAX : -SENSOR_READING_MAX;
+  }
+
+  int32_t const level = (step / 250) % 2 ? 9600 : 8000;
+  int32_t const noise = (int32_t) (next_random() >> 24) - 128;
+  int32_t const spike = step % 97 == 0 ? 5000 : 0;
+
+  return level + noise + spike;
+}
+
+// The same STEPS readings for every filter
+static int32_t test_reading(int step) {
+
+  static int32_t readings[STEPS];
+  static bool filled = false;
+
+  // Every run filters the same readings
+  if (!filled) seed_random(2024);
+
+  for (int i = 0; !filled && i < STEPS; i++) {
+    readings[i] = supply_reading(i);
+  }
+
+  filled = true;
+  return readings[step];
+}
+
+void test_should_always_pass(void) {}
+
+void test_no_filter(void) {
+
+  Sample_Filter const filter = NO_SMOOTHING;
+  Filter_State state;
+  filter_reset(&state);
+
+  for (int i = 0; i < 100; i++) {
+    int32_t const reading = test_reading(i);
+    TEST_ASSERT_EQUAL_INT32_MESSAGE(reading, filter_step(&filter, &state, reading), "Unfiltered reading changed");
+  }
+}
+
+// The fixed point IIR stays within a count of the same filter in doubles
+void test_iir_matches_double(void) {
+
+  double const alphas[] = {0.01, 0.1, 0.25, 0.5, 0.9, 0.999};
+
+  for (int a = 0; a < sizeof(alphas) / sizeof(alphas[0]); a++) {
+
+    Sample_Filter const filter = {.type = FILTER_IIR, .alpha = FILTER_Q15(alphas[a])};
+    double const alpha = filter.alpha / 32768.0;
+
+    Filter_State state;
+    filter_reset(&state);
+
+    double y = test_reading(0);
+
+    for (int i = 0; i < STEPS; i++) {
+
+      int32_t const reading = test_reading(i);
+      y += alpha * (reading - y);
+
+      char message[64];
+      sprintf(message, "alpha %.3f off at step %d", alphas[a], i);
+      TEST_ASSERT_TRUE_MESSAGE(fabs(filter_step(&filter, &state, reading) - y) <= 1.0, message);
+    }
+  }
+}
+
+// The boxcar rounds the same mean the doubles find
+void test_boxcar_matches_double(void) {
+
+  for (int length = 1; length <= FILTER_BOXCAR_MAX; length++) {
+
+    Sample_Filter const filter = {.type = FILTER_BOXCAR, .length = length};
+    Filter_State state;
+    filter_reset(&state);
+
+    for (int i = 0; i < STEPS; i++) {
+
+      // Before the window fills, the first reading stands in for the ones missing
+      double sum = 0;
+      for (int j = i - length + 1; j <= i; j++) {
+        sum += test_reading(j < 0 ? 0 : j);
+      }
+
+      char message[64];
+      sprintf(message, "length %d off at step %d", length, i);
+      TEST_ASSERT_TRUE_MESSAGE(fabs(filter_step(&filter, &state, test_reading(i)) - sum / length) <= 0.5, message);
+    }
+  }
+}
+
+// A one reading spike moves a boxcar by its share, and an IIR by alpha's
+void test_spike(void) {
+
+  Sample_Filter const boxcar = {.type = FILTER_BOXCAR, .length = 4};
+  Sample_Filter const iir = {.type = FILTER_IIR, .alpha = FILTER_Q15(0.25)};
+  Filter_State boxcar_state, iir_state;
+  filter_reset(&boxcar_state);
+  filter_reset(&iir_state);
+
+  TEST_ASSERT_EQUAL_INT32_MESSAGE(8000, filter_step(&boxcar, &boxcar_state, 8000), "First reading didn't prime the boxcar");
+  TEST_ASSERT_EQUAL_INT32_MESSAGE(8000, filter_step(&iir, &iir_state, 8000), "First reading didn't prime the IIR");
+
+  TEST_ASSERT_EQUAL_INT32(9000, filter_step(&boxcar, &boxcar_state, 12000));
+  TEST_ASSERT_EQUAL_INT32(9000, filter_step(&iir, &iir_state, 12000));
+
+  // Gone from the boxcar once it leaves the window
+  for (int i = 0; i < 3; i++) {
+    TEST_ASSERT_EQUAL_INT32(9000, filter_step(&boxcar, &boxcar_state, 8000));
+  }
+  TEST_ASSERT_EQUAL_INT32(8000, filter_step(&boxcar, &boxcar_state, 8000));
+
+  // And settled out of the IIR, right on the reading
+  for (int i = 0; i < 100; i++) {
+    filter_step(&iir, &iir_state, 8000);
+  }
+  TEST_ASSERT_EQUAL_INT32(8000, filter_step(&iir, &iir_state, 8000));
+
+  // Reset starts over from the next reading
+  filter_reset(&boxcar_state);
+  TEST_ASSERT_EQUAL_INT32(-200, filter_step(&boxcar, &boxcar_state, -200));
+}
+
+int main(void) {
+  UNITY_BEGIN();
+
+  RUN_TEST(test_should_always_pass);
+  RUN_TEST(test_no_filter);
+  RUN_TEST(test_iir_matches_double);
+  RUN_TEST(test_boxcar_matches_double);
+  RUN_TEST(test_spike);
+
+  return UNITY_END();
+}
+
+
+void _Error_Handler(char *file, int line)
+{
+
+  char error_message[10000];
+  sprintf(&error_message[0], "Error was thrown at line %d in %s", line, file);
+  TEST_FAIL_MESSAGE(error_message);
+
+}
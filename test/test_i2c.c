@@ -1,9 +1,12 @@
 #include "unity.h"
 #include "i2c.h"
+#include "sensor.h"
 
 #include <stdio.h>
+#include <string.h>
 
-#include "mocks/i2c-mock.h"
+#include "mocks/mock_i2c.h"
+#include "mocks/mock_timing.h"
 
 void test_should_always_pass(void) {}
 
@@ -20,7 +23,7 @@ void test_register_read(void) {
   tx_queue_end = &tx_buf[2];
 
   uint16_t rsp;
-  read_reg(13, 31, &rsp);
+  read_reg(I2C_BUS_1, 13, 31, &rsp);
   TEST_ASSERT_EQUAL_UINT16_MESSAGE(31 << 1, transmit_address, "Wrote wrong i2c address during Read");
   TEST_ASSERT_EQUAL_UINT16_MESSAGE(31 << 1, receive_address, "Read from wrong i2c address");
   TEST_ASSERT_EQUAL_UINT8_MESSAGE(13, tx_buf[0], "Set register pointer to wrong address");
@@ -46,7 +49,7 @@ void test_register_many_read(void) {
     // Reset transmit queue
     tx_queue_start = &tx_buf[0];
 
-    read_reg(registers[i], i2c_channel[i], &rsp);
+    read_reg(I2C_BUS_1, registers[i], i2c_channel[i], &rsp);
 
     TEST_ASSERT_EQUAL_UINT16_MESSAGE(i2c_channel[i] << 1, transmit_address, "Wrote wrong i2c address during read");
     TEST_ASSERT_EQUAL_UINT16_MESSAGE(i2c_channel[i] << 1, receive_address, "Read from wrong i2c address");
@@ -56,71 +59,694 @@ void test_register_many_read(void) {
   }
 }
 
-void test_read_voltage(void) {
+void test_register_write(void) {
+  uint8_t tx_buf[3];
+  tx_queue_start = &tx_buf[0];
+  tx_queue_end = &tx_buf[3];
+
+  write_reg(I2C_BUS_1, 34, 2, 83);
+  TEST_ASSERT_EQUAL_UINT16_MESSAGE(2 << 1, transmit_address, "Transmitted to wrong address");
+  TEST_ASSERT_EQUAL_UINT8_MESSAGE(34, tx_buf[0], "First byte transmitted is wrong");
+  TEST_ASSERT_EQUAL_UINT8_MESSAGE(0, tx_buf[1], "Second byte transmitted is wrong"); 
+  TEST_ASSERT_EQUAL_UINT8_MESSAGE(83, tx_buf[2], "Third byte transmitted is wrong"); 
+}
+
+void test_register_many_write(void) {
+  uint8_t tx_buf[3];
+  
+  uint8_t registers[9] = { 32, 44, 23, 92, 43, 43, 99, 90, 34};
+  uint8_t i2c_channel[9] = { 34, 45, 24, 31, 44, 24, 33, 211, 234};
+  uint16_t value[9]       = { 0, 43, 183, 3539, 39, 363, 239, 22, 31 };
+
+  for (int i = 0; i < 9; i++) {
+    tx_queue_start = &tx_buf[0];
+    tx_queue_end = &tx_buf[3];
+    
+    write_reg(I2C_BUS_1, registers[i], i2c_channel[i], value[i]);
+    
+    TEST_ASSERT_EQUAL_HEX16_MESSAGE(i2c_channel[i] << 1, transmit_address, "Transmitted to wrong address");
+    TEST_ASSERT_EQUAL_UINT8_MESSAGE(registers[i], tx_buf[0], "Wrote to wrong register");
+    TEST_ASSERT_EQUAL_UINT8_MESSAGE(value[i] >> 8, tx_buf[1], "Wrote wrong first byte of value"); 
+    TEST_ASSERT_EQUAL_UINT8_MESSAGE((uint8_t) value[i], tx_buf[2], "Wrote wrong second byte of value");
+  }
+}  
+
+void test_read_uses_repeated_start(void) {
+
+  uint8_t rx_buf[2] = {0x12, 0x34};
+  rx_queue_start = &rx_buf[0];
+  rx_queue_end = &rx_buf[2];
 
   uint8_t tx_buf[1];
   tx_queue_start = &tx_buf[0];
   tx_queue_end = &tx_buf[1];
 
-  uint8_t rx_buf[2] = {0xae, 0x31};
+  mock_i2c_transfers = 0;
+  i2c_stats = (I2C_Stats) {0};
+  invalidate_reg_ptrs();
+
+  uint16_t voltage;
+  read_reg(I2C_BUS_1, INA226_REG_BUS_VOLT, 0x40, &voltage);
+
+  TEST_ASSERT_EQUAL_HEX16_MESSAGE(0x1234, voltage, "Read wrong voltage");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, mock_i2c_transfers, "Read wasn't a single combined transfer");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, i2c_stats.transactions, "Counted wrong number of transactions");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(I2C_READ_CYCLES, i2c_stats.cycles, "Counted wrong number of bus cycles");
+
+  // Writing the pointer and reading it back in separate transactions costs a STOP and a START more
+  uint32_t split_cycles = (I2C_START_CYCLES + 2*I2C_BYTE_CYCLES + I2C_STOP_CYCLES) + (I2C_START_CYCLES + 3*I2C_BYTE_CYCLES + I2C_STOP_CYCLES);
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(split_cycles - I2C_STOP_CYCLES, i2c_stats.cycles, "Combined read didn't save a STOP");
+}
+
+void test_pointer_cache(void) {
+
+  uint8_t rx_buf[40];
+  for (int i = 0; i < 40; i++) rx_buf[i] = i;
+  rx_queue_start = &rx_buf[0];
+  rx_queue_end = &rx_buf[40];
+
+  uint8_t tx_buf[8];
+  tx_queue_start = &tx_buf[0];
+  tx_queue_end = &tx_buf[8];
+
+  i2c_stats = (I2C_Stats) {0};
+  invalidate_reg_ptrs();
+  mock_cpu_cycles = UINT32_MAX - 4;
+
+  // Poll one register, only the first read should select it
+  uint16_t current;
+  for (int i = 0; i < 10; i++) {
+    read_reg(I2C_BUS_1, INA226_REG_CURRENT, 0x41, &current);
+    TEST_ASSERT_EQUAL_HEX16_MESSAGE((rx_buf[2*i] << 8) | rx_buf[2*i + 1], current, "Read wrong current");
+  }
+
+  TEST_ASSERT_EQUAL_INT_MESSAGE(1, tx_queue_start - &tx_buf[0], "Selected an already selected register");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(I2C_READ_CYCLES + 9*I2C_CACHED_READ_CYCLES, i2c_stats.cycles, "Counted wrong number of bus cycles");
+
+  // The mocked cycle counter ticks once between the start and end of each read, across its wrap too
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(10, i2c_stats.blocking_reads, "Didn't time every blocking read");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(10, i2c_stats.blocking_cycles, "Timed the blocking reads wrong");
+  TEST_ASSERT_EQUAL_UINT32(1, i2c_stats.blocking_cycles_max);
+
+  // Another device doesn't share the cached pointer
+  read_reg(I2C_BUS_1, INA226_REG_CURRENT, 0x42, &current);
+  TEST_ASSERT_EQUAL_INT_MESSAGE(2, tx_queue_start - &tx_buf[0], "Used another device's register pointer");
+
+  // Another register has to be selected
+  read_reg(I2C_BUS_1, INA226_REG_BUS_VOLT, 0x41, &current);
+  TEST_ASSERT_EQUAL_INT_MESSAGE(3, tx_queue_start - &tx_buf[0], "Didn't select new register");
+
+  // Writes, resets and errors forget the pointer
+  uint8_t *before = tx_queue_start;
+  write_reg(I2C_BUS_1, INA226_REG_CAL, 0x41, 0);
+  read_reg(I2C_BUS_1, INA226_REG_BUS_VOLT, 0x41, &current);
+  TEST_ASSERT_EQUAL_UINT8_MESSAGE(INA226_REG_BUS_VOLT, tx_queue_start[-1], "Didn't select register after write");
+  TEST_ASSERT_EQUAL_INT_MESSAGE(4, tx_queue_start - before, "Didn't select register after write");
+
+  tx_queue_start = &tx_buf[0];
+  reset_channel(I2C_BUS_1, 0x41);
+  read_reg(I2C_BUS_1, INA226_REG_BUS_VOLT, 0x41, &current);
+  TEST_ASSERT_EQUAL_INT_MESSAGE(4, tx_queue_start - &tx_buf[0], "Didn't select register after reset");
+
+  // 0x42 still points at the current register, so only the read after the error selects it
+  tx_queue_start = &tx_buf[0];
+  mock_i2c_status = HAL_ERROR;
+  read_reg(I2C_BUS_1, INA226_REG_CURRENT, 0x42, &current);
+  mock_i2c_status = HAL_OK;
+  read_reg(I2C_BUS_1, INA226_REG_CURRENT, 0x42, &current);
+  TEST_ASSERT_EQUAL_INT_MESSAGE(1, tx_queue_start - &tx_buf[0], "Didn't select register after error");
+}
+
+// Reads reg_count registers, failing the ones where fail[i] is true
+void read_with_errors(int reg_count, bool (*fail)(int)) {
+
+  uint8_t rx_buf[2];
+  uint8_t tx_buf[1];
+  uint16_t rsp;
+
+  for (int i = 0; i < reg_count; i++) {
+    rx_queue_start = &rx_buf[0];
+    rx_queue_end = &rx_buf[2];
+    tx_queue_start = &tx_buf[0];
+    tx_queue_end = &tx_buf[1];
+    
+    mock_i2c_status = fail(i) ? HAL_ERROR : HAL_OK;
+    read_reg(I2C_BUS_1, INA226_REG_BUS_VOLT, 0x40 + i % 6, &rsp);
+  }
+
+  mock_i2c_status = HAL_OK;
+}
+
+bool fail_one_in_ten(int i) { return i % 10 == 0; }
+bool fail_one_in_hundred(int i) { return i % 100 == 0; }
+
+void test_bus_speed(void) {
+
+  MX_I2C1_Init();
+
+  TEST_ASSERT_EQUAL_INT_MESSAGE(I2C_DEFAULT_SPEED, i2c_speed(I2C_BUS_1), "Bus didn't start at default speed");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(i2c_speed_hz(I2C_BUS_1), hi2c1.Init.ClockSpeed, "Controller set to wrong speed");
+
+  TEST_ASSERT_EQUAL_INT_MESSAGE(HAL_OK, i2c_set_speed(I2C_BUS_1, I2C_SPEED_STANDARD), "Couldn't set speed");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(100000, hi2c1.Init.ClockSpeed, "Controller set to wrong speed");
+  
+  TEST_ASSERT_EQUAL_INT_MESSAGE(HAL_OK, i2c_set_speed(I2C_BUS_1, I2C_SPEED_FAST), "Couldn't set speed");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(400000, hi2c1.Init.ClockSpeed, "Controller set to wrong speed");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(400000, i2c_speed_hz(I2C_BUS_1), "Reported wrong speed");
+
+  TEST_ASSERT_EQUAL_INT_MESSAGE(HAL_ERROR, i2c_set_speed(I2C_BUS_1, NUM_I2C_SPEEDS), "Set invalid speed");
+}
+
+void test_bus_speed_fallback(void) {
+
+  i2c_set_speed(I2C_BUS_1, I2C_SPEED_FAST);
+  update_bus();
+
+  // A clean enough bus stays fast
+  read_with_errors(I2C_SPEED_WINDOW, fail_one_in_hundred);
+  update_bus();
+  TEST_ASSERT_EQUAL_INT_MESSAGE(I2C_SPEED_FAST, i2c_speed(I2C_BUS_1), "Slowed a clean bus down");
+
+  // Errors other than NACKs and lost arbitration aren't the bus speed's fault
+  mock_i2c_error = HAL_I2C_ERROR_OVR;
+  read_with_errors(I2C_SPEED_WINDOW, fail_one_in_ten);
+  update_bus();
+  TEST_ASSERT_EQUAL_INT_MESSAGE(I2C_SPEED_FAST, i2c_speed(I2C_BUS_1), "Slowed down for overrun errors");
+
+  // A NACKing bus steps down
+  mock_i2c_error = HAL_I2C_ERROR_AF;
+  read_with_errors(I2C_SPEED_WINDOW, fail_one_in_ten);
+  update_bus();
+  TEST_ASSERT_EQUAL_INT_MESSAGE(I2C_SPEED_STANDARD, i2c_speed(I2C_BUS_1), "Didn't slow down an erroring bus");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(100000, hi2c1.Init.ClockSpeed, "Controller wasn't slowed down");
+
+  // But never below standard speed
+  mock_i2c_error = HAL_I2C_ERROR_ARLO;
+  read_with_errors(I2C_SPEED_WINDOW, fail_one_in_ten);
+  update_bus();
+  TEST_ASSERT_EQUAL_INT_MESSAGE(I2C_SPEED_STANDARD, i2c_speed(I2C_BUS_1), "Slowed down past standard speed");
+
+  mock_i2c_error = HAL_I2C_ERROR_AF;
+  i2c_set_speed(I2C_BUS_1, I2C_DEFAULT_SPEED);
+}
+
+bool never_fail(int i) { return false; }
+
+void test_samples_per_second(void) {
+
+  SYSTEM_TICKS = 5000;
+  update_bus();
+  SYSTEM_TICKS = 10000;
+  update_bus();
+
+  read_with_errors(350, never_fail);
+  read_with_errors(50, fail_one_in_ten);
+
+  SYSTEM_TICKS = 10500;
+  update_bus();
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, i2c_samples_per_second(), "Sample rate updated before a second passed");
+
+  SYSTEM_TICKS = 12000;
+  update_bus();
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(197, i2c_samples_per_second(), "Measured wrong sample rate");
+}
+
+// Records queued transactions in the order they complete
+
+#define MAX_COMPLETIONS 32
+
+I2C_Transaction completions[MAX_COMPLETIONS];
+HAL_StatusTypeDef completion_status[MAX_COMPLETIONS];
+int completion_count;
+
+void record_completion(I2C_Transaction const * const txn, HAL_StatusTypeDef status) {
+  TEST_ASSERT_TRUE_MESSAGE(completion_count < MAX_COMPLETIONS, "Too many completions");
+  completions[completion_count] = *txn;
+  completion_status[completion_count] = status;
+  completion_count++;
+}
+
+void test_queue_read_order(void) {
+
+  // Two registers from each of six devices
+  uint8_t devices[6] = { 0x40, 0x41, 0x42, 0x43, 0x44, 0x45 };
+  uint8_t registers[2] = { INA226_REG_BUS_VOLT, INA226_REG_CURRENT };
+  
+  uint8_t rx_buf[24];
+  for (int i = 0; i < 24; i++) rx_buf[i] = 3*i + 1;
+  rx_queue_start = &rx_buf[0];
+  rx_queue_end = &rx_buf[24];
+
+  uint8_t tx_buf[12];
+  tx_queue_start = &tx_buf[0];
+  tx_queue_end = &tx_buf[12];
+
+  completion_count = 0;
+  mock_i2c_transfers = 0;
+  i2c_stats = (I2C_Stats) {0};
+  invalidate_reg_ptrs();
+
+  for (int i = 0; i < 12; i++) {
+    int context = i;
+    TEST_ASSERT_EQUAL_INT_MESSAGE(HAL_OK, queue_read(I2C_BUS_1, registers[i % 2], devices[i / 2], record_completion, (void*) (intptr_t) context), "Couldn't queue read");
+  }
+
+  // Queueing returns straight away, nothing has been on the bus yet
+  TEST_ASSERT_EQUAL_INT_MESSAGE(0, completion_count, "Queueing waited on the bus");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, mock_i2c_transfers, "Queueing waited on the bus");
+  TEST_ASSERT_FALSE_MESSAGE(i2c_queue_idle(), "Queue idle with reads waiting");
+
+  // Let the interrupts run everything back to back
+  mock_i2c_run();
+
+  TEST_ASSERT_TRUE_MESSAGE(i2c_queue_idle(), "Queue not idle after bus went quiet");
+  TEST_ASSERT_EQUAL_INT_MESSAGE(12, completion_count, "Wrong number of completions");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(12, mock_i2c_transfers, "Wrong number of transfers per read");
+
+  for (int i = 0; i < 12; i++) {
+    TEST_ASSERT_EQUAL_INT_MESSAGE(i, (intptr_t) completions[i].context, "Reads completed out of order");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(HAL_OK, completion_status[i], "Read failed");
+    TEST_ASSERT_EQUAL_UINT8_MESSAGE(devices[i / 2], completions[i].channel_addr, "Read wrong device");
+    TEST_ASSERT_EQUAL_UINT8_MESSAGE(registers[i % 2], tx_buf[i], "Set register pointer to wrong address");
+    TEST_ASSERT_EQUAL_HEX16_MESSAGE((rx_buf[2*i] << 8) | rx_buf[2*i + 1], completions[i].rsp, "Read wrong value from register");
+  }
+
+  // Registers alternate, so every read selects its register
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(12 * I2C_READ_CYCLES, i2c_stats.cycles, "Counted wrong number of bus cycles");
+}
+
+void test_queue_write(void) {
+
+  uint8_t rx_buf[2] = { 0x12, 0x34 };
   rx_queue_start = &rx_buf[0];
   rx_queue_end = &rx_buf[2];
 
-  uint16_t voltage;
-  read_voltage(39, &voltage);
+  uint8_t tx_buf[5];
+  tx_queue_start = &tx_buf[0];
+  tx_queue_end = &tx_buf[5];
+
+  completion_count = 0;
+  i2c_stats = (I2C_Stats) {0};
+  invalidate_reg_ptrs();
+
+  TEST_ASSERT_EQUAL_INT(HAL_OK, queue_read(I2C_BUS_1, INA226_REG_CURRENT, 0x40, record_completion, NULL));
+  TEST_ASSERT_EQUAL_INT(HAL_OK, queue_write(I2C_BUS_1, INA226_REG_CAL, 0x40, 0xa1b2, record_completion, NULL));
+
+  mock_i2c_run();
+
+  TEST_ASSERT_EQUAL_INT(2, completion_count);
+  TEST_ASSERT_EQUAL_INT(HAL_OK, completion_status[1]);
+  TEST_ASSERT_EQUAL_UINT8_MESSAGE(INA226_REG_CAL, tx_buf[1], "Wrote wrong register");
+  TEST_ASSERT_EQUAL_HEX8_MESSAGE(0xa1, tx_buf[2], "Wrote wrong value");
+  TEST_ASSERT_EQUAL_HEX8_MESSAGE(0xb2, tx_buf[3], "Wrote wrong value");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, i2c_stats.reads, "Counted the write as a read");
+  TEST_ASSERT_EQUAL_UINT32(I2C_READ_CYCLES + I2C_WRITE_CYCLES, i2c_stats.cycles);
+
+  // The write moved the register pointer off the current register
+  rx_queue_start = &rx_buf[0];
+  queue_read(I2C_BUS_1, INA226_REG_CURRENT, 0x40, NULL, NULL);
+  mock_i2c_run();
+  TEST_ASSERT_EQUAL_UINT8_MESSAGE(INA226_REG_CURRENT, tx_buf[4], "Trusted a pointer across a write");
+}
+
+void test_queue_full(void) {
+
+  completion_count = 0;
+
+  for (int i = 0; i < I2C_QUEUE_LEN; i++) {
+    TEST_ASSERT_EQUAL_INT_MESSAGE(HAL_OK, queue_read(I2C_BUS_1, INA226_REG_CURRENT, 0x40, NULL, NULL), "Couldn't queue read");
+  }
+
+  TEST_ASSERT_EQUAL_INT_MESSAGE(HAL_BUSY, queue_read(I2C_BUS_1, INA226_REG_CURRENT, 0x40, record_completion, NULL), "Queued past the end of the queue");
+
+  // Drain it for the next test
+  uint8_t rx_buf[2 * I2C_QUEUE_LEN];
+  rx_queue_start = &rx_buf[0];
+  rx_queue_end = &rx_buf[2 * I2C_QUEUE_LEN];
+
+  uint8_t tx_buf[I2C_QUEUE_LEN];
+  tx_queue_start = &tx_buf[0];
+  tx_queue_end = &tx_buf[I2C_QUEUE_LEN];
+
+  mock_i2c_run();
   
-  TEST_ASSERT_EQUAL_UINT8_MESSAGE(INA226_REG_BUS_VOLT, tx_buf[0], "Didn't set voltage register for read");
-  TEST_ASSERT_EQUAL_HEX16_MESSAGE(0xae31, voltage, "Read wrong voltage");
+  TEST_ASSERT_TRUE_MESSAGE(i2c_queue_idle(), "Queue didn't drain");
+  TEST_ASSERT_EQUAL_INT_MESSAGE(0, completion_count, "Rejected read was completed");
 }
- 
-void test_read_current(void) {
 
+void test_queue_pointer_cache(void) {
+
+  uint8_t rx_buf[10];
+  rx_queue_start = &rx_buf[0];
+  rx_queue_end = &rx_buf[10];
+
+  uint8_t tx_buf[4];
+  tx_queue_start = &tx_buf[0];
+  tx_queue_end = &tx_buf[4];
+
+  completion_count = 0;
+  invalidate_reg_ptrs();
+
+  // Steady polling of one register only selects it once
+  for (int i = 0; i < 3; i++) {
+    queue_read(I2C_BUS_1, INA226_REG_CURRENT, 0x43, record_completion, NULL);
+  }
+  mock_i2c_run();
+
+  TEST_ASSERT_EQUAL_INT_MESSAGE(1, tx_queue_start - &tx_buf[0], "Queue selected an already selected register");
+
+  // A failed read forgets the pointer
+  mock_i2c_status = HAL_ERROR;
+  queue_read(I2C_BUS_1, INA226_REG_CURRENT, 0x43, record_completion, NULL);
+  mock_i2c_run();
+  mock_i2c_status = HAL_OK;
+
+  queue_read(I2C_BUS_1, INA226_REG_CURRENT, 0x43, record_completion, NULL);
+  mock_i2c_run();
+
+  TEST_ASSERT_EQUAL_INT_MESSAGE(HAL_ERROR, completion_status[3], "Failed read wasn't reported");
+  TEST_ASSERT_EQUAL_INT_MESSAGE(HAL_OK, completion_status[4], "Read after error failed");
+  TEST_ASSERT_EQUAL_INT_MESSAGE(2, tx_queue_start - &tx_buf[0], "Queue didn't select register after error");
+}
+
+// Records the completion, the first one queues another read of the same register
+static void requeue_completion(I2C_Transaction const * const txn, HAL_StatusTypeDef status) {
+  record_completion(txn, status);
+  if (completion_count == 1) queue_read(txn->bus, txn->reg_addr, txn->channel_addr, record_completion, NULL);
+}
+
+void test_stall_recovery(void) {
+
+  uint8_t rx_buf[2] = { 0x12, 0x34 };
   uint8_t tx_buf[1];
+
+  completion_count = 0;
+  i2c_stats = (I2C_Stats) {0};
+  i2c_set_speed(I2C_BUS_1, I2C_SPEED_FAST);
+  invalidate_reg_ptrs();
+
+  // A device holding SDA low until it gets 3 more clocks
+  mock_i2c_stuck = 3;
+  mock_i2c_clocks = 0;
+  mock_time_us = 1000;
+  uint32_t inits = mock_i2c_inits;
+
+  TEST_ASSERT_EQUAL_INT(HAL_OK, queue_read(I2C_BUS_1, INA226_REG_BUS_VOLT, 0x4a, requeue_completion, NULL));
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, mock_i2c_run(), "Stuck transfer completed");
+
+  // 48 cycles at 400 kHz is 120 us, give or take the budget
+  mock_time_us += 120 * I2C_BUDGET_MARGIN;
+  update_bus();
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, i2c_stats.stalls, "Stalled inside time budget");
+  TEST_ASSERT_FALSE(i2c_queue_idle());
+
+  mock_time_us += I2C_BUDGET_SLACK_US + 1;
+  update_bus();
+
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, i2c_stats.stalls, "Didn't catch stall");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, i2c_stats.recoveries, "Didn't recover bus");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, mock_i2c_stuck, "Bus still stuck");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(3 + 1, mock_i2c_clocks, "Clocked more than the device and a STOP needed");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(inits + 1, mock_i2c_inits, "Controller wasn't re-initialized");
+  TEST_ASSERT_EQUAL_INT(1, completion_count);
+  TEST_ASSERT_EQUAL_INT_MESSAGE(HAL_TIMEOUT, completion_status[0], "Stalled read didn't time out");
+
+  // Bus works again, for the read queued as the stalled one finished
+  TEST_ASSERT_FALSE_MESSAGE(i2c_queue_idle(), "Read queued during recovery didn't start");
+
+  rx_queue_start = &rx_buf[0];
+  rx_queue_end = &rx_buf[2];
   tx_queue_start = &tx_buf[0];
   tx_queue_end = &tx_buf[1];
 
-  uint8_t rx_buf[2] = {0xfd, 0x3d};
+  mock_i2c_run();
+  TEST_ASSERT_TRUE(i2c_queue_idle());
+  TEST_ASSERT_EQUAL_INT(HAL_OK, completion_status[1]);
+  TEST_ASSERT_EQUAL_HEX16(0x1234, completions[1].rsp);
+
+  // A dead device gets the whole recovery and still holds on
+  mock_i2c_stuck = UINT32_MAX;
+  mock_i2c_clocks = 0;
+  TEST_ASSERT_EQUAL_INT_MESSAGE(HAL_ERROR, recover_bus(I2C_BUS_1), "Recovered a dead bus");
+  TEST_ASSERT_EQUAL_UINT32(I2C_RECOVERY_CLOCKS + 1, mock_i2c_clocks);
+
+  // Blocking transfers recover the bus themselves
+  uint16_t rsp;
+  mock_i2c_stuck = 1;
+  TEST_ASSERT_EQUAL_INT(HAL_BUSY, read_reg(I2C_BUS_1, INA226_REG_BUS_VOLT, 0x4b, &rsp));
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, mock_i2c_stuck, "Blocking read didn't recover bus");
+}
+
+// Blocking transfers keep off a bus the queue is using, rather than recovering it
+void test_blocking_while_queued(void) {
+
+  uint8_t rx_buf[4] = { 0x12, 0x34, 0x56, 0x78 };
+  uint8_t tx_buf[1];
+  uint8_t found[4];
+  uint16_t rsp;
+
+  rx_queue_start = &rx_buf[0];
+  rx_queue_end = &rx_buf[4];
+  tx_queue_start = &tx_buf[0];
+  tx_queue_end = &tx_buf[1];
+  invalidate_reg_ptrs();
+
+  completion_count = 0;
+  i2c_stats = (I2C_Stats) {0};
+  mock_i2c_transfers = 0;
+  mock_i2c_present[0x41] = true;
+
+  TEST_ASSERT_EQUAL_INT(HAL_OK, queue_read(I2C_BUS_1, INA226_REG_BUS_VOLT, 0x4a, record_completion, NULL));
+
+  TEST_ASSERT_EQUAL_INT(HAL_BUSY, read_reg(I2C_BUS_1, INA226_REG_CURRENT, 0x4b, &rsp));
+  TEST_ASSERT_EQUAL_INT(HAL_BUSY, write_reg(I2C_BUS_1, INA226_REG_CONF, 0x4b, 0x4127));
+  TEST_ASSERT_EQUAL_INT(HAL_BUSY, reset_bus(I2C_BUS_1));
+  TEST_ASSERT_EQUAL_UINT8(0, scan_bus(I2C_BUS_1, found, 4));
+
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, mock_i2c_transfers, "Blocking transfer went on the queue's bus");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, i2c_stats.recoveries, "Recovered a bus the queue was using");
+
+  // The queued read is left to finish, then blocking reads go ahead
+  mock_i2c_run();
+  TEST_ASSERT_EQUAL_INT(1, completion_count);
+  TEST_ASSERT_EQUAL_INT(HAL_OK, completion_status[0]);
+  TEST_ASSERT_EQUAL_HEX16(0x1234, completions[0].rsp);
+
+  TEST_ASSERT_EQUAL_INT(HAL_OK, read_reg(I2C_BUS_1, INA226_REG_BUS_VOLT, 0x4a, &rsp));
+  TEST_ASSERT_EQUAL_HEX16(0x5678, rsp);
+
+  memset(mock_i2c_present, 0, sizeof(mock_i2c_present));
+}
+
+void test_quarantine(void) {
+
+  uint8_t rx_buf[2];
+  uint8_t tx_buf[1];
+  uint16_t rsp;
+
+  i2c_stats = (I2C_Stats) {0};
+  SYSTEM_TICKS = 5000;
+
+  // A few failures are let go
+  mock_i2c_status = HAL_ERROR;
+  for (int i = 0; i < I2C_QUARANTINE_FAILURES; i++) {
+    TEST_ASSERT_FALSE_MESSAGE(i2c_quarantined(I2C_BUS_1, 0x4c), "Quarantined too early");
+    rx_queue_start = &rx_buf[0];
+    rx_queue_end = &rx_buf[2];
+    tx_queue_start = &tx_buf[0];
+    tx_queue_end = &tx_buf[1];
+    read_reg(I2C_BUS_1, INA226_REG_CURRENT, 0x4c, &rsp);
+  }
+
+  TEST_ASSERT_TRUE_MESSAGE(i2c_quarantined(I2C_BUS_1, 0x4c), "Failing device wasn't quarantined");
+  TEST_ASSERT_FALSE_MESSAGE(i2c_quarantined(I2C_BUS_1, 0x4d), "Quarantined a healthy device");
+
+  // Quarantined devices cost no bus time
+  mock_i2c_transfers = 0;
+  TEST_ASSERT_EQUAL_INT(HAL_BUSY, read_reg(I2C_BUS_1, INA226_REG_CURRENT, 0x4c, &rsp));
+  TEST_ASSERT_EQUAL_INT(HAL_BUSY, write_reg(I2C_BUS_1, INA226_REG_CONF, 0x4c, 0));
+  TEST_ASSERT_EQUAL_INT(HAL_BUSY, queue_read(I2C_BUS_1, INA226_REG_CURRENT, 0x4c, NULL, NULL));
+  TEST_ASSERT_EQUAL_UINT32(0, mock_i2c_transfers);
+  TEST_ASSERT_EQUAL_UINT32(3, i2c_stats.skipped);
+
+  // Probe fails, backoff doubles
+  SYSTEM_TICKS += I2C_BACKOFF_MIN_MS;
+  TEST_ASSERT_FALSE(i2c_quarantined(I2C_BUS_1, 0x4c));
+  rx_queue_start = &rx_buf[0];
+  rx_queue_end = &rx_buf[2];
+  tx_queue_start = &tx_buf[0];
+  tx_queue_end = &tx_buf[1];
+  read_reg(I2C_BUS_1, INA226_REG_CURRENT, 0x4c, &rsp);
+
+  SYSTEM_TICKS += 2*I2C_BACKOFF_MIN_MS - 1;
+  TEST_ASSERT_TRUE_MESSAGE(i2c_quarantined(I2C_BUS_1, 0x4c), "Backoff didn't double");
+  SYSTEM_TICKS += 1;
+  TEST_ASSERT_FALSE(i2c_quarantined(I2C_BUS_1, 0x4c));
+
+  // Probe succeeds, device is trusted again
+  mock_i2c_status = HAL_OK;
   rx_queue_start = &rx_buf[0];
   rx_queue_end = &rx_buf[2];
+  tx_queue_start = &tx_buf[0];
+  tx_queue_end = &tx_buf[1];
+  TEST_ASSERT_EQUAL_INT(HAL_OK, read_reg(I2C_BUS_1, INA226_REG_CURRENT, 0x4c, &rsp));
 
-  uint16_t current;
-  read_current(39, &current);
-  
-  TEST_ASSERT_EQUAL_UINT8_MESSAGE(INA226_REG_CURRENT, tx_buf[0], "Didn't set current register for read");
-  TEST_ASSERT_EQUAL_HEX16_MESSAGE(0xfd3d, current, "Read wrong current");
+  mock_i2c_status = HAL_ERROR;
+  rx_queue_start = &rx_buf[0];
+  rx_queue_end = &rx_buf[2];
+  read_reg(I2C_BUS_1, INA226_REG_CURRENT, 0x4c, &rsp);
+  TEST_ASSERT_FALSE_MESSAGE(i2c_quarantined(I2C_BUS_1, 0x4c), "Recovered device quarantined on first failure");
+
+  TEST_ASSERT_EQUAL_UINT32(2, i2c_stats.quarantines);
+  mock_i2c_status = HAL_OK;
 }
 
-void test_register_write(void) {
-  uint8_t tx_buf[3];
+// Cycle time of reading every channel's voltage and current with the
+// channels spread over bus_count buses, in us from the bus cost model
+uint32_t sample_cycle_us(int bus_count) {
+
+  uint8_t rx_buf[24] = {0};
+  rx_queue_start = &rx_buf[0];
+  rx_queue_end = &rx_buf[24];
+
+  uint8_t tx_buf[12];
   tx_queue_start = &tx_buf[0];
-  tx_queue_end = &tx_buf[3];
+  tx_queue_end = &tx_buf[12];
 
-  write_reg(34, 2, 83);
-  TEST_ASSERT_EQUAL_UINT16_MESSAGE(2 << 1, transmit_address, "Transmitted to wrong address");
-  TEST_ASSERT_EQUAL_UINT8_MESSAGE(34, tx_buf[0], "First byte transmitted is wrong");
-  TEST_ASSERT_EQUAL_UINT16_MESSAGE(83, tx_buf[1], "Second byte transmitted is wrong"); 
+  invalidate_reg_ptrs();
+
+  for (int bus = 0; bus < NUM_I2C_BUSES; bus++) {
+    i2c_set_speed(bus, I2C_SPEED_FAST);
+    i2c_bus_stats[bus] = (I2C_Stats) {0};
+  }
+
+  for (int channel = 0; channel < 6; channel++) {
+    TEST_ASSERT_EQUAL_INT(HAL_OK, queue_read(channel % bus_count, INA226_REG_BUS_VOLT, 0x40 + channel, NULL, NULL));
+    TEST_ASSERT_EQUAL_INT(HAL_OK, queue_read(channel % bus_count, INA226_REG_CURRENT, 0x40 + channel, NULL, NULL));
+  }
+
+  mock_i2c_run();
+  TEST_ASSERT_TRUE(i2c_queue_idle());
+
+  // The buses run side by side, so the slowest one sets the cycle time
+  uint32_t cycle_us = 0;
+
+  for (int bus = 0; bus < bus_count; bus++) {
+    uint32_t const bus_us = (uint64_t) i2c_bus_stats[bus].cycles * 1000000 / i2c_speed_hz(bus);
+    if (bus_us > cycle_us) cycle_us = bus_us;
+  }
+
+  return cycle_us;
 }
 
-void test_register_many_write(void) {
-  uint8_t tx_buf[3];
-  
-  uint8_t registers[9] = { 32, 44, 23, 92, 43, 43, 99, 90, 34};
-  uint8_t i2c_channel[9] = { 34, 45, 24, 31, 44, 24, 33, 211, 234};
-  uint16_t value[9]       = { 0, 43, 183, 3539, 39, 363, 239, 22, 31 };
+void test_parallel_buses(void) {
 
-  for (int i = 0; i < 9; i++) {
-    tx_queue_start = &tx_buf[0];
-    tx_queue_end = &tx_buf[3];
-    
-    write_reg(registers[i], i2c_channel[i], value[i]);
-    
-    TEST_ASSERT_EQUAL_HEX16_MESSAGE(i2c_channel[i] << 1, transmit_address, "Transmitted to wrong address");
-    TEST_ASSERT_EQUAL_UINT8_MESSAGE(registers[i], tx_buf[0], "Wrote to wrong register");
-    TEST_ASSERT_EQUAL_UINT8_MESSAGE((uint8_t) value[i], tx_buf[1], "Wrote wrong first byte of value"); 
-    TEST_ASSERT_EQUAL_UINT8_MESSAGE(((uint8_t*) &value)[1], tx_buf[2], "Wrote wrong second byte of value");
+  uint32_t cycle_us[NUM_I2C_BUSES + 1];
+
+  for (int bus_count = 1; bus_count <= NUM_I2C_BUSES; bus_count++) {
+    cycle_us[bus_count] = sample_cycle_us(bus_count);
+    printf("6 channels on %d bus(es): %lu us per sample cycle\n", bus_count, (unsigned long) cycle_us[bus_count]);
   }
-}  
 
+  // 12 reads of 48 SCL cycles at 400 kHz
+  TEST_ASSERT_EQUAL_UINT32(12 * I2C_READ_CYCLES * 1000000 / 400000, cycle_us[1]);
+
+  for (int bus_count = 2; bus_count <= NUM_I2C_BUSES; bus_count++) {
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(cycle_us[1] / bus_count, cycle_us[bus_count], "Buses didn't split the cycle evenly");
+  }
+
+  // Devices on different buses can share an address, but not a register pointer
+  uint8_t rx_buf[4] = { 0x11, 0x11, 0x22, 0x22 };
+  rx_queue_start = &rx_buf[0];
+  rx_queue_end = &rx_buf[4];
+
+  uint8_t tx_buf[2];
+  tx_queue_start = &tx_buf[0];
+  tx_queue_end = &tx_buf[2];
+
+  completion_count = 0;
+  queue_read(I2C_BUS_1, INA226_REG_BUS_VOLT, 0x40, record_completion, NULL);
+  mock_i2c_run();
+  queue_read(I2C_BUS_2, INA226_REG_BUS_VOLT, 0x40, record_completion, NULL);
+  mock_i2c_run();
+
+  TEST_ASSERT_EQUAL_INT(2, completion_count);
+  TEST_ASSERT_EQUAL_INT(I2C_BUS_1, completions[0].bus);
+  TEST_ASSERT_EQUAL_HEX16(0x1111, completions[0].rsp);
+  TEST_ASSERT_EQUAL_INT(I2C_BUS_2, completions[1].bus);
+  TEST_ASSERT_EQUAL_HEX16(0x2222, completions[1].rsp);
+  TEST_ASSERT_EQUAL_INT_MESSAGE(2, tx_queue_start - &tx_buf[0], "Used another bus's register pointer");
+}
+
+void test_scan_bus(void) {
+
+  // A pair of INA226s with someone else's part between them
+  uint8_t rx_buf[12] = {
+    0x54, 0x49, 0x22, 0x60,   // 0x41
+    0x12, 0x34, 0x22, 0x60,   // 0x44
+    0x54, 0x49, 0x22, 0x61,   // 0x47, a later revision
+  };
+  uint8_t tx_buf[6];
+  uint8_t found[4];
+
+  rx_queue_start = &rx_buf[0];
+  rx_queue_end = &rx_buf[12];
+  tx_queue_start = &tx_buf[0];
+  tx_queue_end = &tx_buf[6];
+  invalidate_reg_ptrs();
+
+  mock_i2c_present[0x41] = true;
+  mock_i2c_present[0x44] = true;
+  mock_i2c_present[0x47] = true;
+
+  i2c_stats = (I2C_Stats) {0};
+
+  TEST_ASSERT_EQUAL_UINT8_MESSAGE(2, scan_bus(I2C_BUS_1, found, 4), "Found the wrong number of sensors");
+  TEST_ASSERT_EQUAL_HEX8(0x41, found[0]);
+  TEST_ASSERT_EQUAL_HEX8(0x47, found[1]);
+  TEST_ASSERT_EQUAL_UINT8_MESSAGE(INA226_REG_MFG_ID, tx_buf[0], "Didn't check the manufacturer");
+  TEST_ASSERT_EQUAL_UINT8_MESSAGE(INA226_REG_DIE_ID, tx_buf[1], "Didn't check the part");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, i2c_stats.errors, "Counted empty addresses as errors");
+  TEST_ASSERT_EQUAL_UINT32(INA226_ADDR_LAST - INA226_ADDR_FIRST + 1 + 6, i2c_stats.transactions);
+
+  // Stops probing once there's no room for more
+  rx_queue_start = &rx_buf[0];
+  tx_queue_start = &tx_buf[0];
+  mock_i2c_transfers = 0;
+
+  TEST_ASSERT_EQUAL_UINT8(1, scan_bus(I2C_BUS_1, found, 1));
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(4, mock_i2c_transfers, "Kept probing with no room left");
+
+  memset(mock_i2c_present, 0, sizeof(mock_i2c_present));
+}
+
+void test_reset_bus(void) {
+
+  uint8_t rx_buf[4] = {0};
+  uint8_t tx_buf[3];
+  uint16_t rsp;
+
+  rx_queue_start = &rx_buf[0];
+  rx_queue_end = &rx_buf[4];
+  tx_queue_start = &tx_buf[0];
+  tx_queue_end = &tx_buf[3];
+  invalidate_reg_ptrs();
+
+  read_reg(I2C_BUS_1, INA226_REG_CURRENT, 0x40, &rsp);
+
+  // One transaction resets every sensor
+  i2c_stats = (I2C_Stats) {0};
+
+  TEST_ASSERT_EQUAL_INT(HAL_OK, reset_bus(I2C_BUS_1));
+  TEST_ASSERT_EQUAL_HEX16_MESSAGE(I2C_GENERAL_CALL_ADDR, transmit_address, "Didn't use the general call");
+  TEST_ASSERT_EQUAL_HEX8_MESSAGE(I2C_GENERAL_CALL_RESET, tx_buf[1], "Didn't send reset");
+  TEST_ASSERT_EQUAL_UINT32(1, i2c_stats.transactions);
+  TEST_ASSERT_EQUAL_UINT32(I2C_GENERAL_CALL_CYCLES, i2c_stats.cycles);
+
+  // Reset moved every register pointer
+  read_reg(I2C_BUS_1, INA226_REG_CURRENT, 0x40, &rsp);
+  TEST_ASSERT_EQUAL_UINT8_MESSAGE(INA226_REG_CURRENT, tx_buf[2], "Trusted a pointer across reset");
+}
 
 int main(void) {
   UNITY_BEGIN();
@@ -129,8 +755,21 @@ int main(void) {
   RUN_TEST(test_register_many_write);
   RUN_TEST(test_register_read);
   RUN_TEST(test_register_many_read);
-  RUN_TEST(test_read_current);
-  RUN_TEST(test_read_voltage);
+  RUN_TEST(test_read_uses_repeated_start);
+  RUN_TEST(test_pointer_cache);
+  RUN_TEST(test_queue_read_order);
+  RUN_TEST(test_queue_write);
+  RUN_TEST(test_queue_full);
+  RUN_TEST(test_queue_pointer_cache);
+  RUN_TEST(test_bus_speed);
+  RUN_TEST(test_bus_speed_fallback);
+  RUN_TEST(test_samples_per_second);
+  RUN_TEST(test_stall_recovery);
+  RUN_TEST(test_blocking_while_queued);
+  RUN_TEST(test_quarantine);
+  RUN_TEST(test_parallel_buses);
+  RUN_TEST(test_scan_bus);
+  RUN_TEST(test_reset_bus);
   return UNITY_END();
 }
 
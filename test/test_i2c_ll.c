@@ -0,0 +1,293 @@
+#include "unity.h"
+#include "i2c_ll.h"
+#include "sensor.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "mocks/mock_i2c.h"
+#include "mocks/mock_i2c_ll.h"
+#include "mocks/mock_sensor.h"
+
+#define ADDR 0x45
+
+static I2C_TypeDef periph;
+static I2C_HandleTypeDef hi2c = {.Instance = &periph};
+
+// Fresh controller, bus and sensor for each test
+static void setup(void) {
+  mock_i2c_ll_reset(&periph);
+  mock_i2c_ll_hang = false;
+  mock_i2c_ll_stops = 0;
+  mock_i2c_stuck = 0;
+  mock_sensor_reset();
+  mock_sensor_attach(ADDR, SENSOR_INA226);
+  hi2c.State = HAL_I2C_STATE_READY;
+  hi2c.ErrorCode = HAL_I2C_ERROR_NONE;
+}
+
+void test_ll_mem_read(void) {
+
+  setup();
+  uint8_t buf[2];
+
+  mock_sensor_convert(ADDR, 0, -200, 9600);
+
+  TEST_ASSERT_EQUAL_INT(HAL_OK, i2c_ll_mem_read(&hi2c, ADDR, INA226_REG_BUS_VOLT, buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_HEX16_MESSAGE(9600, (buf[0] << 8) | buf[1], "Read wrong bus voltage");
+
+  TEST_ASSERT_EQUAL_INT(HAL_OK, i2c_ll_mem_read(&hi2c, ADDR, INA226_REG_SHUNT_VOLT, buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_HEX16_MESSAGE((uint16_t) -200, (buf[0] << 8) | buf[1], "Read wrong shunt voltage");
+
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(2, mock_i2c_ll_stops, "Each read should end in one STOP");
+  TEST_ASSERT_EQUAL_INT_MESSAGE(HAL_I2C_STATE_READY, hi2c.State, "Didn't hand the controller back");
+  TEST_ASSERT_EQUAL_UINT32(HAL_I2C_ERROR_NONE, hi2c.ErrorCode);
+}
+
+// Each length has its own sequence for the last bytes
+void test_ll_read_sizes(void) {
+
+  setup();
+  mock_sensor_attach(ADDR, SENSOR_INA228);
+  mock_sensor_convert(ADDR, 0, 0, 0x12345);
+
+  uint32_t const expected = mock_sensor_reg(ADDR, INA228_REG_BUS_VOLT);
+
+  for (uint16_t size = 1; size <= 4; size++) {
+
+    uint8_t buf[4] = {0xAA, 0xAA, 0xAA, 0xAA};
+    char message[64];
+    sprintf(message, "Read %d bytes wrong", size);
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(HAL_OK, i2c_ll_mem_read(&hi2c, ADDR, INA228_REG_BUS_VOLT, buf, size), message);
+
+    for (int i = 0; i < 4; i++) {
+      uint8_t const byte = i < 3 ? expected >> (8 * (2 - i)) : 0;
+      TEST_ASSERT_EQUAL_HEX8_MESSAGE(i < size ? byte : 0xAA, buf[i], message);
+    }
+  }
+}
+
+// Reading without selecting the register goes wherever the pointer was left
+void test_ll_receive(void) {
+
+  setup();
+  uint8_t buf[2];
+
+  TEST_ASSERT_EQUAL_INT(HAL_OK, i2c_ll_mem_read(&hi2c, ADDR, INA226_REG_MFG_ID, buf, sizeof(buf)));
+
+  mock_i2c_ll_accesses = 0;
+  TEST_ASSERT_EQUAL_INT(HAL_OK, i2c_ll_receive(&hi2c, ADDR, buf, sizeof(buf)));
+  uint32_t const cached_accesses = mock_i2c_ll_accesses;
+
+  TEST_ASSERT_EQUAL_HEX16_MESSAGE(INA226_MFG_ID, (buf[0] << 8) | buf[1], "Didn't read from the register pointer");
+
+  mock_i2c_ll_accesses = 0;
+  TEST_ASSERT_EQUAL_INT(HAL_OK, i2c_ll_mem_read(&hi2c, ADDR, INA226_REG_MFG_ID, buf, sizeof(buf)));
+
+  TEST_ASSERT_TRUE_MESSAGE(cached_accesses < mock_i2c_ll_accesses, "Cached read should touch fewer registers");
+}
+
+void test_ll_transmit(void) {
+
+  setup();
+  uint8_t msg[3] = {INA226_REG_CAL, 0x0A, 0x00};
+
+  TEST_ASSERT_EQUAL_INT(HAL_OK, i2c_ll_transmit(&hi2c, ADDR, msg, sizeof(msg)));
+
+  TEST_ASSERT_EQUAL_HEX16_MESSAGE(0x0A00, mock_sensor_reg(ADDR, INA226_REG_CAL), "Register write didn't land");
+  TEST_ASSERT_EQUAL_UINT32(1, mock_sensor_writes(ADDR));
+  TEST_ASSERT_EQUAL_UINT32(1, mock_i2c_ll_stops);
+
+  // The write moved the pointer too
+  uint8_t buf[2];
+  TEST_ASSERT_EQUAL_INT(HAL_OK, i2c_ll_receive(&hi2c, ADDR, buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_HEX16(0x0A00, (buf[0] << 8) | buf[1]);
+}
+
+void test_ll_nack(void) {
+
+  setup();
+  uint8_t buf[2];
+  uint8_t msg[3] = {INA226_REG_CAL, 0, 0};
+
+  TEST_ASSERT_EQUAL_INT_MESSAGE(HAL_ERROR, i2c_ll_mem_read(&hi2c, ADDR + 1, INA226_REG_CONF, buf, sizeof(buf)), "Missing device should NACK");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(HAL_I2C_ERROR_AF, hi2c.ErrorCode, "NACK should leave AF for count_result()");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, mock_i2c_ll_stops, "Didn't release the bus after the NACK");
+  TEST_ASSERT_EQUAL_HEX32_MESSAGE(0, periph.SR1 & I2C_SR1_AF, "Didn't clear AF");
+  TEST_ASSERT_EQUAL_INT(HAL_I2C_STATE_READY, hi2c.State);
+
+  TEST_ASSERT_EQUAL_INT(HAL_ERROR, i2c_ll_transmit(&hi2c, ADDR + 1, msg, sizeof(msg)));
+
+  // Next transfer starts clean
+  TEST_ASSERT_EQUAL_INT(HAL_OK, i2c_ll_mem_read(&hi2c, ADDR, INA226_REG_CONF, buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_UINT32(HAL_I2C_ERROR_NONE, hi2c.ErrorCode);
+}
+
+void test_ll_timeout(void) {
+
+  setup();
+  uint8_t buf[2];
+
+  mock_i2c_ll_hang = true;
+
+  TEST_ASSERT_EQUAL_INT_MESSAGE(HAL_TIMEOUT, i2c_ll_mem_read(&hi2c, ADDR, INA226_REG_CONF, buf, sizeof(buf)), "Hung controller should time out");
+  TEST_ASSERT_EQUAL_UINT32(HAL_I2C_ERROR_TIMEOUT, hi2c.ErrorCode);
+  TEST_ASSERT_EQUAL_INT(HAL_I2C_STATE_READY, hi2c.State);
+}
+
+void test_ll_busy(void) {
+
+  setup();
+  uint8_t buf[2];
+
+  // A device holding the bus
+  mock_i2c_stuck = 9;
+  TEST_ASSERT_EQUAL_INT_MESSAGE(HAL_BUSY, i2c_ll_mem_read(&hi2c, ADDR, INA226_REG_CONF, buf, sizeof(buf)), "Started on a held bus");
+  mock_i2c_stuck = 0;
+
+  // The HAL's interrupt transfer on the same controller
+  hi2c.State = HAL_I2C_STATE_BUSY;
+  mock_i2c_ll_accesses = 0;
+  TEST_ASSERT_EQUAL_INT_MESSAGE(HAL_BUSY, i2c_ll_mem_read(&hi2c, ADDR, INA226_REG_CONF, buf, sizeof(buf)), "Cut into a running transfer");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, mock_i2c_ll_accesses, "Touched the controller mid transfer");
+}
+
+#define CR2_IT (I2C_CR2_ITEVTEN | I2C_CR2_ITERREN | I2C_CR2_ITBUFEN)
+
+// The queue's transfers, stepped on by the interrupts
+void test_ll_it_read_sizes(void) {
+
+  setup();
+  mock_sensor_attach(ADDR, SENSOR_INA228);
+  mock_sensor_convert(ADDR, 0, 0, 0x12345);
+
+  uint32_t const expected = mock_sensor_reg(ADDR, INA228_REG_BUS_VOLT);
+
+  for (uint16_t size = 1; size <= 4; size++) {
+
+    uint8_t buf[4] = {0xAA, 0xAA, 0xAA, 0xAA};
+    char message[64];
+    sprintf(message, "Read %d bytes wrong", size);
+
+    mock_i2c_ll_stops = 0;
+    TEST_ASSERT_EQUAL_INT_MESSAGE(HAL_OK, i2c_ll_mem_read_it(&hi2c, ADDR, INA228_REG_BUS_VOLT, buf, size), message);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(HAL_I2C_STATE_BUSY_RX, hi2c.State, "Should run on from the interrupts");
+
+    mock_i2c_ll_run(&hi2c);
+
+    for (int i = 0; i < 4; i++) {
+      uint8_t const byte = i < 3 ? expected >> (8 * (2 - i)) : 0;
+      TEST_ASSERT_EQUAL_HEX8_MESSAGE(i < size ? byte : 0xAA, buf[i], message);
+    }
+
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, mock_i2c_ll_stops, message);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(HAL_I2C_STATE_READY, hi2c.State, message);
+    TEST_ASSERT_EQUAL_HEX32_MESSAGE(0, periph.CR2 & CR2_IT, "Left the interrupts on");
+  }
+}
+
+void test_ll_it_interrupts(void) {
+
+  setup();
+  uint8_t buf[2];
+
+  mock_sensor_convert(ADDR, 0, -200, 9600);
+
+  // SB, ADDR, TXE, BTF for the register, then SB, ADDR and BTF for both bytes
+  TEST_ASSERT_EQUAL_INT(HAL_OK, i2c_ll_mem_read_it(&hi2c, ADDR, INA226_REG_BUS_VOLT, buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(7, mock_i2c_ll_run(&hi2c), "Should take one interrupt per bus event");
+  TEST_ASSERT_EQUAL_HEX16(9600, (buf[0] << 8) | buf[1]);
+
+  // Cached, so no register
+  TEST_ASSERT_EQUAL_INT(HAL_OK, i2c_ll_receive_it(&hi2c, ADDR, buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_UINT32(3, mock_i2c_ll_run(&hi2c));
+  TEST_ASSERT_EQUAL_HEX16(9600, (buf[0] << 8) | buf[1]);
+}
+
+void test_ll_it_write(void) {
+
+  setup();
+  uint8_t val[2] = {0x0A, 0x00};
+  uint8_t buf[2];
+
+  TEST_ASSERT_EQUAL_INT(HAL_OK, i2c_ll_mem_write_it(&hi2c, ADDR, INA226_REG_CAL, val, sizeof(val)));
+  TEST_ASSERT_EQUAL_INT(HAL_I2C_STATE_BUSY_TX, hi2c.State);
+  mock_i2c_ll_run(&hi2c);
+
+  TEST_ASSERT_EQUAL_HEX16_MESSAGE(0x0A00, mock_sensor_reg(ADDR, INA226_REG_CAL), "Register write didn't land");
+  TEST_ASSERT_EQUAL_UINT32(1, mock_sensor_writes(ADDR));
+  TEST_ASSERT_EQUAL_UINT32(1, mock_i2c_ll_stops);
+  TEST_ASSERT_EQUAL_INT(HAL_I2C_STATE_READY, hi2c.State);
+  TEST_ASSERT_EQUAL_HEX32(0, periph.CR2 & CR2_IT);
+
+  // The write moved the pointer too
+  TEST_ASSERT_EQUAL_INT(HAL_OK, i2c_ll_receive_it(&hi2c, ADDR, buf, sizeof(buf)));
+  mock_i2c_ll_run(&hi2c);
+  TEST_ASSERT_EQUAL_HEX16(0x0A00, (buf[0] << 8) | buf[1]);
+}
+
+void test_ll_it_nack(void) {
+
+  setup();
+  uint8_t buf[2];
+
+  TEST_ASSERT_EQUAL_INT(HAL_OK, i2c_ll_mem_read_it(&hi2c, ADDR + 1, INA226_REG_CONF, buf, sizeof(buf)));
+  mock_i2c_ll_run(&hi2c);
+
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(HAL_I2C_ERROR_AF, hi2c.ErrorCode, "NACK should leave AF for count_result()");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, mock_i2c_ll_stops, "Didn't release the bus after the NACK");
+  TEST_ASSERT_EQUAL_HEX32_MESSAGE(0, periph.SR1 & I2C_SR1_AF, "Didn't clear AF");
+  TEST_ASSERT_EQUAL_INT(HAL_I2C_STATE_READY, hi2c.State);
+  TEST_ASSERT_EQUAL_HEX32(0, periph.CR2 & CR2_IT);
+
+  // Next transfer starts clean
+  TEST_ASSERT_EQUAL_INT(HAL_OK, i2c_ll_mem_read_it(&hi2c, ADDR, INA226_REG_CONF, buf, sizeof(buf)));
+  mock_i2c_ll_run(&hi2c);
+  TEST_ASSERT_EQUAL_UINT32(HAL_I2C_ERROR_NONE, hi2c.ErrorCode);
+  TEST_ASSERT_EQUAL_INT(HAL_I2C_STATE_READY, hi2c.State);
+}
+
+// Left for check_stall() to find
+void test_ll_it_hang(void) {
+
+  setup();
+  uint8_t buf[2];
+
+  mock_i2c_ll_hang = true;
+
+  TEST_ASSERT_EQUAL_INT(HAL_OK, i2c_ll_mem_read_it(&hi2c, ADDR, INA226_REG_CONF, buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_UINT32(0, mock_i2c_ll_run(&hi2c));
+  TEST_ASSERT_EQUAL_INT_MESSAGE(HAL_I2C_STATE_BUSY_RX, hi2c.State, "Hung transfer shouldn't look finished");
+
+  TEST_ASSERT_EQUAL_INT_MESSAGE(HAL_BUSY, i2c_ll_mem_read(&hi2c, ADDR, INA226_REG_CONF, buf, sizeof(buf)), "Cut into a hung transfer");
+}
+
+int main(void) {
+  UNITY_BEGIN();
+
+  RUN_TEST(test_ll_mem_read);
+  RUN_TEST(test_ll_read_sizes);
+  RUN_TEST(test_ll_receive);
+  RUN_TEST(test_ll_transmit);
+  RUN_TEST(test_ll_nack);
+  RUN_TEST(test_ll_timeout);
+  RUN_TEST(test_ll_busy);
+  RUN_TEST(test_ll_it_read_sizes);
+  RUN_TEST(test_ll_it_interrupts);
+  RUN_TEST(test_ll_it_write);
+  RUN_TEST(test_ll_it_nack);
+  RUN_TEST(test_ll_it_hang);
+
+  return UNITY_END();
+}
+
+
+void _Error_Handler(char *file, int line)
+{
+
+  char error_message[10000];
+  sprintf(&error_message[0], "Error was thrown at line %d in %s", line, file);
+  TEST_FAIL_MESSAGE(error_message);
+
+}
@@ -0,0 +1,282 @@
+#include "unity.h"
+#include "sampler.h"
+#include "channels.h"
+#include "i2c.h"
+#include "tim.h"
+#include "can.h"
+
+#include "mocks/mock_channels.h"
+#include "mocks/mock_i2c.h"
+#include "mocks/mock_tim.h"
+
+#include <stdio.h>
+
+// Flags with no new conversion, for every read a test makes
+static uint8_t rx_buf[16];
+static uint8_t tx_buf[32];
+
+// Sets up every channel with nothing to read until the test says so
+static void init_quiet_channels(uint32_t ticks) {
+
+  // Finish whatever the last test left on the buses
+  mock_i2c_run();
+
+  rx_queue_start = &rx_buf[0];
+  rx_queue_end = &rx_buf[16];
+  tx_queue_start = &tx_buf[0];
+  tx_queue_end = &tx_buf[32];
+  invalidate_reg_ptrs();
+
+  init_mock_channels(ticks);
+
+  for (Channel_Name name = 0; name < NUM_CHANNELS; name++) {
+    channels[name].alert_pending = false;
+  }
+}
+
+void test_should_always_pass(void) {}
+
+void test_earliest_deadline_first(void) {
+
+  init_quiet_channels(1000);
+
+  // Both on I2C1, SHUTDOWN_CHAN is listed later but due sooner
+  TEST_ASSERT_EQUAL_INT(channel_configs[VCU_CHAN].bus, channel_configs[SHUTDOWN_CHAN].bus);
+  TEST_ASSERT_TRUE(sample_timing[SHUTDOWN_CHAN].deadline_ms < sample_timing[VCU_CHAN].deadline_ms);
+
+  channels[VCU_CHAN].alert_pending = true;
+  channels[SHUTDOWN_CHAN].alert_pending = true;
+
+  init_sampler();
+  run_sampler();
+
+  TEST_ASSERT_TRUE_MESSAGE(sample_jobs[SHUTDOWN_CHAN].in_flight, "Didn't start the earliest deadline");
+  TEST_ASSERT_TRUE_MESSAGE(sample_jobs[VCU_CHAN].pending, "Started a later deadline on a busy bus");
+
+  mock_i2c_complete();
+  TEST_ASSERT_EQUAL_HEX16_MESSAGE(channels[SHUTDOWN_CHAN].addr << 1, receive_address, "Read the wrong sensor first");
+
+  // Jobs with nothing to read are done straight away
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, sample_jobs[FANS_CHAN].jobs, "Didn't finish an idle channel's job");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, sample_jobs[SHUTDOWN_CHAN].jobs, "Finished a job before running the sampler");
+
+  run_sampler();
+
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, sample_jobs[SHUTDOWN_CHAN].jobs, "Didn't finish the job");
+  TEST_ASSERT_TRUE_MESSAGE(sample_jobs[VCU_CHAN].in_flight, "Didn't start the next deadline");
+
+  mock_i2c_complete();
+  TEST_ASSERT_EQUAL_HEX16_MESSAGE(channels[VCU_CHAN].addr << 1, receive_address, "Read the wrong sensor second");
+
+  run_sampler();
+
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, sample_jobs[VCU_CHAN].jobs, "Didn't finish the job");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, sample_jobs[SHUTDOWN_CHAN].misses + sample_jobs[VCU_CHAN].misses, "Missed a deadline");
+}
+
+void test_parallel_buses(void) {
+
+  init_quiet_channels(1000);
+
+  // One job on each bus at once
+  channels[SHUTDOWN_CHAN].alert_pending = true;
+  channels[PUMPS_CHAN].alert_pending = true;
+  channels[REGEN_CHAN].alert_pending = true;
+
+  init_sampler();
+  run_sampler();
+
+  TEST_ASSERT_TRUE(sample_jobs[SHUTDOWN_CHAN].in_flight);
+  TEST_ASSERT_TRUE(sample_jobs[PUMPS_CHAN].in_flight);
+  TEST_ASSERT_TRUE(sample_jobs[REGEN_CHAN].in_flight);
+
+  TEST_ASSERT_EQUAL_UINT32(3, mock_i2c_run());
+  run_sampler();
+
+  TEST_ASSERT_EQUAL_UINT32(1, sample_jobs[SHUTDOWN_CHAN].jobs);
+  TEST_ASSERT_EQUAL_UINT32(1, sample_jobs[PUMPS_CHAN].jobs);
+  TEST_ASSERT_EQUAL_UINT32(1, sample_jobs[REGEN_CHAN].jobs);
+}
+
+void test_deadline_miss(void) {
+
+  init_quiet_channels(1000);
+  channels[SHUTDOWN_CHAN].alert_pending = true;
+
+  init_sampler();
+  run_sampler();
+
+  // The read finishes one ms after its deadline
+  SYSTEM_TICKS += sample_timing[SHUTDOWN_CHAN].deadline_ms + 1;
+  mock_i2c_run();
+  run_sampler();
+
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, sample_jobs[SHUTDOWN_CHAN].misses, "Didn't count the missed deadline");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(sample_timing[SHUTDOWN_CHAN].deadline_ms + 1, sample_jobs[SHUTDOWN_CHAN].worst_response, "Wrong response time");
+
+  // A job that overruns its whole period drops the release it missed
+  SYSTEM_TICKS = 1000 + sample_timing[SHUTDOWN_CHAN].period_ms;
+  channels[SHUTDOWN_CHAN].alert_pending = true;
+  run_sampler();
+  TEST_ASSERT_TRUE(sample_jobs[SHUTDOWN_CHAN].in_flight);
+
+  SYSTEM_TICKS += 2 * sample_timing[SHUTDOWN_CHAN].period_ms;
+  mock_i2c_run();
+  run_sampler();
+
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(3, sample_jobs[SHUTDOWN_CHAN].misses, "Didn't count the overrun");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(SYSTEM_TICKS + sample_timing[SHUTDOWN_CHAN].period_ms, sample_jobs[SHUTDOWN_CHAN].next_release, "Tried to catch up missed releases");
+}
+
+void test_periodic_release(void) {
+
+  // Start just short of HAL_GetTick() wrapping
+  init_quiet_channels(UINT32_MAX - 1);
+
+  init_sampler();
+  run_sampler();
+
+  uint32_t const period = sample_timing[SHUTDOWN_CHAN].period_ms;
+  TEST_ASSERT_EQUAL_UINT32(1, sample_jobs[SHUTDOWN_CHAN].jobs);
+
+  for (uint32_t i = 1; i < period; i++) {
+    SYSTEM_TICKS++;
+    run_sampler();
+  }
+
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, sample_jobs[SHUTDOWN_CHAN].jobs, "Released a job before its period");
+
+  SYSTEM_TICKS++;
+  run_sampler();
+
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(2, sample_jobs[SHUTDOWN_CHAN].jobs, "Didn't release a job across the tick wrapping");
+  TEST_ASSERT_EQUAL_UINT32(0, sample_jobs[SHUTDOWN_CHAN].misses);
+}
+
+void test_check_in_slack(void) {
+
+  init_quiet_channels(1000);
+
+  init_sampler();
+  run_sampler();
+
+  // Nothing is read back until it's due
+  TEST_ASSERT_EQUAL_UINT32(0, mock_i2c_run());
+
+  // Due on every bus, but I2C1 has a job waiting
+  SYSTEM_TICKS += SAMPLER_CHECK_PERIOD_MS;
+
+  for (Channel_Name name = 0; name < NUM_CHANNELS; name++) {
+    channels[name].poll_timestamp = SYSTEM_TICKS;  // Otherwise their flags would be overdue
+  }
+
+  channels[SHUTDOWN_CHAN].alert_pending = true;
+  run_sampler();
+
+  TEST_ASSERT_TRUE(sample_jobs[SHUTDOWN_CHAN].in_flight);
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(SYSTEM_TICKS, sample_jobs[VCU_CHAN].next_check, "Checked a bus with a job waiting");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(SYSTEM_TICKS, sample_jobs[SHUTDOWN_CHAN].next_check, "Checked a bus with a job waiting");
+  TEST_ASSERT_EQUAL_UINT32(SYSTEM_TICKS + SAMPLER_CHECK_PERIOD_MS, sample_jobs[PUMPS_CHAN].next_check);
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(SYSTEM_TICKS, sample_jobs[FANS_CHAN].next_check, "Checked two sensors on one bus at once");
+  TEST_ASSERT_EQUAL_UINT32(SYSTEM_TICKS + SAMPLER_CHECK_PERIOD_MS, sample_jobs[AERO_CHAN].next_check);
+
+  // Both read back an all zero CONF, so get re-programmed
+  mock_i2c_run();
+
+  TEST_ASSERT_EQUAL_UINT32(1, channels[PUMPS_CHAN].stats.reinits);
+  TEST_ASSERT_EQUAL_UINT32(1, channels[AERO_CHAN].stats.reinits);
+  TEST_ASSERT_EQUAL_UINT32(0, channels[SHUTDOWN_CHAN].stats.reinits);
+}
+
+void test_snapshot(void) {
+
+  init_quiet_channels(1000);
+  CHANNEL_ADDR[AERO_CHAN] = SENSOR_MISSING;
+  channels[AERO_CHAN].addr = SENSOR_MISSING;
+
+  // Every read returns a new conversion, so every reading is 0x0008 counts
+  uint8_t rx[64];
+  for (int i = 0; i < 64; i += 2) {
+    rx[i] = 0x00;
+    rx[i + 1] = INA226_MASK_CVRF;
+  }
+  uint8_t tx[64];
+
+  rx_queue_start = &rx[0];
+  rx_queue_end = &rx[64];
+  tx_queue_start = &tx[0];
+  tx_queue_end = &tx[64];
+
+  init_sampler();
+  start_snapshots();
+  run_sampler();
+
+  // One CONF write per sensor, each starting a single conversion
+  TEST_ASSERT_EQUAL_INT(SNAPSHOT_CONVERTING, snapshot_state());
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(NUM_CHANNELS - 1, mock_i2c_run(), "Didn't trigger every sensor");
+  TEST_ASSERT_EQUAL_UINT8(INA226_REG_CONF, tx[0]);
+  TEST_ASSERT_EQUAL_HEX16_MESSAGE(INA226_MODE_TRIGGERED, tx[2] & 0x7, "Sensor wasn't triggered");
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, sample_jobs[SHUTDOWN_CHAN].jobs, "Sampled on the channel's own period");
+
+  // Nothing is read until the conversion is done, with some slack for the sensor's clock
+  uint32_t const conversion_us = SENSOR_FN(conversion_time_us)(sensor_conf(&channels[VCU_CHAN]));
+
+  while (snapshot_state() == SNAPSHOT_CONVERTING) {
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, mock_i2c_run(), "Read before the conversion was done");
+    SYSTEM_TICKS++;
+    run_sampler();
+  }
+
+  TEST_ASSERT_EQUAL_INT(SNAPSHOT_READING, snapshot_state());
+  TEST_ASSERT_TRUE_MESSAGE((SYSTEM_TICKS - 1000) * 1000 > conversion_us, "Read before the conversion was done");
+  TEST_ASSERT_TRUE_MESSAGE((SYSTEM_TICKS - 1000) * 1000 < conversion_us * 3 / 2, "Waited too long to read");
+
+  SYSTEM_TICKS += 1;
+  mock_i2c_run();
+  run_sampler();
+
+  TEST_ASSERT_EQUAL_INT(SNAPSHOT_IDLE, snapshot_state());
+  TEST_ASSERT_EQUAL_UINT32(1, snapshot_frame.seq);
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(1000, snapshot_frame.timestamp, "Frame wasn't stamped with its trigger");
+  TEST_ASSERT_EQUAL_HEX8_MESSAGE(0x3f & ~(1 << AERO_CHAN), snapshot_frame.valid, "Wrong channels in the frame");
+  TEST_ASSERT_EQUAL_HEX16(INA226_MASK_CVRF, snapshot_frame.voltage[REGEN_CHAN]);
+  TEST_ASSERT_EQUAL_INT32(INA226_MASK_CVRF * channel_configs[VCU_CHAN].sensor.current_lsb_ua, snapshot_frame.current[VCU_CHAN]);
+
+  // The next frame waits for its period
+  run_sampler();
+  TEST_ASSERT_EQUAL_UINT32(0, mock_i2c_run());
+
+  SYSTEM_TICKS = 1000 + SNAPSHOT_PERIOD_MS;
+  run_sampler();
+  TEST_ASSERT_EQUAL_INT(SNAPSHOT_CONVERTING, snapshot_state());
+
+  // Back to converting continuously
+  mock_i2c_run();
+  stop_snapshots();
+  TEST_ASSERT_EQUAL_INT(SNAPSHOT_OFF, snapshot_state());
+
+  tx_queue_start = &tx[0];
+  tx_queue_end = &tx[64];
+  mock_i2c_run();
+  TEST_ASSERT_EQUAL_HEX16_MESSAGE(INA226_MODE_CONTINUOUS, tx[2] & 0x7, "Sensor wasn't set back to continuous");
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_should_always_pass);
+  RUN_TEST(test_earliest_deadline_first);
+  RUN_TEST(test_parallel_buses);
+  RUN_TEST(test_deadline_miss);
+  RUN_TEST(test_periodic_release);
+  RUN_TEST(test_check_in_slack);
+  RUN_TEST(test_snapshot);
+  return UNITY_END();
+}
+
+
+void _Error_Handler(char *file, int line)
+{
+
+ TEST_FAIL_MESSAGE("Error was thrown");
+
+}
@@ -0,0 +1,171 @@
+#include "unity.h"
+#include "scheduler.h"
+#include "repl.h"
+
+#include "mocks/mock_timing.h"
+#include "mocks/mock_uart.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static uint32_t fast_runs, medium_runs, slow_runs;
+
+static void fast_task(void)   { fast_runs++; }
+static void medium_task(void) { medium_runs++; }
+static void slow_task(void)   { slow_runs++; }
+
+// Takes twice its period
+static void slow_running_task(void) {
+  mock_cpu_cycles += 2 * (SystemCoreClock / 1000) * 10;
+}
+
+static Task const tasks[] = {
+  {.name = "fast",   .run = fast_task,   .period_ms = 1},
+  {.name = "medium", .run = medium_task, .period_ms = 10},
+  {.name = "slow",   .run = slow_task,   .period_ms = 100},
+};
+
+#define NUM_TEST_TASKS (sizeof(tasks) / sizeof(tasks[0]))
+
+// Starts tasks at ticks, nothing run yet
+static void start(Task const * const table, uint8_t num_tasks, uint32_t ticks) {
+
+  SYSTEM_TICKS = ticks;
+  fast_runs = medium_runs = slow_runs = 0;
+
+  init_scheduler(table, num_tasks);
+}
+
+void test_should_always_pass(void) {}
+
+void test_fixed_rates(void) {
+
+  start(tasks, NUM_TEST_TASKS, 5000);
+
+  for (int i = 0; i < 1000; i++) {
+    TEST_ASSERT_TRUE_MESSAGE(run_tasks(), "The fast task wasn't due");
+    TEST_ASSERT_FALSE_MESSAGE(run_tasks(), "Ran a task twice in one tick");
+    SYSTEM_TICKS++;
+  }
+
+  TEST_ASSERT_EQUAL_UINT32(1000, fast_runs);
+  TEST_ASSERT_EQUAL_UINT32(100, medium_runs);
+  TEST_ASSERT_EQUAL_UINT32(10, slow_runs);
+
+  for (int i = 0; i < NUM_TEST_TASKS; i++) {
+    TEST_ASSERT_EQUAL_UINT32(0, task_stats[i].skipped);
+    TEST_ASSERT_EQUAL_UINT32(0, task_stats[i].overruns);
+    TEST_ASSERT_EQUAL_UINT32(1, task_stats[i].max_cycles);
+  }
+}
+
+void test_late_releases(void) {
+
+  start(&tasks[1], 1, 0);
+
+  run_tasks();
+
+  // Started 5 ms late, the next release keeps to the 10 ms grid
+  SYSTEM_TICKS = 15;
+  TEST_ASSERT_TRUE(run_tasks());
+  TEST_ASSERT_EQUAL_UINT32(20, task_stats[0].release);
+
+  // Over two periods late, the releases missed are dropped rather than run back to back
+  SYSTEM_TICKS = 47;
+  TEST_ASSERT_TRUE(run_tasks());
+  TEST_ASSERT_FALSE(run_tasks());
+
+  TEST_ASSERT_EQUAL_UINT32(3, medium_runs);
+  TEST_ASSERT_EQUAL_UINT32(2, task_stats[0].skipped);
+  TEST_ASSERT_EQUAL_UINT32(50, task_stats[0].release);
+}
+
+void test_overruns(void) {
+
+  Task const overrunning = {.name = "slow", .run = slow_running_task, .period_ms = 10};
+
+  start(&overrunning, 1, 0);
+
+  run_tasks();
+
+  TEST_ASSERT_EQUAL_UINT32(1, task_stats[0].overruns);
+  TEST_ASSERT_EQUAL_UINT32(2 * (SystemCoreClock / 1000) * 10 + 1, task_stats[0].last_cycles);
+  TEST_ASSERT_EQUAL_UINT32(task_stats[0].last_cycles, task_stats[0].max_cycles);
+}
+
+// Releases carry on at the same rate across HAL_GetTick() wrapping
+void test_wraps(void) {
+
+  start(tasks, NUM_TEST_TASKS, UINT32_MAX - 500);
+
+  for (int i = 0; i < 1000; i++) {
+    run_tasks();
+    SYSTEM_TICKS++;
+  }
+
+  TEST_ASSERT_EQUAL_UINT32(1000, fast_runs);
+  TEST_ASSERT_EQUAL_UINT32(100, medium_runs);
+  TEST_ASSERT_EQUAL_UINT32(10, slow_runs);
+}
+
+static REPL_Status handler(int argc, char argv[MAX_ARGS][MAX_ARG_LEN]) {
+
+  if (eq(argv[0], "tasks")) {
+    return tasks_command(argc, argv);
+  }
+
+  return REPL_CONTINUE;
+}
+
+// The stats print from the REPL, polled a few characters at a time
+void test_tasks_command(void) {
+
+  start(tasks, NUM_TEST_TASKS, 0);
+
+  for (int i = 0; i < 20; i++) {
+    run_tasks();
+    SYSTEM_TICKS++;
+  }
+
+  printed[0] = '\0';
+
+  // The first key only brings up the prompt
+  typed = "\r";
+  repl_poll(handler);
+  typed = "tas";
+  repl_poll(handler);
+  typed = "ks\r";
+  repl_poll(handler);
+
+  TEST_ASSERT_NOT_NULL_MESSAGE(strstr(printed, "fast: 20 runs, 1 cycles average, 1 max, 0 overruns, 0 skipped"), printed);
+  TEST_ASSERT_NOT_NULL_MESSAGE(strstr(printed, "medium: 2 runs"), printed);
+  TEST_ASSERT_NOT_NULL_MESSAGE(strstr(printed, "slow: 1 runs"), printed);
+
+  typed = "tasks reset\r";
+  repl_poll(handler);
+
+  TEST_ASSERT_EQUAL_UINT32(0, task_stats[0].runs);
+  TEST_ASSERT_EQUAL_UINT32(20, task_stats[0].release);
+}
+
+int main(void) {
+  UNITY_BEGIN();
+
+  RUN_TEST(test_should_always_pass);
+  RUN_TEST(test_fixed_rates);
+  RUN_TEST(test_late_releases);
+  RUN_TEST(test_overruns);
+  RUN_TEST(test_wraps);
+  RUN_TEST(test_tasks_command);
+
+  return UNITY_END();
+}
+
+void _Error_Handler(char *file, int line)
+{
+
+  char error_message[10000];
+  sprintf(&error_message[0], "Error was thrown at line %d in %s", line, file);
+  TEST_FAIL_MESSAGE(error_message);
+
+}
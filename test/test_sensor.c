@@ -0,0 +1,303 @@
+#include "unity.h"
+#include "sensor.h"
+#include "i2c.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "mocks/mock_i2c.h"
+#include "mocks/mock_sensor.h"
+
+// Every part's driver, so each can be run against its emulated model whatever SENSOR_MODEL is
+typedef struct {
+  int       model;
+  uint8_t   (*reg)(Reading_Type reading, uint8_t sub);
+  uint8_t   (*reg_size)(Reading_Type reading);
+  int32_t   (*decode)(Reading_Type reading, uint32_t raw);
+  bool      (*alerted)(uint16_t flags, uint8_t sub);
+  uint8_t   (*writes)(uint16_t conf, uint16_t cal, Sensor_Alert alert, int32_t limit, uint8_t sub, Sensor_Write writes[SENSOR_WRITES]);
+  uint8_t   flags_reg;
+} Part;
+
+static Part const INA226 = {SENSOR_INA226, ina226_reg, ina226_reg_size, ina226_decode, ina226_alerted, ina226_writes, INA226_REG_MASK};
+static Part const INA3221 = {SENSOR_INA3221, ina3221_reg, ina3221_reg_size, ina3221_decode, ina3221_alerted, ina3221_writes, INA3221_REG_MASK};
+static Part const INA228 = {SENSOR_INA228, ina228_reg, ina228_reg_size, ina228_decode, ina228_alerted, ina228_writes, INA228_REG_DIAG_ALRT};
+
+static uint32_t read_rsp;
+static HAL_StatusTypeDef read_status;
+
+static void store_read(I2C_Transaction const * const txn, HAL_StatusTypeDef status) {
+  read_rsp = txn->rsp;
+  read_status = status;
+}
+
+// Reads reading from sub channel of the part at addr through the queue, and decodes it
+static int32_t read_reading(Part const * const part, uint8_t addr, uint8_t sub, Reading_Type reading) {
+
+  read_status = HAL_ERROR;
+
+  TEST_ASSERT_EQUAL_INT(HAL_OK, queue_burst(I2C_BUS_1, part->reg(reading, sub), addr, part->reg_size(reading), store_read, NULL));
+  mock_i2c_run();
+  TEST_ASSERT_EQUAL_INT_MESSAGE(HAL_OK, read_status, "Reading didn't come back");
+
+  return part->decode(reading, read_rsp);
+}
+
+// Programs the part at addr the way configure_channel() would
+static void program(Part const * const part, uint8_t addr, uint16_t conf, uint16_t cal, Sensor_Alert alert, int32_t limit, uint8_t sub) {
+
+  Sensor_Write writes[SENSOR_WRITES];
+  uint8_t const count = part->writes(conf, cal, alert, limit, sub, writes);
+
+  for (int i = 0; i < count; i++) {
+    TEST_ASSERT_EQUAL_INT(HAL_OK, write_reg(I2C_BUS_1, writes[i].reg_addr, addr, writes[i].val));
+  }
+}
+
+static uint16_t read_flags(Part const * const part, uint8_t addr) {
+  uint16_t flags;
+  TEST_ASSERT_EQUAL_INT(HAL_OK, read_reg(I2C_BUS_1, part->flags_reg, addr, &flags));
+  return flags;
+}
+
+void test_conversion_time(void) {
+
+  // Power on default, 1 sample of 1.1 ms each for bus and shunt
+  TEST_ASSERT_EQUAL_UINT32(2200, ina226_conversion_time_us(0x4127));
+  TEST_ASSERT_EQUAL_UINT32(2200, ina226_conversion_time_us(INA226_CONF(INA226_AVG_1, INA226_CT_1100US, INA226_CT_1100US, INA226_MODE_CONTINUOUS)));
+  TEST_ASSERT_EQUAL_UINT32(16 * (140 + 8244), ina226_conversion_time_us(INA226_CONF(INA226_AVG_16, INA226_CT_140US, INA226_CT_8244US, INA226_MODE_CONTINUOUS)));
+  TEST_ASSERT_EQUAL_UINT32(1024 * 2 * 8244, ina226_conversion_time_us(INA226_CONF(INA226_AVG_1024, INA226_CT_8244US, INA226_CT_8244US, INA226_MODE_CONTINUOUS)));
+
+  // The INA3221 converts its channels in turn
+  TEST_ASSERT_EQUAL_UINT32(3 * 2200, ina3221_conversion_time_us(0x7127));
+
+  // INA228 power on default, 1 sample of 1.052 ms each
+  TEST_ASSERT_EQUAL_UINT32(2 * 1052, ina228_conversion_time_us(0xFB68));
+  TEST_ASSERT_EQUAL_UINT32(16 * 2 * 1052, ina228_conversion_time_us(ina228_conf(INA226_AVG_16, INA226_CT_1100US, INA226_CT_1100US, false)));
+}
+
+void test_conf(void) {
+
+  TEST_ASSERT_EQUAL_HEX16(INA226_CONF(INA226_AVG_4, INA226_CT_588US, INA226_CT_140US, INA226_MODE_TRIGGERED),
+                          ina226_conf(INA226_AVG_4, INA226_CT_588US, INA226_CT_140US, true));
+
+  // Same layout, with every channel enabled
+  TEST_ASSERT_EQUAL_HEX16(0x7000 | INA226_CONF(INA226_AVG_4, INA226_CT_588US, INA226_CT_140US, INA226_MODE_CONTINUOUS),
+                          ina3221_conf(INA226_AVG_4, INA226_CT_588US, INA226_CT_140US, false));
+
+  // 588 us goes to 540 us, 140 us to 150 us
+  TEST_ASSERT_EQUAL_HEX16((0x3 << 12) | (4 << 9) | (2 << 6) | INA226_AVG_4,
+                          ina228_conf(INA226_AVG_4, INA226_CT_588US, INA226_CT_140US, true));
+  TEST_ASSERT_EQUAL_HEX16((0xB << 12) | (7 << 9) | (7 << 6) | INA226_AVG_1024,
+                          ina228_conf(INA226_AVG_1024, INA226_CT_8244US, INA226_CT_8244US, false));
+}
+
+void test_calibration(void) {
+
+  // Datasheet example, 2 mOhm shunt with 1 mA per count
+  TEST_ASSERT_EQUAL_UINT16(2560, ina226_calibration(2000, 1000));
+  TEST_ASSERT_EQUAL_UINT16(5120, ina226_calibration(10000, 100));
+
+  // CAL is only 15 bits
+  TEST_ASSERT_EQUAL_UINT16(0x7fff, ina226_calibration(100, 10));
+
+  // The INA228's goes the other way, 13107.2 * 10^6 * LSB * shunt
+  TEST_ASSERT_EQUAL_UINT16(26214, ina228_calibration(2000, 1000));
+  TEST_ASSERT_EQUAL_UINT16(13107, ina228_calibration(10000, 100));
+  TEST_ASSERT_EQUAL_UINT16(0x7fff, ina228_calibration(100000, 1000));
+
+  TEST_ASSERT_EQUAL_UINT16(0, ina3221_calibration(2000, 1000));
+
+  // The rest are in the build's sensor's counts
+  TEST_ASSERT_EQUAL_INT32(12000000000ull / SENSOR_BUS_VOLT_LSB_NV, bus_volt_counts(12000));
+
+  TEST_ASSERT_EQUAL_INT32(1500, current_counts(1500, 1000));
+  TEST_ASSERT_EQUAL_INT32(SENSOR_READING_MAX, current_counts(60000, 1));
+
+  // 1.5 A through 2 mOhm is 3 mV
+  TEST_ASSERT_EQUAL_INT32(3000000000 / SENSOR_SHUNT_VOLT_LSB_PV, shunt_volt_counts(1500, 1000, 2000));
+  TEST_ASSERT_EQUAL_INT32(-3000000000 / SENSOR_SHUNT_VOLT_LSB_PV, shunt_volt_counts(-1500, 1000, 2000));
+  TEST_ASSERT_EQUAL_INT32(SENSOR_READING_MAX, shunt_volt_counts(SENSOR_READING_MAX, 1000, 100000));
+}
+
+void test_shunt_current_and_power(void) {
+
+  uint32_t const lsb_pv = SENSOR_SHUNT_VOLT_LSB_PV;
+
+  // One count through 2 mOhm, 1.25 mA on the INA226
+  uint32_t const scale = shunt_scale_q16(2000);
+  TEST_ASSERT_EQUAL_UINT32(((uint64_t) lsb_pv << 16) / 2000, scale);
+
+  TEST_ASSERT_UINT32_WITHIN(1, 1200ull * lsb_pv / 2000, shunt_current_ua(1200, scale));
+  TEST_ASSERT_UINT32_WITHIN(1, -(int32_t) (1200ull * lsb_pv / 2000), shunt_current_ua(-1200, scale));
+
+  // Shunts that don't divide evenly are still within a uA
+  TEST_ASSERT_UINT32_WITHIN(1, 1000ull * lsb_pv / 3000, shunt_current_ua(1000, shunt_scale_q16(3000)));
+
+  // 25 current LSBs times a volt per count, 12 V at 1.5 A is 18 W
+  TEST_ASSERT_EQUAL_UINT32(18000000, ina226_power_uw(720, 1000));
+  TEST_ASSERT_EQUAL_UINT32(65535u * 25 * 1000, ina226_power_uw(UINT16_MAX, 1000));
+
+  // 3.2 current LSBs on the INA228
+  TEST_ASSERT_EQUAL_UINT32(18000000, ina228_power_uw(5625, 1000));
+  TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, ina228_power_uw(0xFFFFFF, 1000));
+}
+
+void test_ina226_model(void) {
+
+  mock_sensor_attach(0x40, SENSOR_INA226);
+  invalidate_reg_ptrs();
+
+  // Watching for the bus under 11 V
+  program(&INA226, 0x40, ina226_conf(INA226_AVG_4, INA226_CT_588US, INA226_CT_588US, false), ina226_calibration(2000, 1000),
+          SENSOR_ALERT_BUS_UNDER, 8800, 0);
+
+  TEST_ASSERT_EQUAL_UINT32(4, mock_sensor_writes(0x40));
+  TEST_ASSERT_EQUAL_HEX16(INA226_MASK_BUL | INA226_MASK_CNVR | INA226_MASK_LEN, mock_sensor_reg(0x40, INA226_REG_MASK));
+
+  // Backwards through the shunt, 1.5 A at 12 V
+  mock_sensor_convert(0x40, 0, -1200, 9600);
+
+  uint16_t flags = read_flags(&INA226, 0x40);
+  TEST_ASSERT_TRUE_MESSAGE(flags & INA226_MASK_CVRF, "No conversion flagged");
+  TEST_ASSERT_FALSE_MESSAGE(INA226.alerted(flags, 0), "Alerted above the limit");
+
+  TEST_ASSERT_EQUAL_INT32(-1200, read_reading(&INA226, 0x40, 0, SHUNT_VOLT_READING));
+  TEST_ASSERT_EQUAL_INT32(9600,  read_reading(&INA226, 0x40, 0, BUS_VOLT_READING));
+  TEST_ASSERT_EQUAL_INT32(-1500, read_reading(&INA226, 0x40, 0, CURRENT_READING));
+  TEST_ASSERT_EQUAL_UINT32(18000000, ina226_power_uw(read_reading(&INA226, 0x40, 0, POWER_READING), 1000));
+
+  mock_sensor_convert(0x40, 0, -1200, 8000);
+  TEST_ASSERT_TRUE_MESSAGE(INA226.alerted(read_flags(&INA226, 0x40), 0), "Didn't alert below the limit");
+
+  mock_sensor_reset();
+}
+
+void test_ina228_model(void) {
+
+  mock_sensor_attach(0x41, SENSOR_INA228);
+  invalidate_reg_ptrs();
+
+  // Watching for 1.25 A backwards through 2 mOhm
+  int32_t const limit = -8000;
+  program(&INA228, 0x41, ina228_conf(INA226_AVG_4, INA226_CT_588US, INA226_CT_588US, false), ina228_calibration(2000, 1000),
+          SENSOR_ALERT_SHUNT_UNDER, limit, 0);
+
+  TEST_ASSERT_EQUAL_HEX16((uint16_t) (limit >> 4), mock_sensor_reg(0x41, INA228_REG_SUVL));
+  TEST_ASSERT_EQUAL_HEX16(INA228_DIAG_CNVR | INA228_DIAG_ALATCH, mock_sensor_reg(0x41, INA228_REG_DIAG_ALRT));
+
+  // 1.5 A backwards at 12 V, 3 mV is 9600 counts of 312.5 nV and 12 V is 61440 of 195.3 uV
+  mock_sensor_convert(0x41, 0, -9600, 61440);
+
+  uint16_t flags = read_flags(&INA228, 0x41);
+  TEST_ASSERT_TRUE_MESSAGE(flags & INA228_DIAG_CNVRF, "No conversion flagged");
+  TEST_ASSERT_TRUE_MESSAGE(INA228.alerted(flags, 0), "Didn't alert past the limit");
+
+  // Every reading is 3 bytes, sign extended from 20 bits
+  i2c_stats = (I2C_Stats) {0};
+  invalidate_reg_ptrs();
+
+  TEST_ASSERT_EQUAL_INT32(-9600, read_reading(&INA228, 0x41, 0, SHUNT_VOLT_READING));
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(I2C_READ_CYCLES + I2C_BYTE_CYCLES, i2c_stats.cycles, "Didn't count the third byte");
+
+  TEST_ASSERT_EQUAL_INT32(61440, read_reading(&INA228, 0x41, 0, BUS_VOLT_READING));
+  TEST_ASSERT_EQUAL_INT32(-1500, read_reading(&INA228, 0x41, 0, CURRENT_READING));
+  TEST_ASSERT_EQUAL_UINT32(18000000, ina228_power_uw(read_reading(&INA228, 0x41, 0, POWER_READING), 1000));
+
+  // Reading the flags cleared them
+  TEST_ASSERT_FALSE(read_flags(&INA228, 0x41) & (INA228_DIAG_CNVRF | INA228_DIAG_LIMITS));
+
+  mock_sensor_reset();
+}
+
+void test_ina3221_model(void) {
+
+  mock_sensor_attach(0x42, SENSOR_INA3221);
+  invalidate_reg_ptrs();
+
+  // Only the second channel watches its shunt
+  uint16_t const conf = ina3221_conf(INA226_AVG_4, INA226_CT_588US, INA226_CT_588US, false);
+  program(&INA3221, 0x42, conf, 0, SENSOR_ALERT_NONE, 0, 0);
+  program(&INA3221, 0x42, conf, 0, SENSOR_ALERT_SHUNT_OVER, 1000, 1);
+  program(&INA3221, 0x42, conf, 0, SENSOR_ALERT_NONE, 0, 2);
+
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(4, mock_sensor_writes(0x42), "Wrote more than CONF and the limit");
+  TEST_ASSERT_EQUAL_HEX16(1000 << 3, mock_sensor_reg(0x42, INA3221_REG_CRITICAL(1)));
+
+  mock_sensor_convert(0x42, 0, 25, 1500);
+  mock_sensor_convert(0x42, 1, 1200, 1500);
+  mock_sensor_convert(0x42, 2, -75, 625);
+
+  uint16_t const flags = read_flags(&INA3221, 0x42);
+  TEST_ASSERT_TRUE(flags & INA3221_MASK_CVRF);
+  TEST_ASSERT_FALSE_MESSAGE(INA3221.alerted(flags, 0), "Alerted on the wrong channel");
+  TEST_ASSERT_TRUE_MESSAGE(INA3221.alerted(flags, 1), "Didn't alert past the limit");
+
+  // No current or power registers
+  TEST_ASSERT_EQUAL_HEX8(SENSOR_NO_REG, INA3221.reg(CURRENT_READING, 0));
+  TEST_ASSERT_EQUAL_HEX8(SENSOR_NO_REG, INA3221.reg(POWER_READING, 0));
+
+  TEST_ASSERT_EQUAL_INT32(25,   read_reading(&INA3221, 0x42, 0, SHUNT_VOLT_READING));
+  TEST_ASSERT_EQUAL_INT32(1200, read_reading(&INA3221, 0x42, 1, SHUNT_VOLT_READING));
+  TEST_ASSERT_EQUAL_INT32(-75,  read_reading(&INA3221, 0x42, 2, SHUNT_VOLT_READING));
+  TEST_ASSERT_EQUAL_INT32(1500, read_reading(&INA3221, 0x42, 1, BUS_VOLT_READING));
+  TEST_ASSERT_EQUAL_INT32(625,  read_reading(&INA3221, 0x42, 2, BUS_VOLT_READING));
+
+  mock_sensor_reset();
+}
+
+void test_identify(void) {
+
+  uint8_t found[4];
+
+  // Only the build's part is picked up, the others don't identify as it
+  mock_sensor_attach(0x41, SENSOR_INA226);
+  mock_sensor_attach(0x42, SENSOR_INA228);
+  mock_sensor_attach(0x43, SENSOR_INA3221);
+  mock_sensor_attach(0x47, SENSOR_INA226);
+  invalidate_reg_ptrs();
+
+  uint8_t const expected = SENSOR_MODEL == SENSOR_INA226 ? 2 : 1;
+  TEST_ASSERT_EQUAL_UINT8(expected, scan_bus(I2C_BUS_1, found, 4));
+
+  // Each model answers to its own ID registers
+  uint16_t die_id;
+  read_reg(I2C_BUS_1, INA228_REG_DIE_ID, 0x42, &die_id);
+  TEST_ASSERT_EQUAL_HEX16(INA228_DIE_ID, die_id & SENSOR_DIE_ID_MASK);
+  read_reg(I2C_BUS_1, INA3221_REG_DIE_ID, 0x43, &die_id);
+  TEST_ASSERT_EQUAL_HEX16(INA3221_DIE_ID, die_id & SENSOR_DIE_ID_MASK);
+
+  mock_sensor_reset();
+}
+
+void test_burst_size(void) {
+
+  // Wider than the queue can hold
+  TEST_ASSERT_EQUAL_INT(HAL_ERROR, queue_burst(I2C_BUS_1, INA228_REG_POWER, 0x41, I2C_MAX_REG_SIZE + 1, store_read, NULL));
+  TEST_ASSERT_EQUAL_INT(HAL_ERROR, queue_burst(I2C_BUS_1, INA228_REG_POWER, 0x41, 0, store_read, NULL));
+  TEST_ASSERT_TRUE(i2c_bus_idle(I2C_BUS_1));
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_conversion_time);
+  RUN_TEST(test_conf);
+  RUN_TEST(test_calibration);
+  RUN_TEST(test_shunt_current_and_power);
+  RUN_TEST(test_ina226_model);
+  RUN_TEST(test_ina228_model);
+  RUN_TEST(test_ina3221_model);
+  RUN_TEST(test_identify);
+  RUN_TEST(test_burst_size);
+  return UNITY_END();
+}
+
+
+void _Error_Handler(char *file, int line)
+{
+
+  char error_message[10000];
+  sprintf(&error_message[0], "Error was thrown at line %d in %s", line, file);
+  TEST_FAIL_MESSAGE(error_message);
+
+}
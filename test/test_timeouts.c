@@ -0,0 +1,193 @@
+#include "unity.h"
+#include "timeouts.h"
+
+#include "mocks/mock_random.h"
+
+#include <stdio.h>
+
+#define ALL_TIMEOUTS 0xFFFFFFFFU
+
+void test_should_always_pass(void) {}
+
+void test_expires_on_deadline(void) {
+
+  init_timeouts(0);
+  arm_timeout(3, 10);
+
+  for (uint32_t tick = 1; tick < 10; tick++) {
+    run_timeouts(tick);
+    TEST_ASSERT_EQUAL_HEX32_MESSAGE(0, take_timeouts(ALL_TIMEOUTS), "Timed out early");
+  }
+
+  TEST_ASSERT_TRUE(timeout_armed(3));
+
+  run_timeouts(10);
+  TEST_ASSERT_FALSE(timeout_armed(3));
+  TEST_ASSERT_EQUAL_HEX32_MESSAGE(1U << 3, take_timeouts(ALL_TIMEOUTS), "Didn't time out on its deadline");
+
+  // Taken once
+  run_timeouts(11);
+  TEST_ASSERT_EQUAL_HEX32(0, take_timeouts(ALL_TIMEOUTS));
+}
+
+void test_turns_off(void) {
+
+  // Lands in the same slot as 1000 % WHEEL_SLOTS, a few turns before it's due
+  init_timeouts(0);
+  arm_timeout(0, 1000);
+  arm_timeout(1, 1000 % WHEEL_SLOTS);
+
+  for (uint32_t tick = 1; tick < 1000; tick++) {
+    run_timeouts(tick);
+
+    Timeout_Mask const expected = tick == 1000 % WHEEL_SLOTS ? 1U << 1 : 0;
+    TEST_ASSERT_EQUAL_HEX32_MESSAGE(expected, take_timeouts(ALL_TIMEOUTS), "Timed out on the wrong turn");
+  }
+
+  run_timeouts(1000);
+  TEST_ASSERT_EQUAL_HEX32(1U << 0, take_timeouts(ALL_TIMEOUTS));
+
+  // Jumping past several turns runs every slot once
+  arm_timeout(5, 1300);
+  arm_timeout(6, 1500);
+
+  run_timeouts(1400);
+  TEST_ASSERT_EQUAL_HEX32(1U << 5, take_timeouts(ALL_TIMEOUTS));
+
+  run_timeouts(1500);
+  TEST_ASSERT_EQUAL_HEX32(1U << 6, take_timeouts(ALL_TIMEOUTS));
+}
+
+void test_rearm_and_cancel(void) {
+
+  init_timeouts(100);
+
+  // Arming again moves the deadline
+  arm_timeout(7, 110);
+  arm_timeout(7, 140);
+
+  run_timeouts(139);
+  TEST_ASSERT_EQUAL_HEX32_MESSAGE(0, take_timeouts(ALL_TIMEOUTS), "Kept the old deadline");
+
+  run_timeouts(140);
+  TEST_ASSERT_EQUAL_HEX32(1U << 7, take_timeouts(ALL_TIMEOUTS));
+
+  // Arming one that timed out but wasn't taken starts it over
+  arm_timeout(8, 145);
+  run_timeouts(150);
+  arm_timeout(8, 160);
+  TEST_ASSERT_EQUAL_HEX32(0, take_timeouts(ALL_TIMEOUTS));
+
+  // Cancelled ones never time out, even if they already have
+  arm_timeout(9, 155);
+  run_timeouts(155);
+  cancel_timeouts((1U << 8) | (1U << 9));
+
+  run_timeouts(200);
+  TEST_ASSERT_EQUAL_HEX32(0, take_timeouts(ALL_TIMEOUTS));
+  TEST_ASSERT_FALSE(timeout_armed(8));
+
+  // A deadline the wheel's already passed times out straight away
+  arm_timeout(31, 200);
+  TEST_ASSERT_EQUAL_HEX32(1U << 31, take_timeouts(ALL_TIMEOUTS));
+
+  // Taking some leaves the rest
+  arm_timeout(1, 201);
+  arm_timeout(2, 201);
+  run_timeouts(201);
+  TEST_ASSERT_EQUAL_HEX32(1U << 1, take_timeouts(1U << 1));
+  TEST_ASSERT_EQUAL_HEX32(1U << 2, take_timeouts(ALL_TIMEOUTS));
+}
+
+// The last timeout's bit is the top one in Timeout_Mask
+void test_last_timeout(void) {
+
+  init_timeouts(0);
+
+  arm_timeout(NUM_TIMEOUTS - 1, 10);
+  arm_timeout(NUM_TIMEOUTS - 1, 20);
+  arm_timeout(0, 20);
+
+  run_timeouts(19);
+  TEST_ASSERT_EQUAL_HEX32_MESSAGE(0, take_timeouts(ALL_TIMEOUTS), "Kept the old deadline");
+
+  run_timeouts(20);
+  TEST_ASSERT_EQUAL_HEX32(1U << (NUM_TIMEOUTS - 1) | 1U << 0, take_timeouts(ALL_TIMEOUTS));
+
+  arm_timeout(NUM_TIMEOUTS - 1, 30);
+  cancel_timeouts(1U << (NUM_TIMEOUTS - 1));
+  TEST_ASSERT_FALSE(timeout_armed(NUM_TIMEOUTS - 1));
+
+  run_timeouts(100);
+  TEST_ASSERT_EQUAL_HEX32(0, take_timeouts(ALL_TIMEOUTS));
+}
+
+// Runs past 2^32 ms against 64 bit time, arming and rearming like faults that keep latching
+void test_wraps(void) {
+
+  uint64_t const start = (1ULL << 32) - 100000;
+  uint64_t const end   = (1ULL << 32) + 100000;
+
+  uint32_t const periods[] = {14, 33, 1, 51, 200};
+  uint64_t deadlines[NUM_TIMEOUTS] = {0};
+
+  init_timeouts((uint32_t) start);
+
+  // Every run arms the same timeouts
+  seed_random(2024);
+
+  uint64_t now = start;
+
+  while (now < end) {
+
+    // Mostly a ms at a time, now and then a late pass
+    now += next_random() % 8 == 0 ? 1 + next_random() % 5 : 1;
+    run_timeouts((uint32_t) now);
+
+    Timeout_Mask expected = 0;
+
+    for (int i = 0; i < NUM_TIMEOUTS; i++) {
+      if (deadlines[i] != 0 && deadlines[i] <= now) {
+        expected |= 1U << i;
+        deadlines[i] = 0;
+      }
+    }
+
+    TEST_ASSERT_EQUAL_HEX32_MESSAGE(expected, take_timeouts(ALL_TIMEOUTS), "Timed out differently from 64 bit time");
+
+    // A few latch each pass
+    for (int j = 0; j < 3; j++) {
+
+      uint32_t const timeout = next_random() % NUM_TIMEOUTS;
+      uint32_t const period  = periods[next_random() % (sizeof(periods) / sizeof(periods[0]))];
+
+      if (next_random() % 4 == 0) {
+        arm_timeout(timeout, (uint32_t) (now + period));
+        deadlines[timeout] = now + period;
+      }
+    }
+  }
+}
+
+int main(void) {
+  UNITY_BEGIN();
+
+  RUN_TEST(test_should_always_pass);
+  RUN_TEST(test_expires_on_deadline);
+  RUN_TEST(test_turns_off);
+  RUN_TEST(test_rearm_and_cancel);
+  RUN_TEST(test_last_timeout);
+  RUN_TEST(test_wraps);
+
+  return UNITY_END();
+}
+
+
+void _Error_Handler(char *file, int line)
+{
+
+  char error_message[10000];
+  sprintf(&error_message[0], "Error was thrown at line %d in %s", line, file);
+  TEST_FAIL_MESSAGE(error_message);
+
+}